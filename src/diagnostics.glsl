@@ -0,0 +1,45 @@
+/*
+ * Provided under the BSD 3-Clause License, see LICENSE.
+ *
+ * Copyright (c) 2019, Gareth Francis
+ * All rights reserved.
+ */
+
+// First pass of the diagnostics reduction, turns each particle into a record
+// Layout must match VulkanApp::readDiagnostics
+// 0 - sum: kinetic energy, unused, mass, particle count
+// 1 - sum: momentum
+// 2 - sum: mass weighted position, divide by total mass for the centre of mass
+// 3 - min: position
+// 4 - max: position
+
+#define REDUCE_CUSTOM_LOAD
+#include "reduce.glsl"
+
+struct Particle {
+  vec4 position;
+  vec4 velocity;
+  vec4 force;
+  vec4 colour;
+  float mass;
+  float radius;
+  uint id;
+  uint simulation;
+};
+
+layout(set = 0, binding = 1) readonly buffer inputParticles {
+  Particle particles[];
+};
+
+void reduceLoad(uint index, inout vec4 record[REDUCE_MAX_WIDTH]) {
+  Particle p = particles[index];
+  vec3 x = p.position.xyz;
+  vec3 v = p.velocity.xyz;
+
+  // Potential energy depends on the force fields, so that's worked out on the host from record 2
+  record[0] = vec4(0.5 * p.mass * dot(v, v), 0.0, p.mass, 1.0);
+  record[1] = vec4(p.mass * v, 0.0);
+  record[2] = vec4(p.mass * x, 0.0);
+  record[3] = vec4(x, 0.0);
+  record[4] = vec4(x, 0.0);
+}
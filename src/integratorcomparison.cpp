@@ -0,0 +1,137 @@
+/*
+ * Provided under the BSD 3-Clause License, see LICENSE.
+ *
+ * Copyright (c) 2019, Gareth Francis
+ * All rights reserved.
+ */
+
+#include "integratorcomparison.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+#include <stdexcept>
+
+namespace {
+  // An attractor at the origin, as in test.comp
+  constexpr float strength = 1.f;
+  // Close in, where the softening matters and the orbit's quick
+  constexpr float orbitRadius = 2.f;
+  constexpr float pi = 3.14159265358979f;
+
+  /// Speed for a circular orbit, the attractor's pull is the centripetal force
+  float orbitSpeed() {
+    return std::sqrt(strength * orbitRadius / ((orbitRadius * orbitRadius) + 1.f));
+  }
+
+  float orbitPeriod() {
+    return 2.f * pi * orbitRadius / orbitSpeed();
+  }
+
+  glm::vec3 acceleration(const glm::vec3& p) {
+    auto d2 = glm::dot(p, p);
+    return p * (-strength / (std::sqrt(d2) * (d2 + 1.f)));
+  }
+
+  /// Kinetic + potential, per unit mass. The potential of s/(d^2+1) is s*atan(d)
+  double energy(const glm::vec3& p, const glm::vec3& v) {
+    return (0.5 * glm::dot(v, v)) + (strength * std::atan(glm::length(p)));
+  }
+
+  /// One step, same as test.comp. a is carried over between steps for Verlet
+  void step(VulkanApp::Integrator integrator, float dT, glm::vec3& p, glm::vec3& v, glm::vec3& a) {
+    switch( integrator ) {
+      case VulkanApp::Integrator::Verlet: {
+        auto p1 = p + (v * dT) + (a * (0.5f * dT * dT));
+        auto a1 = acceleration(p1);
+        v = v + ((a + a1) * (0.5f * dT));
+        p = p1;
+        a = a1;
+        break;
+      }
+      case VulkanApp::Integrator::Leapfrog: {
+        auto pHalf = p + (v * (0.5f * dT));
+        a = acceleration(pHalf);
+        v = v + (a * dT);
+        p = pHalf + (v * (0.5f * dT));
+        break;
+      }
+      case VulkanApp::Integrator::RK4: {
+        auto k1v = acceleration(p);
+        auto k1p = v;
+        auto k2p = v + (k1v * (0.5f * dT));
+        auto k2v = acceleration(p + (k1p * (0.5f * dT)));
+        auto k3p = v + (k2v * (0.5f * dT));
+        auto k3v = acceleration(p + (k2p * (0.5f * dT)));
+        auto k4p = v + (k3v * dT);
+        auto k4v = acceleration(p + (k3p * dT));
+        p = p + ((k1p + (k2p * 2.f) + (k3p * 2.f) + k4p) * (dT / 6.f));
+        v = v + ((k1v + (k2v * 2.f) + (k3v * 2.f) + k4v) * (dT / 6.f));
+        a = k1v;
+        break;
+      }
+      case VulkanApp::Integrator::Euler:
+      default:
+        a = acceleration(p);
+        v = v + (a * dT);
+        p = p + (v * dT);
+        break;
+    }
+  }
+}
+
+IntegratorComparison::IntegratorComparison(float tolerance, float numOrbits)
+  : mTolerance(tolerance)
+  , mNumOrbits(numOrbits) {
+  if( mTolerance <= 0.f || mNumOrbits <= 0.f ) throw std::runtime_error("IntegratorComparison: Tolerance and orbits must be positive");
+}
+
+float IntegratorComparison::drift(VulkanApp::Integrator integrator, float timeStep) const {
+  glm::vec3 p(orbitRadius, 0.f, 0.f);
+  glm::vec3 v(0.f, orbitSpeed(), 0.f);
+  auto a = acceleration(p);
+
+  auto initial = energy(p, v);
+  auto steps = static_cast<uint64_t>(std::ceil(mNumOrbits * orbitPeriod() / timeStep));
+  auto worst = 0.;
+  for( auto i = 0u; i < steps; ++i ) {
+    step(integrator, timeStep, p, v, a);
+    worst = std::max(worst, std::fabs((energy(p, v) - initial) / initial));
+    // Blown up, no point carrying on
+    if( !std::isfinite(worst) || worst > 1. ) return 1.f;
+  }
+  return static_cast<float>(worst);
+}
+
+IntegratorComparison::Result IntegratorComparison::run(VulkanApp::Integrator integrator) const {
+  Result result;
+  result.integrator = integrator;
+  // Double until it drifts too far, then the last one that didn't is the answer
+  // Steps past a quarter orbit aren't going to be any use to anyone
+  for( auto timeStep = 1.f / 64.f; timeStep < orbitPeriod() / 4.f; timeStep *= 2.f ) {
+    auto d = drift(integrator, timeStep);
+    if( d > mTolerance ) break;
+    result.stableTimeStep = timeStep;
+    result.drift = d;
+  }
+  if( result.stableTimeStep > 0.f ) {
+    result.evaluationsPerSecond = VulkanApp::integratorEvaluations(integrator) / result.stableTimeStep;
+  }
+  return result;
+}
+
+void IntegratorComparison::report(std::ostream& out) const {
+  out << "Integrators, largest step with under " << mTolerance * 100.f << "% energy drift over "
+      << mNumOrbits << " orbits:" << std::endl;
+  out << std::left << std::setw(10) << "" << std::setw(12) << "dt" << std::setw(12) << "drift"
+      << "evaluations per simulated second" << std::endl;
+  for( auto i : {VulkanApp::Integrator::Euler, VulkanApp::Integrator::Verlet, VulkanApp::Integrator::Leapfrog, VulkanApp::Integrator::RK4} ) {
+    auto r = run(i);
+    out << std::left << std::setw(10) << VulkanApp::integratorName(i);
+    if( r.stableTimeStep > 0.f ) {
+      out << std::setw(12) << r.stableTimeStep << std::setw(12) << r.drift << r.evaluationsPerSecond << std::endl;
+    } else {
+      out << "unstable at every step tried" << std::endl;
+    }
+  }
+}
@@ -0,0 +1,55 @@
+/*
+ * Provided under the BSD 3-Clause License, see LICENSE.
+ *
+ * Copyright (c) 2019, Gareth Francis
+ * All rights reserved.
+ */
+
+#ifndef INTEGRATORCOMPARISON_H
+#define INTEGRATORCOMPARISON_H
+
+#include "vulkanapp.h"
+
+#include <iostream>
+
+/**
+ * How big a step each integrator gets away with, and what that costs per simulated second
+ *
+ * Runs on the host, with the same maths as test.comp. The test is a particle orbiting
+ * an attractor (same softened falloff as the shader's), which should hold its energy forever.
+ * For each integrator the step is doubled until the energy drifts more than tolerance
+ * over numOrbits orbits. The biggest step that stays under is the stable one.
+ *
+ * Cost is in force evaluations per simulated second, the GPU's cost per step is roughly
+ * proportional to that once there's more than a handful of force fields. The real timings
+ * come from the profiler on exit, when running with a given integrator.
+ */
+class IntegratorComparison
+{
+public:
+  struct Result {
+    VulkanApp::Integrator integrator;
+    float stableTimeStep = 0.f; // 0 if even the smallest step drifted
+    float drift = 0.f; // Relative energy drift at that step
+    float evaluationsPerSecond = 0.f;
+  };
+
+  /**
+   * @param tolerance Relative energy drift allowed
+   * @param numOrbits How long to run for
+   */
+  IntegratorComparison(float tolerance = 0.01f, float numOrbits = 20.f);
+
+  Result run(VulkanApp::Integrator integrator) const;
+  /// Run every integrator, and print a table
+  void report(std::ostream& out) const;
+
+private:
+  /// Relative energy drift, running for a given step
+  float drift(VulkanApp::Integrator integrator, float timeStep) const;
+
+  float mTolerance;
+  float mNumOrbits;
+};
+
+#endif
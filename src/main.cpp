@@ -6,14 +6,123 @@
  */
 
 #include "vulkanapp.h"
+#include "integratorcomparison.h"
 
+#include <cmath>
 #include <exception>
 #include <iostream>
+#include <random>
+#include <stdexcept>
+#include <string>
+
+namespace {
+  /// Gravity plus a bunch of random fields scattered around the box, to see how the step copes with lots of them
+  std::vector<VulkanApp::ForceField> randomForceFields(uint32_t count) {
+    std::mt19937 gen(1234);
+    std::uniform_real_distribution<float> pos(-100.f, 100.f);
+    std::uniform_real_distribution<float> dir(-1.f, 1.f);
+    std::uniform_real_distribution<float> radius(5.f, 30.f);
+    std::uniform_int_distribution<uint32_t> type(1, 4);
+
+    std::vector<VulkanApp::ForceField> fields(1);
+    fields[0].direction = {0, -1, 0, 0};
+    fields[0].strength = 0.01f;
+    for( auto i = 0u; i < count; ++i ) {
+      VulkanApp::ForceField f;
+      f.type = static_cast<VulkanApp::ForceField::Type>(type(gen));
+      f.position = {pos(gen), pos(gen), pos(gen), 1};
+      f.direction = {dir(gen), dir(gen), dir(gen), 0};
+      f.radius = radius(gen);
+      f.strength = f.type == VulkanApp::ForceField::Type::Drag || f.type == VulkanApp::ForceField::Type::Wind ? 0.01f : 1.f;
+      fields.emplace_back(f);
+    }
+    return fields;
+  }
+
+  /// Sweep gravity and restitution across the members, so there's something to compare
+  std::vector<VulkanApp::SimulationParams> ensembleSweep(uint32_t count) {
+    std::vector<VulkanApp::SimulationParams> params(count);
+    for( auto i = 0u; i < count; ++i ) {
+      auto t = count > 1 ? static_cast<float>(i) / static_cast<float>(count - 1) : 0.f;
+      params[i].gravityScale = 0.5f + (1.5f * t);
+      params[i].restitution = 1.f - (0.5f * t);
+    }
+    return params;
+  }
+}
 
 int main(int argc, char* argv[])
 {
   try {
     VulkanApp app;
+
+    // --profile, time each pass on the GPU and print the timings on exit
+    // --lead=steps, how far the simulation may run ahead of the screen
+    // --renderer=points|splat|density, so the renderers can be compared on the same scene
+    // --diagnostics[=seconds], work out energy/momentum every step and print a summary every so often (0 for never)
+    // --reorder-interval=N, sort the particles every N steps (0 to never)
+    // --track=ID, print where a particle is along with the diagnostics
+    // --mesh=file.obj|file.stl, collide the particles with a mesh
+    // --sdf=file.obj|file.stl|primitives, collide the particles with a distance field baked from a mesh or some shapes
+    // --force-fields=N, add N random force fields (on top of gravity)
+    // --integrator=euler|verlet|leapfrog|rk4 and --dt=seconds, how the simulation steps
+    // --compare-integrators, print how big a step each integrator can take (on the host) and exit
+    // --adaptive-dt, let the GPU pick the step size (--dt is the first step's), --dt-log=file.csv to see how it goes
+    // --buffer-device-address, hand the simulation step its buffers by address instead of through descriptor sets
+    // --ensemble=simulations,particles, run a batch of small simulations at once, sweeping gravity and restitution across them
+    // --memory-report, print the memory heaps and what's been allocated once everything's set up
+    // --device=index|name, which GPU to use (see the list printed at startup), VULKANUTILS_DEVICE does the same
+    // --benchmark-devices, time the integrator on each GPU and use the fastest, the pick is cached in physics-devices.cache
+    auto integrator = VulkanApp::Integrator::Euler;
+    auto timeStep = 0.1f;
+    for( auto i = 1; i < argc; ++i ) {
+      std::string arg(argv[i]);
+      if( arg == "--profile" ) app.profileGPU(true);
+      else if( arg.rfind("--lead=", 0) == 0 ) app.computeLead(static_cast<uint32_t>(std::stoul(arg.substr(7))));
+      else if( arg == "--renderer=points" ) app.renderMode(VulkanApp::RenderMode::Points);
+      else if( arg == "--renderer=splat" ) app.renderMode(VulkanApp::RenderMode::SplatNearest);
+      else if( arg == "--renderer=density" ) app.renderMode(VulkanApp::RenderMode::SplatDensity);
+      else if( arg == "--diagnostics" ) app.diagnostics(true);
+      else if( arg.rfind("--diagnostics=", 0) == 0 ) {
+        auto interval = std::stod(arg.substr(14));
+        if( !std::isfinite(interval) || interval < 0.0 ) throw std::runtime_error("--diagnostics needs a number of seconds, 0 or more");
+        app.diagnostics(true, interval);
+      }
+      else if( arg.rfind("--reorder-interval=", 0) == 0 ) app.reorderInterval(static_cast<uint32_t>(std::stoul(arg.substr(19))));
+      else if( arg.rfind("--track=", 0) == 0 ) app.trackParticle(static_cast<uint32_t>(std::stoul(arg.substr(8))));
+      else if( arg.rfind("--mesh=", 0) == 0 ) app.collisionMesh(arg.substr(7));
+      else if( arg.rfind("--sdf=", 0) == 0 ) app.collisionField(arg.substr(6));
+      else if( arg.rfind("--force-fields=", 0) == 0 ) app.forceFields(randomForceFields(static_cast<uint32_t>(std::stoul(arg.substr(15)))));
+      else if( arg == "--integrator=euler" ) integrator = VulkanApp::Integrator::Euler;
+      else if( arg == "--integrator=verlet" ) integrator = VulkanApp::Integrator::Verlet;
+      else if( arg == "--integrator=leapfrog" ) integrator = VulkanApp::Integrator::Leapfrog;
+      else if( arg == "--integrator=rk4" ) integrator = VulkanApp::Integrator::RK4;
+      else if( arg.rfind("--dt=", 0) == 0 ) {
+        timeStep = std::stof(arg.substr(5));
+        if( !std::isfinite(timeStep) || timeStep <= 0.0f ) throw std::runtime_error("--dt needs a positive number of seconds");
+      }
+      else if( arg == "--adaptive-dt" ) app.adaptiveTimeStep();
+      else if( arg.rfind("--dt-log=", 0) == 0 ) app.timeStepLog(arg.substr(9));
+      else if( arg == "--buffer-device-address" ) app.bufferDeviceAddress(true);
+      else if( arg == "--memory-report" ) app.memoryReport(true);
+      else if( arg.rfind("--device=", 0) == 0 ) app.device(arg.substr(9));
+      else if( arg == "--benchmark-devices" ) app.benchmarkDevices(true);
+      else if( arg.rfind("--ensemble=", 0) == 0 ) {
+        auto values = arg.substr(11);
+        auto comma = values.find(',');
+        if( comma == std::string::npos ) throw std::runtime_error("--ensemble needs simulations,particles");
+        auto numSimulations = static_cast<uint32_t>(std::stoul(values.substr(0, comma)));
+        app.ensemble(numSimulations, static_cast<uint32_t>(std::stoul(values.substr(comma + 1))));
+        app.simulationParameters(ensembleSweep(numSimulations));
+      }
+      else if( arg == "--compare-integrators" ) {
+        IntegratorComparison().report(std::cout);
+        return 0;
+      }
+      else throw std::runtime_error("Unknown argument: " + arg);
+    }
+    app.integrator(integrator, timeStep);
+
     app.run();
   } catch ( std::exception& e) {
     std::cerr << e.what() << std::endl;
@@ -0,0 +1,31 @@
+/*
+ * Provided under the BSD 3-Clause License, see LICENSE.
+ *
+ * Copyright (c) 2019, Gareth Francis
+ * All rights reserved.
+ */
+
+#version 450
+#extension GL_ARB_separate_shader_objects : enable
+
+// Turns the output of splat.comp into colours, modes must match
+layout(constant_id = 0) const uint splatMode = 0;
+// Density mode only, how quickly the particle count saturates
+layout(constant_id = 1) const float densityExposure = 0.05;
+
+layout(set = 0, binding = 0, r32ui) uniform readonly uimage2D splatImage;
+
+layout(location = 0) out vec4 outColour;
+
+void main() {
+  uint value = imageLoad(splatImage, ivec2(gl_FragCoord.xy)).r;
+
+  if( splatMode == 0 ) {
+    // Depth is in the top half, only the colour matters now
+    vec3 c = vec3((value >> 11) & 0x1fu, (value >> 5) & 0x3fu, value & 0x1fu) / vec3(31.0, 63.0, 31.0);
+    outColour = vec4(c, 1.0);
+  } else {
+    float d = 1.0 - exp(-float(value) * densityExposure);
+    outColour = vec4(d, d, d, 1.0);
+  }
+}
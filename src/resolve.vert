@@ -0,0 +1,15 @@
+/*
+ * Provided under the BSD 3-Clause License, see LICENSE.
+ *
+ * Copyright (c) 2019, Gareth Francis
+ * All rights reserved.
+ */
+
+#version 450
+
+// Fullscreen triangle, no vertex buffer needed
+// Vertices are (-1,-1), (-1,3), (3,-1), counter-clockwise so back face culling leaves it alone
+void main() {
+  vec2 uv = vec2(gl_VertexIndex & 2, (gl_VertexIndex << 1) & 2);
+  gl_Position = vec4(uv * 2.0 - 1.0, 0.0, 1.0);
+}
@@ -0,0 +1,309 @@
+/*
+ * Provided under the BSD 3-Clause License, see LICENSE.
+ *
+ * Copyright (c) 2019, Gareth Francis
+ * All rights reserved.
+ */
+
+// The simulation step, see test.comp and test_bda.comp
+// With BUFFER_DEVICE_ADDRESS defined every buffer arrives as a pointer in the push constants,
+// instead of through the descriptor set. Matches VulkanApp::ComputeParams
+
+layout(constant_id = 0) const uint computeBufferWidth = 1000;
+layout(constant_id = 1) const uint computeBufferHeight = 1;
+layout(constant_id = 2) const uint computeBufferDepth = 1;
+layout(constant_id = 3) const uint computeGroupSizeX = 1;
+layout(constant_id = 4) const uint computeGroupSizeY = 1;
+layout(constant_id = 5) const uint computeGroupSizeZ = 1;
+
+// How each step moves the particles along, anything not selected is compiled out
+// Costs are in force evaluations (passes over the force fields) per step
+const uint integratorEuler = 0;    // Semi-implicit Euler, 1st order, 1 evaluation
+const uint integratorVerlet = 1;   // Velocity Verlet, 2nd order, 1 evaluation (reuses the last step's force)
+const uint integratorLeapfrog = 2; // Leapfrog, drift-kick-drift, 2nd order, 1 evaluation
+const uint integratorRK4 = 3;      // Classic Runge-Kutta, 4th order, 4 evaluations
+layout(constant_id = 6) const uint integrator = integratorEuler;
+layout(constant_id = 7) const float timeStep = 0.1;
+// Take the step size from timeStepState instead, where timestep.comp left it after the last step
+layout(constant_id = 8) const bool adaptiveTimeStep = false;
+
+struct Particle {
+  vec4 position;
+  vec4 velocity;
+  vec4 force;
+  vec4 colour;
+  float mass;
+  float radius;
+  uint id;
+  uint simulation;
+};
+
+// Work group size
+// For a simple example mainly arbitrary, but for more complex stuff would matter
+// Invocations within a work group can communicate via some variables/methods
+// so group size would be like the block size in an image compression algorithm or such
+// Syntax here sets sizes to be defined by the specialisation constants above
+layout(local_size_x_id = 3, local_size_y_id = 4, local_size_z_id = 5) in;
+
+// Everything pushing the particles around, edited by the host between steps
+// Sorted by type on the way in, so neighbouring fields take the same path through the switch
+const uint fieldGravity = 0;   // Constant acceleration along direction
+const uint fieldAttractor = 1; // Towards position, inverse square (negative strength repels)
+const uint fieldVortex = 2;    // Around the direction axis, through position
+const uint fieldDrag = 3;      // Against velocity
+const uint fieldWind = 4;      // Drag towards a velocity of direction
+struct ForceField {
+  vec4 position;
+  vec4 direction;
+  uint type;
+  float radius; // Only particles within this distance of position are affected, 0 for everywhere
+  float strength;
+  float pad0;
+};
+
+// The whole workgroup loads fields in tiles, so each one's fetched once per group
+// rather than once per particle
+const uint fieldTileSize = 64;
+shared ForceField fieldTile[fieldTileSize];
+
+// Per simulation settings, a single entry unless running an ensemble
+// Matches VulkanApp::SimulationParams
+struct SimulationParams {
+  float gravityScale; // Scales gravity fields
+  float fieldScale;   // Scales every other field
+  float drag;         // On top of any drag fields
+  float restitution;  // How much speed is kept bouncing off the walls
+};
+
+#ifdef BUFFER_DEVICE_ADDRESS
+// The same buffers as below, in the same order
+layout(buffer_reference, std430, buffer_reference_align = 16) buffer ParticleBuffer {
+  Particle particles[];
+};
+// Sorted order or ID -> slot table
+layout(buffer_reference, std430, buffer_reference_align = 4) buffer IndexBuffer {
+  uint indices[];
+};
+layout(buffer_reference, std430, buffer_reference_align = 16) readonly buffer ForceFieldBuffer {
+  uint count;
+  uint pad[3];
+  ForceField entries[];
+};
+layout(buffer_reference, std430, buffer_reference_align = 16) readonly buffer TimeStepBuffer {
+  float dt;
+  float time;
+  float maxSpeed;
+  float maxAcceleration;
+};
+layout(buffer_reference, std430, buffer_reference_align = 16) readonly buffer SimulationBuffer {
+  SimulationParams entries[];
+};
+
+layout(push_constant) uniform ComputeParams {
+  uint reorder; // Gather the input through order[], so the output comes out sorted
+  uint pad0;
+  ParticleBuffer inputBuffer;
+  ParticleBuffer outputBuffer;
+  IndexBuffer orderBuffer; // Only valid when reordering
+  IndexBuffer slotBuffer;
+  ForceFieldBuffer forceFieldBuffer;
+  TimeStepBuffer timeStepBuffer;
+  SimulationBuffer simulationBuffer;
+} params;
+
+// So the rest of the shader doesn't need to care where the buffers came from
+#define inParticles params.inputBuffer.particles
+#define outParticles params.outputBuffer.particles
+#define order params.orderBuffer.indices
+#define slots params.slotBuffer.indices
+#define numFields params.forceFieldBuffer.count
+#define fields params.forceFieldBuffer.entries
+#define timeStepState params.timeStepBuffer
+#define simulations params.simulationBuffer.entries
+#else
+layout(binding = 0) buffer inputParticles {
+  Particle inParticles[];
+};
+
+layout(binding = 1) buffer outputBuffer {
+  Particle outParticles[];
+};
+
+// Sorted particle indices, only read when reordering
+layout(binding = 2) readonly buffer orderBuffer {
+  uint order[];
+};
+
+// Where each particle ID lives, kept up to date whenever the particles move around
+layout(binding = 3) writeonly buffer slotBuffer {
+  uint slots[];
+};
+
+layout(binding = 4) readonly buffer forceFieldBuffer {
+  uint numFields;
+  uint pad[3];
+  ForceField fields[];
+};
+
+layout(binding = 5) readonly buffer timeStepBuffer {
+  float dt;
+  float time;
+  float maxSpeed;
+  float maxAcceleration;
+} timeStepState;
+
+layout(binding = 6) readonly buffer simulationBuffer {
+  SimulationParams simulations[];
+};
+
+layout(push_constant) uniform ComputeParams {
+  uint reorder; // Gather the input through order[], so the output comes out sorted
+} params;
+#endif
+
+// The particle's simulation, set before anything else happens
+SimulationParams sim;
+
+vec3 fieldForce(ForceField field, vec3 p, vec3 v, float m) {
+  vec3 r = field.position.xyz - p;
+  // Early out, most fields in a big scene won't be anywhere near
+  if( field.radius > 0.0 && dot(r, r) > field.radius * field.radius ) return vec3(0.0);
+
+  switch( field.type ) {
+    case fieldGravity:
+      return field.direction.xyz * (field.strength * m);
+    case fieldAttractor:
+      // Softened a little, so nothing gets flung off to infinity going through the middle
+      return normalize(r + vec3(1e-6)) * (field.strength * m / (dot(r, r) + 1.0));
+    case fieldVortex: {
+      vec3 axis = field.direction.xyz;
+      vec3 radial = r - (axis * dot(r, axis));
+      return cross(axis, radial) * (field.strength * m / (dot(radial, radial) + 1.0));
+    }
+    case fieldDrag:
+      return -v * field.strength;
+    case fieldWind:
+      return (field.direction.xyz - v) * field.strength;
+  }
+  return vec3(0.0);
+}
+
+// Acceleration from all the force fields, at a given state
+// Must be called by the whole workgroup, the fields are loaded a tile at a time
+vec3 acceleration(vec3 p, vec3 v, float m, bool active) {
+  vec3 fieldSum = vec3(0.0);
+  uint groupSize = gl_WorkGroupSize.x * gl_WorkGroupSize.y * gl_WorkGroupSize.z;
+  for( uint tileStart = 0; tileStart < numFields; tileStart += fieldTileSize ) {
+    uint tileCount = min(fieldTileSize, numFields - tileStart);
+    for( uint j = gl_LocalInvocationIndex; j < tileCount; j += groupSize ) fieldTile[j] = fields[tileStart + j];
+    barrier();
+    if( active ) {
+      for( uint j = 0; j < tileCount; ++j ) {
+        float scale = fieldTile[j].type == fieldGravity ? sim.gravityScale : sim.fieldScale;
+        fieldSum += fieldForce(fieldTile[j], p, v, m) * scale;
+      }
+    }
+    // Everyone's finished with this tile before the next overwrites it
+    barrier();
+  }
+  fieldSum -= v * sim.drag;
+  return active ? fieldSum / m : vec3(0.0);
+}
+
+void main(){
+  // Some unnecesary threads are launched in order to fit work into workgroups
+  // They can't leave until the force fields are done with, the whole group loads those
+  bool active = gl_GlobalInvocationID.x < computeBufferWidth && gl_GlobalInvocationID.y < computeBufferHeight && gl_GlobalInvocationID.z < computeBufferDepth;
+
+  // Fetch the input data
+  uint i = (computeBufferWidth * gl_GlobalInvocationID.y) + gl_GlobalInvocationID.x;
+  Particle part;
+  if( active ) {
+    uint src = params.reorder != 0 ? order[i] : i;
+    part = inParticles[src];
+    sim = simulations[part.simulation];
+  }
+
+  vec4 startPos = part.position;
+
+  float dT = adaptiveTimeStep ? timeStepState.dt : timeStep;
+  float m = part.mass;
+  vec3 p0 = part.position.xyz;
+  vec3 v0 = part.velocity.xyz;
+
+  // integrator is a constant, so only one of these survives and the barriers
+  // inside acceleration() stay in uniform control flow
+  // force ends up as whatever was evaluated last, Verlet needs it for the next step
+  vec3 p1, v1, force;
+  if( integrator == integratorVerlet ) {
+    // The first step starts from the initial force, which is nothing
+    vec3 a0 = part.force.xyz / m;
+    p1 = p0 + (v0 * dT) + (a0 * (0.5 * dT * dT));
+    // Velocity dependent fields (drag, wind) need the new velocity, which isn't known yet, so estimate it
+    vec3 a1 = acceleration(p1, v0 + (a0 * dT), m, active);
+    v1 = v0 + ((a0 + a1) * (0.5 * dT));
+    force = a1 * m;
+  } else if( integrator == integratorLeapfrog ) {
+    vec3 pHalf = p0 + (v0 * (0.5 * dT));
+    vec3 a = acceleration(pHalf, v0, m, active);
+    v1 = v0 + (a * dT);
+    p1 = pHalf + (v1 * (0.5 * dT));
+    force = a * m;
+  } else if( integrator == integratorRK4 ) {
+    float h = dT;
+    vec3 k1v = acceleration(p0, v0, m, active);
+    vec3 k1p = v0;
+    vec3 k2p = v0 + (k1v * (0.5 * h));
+    vec3 k2v = acceleration(p0 + (k1p * (0.5 * h)), k2p, m, active);
+    vec3 k3p = v0 + (k2v * (0.5 * h));
+    vec3 k3v = acceleration(p0 + (k2p * (0.5 * h)), k3p, m, active);
+    vec3 k4p = v0 + (k3v * h);
+    vec3 k4v = acceleration(p0 + (k3p * h), k4p, m, active);
+    p1 = p0 + ((k1p + (2.0 * k2p) + (2.0 * k3p) + k4p) * (h / 6.0));
+    v1 = v0 + ((k1v + (2.0 * k2v) + (2.0 * k3v) + k4v) * (h / 6.0));
+    force = k1v * m;
+  } else {
+    vec3 a = acceleration(p0, v0, m, active);
+    v1 = v0 + (a * dT);
+    p1 = p0 + (v1 * dT);
+    force = a * m;
+  }
+  if( !active ) return;
+
+  vec4 f = vec4(force, part.force.w);
+  vec4 v = vec4(v1, part.velocity.w);
+  vec4 p = vec4(p1, part.position.w);
+
+  if( p.y < -100 ) {
+    p.y = startPos.y;
+    v = reflect(v * sim.restitution, vec4(0,1,0,0));
+  }
+
+  if( p.x < -100 ) {
+    p.x = startPos.x;
+    v = reflect(v * sim.restitution, vec4(1,0,0,0));
+  }
+  if( p.x > 100 ) {
+    p.x = startPos.x;
+    v = reflect(v * sim.restitution, vec4(-1,0,0,0));
+  }
+
+  if( p.z < -100 ) {
+    p.z = startPos.z;
+    v = reflect(v * sim.restitution, vec4(0,0,-1,0));
+  }
+  if( p.z > 100 ) {
+    p.z = startPos.z;
+    v = reflect(v * sim.restitution, vec4(0,0,1,0));
+  }
+
+  outParticles[i].position = p;
+  outParticles[i].velocity = v;
+  outParticles[i].force = f;
+  outParticles[i].colour = part.colour;
+  outParticles[i].mass = part.mass;
+  outParticles[i].radius = part.radius;
+  outParticles[i].id = part.id;
+  outParticles[i].simulation = part.simulation;
+  if( params.reorder != 0 ) slots[part.id] = i;
+}
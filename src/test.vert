@@ -13,14 +13,14 @@ layout(location = 2) in float vert_radius;
 
 layout(location = 0) out vec4 fragColour;
 
-layout(push_constant) uniform PushConstants {
+layout(set = 0, binding = 0) uniform FrameUniforms {
   mat4 modelM;
   mat4 viewM;
   mat4 projM;
-} push;
+} frame;
 
 void main() {
-  gl_Position = push.projM * push.viewM * push.modelM * vert_partPos;
+  gl_Position = frame.projM * frame.viewM * frame.modelM * vert_partPos;
 
   // Set the particle size based on dimensions
   gl_PointSize = 1;
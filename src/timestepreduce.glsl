@@ -0,0 +1,36 @@
+/*
+ * Provided under the BSD 3-Clause License, see LICENSE.
+ *
+ * Copyright (c) 2019, Gareth Francis
+ * All rights reserved.
+ */
+
+// First pass of the time step reduction, what the next step's size depends on
+// Layout must match timestep.comp
+// 0 - max: speed, acceleration
+// 1 - min: radius
+
+#define REDUCE_CUSTOM_LOAD
+#include "reduce.glsl"
+
+struct Particle {
+  vec4 position;
+  vec4 velocity;
+  vec4 force;
+  vec4 colour;
+  float mass;
+  float radius;
+  uint id;
+  uint simulation;
+};
+
+layout(set = 0, binding = 1) readonly buffer inputParticles {
+  Particle particles[];
+};
+
+void reduceLoad(uint index, inout vec4 record[REDUCE_MAX_WIDTH]) {
+  Particle p = particles[index];
+  // force is the last one the integrator evaluated
+  record[0] = vec4(length(p.velocity.xyz), length(p.force.xyz) / p.mass, 0.0, 0.0);
+  record[1] = vec4(p.radius, 0.0, 0.0, 0.0);
+}
@@ -6,36 +6,83 @@
  */
 
 #include "vulkanapp.h"
+#include "util/trace.h"
+#include "embeddedshaders.h"
+#include <algorithm>
+#include <cstring>
+#include <deque>
+#include <limits>
 #include <mutex>
 #include <chrono>
 #include <random>
 
 #include "glm/gtc/matrix_transform.hpp"
+#include "glm/gtc/packing.hpp"
 
 VulkanApp::VulkanApp() {
   // TODO: Must be a multiple of 4, we don't validate buffer size before throwing at vulkan
-  auto numParticles = 5000000u;
+  createParticles(1, 5000000u);
 
+  // Same gravity that used to be hardcoded in the shader
+  ForceField gravity;
+  gravity.type = ForceField::Type::Gravity;
+  gravity.direction = {0, -1, 0, 0};
+  gravity.strength = 0.01f;
+  mForceFields.emplace_back(gravity);
+
+}
+
+void VulkanApp::createParticles(uint32_t numSimulations, uint32_t particlesPerSimulation) {
   std::random_device rd;
-   std::mt19937 rdGen(rd());
-   std::uniform_real_distribution<> dis(-10.0, 10.0);
-   std::uniform_real_distribution<> disM(0.1, 100.0);
-   std::uniform_real_distribution<> disC(0.0,1.0);
-   for( auto i = 0u; i < numParticles; ++i ) {
-     auto p = Particle();
-     p.position = {dis(rdGen), dis(rdGen), dis(rdGen), 1};
-     p.mass = static_cast<float>(disM(rdGen));
-     p.colour = {disC(rdGen), disC(rdGen), disC(rdGen), 1};
+  std::mt19937 rdGen(rd());
+  std::uniform_real_distribution<> dis(-10.0, 10.0);
+  std::uniform_real_distribution<> disM(0.1, 100.0);
+  std::uniform_real_distribution<> disC(0.0,1.0);
+  std::vector<Particle> initial;
+  for( auto i = 0u; i < particlesPerSimulation; ++i ) {
+    auto p = Particle();
+    p.position = {dis(rdGen), dis(rdGen), dis(rdGen), 1};
+    p.mass = static_cast<float>(disM(rdGen));
+    p.colour = {disC(rdGen), disC(rdGen), disC(rdGen), 1};
+
+    p.velocity = glm::vec4(dis(rdGen), dis(rdGen), dis(rdGen), 1);
+    initial.emplace_back(p);
+  }
 
-     p.velocity = glm::vec4(dis(rdGen), dis(rdGen), dis(rdGen), 1);
+  // Same starting point for everyone, so only the parameters differ
+  mParticles.clear();
+  mParticles.reserve(static_cast<size_t>(numSimulations) * particlesPerSimulation);
+  for( auto sim = 0u; sim < numSimulations; ++sim ) {
+    for( auto& p : initial ) {
+      mParticles.emplace_back(p);
+      mParticles.back().id = static_cast<uint32_t>(mParticles.size() - 1);
+      mParticles.back().simulation = sim;
+    }
+  }
+  mNumSimulations = numSimulations;
+  mParticlesPerSimulation = particlesPerSimulation;
+  mSimulationParams.assign(numSimulations, SimulationParams());
+}
 
-     mParticles.emplace_back(p);
-   }
+void VulkanApp::ensemble(uint32_t numSimulations, uint32_t particlesPerSimulation) {
+  if( numSimulations == 0 || numSimulations > maxSimulations ) throw std::runtime_error("VulkanApp::ensemble: Need between 1 and " + std::to_string(maxSimulations) + " simulations");
+  if( particlesPerSimulation == 0 ) throw std::runtime_error("VulkanApp::ensemble: Need at least 1 particle per simulation");
+  if( static_cast<uint64_t>(numSimulations) * particlesPerSimulation > std::numeric_limits<uint32_t>::max() ) throw std::runtime_error("VulkanApp::ensemble: Too many particles");
+  if( (numSimulations * particlesPerSimulation) % 4 ) throw std::runtime_error("VulkanApp::ensemble: Total particles must be a multiple of 4");
+  createParticles(numSimulations, particlesPerSimulation);
+}
 
+void VulkanApp::simulationParameters(const std::vector<SimulationParams>& params) {
+  if( params.size() != mNumSimulations ) throw std::runtime_error("VulkanApp::simulationParameters: Need parameters for each of the " + std::to_string(mNumSimulations) + " simulations");
+  mSimulationParams = params;
 }
 
 VulkanApp::~VulkanApp() {
-
+  // Only if we didn't make it out of the loop cleanly
+  if( mSimThread.joinable() ) {
+    mSimRunning = false;
+    mSimThread.join();
+  }
 }
 
 void VulkanApp::initWindow() {
@@ -47,6 +94,8 @@ void VulkanApp::initWindow() {
 }
 
 void VulkanApp::initVK() {
+  mThreadPool.reset(new ThreadPool());
+
   // Initialise the vulkan instance
   // GLFW can give us what extensions it requires, nice
   uint32_t glfwExtensionCount = 0;
@@ -56,13 +105,49 @@ void VulkanApp::initVK() {
   std::vector<const char*> enabledLayers = {};
 
   // One for rendering and one for computing
+  // Compute will be on a dedicated compute family if there is one, or another queue in the graphics family
+  // If neither of those are available both end up on the same queue
   std::vector<vk::QueueFlags> requiredQueues = { vk::QueueFlagBits::eGraphics, vk::QueueFlagBits::eCompute };
-  mDeviceInstance.reset(new DeviceInstance(requiredExtensions, {}, "Vulkan Test Application", 1, VK_API_VERSION_1_0, requiredQueues, enabledLayers));
+  // Timeline semaphores order compute against rendering, only needed if they're on different queues
+  // Real heap budgets for checkMemoryBudget, otherwise it has to guess from the heap sizes
+  std::vector<const char*> optionalDeviceExtensions = { VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME, VK_EXT_MEMORY_BUDGET_EXTENSION_NAME };
+  // Only asked for when wanted, every storage buffer gets an address once it's enabled
+  if( mBufferDeviceAddress ) optionalDeviceExtensions.emplace_back(VK_KHR_BUFFER_DEVICE_ADDRESS_EXTENSION_NAME);
+  // Which GPU, see DeviceInstance::DeviceSelection
+  DeviceInstance::DeviceSelection deviceSelection;
+  deviceSelection.preferred = mDevice;
+  // Anything which can't show the window is no use, however well it scores
+  deviceSelection.filter = [](vk::Instance instance, vk::PhysicalDevice device) {
+    auto families = device.getQueueFamilyProperties();
+    for( auto i = 0u; i < families.size(); ++i ) {
+      if( (families[i].queueFlags & vk::QueueFlagBits::eGraphics) &&
+          glfwGetPhysicalDevicePresentationSupport(instance, device, i) ) return true;
+    }
+    return false;
+  };
+  deviceSelection.filterReason = "can't present to the window";
+  if( mBenchmarkDevices ) {
+    deviceSelection.benchmark = [this](DeviceInstance& deviceInstance) { return benchmarkStep(deviceInstance); };
+    deviceSelection.benchmarkCacheFile = "physics-devices.cache";
+  }
+  mDeviceInstance.reset(new DeviceInstance(requiredExtensions, {}, "Vulkan Test Application", 1, VK_API_VERSION_1_1, requiredQueues, enabledLayers, optionalDeviceExtensions, deviceSelection));
+  mDeviceInstance->reportDevices(std::cout);
+  if( mBufferDeviceAddress && !mDeviceInstance->bufferDeviceAddressEnabled() ) {
+    std::cerr << "VulkanApp::initVK: Buffer device address not supported, using descriptor sets" << std::endl;
+    mBufferDeviceAddress = false;
+  }
 
-  mGraphicsQueue = mDeviceInstance->getQueue(requiredQueues[0]);
-  mComputeQueue = mDeviceInstance->getQueue(requiredQueues[1]);
+  mGraphicsQueue = mDeviceInstance->queue(0);
+  mComputeQueue = mDeviceInstance->queue(1);
   if( !mGraphicsQueue || !mComputeQueue ) throw std::runtime_error("Failed to get graphics and compute queues");
 
+  // Without timeline semaphores just do everything on the graphics queue
+  if( mComputeQueue->queue != mGraphicsQueue->queue && !mDeviceInstance->timelineSemaphoresEnabled() ) mComputeQueue = mGraphicsQueue;
+  mSingleSubmit = mComputeQueue->queue == mGraphicsQueue->queue;
+
+  // Saves recompiling all our shaders on every run, saved back when the device instance is destroyed
+  mDeviceInstance->loadPipelineCache("physics-pipeline.cache");
+
   // Find out what queues are available
   //auto queueFamilyProps = dev.getQueueFamilyProperties();
   //printQueueFamilyProperties(queueFamilyProps);
@@ -77,10 +162,10 @@ void VulkanApp::initVK() {
   mComputePipeline.reset(new ComputePipeline(*mDeviceInstance.get()));
 
   // Build the graphics pipeline
-  // In this case we can throw away the shader modules after building as they're only used by the one pipeline
+  // Shaders are compiled into the binary, modules are owned by the device instance
   {
-    mGraphicsPipeline->shaders()[vk::ShaderStageFlagBits::eVertex] = mGraphicsPipeline->createShaderModule("vert.spv");
-    mGraphicsPipeline->shaders()[vk::ShaderStageFlagBits::eFragment] = mGraphicsPipeline->createShaderModule("frag.spv");
+    mGraphicsPipeline->shaders()[vk::ShaderStageFlagBits::eVertex] = mGraphicsPipeline->createShaderModule(shader_test_vert);
+    mGraphicsPipeline->shaders()[vk::ShaderStageFlagBits::eFragment] = mGraphicsPipeline->createShaderModule(shader_test_frag);
     mGraphicsPipeline->inputAssembly_primitiveTopology(vk::PrimitiveTopology::ePointList);
 
     // The layout of our vertex buffers
@@ -97,34 +182,117 @@ void VulkanApp::initVK() {
     mGraphicsPipeline->vertexInputAttributes().emplace_back(1, 0, vk::Format::eR32G32B32Sfloat, offsetof(Particle, colour));
     mGraphicsPipeline->vertexInputAttributes().emplace_back(2, 0, vk::Format::eR32G32B32Sfloat, offsetof(Particle, radius));
 
-    // Register our push constant block
-    mPushContantsRange = vk::PushConstantRange()
-        .setStageFlags(vk::ShaderStageFlagBits::eVertex)
-        .setOffset(0)
-        .setSize(sizeof(PushConstants));
-    mGraphicsPipeline->pushConstants().emplace_back(mPushContantsRange);
+    // Matrices come from a uniform buffer, so they can change without re-recording command buffers
+    mGraphicsPipeline->addDescriptorSetLayoutBinding(0, 0, vk::DescriptorType::eUniformBuffer, 1, vk::ShaderStageFlagBits::eVertex);
     mGraphicsPipeline->build();
   }
 
+  // The compute rasteriser does its own frustum test, there's nothing for culling to do
+  if( mRenderMode != RenderMode::Points ) mCullParticles = false;
+
+  // Build the culling pipeline
+  // This runs on the graphics queue as part of rendering
+  if( mCullParticles ) {
+    mCullPipeline.reset(new ComputePipeline(*mDeviceInstance.get()));
+    mCullPipeline->shaders()[vk::ShaderStageFlagBits::eCompute] = mCullPipeline->createShaderModule(shader_cull_comp);
+    // Particles, matrices, visible indices, draw command
+    mCullPipeline->addDescriptorSetLayoutBinding(0, 0, vk::DescriptorType::eStorageBuffer, 1, vk::ShaderStageFlagBits::eCompute);
+    mCullPipeline->addDescriptorSetLayoutBinding(0, 1, vk::DescriptorType::eUniformBuffer, 1, vk::ShaderStageFlagBits::eCompute);
+    mCullPipeline->addDescriptorSetLayoutBinding(0, 2, vk::DescriptorType::eStorageBuffer, 1, vk::ShaderStageFlagBits::eCompute);
+    mCullPipeline->addDescriptorSetLayoutBinding(0, 3, vk::DescriptorType::eStorageBuffer, 1, vk::ShaderStageFlagBits::eCompute);
+    mCullPipeline->pushConstants().emplace_back(vk::ShaderStageFlagBits::eCompute, 0, sizeof(CullParams));
+
+    mCullSpecConstants.numParticles = static_cast<uint32_t>(mParticles.size());
+    std::vector<vk::SpecializationMapEntry> specs = {
+      {0, offsetof(CullSpecConstants, numParticles), sizeof(uint32_t)},
+      {1, offsetof(CullSpecConstants, groupSizeX), sizeof(uint32_t)},
+    };
+    mCullPipeline->specialisationConstants()[vk::ShaderStageFlagBits::eCompute] = vk::SpecializationInfo(static_cast<uint32_t>(specs.size()), specs.data(), sizeof(CullSpecConstants), &mCullSpecConstants);
+    mCullPipeline->build();
+    mCullParams.viewportHeight = static_cast<float>(mWindowIntegration->extent().height);
+  }
+
+  // Build the compute rasteriser
+  // Splatting runs on the graphics queue as part of rendering, same as culling
+  if( mRenderMode != RenderMode::Points ) {
+    auto mode = mRenderMode == RenderMode::SplatNearest ? 0u : 1u;
+
+    mSplatPipeline.reset(new ComputePipeline(*mDeviceInstance.get()));
+    mSplatPipeline->shaders()[vk::ShaderStageFlagBits::eCompute] = mSplatPipeline->createShaderModule(shader_splat_comp);
+    // Particles, matrices, splat image
+    mSplatPipeline->addDescriptorSetLayoutBinding(0, 0, vk::DescriptorType::eStorageBuffer, 1, vk::ShaderStageFlagBits::eCompute);
+    mSplatPipeline->addDescriptorSetLayoutBinding(0, 1, vk::DescriptorType::eUniformBuffer, 1, vk::ShaderStageFlagBits::eCompute);
+    mSplatPipeline->addDescriptorSetLayoutBinding(0, 2, vk::DescriptorType::eStorageImage, 1, vk::ShaderStageFlagBits::eCompute);
+
+    mSplatSpecConstants.numParticles = static_cast<uint32_t>(mParticles.size());
+    mSplatSpecConstants.mode = mode;
+    std::vector<vk::SpecializationMapEntry> splatSpecs = {
+      {0, offsetof(SplatSpecConstants, numParticles), sizeof(uint32_t)},
+      {1, offsetof(SplatSpecConstants, groupSizeX), sizeof(uint32_t)},
+      {2, offsetof(SplatSpecConstants, mode), sizeof(uint32_t)},
+    };
+    mSplatPipeline->specialisationConstants()[vk::ShaderStageFlagBits::eCompute] = vk::SpecializationInfo(static_cast<uint32_t>(splatSpecs.size()), splatSpecs.data(), sizeof(SplatSpecConstants), &mSplatSpecConstants);
+    mSplatPipeline->build();
+
+    // The resolve's render pass is the same as mGraphicsPipeline's, so it can use the same framebuffers
+    // No vertex input, the fullscreen triangle comes from the vertex index
+    mResolvePipeline.reset(new GraphicsPipeline(*mWindowIntegration.get(), *mDeviceInstance.get()));
+    mResolvePipeline->shaders()[vk::ShaderStageFlagBits::eVertex] = mResolvePipeline->createShaderModule(shader_resolve_vert);
+    mResolvePipeline->shaders()[vk::ShaderStageFlagBits::eFragment] = mResolvePipeline->createShaderModule(shader_resolve_frag);
+    mResolvePipeline->inputAssembly_primitiveTopology(vk::PrimitiveTopology::eTriangleList);
+    mResolvePipeline->addDescriptorSetLayoutBinding(0, 0, vk::DescriptorType::eStorageImage, 1, vk::ShaderStageFlagBits::eFragment);
+
+    mResolveSpecConstants.mode = mode;
+    std::vector<vk::SpecializationMapEntry> resolveSpecs = {
+      {0, offsetof(ResolveSpecConstants, mode), sizeof(uint32_t)},
+      {1, offsetof(ResolveSpecConstants, densityExposure), sizeof(float)},
+    };
+    mResolvePipeline->specialisationConstants()[vk::ShaderStageFlagBits::eFragment] = vk::SpecializationInfo(static_cast<uint32_t>(resolveSpecs.size()), resolveSpecs.data(), sizeof(ResolveSpecConstants), &mResolveSpecConstants);
+    mResolvePipeline->build();
+  }
+
   // Build the compute pipeline
   {
-    mComputePipeline->shaders()[vk::ShaderStageFlagBits::eCompute] = mComputePipeline->createShaderModule("comp.spv");
-    // Input and output buffers to compute shader
-    mComputePipeline->addDescriptorSetLayoutBinding(0, 0, vk::DescriptorType::eStorageBuffer, 1, vk::ShaderStageFlagBits::eCompute);
-    mComputePipeline->addDescriptorSetLayoutBinding(0, 1, vk::DescriptorType::eStorageBuffer, 1, vk::ShaderStageFlagBits::eCompute);
+    if( mBufferDeviceAddress ) {
+      // Everything comes in through the push constants, no descriptor sets at all
+      mComputePipeline->shaders()[vk::ShaderStageFlagBits::eCompute] = mComputePipeline->createShaderModule(shader_test_bda_comp);
+    } else {
+      mComputePipeline->shaders()[vk::ShaderStageFlagBits::eCompute] = mComputePipeline->createShaderModule(shader_test_comp);
+      // Input and output buffers to compute shader
+      mComputePipeline->addDescriptorSetLayoutBinding(0, 0, vk::DescriptorType::eStorageBuffer, 1, vk::ShaderStageFlagBits::eCompute);
+      mComputePipeline->addDescriptorSetLayoutBinding(0, 1, vk::DescriptorType::eStorageBuffer, 1, vk::ShaderStageFlagBits::eCompute);
+      // Sorted order of the input, for steps which reorder
+      mComputePipeline->addDescriptorSetLayoutBinding(0, 2, vk::DescriptorType::eStorageBuffer, 1, vk::ShaderStageFlagBits::eCompute);
+      // ID -> slot table, written when reordering
+      mComputePipeline->addDescriptorSetLayoutBinding(0, 3, vk::DescriptorType::eStorageBuffer, 1, vk::ShaderStageFlagBits::eCompute);
+      // Force fields
+      mComputePipeline->addDescriptorSetLayoutBinding(0, 4, vk::DescriptorType::eStorageBuffer, 1, vk::ShaderStageFlagBits::eCompute);
+      // Adaptive time step
+      mComputePipeline->addDescriptorSetLayoutBinding(0, 5, vk::DescriptorType::eStorageBuffer, 1, vk::ShaderStageFlagBits::eCompute);
+      // Per simulation parameters
+      mComputePipeline->addDescriptorSetLayoutBinding(0, 6, vk::DescriptorType::eStorageBuffer, 1, vk::ShaderStageFlagBits::eCompute);
+    }
+    mComputePipeline->pushConstants().emplace_back(vk::ShaderStageFlagBits::eCompute, 0, sizeof(ComputeParams));
 
     mComputeSpecConstants.mComputeBufferWidth = static_cast<uint32_t>(mParticles.size());
-    vk::SpecializationMapEntry specs[] = {
-      {0, offsetof(ComputeSpecConstants, mComputeBufferWidth), sizeof(uint32_t)},
-      {1, offsetof(ComputeSpecConstants, mComputeBufferHeight), sizeof(uint32_t)},
-      {2, offsetof(ComputeSpecConstants, mComputeBufferDepth), sizeof(uint32_t)},
-      {3, offsetof(ComputeSpecConstants, mComputeGroupSizeX), sizeof(uint32_t)},
-      {4, offsetof(ComputeSpecConstants, mComputeGroupSizeY), sizeof(uint32_t)},
-      {5, offsetof(ComputeSpecConstants, mComputeGroupSizeZ), sizeof(uint32_t)},
-    };
-    mComputePipeline->specialisationConstants()[vk::ShaderStageFlagBits::eCompute] = vk::SpecializationInfo(6, specs, sizeof(ComputeSpecConstants), &mComputeSpecConstants);
+    auto specs = computeSpecialisationEntries();
+    mComputePipeline->specialisationConstants()[vk::ShaderStageFlagBits::eCompute] = vk::SpecializationInfo(static_cast<uint32_t>(specs.size()), specs.data(), sizeof(ComputeSpecConstants), &mComputeSpecConstants);
 
     mComputePipeline->build();
+
+    // Variants of the pipeline for each workgroup size, all compiled up front
+    // so switching between them is free
+    auto limits = mDeviceInstance->physicalDevice().getProperties().limits;
+    mComputeVariants.reset(new ComputePipelineVariants(*mDeviceInstance.get(), *mComputePipeline.get()));
+    for( auto groupSize : {32u, 64u, 128u, 256u, 512u, 1024u} ) {
+      if( groupSize > limits.maxComputeWorkGroupInvocations || groupSize > limits.maxComputeWorkGroupSize[0] ) continue;
+      auto constants = mComputeSpecConstants;
+      constants.mComputeGroupSizeX = groupSize;
+      mComputeVariants->addVariant("groupsize-" + std::to_string(groupSize), ComputePipelineVariants::Specialisation::fromStruct(specs, constants));
+      mComputeVariantGroupSizes.emplace_back(groupSize);
+    }
+    mComputeVariants->build(*mThreadPool.get());
+    mComputeVariant = mComputeVariants->index("groupsize-64");
   }
 
   mFrameBuffer.reset(new FrameBuffer(mDeviceInstance->device(), *mWindowIntegration.get(), mGraphicsPipeline->renderPass()));
@@ -143,9 +311,46 @@ void VulkanApp::initVK() {
     mFrameInFlightFences.emplace_back( mDeviceInstance->device().createFenceUnique({vk::FenceCreateFlagBits::eSignaled}));
   }
 
+  // Compute may be working on mComputeLead steps, each in its own buffer
+  // On top of those there's the most recently published buffer, and the one on screen
+  mComputeLead = std::max(mComputeLead, 1u);
+  mNumParticleBuffers = mComputeLead + 2;
+  mParticleBufferSteps.resize(mNumParticleBuffers, 0);
+
+  // Render uses a slot per swapchain image, compute one per source/target pair
+  if( mProfileGPU ) {
+    mProfiler.reset(new QueryProfiler(*mDeviceInstance.get(), std::max(mMaxFramesInFlight, mNumParticleBuffers * (mNumParticleBuffers - 1))));
+    mProfileScopeUpload = mProfiler->addScope("upload", QueryProfiler::ScopeType::Transfer, *mComputeQueue);
+    mProfileScopeCompute = mProfiler->addScope("compute", QueryProfiler::ScopeType::Compute, *mComputeQueue);
+    mProfileScopeRender = mProfiler->addScope("render", QueryProfiler::ScopeType::Graphics, *mGraphicsQueue);
+    if( mCullParticles ) mProfileScopeCull = mProfiler->addScope("cull", QueryProfiler::ScopeType::Compute, *mGraphicsQueue);
+    if( mSplatPipeline ) mProfileScopeSplat = mProfiler->addScope("splat", QueryProfiler::ScopeType::Compute, *mGraphicsQueue);
+    if( mReorderInterval ) mProfileScopeReorder = mProfiler->addScope("reorder", QueryProfiler::ScopeType::Compute, *mComputeQueue);
+    if( !mCollisionMeshFile.empty() ) mProfileScopeCollide = mProfiler->addScope("collide", QueryProfiler::ScopeType::Compute, *mComputeQueue);
+    if( !mSdfSource.empty() ) mProfileScopeSdf = mProfiler->addScope("sdf", QueryProfiler::ScopeType::Compute, *mComputeQueue);
+    if( mComputeSpecConstants.mAdaptiveTimeStep ) mProfileScopeTimeStep = mProfiler->addScope("timestep", QueryProfiler::ScopeType::Compute, *mComputeQueue);
+    mProfiler->reportOnExit(true);
+#ifdef VULKANUTILS_TRACE
+    // Needed to line GPU scopes up with the CPU trace, each queue family has its own clock
+    mProfiler->calibrate(*mGraphicsQueue);
+    if( mComputeQueue->famIndex != mGraphicsQueue->famIndex ) mProfiler->calibrate(*mComputeQueue);
+#endif
+  }
+
   // Create buffers
+  checkMemoryBudget();
   createComputeBuffers();
-  createComputeDescriptorSet();
+  if( mReorderInterval ) createReorderResources();
+  createForceFieldBuffers();
+  createTimeStepResources();
+  if( !mBufferDeviceAddress ) createComputeDescriptorSet();
+  createLookupResources();
+  if( !mCollisionMeshFile.empty() ) createCollisionMesh();
+  if( !mSdfSource.empty() ) createCollisionField();
+  if( mDiagnosticsEnabled ) createDiagnostics();
+  if( mDiagnosticsEnabled && mNumSimulations > 1 ) createEnsembleDiagnostics();
+
+  if( mMemoryReport ) mDeviceInstance->reportMemory(std::cout);
 
   // Command pool/buffers for compute
   // TODO: If both queue pointers are the same should maybe use a single pool?
@@ -156,14 +361,16 @@ void VulkanApp::initVK() {
                                                                                                                                                 */
                                                        }, *mComputeQueue);
 
-    // Now make a command buffer for each framebuffer
-    auto commandBufferAllocateInfo = vk::CommandBufferAllocateInfo()
-        .setCommandPool(mComputeCommandPool.get())
-        .setCommandBufferCount(static_cast<uint32_t>(mMaxFramesInFlight))
-        .setLevel(vk::CommandBufferLevel::ePrimary);
-    mComputeCommandBuffers = mDeviceInstance->device().allocateCommandBuffersUnique(commandBufferAllocateInfo);
+    // The step command buffers come from here, see buildComputeCommandBuffers
+    mComputeCommandPools.reset(new CommandPools(*mDeviceInstance.get(), *mComputeQueue));
   }
 
+  if( !mSingleSubmit ) mScheduler.reset(new TimelineScheduler(*mDeviceInstance.get(), mNumParticleBuffers, mComputeLead));
+
+  createGraphicsDescriptorSets();
+  if( mCullParticles ) createCullBuffers();
+  if( mSplatPipeline ) createSplatResources();
+
   // TODO: Could be utilitised
   // Command pool/buffers for rendering
   {
@@ -173,18 +380,104 @@ void VulkanApp::initVK() {
                                                                                                                                                 */
                                                        }, *mGraphicsQueue);
 
-    // Now make a command buffer for each framebuffer
+    // Now make a command buffer for each framebuffer/particle buffer pair
+    // These are recorded on first use and then reused until invalidated
+    auto numImages = static_cast<uint32_t>(mWindowIntegration->swapChainImages().size());
     auto commandBufferAllocateInfo = vk::CommandBufferAllocateInfo()
         .setCommandPool(mCommandPool.get())
-        .setCommandBufferCount(static_cast<uint32_t>(mWindowIntegration->swapChainImages().size()))
+        .setCommandBufferCount(numImages * static_cast<uint32_t>(mComputeDataBuffers.size()))
         .setLevel(vk::CommandBufferLevel::ePrimary)
         ;
 
     mCommandBuffers = mDeviceInstance->device().allocateCommandBuffersUnique(commandBufferAllocateInfo);
+    mCommandBuffersValid.resize(mCommandBuffers.size(), false);
+    mImagesInFlight.resize(numImages);
+    mFrameSteps.resize(mMaxFramesInFlight, 0);
+  }
+}
+
+vk::CommandBuffer VulkanApp::renderCommandBuffer(uint32_t imageIndex, uint32_t particleBufferIndex) {
+  auto index = (imageIndex * static_cast<uint32_t>(mComputeDataBuffers.size())) + particleBufferIndex;
+  auto commandBuffer = mCommandBuffers[index].get();
+  if( !mCommandBuffersValid[index] ) {
+    TRACE_SCOPE("buildCommandBuffer");
+    buildCommandBuffer(commandBuffer, imageIndex, particleBufferIndex);
+    mCommandBuffersValid[index] = true;
   }
+  return commandBuffer;
+}
+
+void VulkanApp::invalidateRenderCommandBuffers() {
+  // Can't reset command buffers which may still be executing
+  // This should be rare (swapchain/pipeline changes), so just wait for everything to finish
+  mDeviceInstance->waitAllDevicesIdle();
+  std::fill(mCommandBuffersValid.begin(), mCommandBuffersValid.end(), false);
+}
+
+void VulkanApp::buildCullCommands(TaskGraph& graph, RenderResources& resources, uint32_t imageIndex, uint32_t particleBufferIndex) {
+  // The last frame to use these has finished, the frame fences make sure of that
+  resources.drawCommands = graph.importBuffer("drawcommands", mDrawCommandBuffers[imageIndex]->buffer());
+  resources.visibleIndices = graph.importBuffer("visibleindices", mVisibleIndexBuffers[imageIndex]->buffer());
+
+  // Reset the draw, the cull shader counts up the indices
+  graph.addPass("cullreset", [this, imageIndex](vk::CommandBuffer commandBuffer) {
+    if( mProfiler ) mProfiler->cmdBeginScope(commandBuffer, imageIndex, mProfileScopeCull);
+    vk::DrawIndexedIndirectCommand drawCommand(0, 1, 0, 0, 0);
+    commandBuffer.updateBuffer(mDrawCommandBuffers[imageIndex]->buffer(), 0, sizeof(drawCommand), &drawCommand);
+  }).write(resources.drawCommands, TaskGraph::transferWrite);
+
+  graph.addPass("cull", [this, imageIndex, particleBufferIndex](vk::CommandBuffer commandBuffer) {
+    auto& descriptorSet = mCullDescriptorSets[(imageIndex * mNumParticleBuffers) + particleBufferIndex];
+    commandBuffer.bindPipeline(vk::PipelineBindPoint::eCompute, mCullPipeline->pipeline());
+    commandBuffer.bindDescriptorSets(vk::PipelineBindPoint::eCompute,
+                                     mCullPipeline->pipelineLayout(),
+                                     0, 1,
+                                     &descriptorSet,
+                                     0, nullptr);
+    commandBuffer.pushConstants(mCullPipeline->pipelineLayout(), vk::ShaderStageFlagBits::eCompute, 0, sizeof(CullParams), &mCullParams);
+    commandBuffer.dispatch((mCullSpecConstants.numParticles + mCullSpecConstants.groupSizeX - 1) / mCullSpecConstants.groupSizeX, 1, 1);
+    if( mProfiler ) mProfiler->cmdEndScope(commandBuffer, imageIndex, mProfileScopeCull);
+  }).read(resources.particles, TaskGraph::computeRead)
+    .write(resources.drawCommands, TaskGraph::computeReadWrite)
+    .write(resources.visibleIndices, TaskGraph::computeWrite);
+}
+
+void VulkanApp::buildSplatCommands(TaskGraph& graph, RenderResources& resources, uint32_t imageIndex, uint32_t particleBufferIndex) {
+  auto& splatImage = *mSplatImages[imageIndex].get();
+  auto general = vk::ImageLayout::eGeneral;
+
+  // The resolve which read it last time has finished (frame fences), and the contents are going anyway so the old layout doesn't matter
+  resources.splatImage = graph.importImage("splat", splatImage.image(), splatImage.subresourceRange(), {vk::PipelineStageFlagBits::eFragmentShader, {}, vk::ImageLayout::eUndefined});
+
+  // Clear out the last frame
+  graph.addPass("splatclear", [this, imageIndex](vk::CommandBuffer commandBuffer) {
+    auto& splatImage = *mSplatImages[imageIndex].get();
+    auto range = splatImage.subresourceRange();
+    if( mProfiler ) mProfiler->cmdBeginScope(commandBuffer, imageIndex, mProfileScopeSplat);
+    vk::ClearColorValue clearValue(std::array<uint32_t,4>{0, 0, 0, 0});
+    commandBuffer.clearColorImage(splatImage.image(), vk::ImageLayout::eGeneral, &clearValue, 1, &range);
+  }).write(resources.splatImage, {vk::PipelineStageFlagBits::eTransfer, vk::AccessFlagBits::eTransferWrite, general});
+
+  // One invocation per particle, atomics take care of any overlap
+  graph.addPass("splat", [this, imageIndex, particleBufferIndex](vk::CommandBuffer commandBuffer) {
+    auto& descriptorSet = mSplatDescriptorSets[(imageIndex * mNumParticleBuffers) + particleBufferIndex];
+    commandBuffer.bindPipeline(vk::PipelineBindPoint::eCompute, mSplatPipeline->pipeline());
+    commandBuffer.bindDescriptorSets(vk::PipelineBindPoint::eCompute,
+                                     mSplatPipeline->pipelineLayout(),
+                                     0, 1,
+                                     &descriptorSet,
+                                     0, nullptr);
+    commandBuffer.dispatch((mSplatSpecConstants.numParticles + mSplatSpecConstants.groupSizeX - 1) / mSplatSpecConstants.groupSizeX, 1, 1);
+    if( mProfiler ) mProfiler->cmdEndScope(commandBuffer, imageIndex, mProfileScopeSplat);
+  }).read(resources.particles, TaskGraph::computeRead)
+    .write(resources.splatImage, {vk::PipelineStageFlagBits::eComputeShader, vk::AccessFlagBits::eShaderRead | vk::AccessFlagBits::eShaderWrite, general});
 }
 
-void VulkanApp::buildCommandBuffer(vk::CommandBuffer& commandBuffer, const vk::Framebuffer& frameBuffer, vk::Buffer& particleVertexBuffer) {
+void VulkanApp::buildCommandBuffer(vk::CommandBuffer commandBuffer, uint32_t imageIndex, uint32_t particleBufferIndex) {
+  auto& frameBuffer = mFrameBuffer->frameBuffers()[imageIndex].get();
+  auto& particleBuffer = *mComputeDataBuffers[particleBufferIndex].get();
+  auto& descriptorSet = mGraphicsDescriptorSets[imageIndex];
+  auto profilerSlot = imageIndex;
 
   auto beginInfo = vk::CommandBufferBeginInfo()
       .setFlags(vk::CommandBufferUsageFlagBits::eSimultaneousUse) // Buffer can be resubmitted while already pending execution
@@ -206,103 +499,327 @@ void VulkanApp::buildCommandBuffer(vk::CommandBuffer& commandBuffer, const vk::F
   renderPassInfo.renderArea.extent = mWindowIntegration->extent();
 
   // Barrier to prevent the start of vertex shader until writing has finished to particle buffer
+  // Between queues the semaphores handle ordering, QueueOwnership works out what else is needed
+  // The cull and splat passes read particles too, if they're enabled
   // Remember:
   // - Access flags should be as minimal as possible here
   // - Barriers must be outside a render pass (there's an exception to this, but keep it simple for now)
-  auto particleBufferBarrier = vk::BufferMemoryBarrier()
-      .setSrcAccessMask(vk::AccessFlagBits::eShaderWrite)
-      .setDstAccessMask(vk::AccessFlagBits::eVertexAttributeRead)
-      .setSrcQueueFamilyIndex(mComputeQueue->famIndex)
-      .setDstQueueFamilyIndex(mGraphicsQueue->famIndex)
-      .setBuffer(particleVertexBuffer)
-      .setOffset(0)
-      .setSize(VK_WHOLE_SIZE);
-
-  commandBuffer.pipelineBarrier(
-        vk::PipelineStageFlagBits::eComputeShader,
-        vk::PipelineStageFlagBits::eVertexInput,
-        vk::DependencyFlagBits::eByRegion,
-        0, nullptr,
-        1, &particleBufferBarrier,
-        0, nullptr
-        );
-
-  // render commands will be embedded in primary buffer and no secondary command buffers
-  // will be executed
-  commandBuffer.beginRenderPass(renderPassInfo, vk::SubpassContents::eInline);
-  commandBuffer.bindPipeline(vk::PipelineBindPoint::eGraphics, mGraphicsPipeline->pipeline());
-
-  // Set our push constants
-  commandBuffer.pushConstants(
-        mGraphicsPipeline->pipelineLayout(),
-        mPushContantsRange.stageFlags,
-        mPushContantsRange.offset,
-        sizeof(PushConstants),
-        &mPushConstants);
+  QueueOwnership::Access computeWrite = {vk::PipelineStageFlagBits::eComputeShader, vk::AccessFlagBits::eShaderWrite};
+  QueueOwnership::Access vertexRead = {vk::PipelineStageFlagBits::eVertexInput, vk::AccessFlagBits::eVertexAttributeRead};
+  if( mCullParticles || mSplatPipeline ) {
+    vertexRead.stages |= vk::PipelineStageFlagBits::eComputeShader;
+    vertexRead.access |= vk::AccessFlagBits::eShaderRead;
+  }
+  QueueOwnership::cmdAcquire(commandBuffer, *mComputeQueue, *mGraphicsQueue, particleBuffer, computeWrite, vertexRead);
+
+  // The rest is a task graph, which puts the barriers between culling/splatting and the draw
+  // The acquire has already made the particles visible to everything here
+  TaskGraph graph(*mDeviceInstance.get());
+  RenderResources resources;
+  resources.particles = graph.importBuffer("particles", particleBuffer.buffer());
+
+  // Statistics queries can't nest, so culling is profiled separately rather than as part of the render
+  if( mCullParticles ) buildCullCommands(graph, resources, imageIndex, particleBufferIndex);
+  if( mSplatPipeline ) buildSplatCommands(graph, resources, imageIndex, particleBufferIndex);
+
+  auto& renderPass = graph.addPass("render", [&](vk::CommandBuffer commandBuffer) {
+    if( mProfiler ) mProfiler->cmdBeginScope(commandBuffer, profilerSlot, mProfileScopeRender);
+
+    // render commands will be embedded in primary buffer and no secondary command buffers
+    // will be executed
+    commandBuffer.beginRenderPass(renderPassInfo, vk::SubpassContents::eInline);
+    if( mResolvePipeline ) {
+      // Splatting already did the real work, just get it onto the screen
+      commandBuffer.bindPipeline(vk::PipelineBindPoint::eGraphics, mResolvePipeline->pipeline());
+      commandBuffer.bindDescriptorSets(vk::PipelineBindPoint::eGraphics,
+                                       mResolvePipeline->pipelineLayout(),
+                                       0, 1,
+                                       &mResolveDescriptorSets[imageIndex],
+                                       0, nullptr);
+      commandBuffer.draw(3, 1, 0, 0);
+    } else {
+      commandBuffer.bindPipeline(vk::PipelineBindPoint::eGraphics, mGraphicsPipeline->pipeline());
+
+      // Matrices for this swapchain image, updated each frame before submission
+      commandBuffer.bindDescriptorSets(vk::PipelineBindPoint::eGraphics,
+                                       mGraphicsPipeline->pipelineLayout(),
+                                       0, 1,
+                                       &descriptorSet,
+                                       0, nullptr);
+
+      vk::Buffer buffers[] = { particleBuffer.buffer() };
+      vk::DeviceSize offsets[] = { 0 };
+      commandBuffer.bindVertexBuffers(0, 1, buffers, offsets);
+
+      if( mCullParticles ) {
+        // Only the visible particles, the count comes from the cull pass
+        commandBuffer.bindIndexBuffer(mVisibleIndexBuffers[imageIndex]->buffer(), 0, vk::IndexType::eUint32);
+        commandBuffer.drawIndexedIndirect(mDrawCommandBuffers[imageIndex]->buffer(), 0, 1, sizeof(vk::DrawIndexedIndirectCommand));
+      } else {
+        commandBuffer.draw(static_cast<uint32_t>(mParticles.size()), // Draw n vertices
+                           1, // Used for instanced rendering, 1 otherwise
+                           0, // First vertex
+                           0  // First instance
+                           );
+      }
+    }
 
-  vk::Buffer buffers[] = { particleVertexBuffer };
-  vk::DeviceSize offsets[] = { 0 };
-  commandBuffer.bindVertexBuffers(0, 1, buffers, offsets);
+    // End the render pass
+    commandBuffer.endRenderPass();
+  });
+  if( mResolvePipeline ) {
+    renderPass.read(resources.splatImage, {vk::PipelineStageFlagBits::eFragmentShader, vk::AccessFlagBits::eShaderRead, vk::ImageLayout::eGeneral});
+  } else {
+    renderPass.read(resources.particles, TaskGraph::vertexRead);
+    if( mCullParticles ) {
+      renderPass.read(resources.visibleIndices, TaskGraph::indexRead)
+                .read(resources.drawCommands, TaskGraph::indirectRead);
+    }
+  }
+  graph.record(commandBuffer);
 
-  commandBuffer.draw(static_cast<uint32_t>(mParticles.size()), // Draw n vertices
-                     1, // Used for instanced rendering, 1 otherwise
-                     0, // First vertex
-                     0  // First instance
-                     );
+  // Hand the buffer back for the simulation to overwrite
+  QueueOwnership::cmdRelease(commandBuffer, *mGraphicsQueue, *mComputeQueue, particleBuffer, vertexRead, computeWrite);
 
-  // End the render pass
-  commandBuffer.endRenderPass();
+  if( mProfiler ) mProfiler->cmdEndScope(commandBuffer, profilerSlot, mProfileScopeRender);
 
   // End the command buffer
   commandBuffer.end();
 }
 
-void VulkanApp::buildComputeCommandBuffer(vk::CommandBuffer& commandBuffer, vk::DescriptorSet& descriptorSet, vk::Buffer& particleVertexBuffer) {
-  auto beginInfo = vk::CommandBufferBeginInfo()
-      .setFlags(vk::CommandBufferUsageFlagBits::eSimultaneousUse) // Buffer can be resubmitted while already pending execution
-      .setPInheritanceInfo(nullptr);
-  commandBuffer.begin(beginInfo);
+uint32_t VulkanApp::computePairIndex(uint32_t source, uint32_t target) const {
+  // Skip over source == target, that's never a valid pair
+  return (source * (mNumParticleBuffers - 1)) + (target < source ? target : target - 1);
+}
 
-  // Bind the compute pipeline
-  commandBuffer.bindPipeline(vk::PipelineBindPoint::eCompute, mComputePipeline->pipeline());
+void VulkanApp::buildComputeCommandBuffers() {
+  TRACE_SCOPE("buildComputeCommandBuffers");
+  auto start = now();
+
+  // One for each source/target pair, and the same again for the steps which reorder
+  // They're all independent, so each worker records a share into its own command pool
+  auto numPairs = mNumParticleBuffers * (mNumParticleBuffers - 1);
+  auto build = [&](bool reorder) {
+    return mComputeCommandPools->record(mThreadPool.get(), numPairs, vk::CommandBufferLevel::ePrimary,
+      [this, reorder](vk::CommandBuffer commandBuffer, uint32_t pair) {
+        // Reverse of computePairIndex
+        auto source = pair / (mNumParticleBuffers - 1);
+        auto target = pair % (mNumParticleBuffers - 1);
+        if( target >= source ) ++target;
+        buildComputeCommandBuffer(commandBuffer, source, target, reorder);
+      },
+      vk::CommandBufferUsageFlagBits::eSimultaneousUse); // Buffer can be resubmitted while already pending execution
+  };
+  mComputeCommandBuffers = build(false);
+  if( mReorderInterval ) mReorderCommandBuffers = build(true);
+
+  std::cout << "Recorded " << (mComputeCommandBuffers.size() + mReorderCommandBuffers.size()) << " step command buffers on "
+            << mComputeCommandPools->numPools() << " threads in " << (now() - start) * 1000.0 << "ms" << std::endl;
+}
 
-  // Bind the descriptor sets - Bind the descriptor set (which points to the buffers) to the pipeline
-  commandBuffer.bindDescriptorSets(vk::PipelineBindPoint::eCompute,
-                                   mComputePipeline->pipelineLayout(),
-                                   0, 1,
-                                   &descriptorSet,
-                                   0, nullptr);
+void VulkanApp::buildComputeCommandBuffer(vk::CommandBuffer commandBuffer, uint32_t source, uint32_t target, bool reorder) {
+  auto pair = computePairIndex(source, target);
+  auto profilerSlot = pair;
+  auto& targetBuffer = *mComputeDataBuffers[target].get();
+
+  // Rendering may have been reading the target buffer
+  QueueOwnership::Access computeWrite = {vk::PipelineStageFlagBits::eComputeShader, vk::AccessFlagBits::eShaderWrite};
+  QueueOwnership::Access vertexRead = {vk::PipelineStageFlagBits::eVertexInput, vk::AccessFlagBits::eVertexAttributeRead};
+  QueueOwnership::cmdAcquire(commandBuffer, *mGraphicsQueue, *mComputeQueue, targetBuffer, vertexRead, computeWrite);
+
+  // Everything in between is a task graph, which works out the barriers from what each pass uses
+  // The previous step on this queue wrote our input and read our output, any particle buffer could be either
+  TaskGraph graph(*mDeviceInstance.get());
+  auto sourceParticles = graph.importBuffer("source", mComputeDataBuffers[source]->buffer(), TaskGraph::computeReadWrite);
+  auto targetParticles = graph.importBuffer("target", targetBuffer.buffer(), TaskGraph::computeReadWrite);
+  auto slots = graph.importBuffer("slots", mParticleSlots->buffer(), TaskGraph::computeReadWrite);
+  // Host writes are covered by the submission
+  auto forceFields = graph.importBuffer("forcefields", mForceFieldBuffers[pair]->buffer());
+  auto simulations = graph.importBuffer("simulations", mSimulationBuffer->buffer());
+  // Written by the last step's time step pass
+  auto timeStep = graph.importBuffer("timestep", mTimeStepBuffer->buffer(), TaskGraph::computeWrite);
+  auto lookups = graph.importBuffer("lookups", mLookupBuffers[pair]->buffer());
+  graph.exportResource(lookups, TaskGraph::hostRead);
+
+  // Work out the sorted order of the input, the step gathers through it
+  // Only the order is sorted, the particles themselves only get moved once (by the step)
+  auto order = sourceParticles;
+  if( reorder ) {
+    auto keys = graph.importBuffer("keys", mReorderSort->keys().buffer(), TaskGraph::computeRead);
+    order = graph.importBuffer("order", mReorderSort->values().buffer(), TaskGraph::computeRead);
+
+    graph.addPass("morton", [&](vk::CommandBuffer commandBuffer) {
+      if( mProfiler ) mProfiler->cmdBeginScope(commandBuffer, profilerSlot, mProfileScopeReorder);
+      commandBuffer.bindPipeline(vk::PipelineBindPoint::eCompute, mMortonPipeline->pipeline());
+      commandBuffer.bindDescriptorSets(vk::PipelineBindPoint::eCompute,
+                                       mMortonPipeline->pipelineLayout(),
+                                       0, 1,
+                                       &mMortonDescriptorSets[source],
+                                       0, nullptr);
+      commandBuffer.pushConstants(mMortonPipeline->pipelineLayout(), vk::ShaderStageFlagBits::eCompute, 0, sizeof(MortonParams), &mMortonParams);
+      commandBuffer.dispatch((mMortonSpecConstants.numParticles + mMortonSpecConstants.groupSizeX - 1) / mMortonSpecConstants.groupSizeX, 1, 1);
+    }).read(sourceParticles, TaskGraph::computeRead)
+      .write(keys, TaskGraph::computeWrite)
+      .write(order, TaskGraph::computeWrite);
+
+    // The sort has its own barriers between its passes
+    graph.addPass("sort", [&](vk::CommandBuffer commandBuffer) {
+      mReorderSort->cmdSort(commandBuffer, mMortonSpecConstants.numParticles);
+      if( mProfiler ) mProfiler->cmdEndScope(commandBuffer, profilerSlot, mProfileScopeReorder);
+    }).write(keys, TaskGraph::computeReadWrite)
+      .write(order, TaskGraph::computeReadWrite);
+  }
 
-  // Barrier to prevent the start of compute shader until reading has finished from particle buffer
-  // Remember:
-  // - Access flags should be as minimal as possible here
-  // - Barriers must be outside a render pass (there's an exception to this, but keep it simple for now)
-  auto particleBufferBarrier = vk::BufferMemoryBarrier()
-      .setSrcAccessMask(vk::AccessFlagBits::eVertexAttributeRead)
-      .setDstAccessMask(vk::AccessFlagBits::eShaderWrite)
-      .setSrcQueueFamilyIndex(mComputeQueue->famIndex)
-      .setDstQueueFamilyIndex(mGraphicsQueue->famIndex)
-      .setBuffer(particleVertexBuffer)
-      .setOffset(0)
-      .setSize(VK_WHOLE_SIZE);
+  graph.addPass("step", [&](vk::CommandBuffer commandBuffer) {
+    if( mProfiler ) mProfiler->cmdBeginScope(commandBuffer, profilerSlot, mProfileScopeCompute);
+
+    // Bind the compute pipeline
+    commandBuffer.bindPipeline(vk::PipelineBindPoint::eCompute, mComputeVariants->pipeline(mComputeVariant));
+
+    ComputeParams params;
+    params.reorder = reorder ? 1 : 0;
+    if( mBufferDeviceAddress ) {
+      // Just pointers, re-pointing the step is a matter of pushing different ones
+      params.inParticles = mComputeDataBuffers[source]->deviceAddress();
+      params.outParticles = targetBuffer.deviceAddress();
+      params.order = mReorderSort ? mReorderSort->values().deviceAddress() : 0;
+      params.slots = mParticleSlots->deviceAddress();
+      params.forceFields = mForceFieldBuffers[pair]->deviceAddress();
+      params.timeStep = mTimeStepBuffer->deviceAddress();
+      params.simulations = mSimulationBuffer->deviceAddress();
+    } else {
+      // Bind the descriptor sets - Bind the descriptor set (which points to the buffers) to the pipeline
+      commandBuffer.bindDescriptorSets(vk::PipelineBindPoint::eCompute,
+                                       mComputeVariants->pipelineLayout(),
+                                       0, 1,
+                                       &mComputeDescriptorSets[pair],
+                                       0, nullptr);
+    }
+    commandBuffer.pushConstants(mComputeVariants->pipelineLayout(), vk::ShaderStageFlagBits::eCompute, 0, sizeof(ComputeParams), &params);
+
+    // Dispatch the pipeline - equivalent of a 'draw'
+    // Number of groups is specified here, size of a group is set in the shader
+    // Round up, the shader ignores any invocations past the end of the buffer
+    auto groupSizeX = mComputeVariantGroupSizes[mComputeVariant];
+    commandBuffer.dispatch((mComputeSpecConstants.mComputeBufferWidth + groupSizeX - 1) / groupSizeX,
+                           mComputeSpecConstants.mComputeBufferHeight / mComputeSpecConstants.mComputeGroupSizeY,
+                           mComputeSpecConstants.mComputeBufferDepth / mComputeSpecConstants.mComputeGroupSizeZ );
+
+    // Only the step itself in here, so the compute timings say what the particle layout is costing
+    if( mProfiler ) mProfiler->cmdEndScope(commandBuffer, profilerSlot, mProfileScopeCompute);
+  }).read(sourceParticles, TaskGraph::computeRead)
+    .read(order, TaskGraph::computeRead)
+    .read(forceFields, TaskGraph::computeRead)
+    .read(timeStep, TaskGraph::computeRead)
+    .read(simulations, TaskGraph::computeRead)
+    .write(targetParticles, TaskGraph::computeWrite)
+    .write(slots, TaskGraph::computeWrite);
+
+  // Then push anything that's ended up inside the mesh back out
+  if( mCollidePipeline ) {
+    graph.addPass("collide", [&](vk::CommandBuffer commandBuffer) {
+      if( mProfiler ) mProfiler->cmdBeginScope(commandBuffer, profilerSlot, mProfileScopeCollide);
+      commandBuffer.bindPipeline(vk::PipelineBindPoint::eCompute, mCollidePipeline->pipeline());
+      commandBuffer.bindDescriptorSets(vk::PipelineBindPoint::eCompute,
+                                       mCollidePipeline->pipelineLayout(),
+                                       0, 1,
+                                       &mCollideDescriptorSets[target],
+                                       0, nullptr);
+      commandBuffer.dispatch((mCollideSpecConstants.numParticles + mCollideSpecConstants.groupSizeX - 1) / mCollideSpecConstants.groupSizeX, 1, 1);
+      if( mProfiler ) mProfiler->cmdEndScope(commandBuffer, profilerSlot, mProfileScopeCollide);
+    }).write(targetParticles, TaskGraph::computeReadWrite);
+  }
 
-  commandBuffer.pipelineBarrier(
-        vk::PipelineStageFlagBits::eVertexInput,
-        vk::PipelineStageFlagBits::eComputeShader,
-        vk::DependencyFlagBits::eByRegion,
-        0, nullptr,
-        1, &particleBufferBarrier,
-        0, nullptr
-        );
+  // And the distance field, if there's one of those too it goes last
+  if( mSdfPipeline ) {
+    graph.addPass("sdf", [&](vk::CommandBuffer commandBuffer) {
+      if( mProfiler ) mProfiler->cmdBeginScope(commandBuffer, profilerSlot, mProfileScopeSdf);
+      commandBuffer.bindPipeline(vk::PipelineBindPoint::eCompute, mSdfPipeline->pipeline());
+      commandBuffer.bindDescriptorSets(vk::PipelineBindPoint::eCompute,
+                                       mSdfPipeline->pipelineLayout(),
+                                       0, 1,
+                                       &mSdfDescriptorSets[target],
+                                       0, nullptr);
+      commandBuffer.pushConstants(mSdfPipeline->pipelineLayout(), vk::ShaderStageFlagBits::eCompute, 0, sizeof(SdfParams), &mSdfParams);
+      commandBuffer.dispatch((mSdfSpecConstants.numParticles + mSdfSpecConstants.groupSizeX - 1) / mSdfSpecConstants.groupSizeX, 1, 1);
+      if( mProfiler ) mProfiler->cmdEndScope(commandBuffer, profilerSlot, mProfileScopeSdf);
+    }).write(targetParticles, TaskGraph::computeReadWrite);
+  }
 
-  // Dispatch the pipeline - equivalent of a 'draw'
-  // Number of groups is specified here, size of a group is set in the shader
-  commandBuffer.dispatch(mComputeSpecConstants.mComputeBufferWidth / mComputeSpecConstants.mComputeGroupSizeX,
-                         mComputeSpecConstants.mComputeBufferHeight / mComputeSpecConstants.mComputeGroupSizeY,
-                         mComputeSpecConstants.mComputeBufferDepth / mComputeSpecConstants.mComputeGroupSizeZ );
+  // Diagnostics for the step we just ran, the result comes back in this pair's slot
+  if( mDiagnosticsReduction ) {
+    auto results = graph.importBuffer("diagnostics", mDiagnosticsReduction->resultBuffer());
+    graph.exportResource(results, TaskGraph::hostRead);
+    graph.addPass("diagnostics", [&](vk::CommandBuffer commandBuffer) {
+      mDiagnosticsReduction->cmdReduce(commandBuffer, target, pair);
+    }).read(targetParticles, TaskGraph::computeRead)
+      .write(results, TaskGraph::computeWrite);
+  }
 
-  // End the command buffer
-  commandBuffer.end();
+  // And for each simulation, a workgroup each
+  if( mEnsemblePipeline ) {
+    auto results = graph.importBuffer("ensemble", mEnsembleResults->buffer());
+    graph.exportResource(results, TaskGraph::hostRead);
+    graph.addPass("ensemble", [&](vk::CommandBuffer commandBuffer) {
+      commandBuffer.bindPipeline(vk::PipelineBindPoint::eCompute, mEnsemblePipeline->pipeline());
+      commandBuffer.bindDescriptorSets(vk::PipelineBindPoint::eCompute,
+                                       mEnsemblePipeline->pipelineLayout(),
+                                       0, 1,
+                                       &mEnsembleDescriptorSets[target],
+                                       0, nullptr);
+      commandBuffer.pushConstants(mEnsemblePipeline->pipelineLayout(), vk::ShaderStageFlagBits::eCompute, 0, sizeof(uint32_t), &pair);
+      commandBuffer.dispatch(mNumSimulations, 1, 1);
+    }).read(targetParticles, TaskGraph::computeRead)
+      .read(simulations, TaskGraph::computeRead)
+      .write(results, TaskGraph::computeWrite);
+  }
+
+  // Size of the next step, which never leaves the GPU (other than the log)
+  // The reduction's result is visible to timestep.comp, that's ParallelReduction's job
+  if( mTimeStepReduction ) {
+    auto log = graph.importBuffer("timesteplog", mTimeStepLogBuffer->buffer());
+    graph.exportResource(log, TaskGraph::hostRead);
+    graph.addPass("timestep", [&](vk::CommandBuffer commandBuffer) {
+      if( mProfiler ) mProfiler->cmdBeginScope(commandBuffer, profilerSlot, mProfileScopeTimeStep);
+      mTimeStepReduction->cmdReduce(commandBuffer, target, pair);
+      auto params = mTimeStepParams;
+      params.slot = pair;
+      commandBuffer.bindPipeline(vk::PipelineBindPoint::eCompute, mTimeStepPipeline->pipeline());
+      commandBuffer.bindDescriptorSets(vk::PipelineBindPoint::eCompute,
+                                       mTimeStepPipeline->pipelineLayout(),
+                                       0, 1,
+                                       &mTimeStepDescriptorSet,
+                                       0, nullptr);
+      commandBuffer.pushConstants(mTimeStepPipeline->pipelineLayout(), vk::ShaderStageFlagBits::eCompute, 0, sizeof(TimeStepParams), &params);
+      commandBuffer.dispatch(1, 1, 1);
+      if( mProfiler ) mProfiler->cmdEndScope(commandBuffer, profilerSlot, mProfileScopeTimeStep);
+    }).read(targetParticles, TaskGraph::computeRead)
+      .write(timeStep, TaskGraph::computeReadWrite)
+      .write(log, TaskGraph::computeWrite);
+  }
+
+  // Whatever lookups were handed to this pair, the count is 0 if there aren't any
+  graph.addPass("lookup", [&](vk::CommandBuffer commandBuffer) {
+    commandBuffer.bindPipeline(vk::PipelineBindPoint::eCompute, mLookupPipeline->pipeline());
+    commandBuffer.bindDescriptorSets(vk::PipelineBindPoint::eCompute,
+                                     mLookupPipeline->pipelineLayout(),
+                                     0, 1,
+                                     &mLookupDescriptorSets[pair],
+                                     0, nullptr);
+    commandBuffer.dispatch(1, 1, 1);
+  }).read(targetParticles, TaskGraph::computeRead)
+    .read(slots, TaskGraph::computeRead)
+    .write(lookups, TaskGraph::computeReadWrite);
+
+  graph.record(commandBuffer);
+
+  // Over to rendering
+  QueueOwnership::cmdRelease(commandBuffer, *mComputeQueue, *mGraphicsQueue, targetBuffer, computeWrite, vertexRead);
+}
+
+vk::CommandBuffer VulkanApp::computeCommandBuffer(uint32_t pair, uint64_t step) {
+  if( mReorderInterval && step % mReorderInterval == 0 ) return mReorderCommandBuffers[pair].get();
+  return mComputeCommandBuffers[pair].get();
 }
 
 void VulkanApp::buildComputeCommandBufferDataUpload(vk::CommandBuffer& commandBuffer, SimpleBuffer& targetBuffer) {
@@ -311,6 +828,9 @@ void VulkanApp::buildComputeCommandBufferDataUpload(vk::CommandBuffer& commandBu
       .setPInheritanceInfo(nullptr);
   commandBuffer.begin(beginInfo);
 
+  // Upload always uses the first slot, it's only done once before the main loop
+  if( mProfiler ) mProfiler->cmdBeginScope(commandBuffer, 0, mProfileScopeUpload);
+
   // Upload initial buffer state into target buffer
   auto chunkSize = 65536 / sizeof(Particle);
   if( chunkSize == 0 ) chunkSize = static_cast<uint32_t>(mParticles.size());
@@ -323,38 +843,330 @@ void VulkanApp::buildComputeCommandBufferDataUpload(vk::CommandBuffer& commandBu
     commandBuffer.updateBuffer(targetBuffer.buffer(), i * sizeof(Particle), numToUpload * sizeof(Particle), mParticles.data() + i);
   }
 
+  // Particles start out in ID order, so every ID's slot is itself
+  std::vector<uint32_t> slots(mParticles.size());
+  for( auto i = 0u; i < slots.size(); ++i ) slots[i] = mParticles[i].id;
+  auto slotChunkSize = 65536 / sizeof(uint32_t);
+  for( auto i = 0u; i < slots.size(); i += slotChunkSize ) {
+    auto numToUpload = std::min(slotChunkSize, slots.size() - i);
+    commandBuffer.updateBuffer(mParticleSlots->buffer(), i * sizeof(uint32_t), numToUpload * sizeof(uint32_t), slots.data() + i);
+  }
+
+  // At most maxSimulations of these, so it fits in a single update
+  commandBuffer.updateBuffer(mSimulationBuffer->buffer(), 0, sizeof(SimulationParams) * mSimulationParams.size(), mSimulationParams.data());
+
+  // First step's size, after that the GPU looks after it
+  TimeStepState timeStep;
+  timeStep.dt = mComputeSpecConstants.mAdaptiveTimeStep ? std::clamp(mComputeSpecConstants.mTimeStep, mTimeStepParams.minDt, mTimeStepParams.maxDt) : mComputeSpecConstants.mTimeStep;
+  commandBuffer.updateBuffer(mTimeStepBuffer->buffer(), 0, sizeof(TimeStepState), &timeStep);
+
+  // The collision mesh, from the staging buffers
+  if( mBvhNodes ) {
+    vk::BufferCopy nodeCopy(0, 0, mBvhNodes->size());
+    commandBuffer.copyBuffer(mBvhStaging[0]->buffer(), mBvhNodes->buffer(), 1, &nodeCopy);
+    vk::BufferCopy triangleCopy(0, 0, mBvhTriangles->size());
+    commandBuffer.copyBuffer(mBvhStaging[1]->buffer(), mBvhTriangles->buffer(), 1, &triangleCopy);
+  }
+
+  // The distance field, which needs to be in the right layout either side of the copy
+  // Nothing writes it afterwards, so it stays read only from here on
+  if( mSdfImage ) {
+    auto toTransfer = vk::ImageMemoryBarrier()
+        .setSrcAccessMask({})
+        .setDstAccessMask(vk::AccessFlagBits::eTransferWrite)
+        .setOldLayout(vk::ImageLayout::eUndefined)
+        .setNewLayout(vk::ImageLayout::eTransferDstOptimal)
+        .setSrcQueueFamilyIndex(VK_QUEUE_FAMILY_IGNORED)
+        .setDstQueueFamilyIndex(VK_QUEUE_FAMILY_IGNORED)
+        .setImage(mSdfImage->image())
+        .setSubresourceRange(mSdfImage->subresourceRange());
+    commandBuffer.pipelineBarrier(
+          vk::PipelineStageFlagBits::eTopOfPipe,
+          vk::PipelineStageFlagBits::eTransfer,
+          {},
+          0, nullptr,
+          0, nullptr,
+          1, &toTransfer
+          );
+
+    auto copy = vk::BufferImageCopy()
+        .setBufferOffset(0)
+        .setBufferRowLength(0)
+        .setBufferImageHeight(0)
+        .setImageSubresource({vk::ImageAspectFlagBits::eColor, 0, 0, 1})
+        .setImageOffset({0, 0, 0})
+        .setImageExtent(mSdfImage->extent());
+    commandBuffer.copyBufferToImage(mSdfStaging->buffer(), mSdfImage->image(), vk::ImageLayout::eTransferDstOptimal, 1, &copy);
+
+    auto toRead = vk::ImageMemoryBarrier()
+        .setSrcAccessMask(vk::AccessFlagBits::eTransferWrite)
+        .setDstAccessMask(vk::AccessFlagBits::eShaderRead)
+        .setOldLayout(vk::ImageLayout::eTransferDstOptimal)
+        .setNewLayout(vk::ImageLayout::eShaderReadOnlyOptimal)
+        .setSrcQueueFamilyIndex(VK_QUEUE_FAMILY_IGNORED)
+        .setDstQueueFamilyIndex(VK_QUEUE_FAMILY_IGNORED)
+        .setImage(mSdfImage->image())
+        .setSubresourceRange(mSdfImage->subresourceRange());
+    commandBuffer.pipelineBarrier(
+          vk::PipelineStageFlagBits::eTransfer,
+          vk::PipelineStageFlagBits::eComputeShader,
+          {},
+          0, nullptr,
+          0, nullptr,
+          1, &toRead
+          );
+  }
+
+  // updateBuffer copies the data into the command buffer, so the locals can go
+  // The first step's step barrier only covers compute, so make the upload visible here
+  auto uploadBarrier = vk::MemoryBarrier()
+      .setSrcAccessMask(vk::AccessFlagBits::eTransferWrite)
+      .setDstAccessMask(vk::AccessFlagBits::eShaderRead | vk::AccessFlagBits::eShaderWrite);
+  commandBuffer.pipelineBarrier(
+        vk::PipelineStageFlagBits::eTransfer,
+        vk::PipelineStageFlagBits::eComputeShader,
+        {},
+        1, &uploadBarrier,
+        0, nullptr,
+        0, nullptr
+        );
+
+  if( mProfiler ) mProfiler->cmdEndScope(commandBuffer, 0, mProfileScopeUpload);
+
   // End the command buffer
   commandBuffer.end();
 }
 
+vk::DeviceSize VulkanApp::deviceBytesPerParticle() const {
+  // Particle buffers and the ID -> slot table
+  vk::DeviceSize bytes = (sizeof(Particle) * mNumParticleBuffers) + sizeof(uint32_t);
+  // Sort keys and values, both double buffered
+  if( mReorderInterval ) bytes += sizeof(uint32_t) * 4;
+  // Visible indices for each swapchain image
+  if( mCullParticles ) bytes += sizeof(uint32_t) * mWindowIntegration->swapChainImages().size();
+  // Reductions only keep a record per workgroup, small enough to leave out
+  return bytes;
+}
+
+void VulkanApp::checkMemoryBudget() {
+  // Particle buffers are device local, so the biggest device local heap is where they'll go
+  auto heaps = mDeviceInstance->memoryBudget();
+  auto heap = std::max_element(heaps.begin(), heaps.end(), [](auto& a, auto& b) {
+    return std::make_pair(a.deviceLocal, a.size) < std::make_pair(b.deviceLocal, b.size);
+  });
+  if( heap == heaps.end() ) return;
+  auto available = heap->budget > heap->usage ? heap->budget - heap->usage : 0;
+
+  // A single particle buffer can't be bigger than a storage buffer binding either
+  auto perParticle = deviceBytesPerParticle();
+  auto maxParticles = available / perParticle;
+  if( !mBufferDeviceAddress ) {
+    auto maxRange = mDeviceInstance->physicalDevice().getProperties().limits.maxStorageBufferRange;
+    maxParticles = std::min<vk::DeviceSize>(maxParticles, maxRange / sizeof(Particle));
+  }
+
+  auto mb = [](vk::DeviceSize bytes) { return static_cast<double>(bytes) / (1024.0 * 1024.0); };
+  std::cout << "Memory: " << mParticles.size() << " particles need ~" << mb(perParticle * mParticles.size()) << "MB, "
+            << mb(available) << "MB available" << (mDeviceInstance->memoryBudgetEnabled() ? "" : " (heap size, no VK_EXT_memory_budget)")
+            << ", up to " << maxParticles << " particles fit" << std::endl;
+  if( mParticles.size() > maxParticles ) {
+    std::cerr << "VulkanApp::checkMemoryBudget: " << mParticles.size() << " particles probably won't fit, expect allocation to fail" << std::endl;
+  }
+}
+
+std::vector<vk::SpecializationMapEntry> VulkanApp::computeSpecialisationEntries() {
+  return {
+    {0, offsetof(ComputeSpecConstants, mComputeBufferWidth), sizeof(uint32_t)},
+    {1, offsetof(ComputeSpecConstants, mComputeBufferHeight), sizeof(uint32_t)},
+    {2, offsetof(ComputeSpecConstants, mComputeBufferDepth), sizeof(uint32_t)},
+    {3, offsetof(ComputeSpecConstants, mComputeGroupSizeX), sizeof(uint32_t)},
+    {4, offsetof(ComputeSpecConstants, mComputeGroupSizeY), sizeof(uint32_t)},
+    {5, offsetof(ComputeSpecConstants, mComputeGroupSizeZ), sizeof(uint32_t)},
+    {6, offsetof(ComputeSpecConstants, mIntegrator), sizeof(uint32_t)},
+    {7, offsetof(ComputeSpecConstants, mTimeStep), sizeof(float)},
+    {8, offsetof(ComputeSpecConstants, mAdaptiveTimeStep), sizeof(uint32_t)},
+  };
+}
+
+double VulkanApp::benchmarkStep(DeviceInstance& deviceInstance) {
+  // Just the integrator, with the same shader and settings as the real thing
+  // No sorting, collisions or anything else optional, they'd mostly scale the same way
+  auto numParticles = static_cast<uint32_t>(std::min<size_t>(mParticles.size(), benchmarkParticles));
+  auto queue = deviceInstance.queue(1);
+  if( !queue ) throw std::runtime_error("VulkanApp::benchmarkStep: No compute queue");
+  auto& device = deviceInstance.device();
+
+  ComputePipeline pipeline(deviceInstance);
+  pipeline.shaders()[vk::ShaderStageFlagBits::eCompute] = pipeline.createShaderModule(shader_test_comp);
+  // Same bindings as createComputeDescriptorSet
+  for( auto b = 0u; b < 7; ++b ) pipeline.addDescriptorSetLayoutBinding(0, b, vk::DescriptorType::eStorageBuffer, 1, vk::ShaderStageFlagBits::eCompute);
+  pipeline.pushConstants().emplace_back(vk::ShaderStageFlagBits::eCompute, 0, sizeof(ComputeParams));
+  auto constants = mComputeSpecConstants;
+  constants.mComputeBufferWidth = numParticles;
+  constants.mComputeGroupSizeX = 64;
+  constants.mAdaptiveTimeStep = 0;
+  auto specs = computeSpecialisationEntries();
+  pipeline.specialisationConstants()[vk::ShaderStageFlagBits::eCompute] = vk::SpecializationInfo(static_cast<uint32_t>(specs.size()), specs.data(), sizeof(ComputeSpecConstants), &constants);
+  pipeline.build();
+
+  // Real particles, the speed of some integrators depends on what they're integrating
+  auto particleBytes = sizeof(Particle) * numParticles;
+  SimpleBuffer staging(deviceInstance, particleBytes, vk::BufferUsageFlagBits::eTransferSrc, vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent);
+  std::memcpy(staging.map(), mParticles.data(), particleBytes);
+  staging.unmap();
+  std::vector<std::unique_ptr<SimpleBuffer>> particles;
+  for( auto i = 0u; i < 2; ++i ) {
+    particles.emplace_back(new SimpleBuffer(deviceInstance, particleBytes, vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eTransferDst, vk::MemoryPropertyFlagBits::eDeviceLocal));
+  }
+  SimpleBuffer slots(deviceInstance, sizeof(uint32_t) * numParticles, vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eTransferDst, vk::MemoryPropertyFlagBits::eDeviceLocal);
+  SimpleBuffer forceFields(deviceInstance, sizeof(ForceFieldBuffer), vk::BufferUsageFlagBits::eStorageBuffer, vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent);
+  {
+    auto mapped = static_cast<ForceFieldBuffer*>(forceFields.map());
+    std::lock_guard<std::mutex> lock(mForceFieldMutex);
+    mapped->numFields = static_cast<uint32_t>(std::min<size_t>(mForceFields.size(), maxForceFields));
+    std::copy(mForceFields.begin(), mForceFields.begin() + mapped->numFields, mapped->fields);
+    forceFields.unmap();
+  }
+  SimpleBuffer timeStep(deviceInstance, sizeof(TimeStepState), vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eTransferDst, vk::MemoryPropertyFlagBits::eDeviceLocal);
+  SimpleBuffer simulations(deviceInstance, sizeof(SimulationParams) * mSimulationParams.size(), vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eTransferDst, vk::MemoryPropertyFlagBits::eDeviceLocal);
+
+  // Ping pong between the particle buffers, one set each way
+  std::vector<vk::DescriptorPoolSize> poolSizes = {{vk::DescriptorType::eStorageBuffer, 2 * 7}};
+  auto descriptorPool = device.createDescriptorPoolUnique(vk::DescriptorPoolCreateInfo({}, 2, static_cast<uint32_t>(poolSizes.size()), poolSizes.data()));
+  std::vector<vk::DescriptorSetLayout> layouts(2, pipeline.descriptorSetLayouts()[0].get());
+  auto descriptorSets = device.allocateDescriptorSets(vk::DescriptorSetAllocateInfo(descriptorPool.get(), static_cast<uint32_t>(layouts.size()), layouts.data()));
+  for( auto i = 0u; i < 2; ++i ) {
+    // Never reordering, so the order buffer just needs to be something valid
+    std::vector<vk::DescriptorBufferInfo> infos = {
+      {particles[i]->buffer(), 0, VK_WHOLE_SIZE},
+      {particles[1 - i]->buffer(), 0, VK_WHOLE_SIZE},
+      {particles[i]->buffer(), 0, VK_WHOLE_SIZE},
+      {slots.buffer(), 0, VK_WHOLE_SIZE},
+      {forceFields.buffer(), 0, VK_WHOLE_SIZE},
+      {timeStep.buffer(), 0, VK_WHOLE_SIZE},
+      {simulations.buffer(), 0, VK_WHOLE_SIZE},
+    };
+    auto write = vk::WriteDescriptorSet()
+        .setDstSet(descriptorSets[i])
+        .setDstBinding(0)
+        .setDescriptorCount(static_cast<uint32_t>(infos.size()))
+        .setDescriptorType(vk::DescriptorType::eStorageBuffer)
+        .setPBufferInfo(infos.data());
+    device.updateDescriptorSets(1, &write, 0, nullptr);
+  }
+
+  auto commandPool = deviceInstance.createCommandPool({}, *queue);
+  auto commandBuffers = device.allocateCommandBuffersUnique(vk::CommandBufferAllocateInfo(commandPool.get(), vk::CommandBufferLevel::ePrimary, 2));
+  auto stepBarrier = vk::MemoryBarrier()
+      .setSrcAccessMask(vk::AccessFlagBits::eShaderWrite | vk::AccessFlagBits::eTransferWrite)
+      .setDstAccessMask(vk::AccessFlagBits::eShaderRead | vk::AccessFlagBits::eShaderWrite);
+  auto barrier = [&](vk::CommandBuffer commandBuffer) {
+    commandBuffer.pipelineBarrier(vk::PipelineStageFlagBits::eComputeShader | vk::PipelineStageFlagBits::eTransfer,
+                                  vk::PipelineStageFlagBits::eComputeShader,
+                                  {}, 1, &stepBarrier, 0, nullptr, 0, nullptr);
+  };
+  auto steps = [&](vk::CommandBuffer commandBuffer, uint32_t count) {
+    ComputeParams params;
+    commandBuffer.bindPipeline(vk::PipelineBindPoint::eCompute, pipeline.pipeline());
+    commandBuffer.pushConstants(pipeline.pipelineLayout(), vk::ShaderStageFlagBits::eCompute, 0, sizeof(ComputeParams), &params);
+    for( auto s = 0u; s < count; ++s ) {
+      commandBuffer.bindDescriptorSets(vk::PipelineBindPoint::eCompute, pipeline.pipelineLayout(), 0, 1, &descriptorSets[s % 2], 0, nullptr);
+      commandBuffer.dispatch((numParticles + constants.mComputeGroupSizeX - 1) / constants.mComputeGroupSizeX, 1, 1);
+      barrier(commandBuffer);
+    }
+  };
+
+  // Upload and a couple of steps to warm up, then the timed run
+  auto setup = commandBuffers[0].get();
+  setup.begin(vk::CommandBufferBeginInfo());
+  vk::BufferCopy copy(0, 0, particleBytes);
+  setup.copyBuffer(staging.buffer(), particles[0]->buffer(), 1, &copy);
+  setup.fillBuffer(slots.buffer(), 0, VK_WHOLE_SIZE, 0);
+  TimeStepState timeStepState;
+  timeStepState.dt = constants.mTimeStep;
+  setup.updateBuffer(timeStep.buffer(), 0, sizeof(TimeStepState), &timeStepState);
+  setup.updateBuffer(simulations.buffer(), 0, simulations.size(), mSimulationParams.data());
+  barrier(setup);
+  steps(setup, 2);
+  setup.end();
+
+  auto timed = commandBuffers[1].get();
+  timed.begin(vk::CommandBufferBeginInfo());
+  steps(timed, benchmarkSteps);
+  timed.end();
+
+  auto run = [&](vk::CommandBuffer commandBuffer) {
+    auto fence = device.createFenceUnique({});
+    auto subInfo = vk::SubmitInfo()
+        .setCommandBufferCount(1)
+        .setPCommandBuffers(&commandBuffer);
+    {
+      std::lock_guard<std::mutex> lock(*queue->mutex);
+      queue->queue.submit(1, &subInfo, fence.get());
+    }
+    device.waitForFences(1, &fence.get(), true, std::numeric_limits<uint64_t>::max());
+  };
+  run(setup);
+  // now() only has millisecond resolution, a fast GPU gets through a step in less
+  auto start = std::chrono::steady_clock::now();
+  run(timed);
+  std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - start;
+  return seconds.count() / benchmarkSteps;
+}
+
 void VulkanApp::createComputeBuffers() {
   // 0 - input buffer
   // 1 - output buffer
   auto bufSize = sizeof(Particle) * mComputeSpecConstants.mComputeBufferWidth * mComputeSpecConstants.mComputeBufferHeight * mComputeSpecConstants.mComputeBufferDepth;
-  for( auto i = 0u; i < mWindowIntegration->swapChainImages().size(); ++i ) {
+  // The simulation reads the buffer rendering may be drawing from, so if they're on different families
+  // the buffers have to be concurrent. Exclusive ownership can't be held by both at once
+  std::vector<uint32_t> queueFamilies = { mGraphicsQueue->famIndex, mComputeQueue->famIndex };
+  for( auto i = 0u; i < mNumParticleBuffers; ++i ) {
     mComputeDataBuffers.emplace_back( new SimpleBuffer(
                                          *mDeviceInstance.get(),
                                          bufSize,
                                          vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eTransferDst | vk::BufferUsageFlagBits::eVertexBuffer,
-                                         vk::MemoryPropertyFlagBits::eDeviceLocal /*vk::MemoryPropertyFlagBits::eHostVisible*/ ) );
+                                         vk::MemoryPropertyFlagBits::eDeviceLocal /*vk::MemoryPropertyFlagBits::eHostVisible*/,
+                                         queueFamilies,
+                                         "particles" ) );
   }
+
+  // ID -> slot, only ever touched by compute
+  mParticleSlots.reset(new SimpleBuffer(
+                         *mDeviceInstance.get(),
+                         sizeof(uint32_t) * mParticles.size(),
+                         vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eTransferDst,
+                         vk::MemoryPropertyFlagBits::eDeviceLocal,
+                         {},
+                         "particles" ) );
+
+  // Per simulation parameters, uploaded with the particles
+  mSimulationBuffer.reset(new SimpleBuffer(
+                            *mDeviceInstance.get(),
+                            sizeof(SimulationParams) * mSimulationParams.size(),
+                            vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eTransferDst,
+                            vk::MemoryPropertyFlagBits::eDeviceLocal ) );
 }
 
 void VulkanApp::createComputeDescriptorSet() {
+  // The simulation may go from any particle buffer to any other, depending on what rendering is holding on to
+  // So we need a descriptor set for every (source, target) pair
+  auto numSets = mNumParticleBuffers * (mNumParticleBuffers - 1);
+
   // Create a descriptor pool, to allocate descriptor sets from
   auto poolSize = vk::DescriptorPoolSize()
       .setType(vk::DescriptorType::eStorageBuffer)
-      .setDescriptorCount(mMaxFramesInFlight * 2);
+      .setDescriptorCount(numSets * 7);
 
   auto poolInfo = vk::DescriptorPoolCreateInfo()
       .setFlags({})
-      .setMaxSets(mMaxFramesInFlight)
+      .setMaxSets(numSets)
       .setPoolSizeCount(1)
       .setPPoolSizes(&poolSize);
   mComputeDescriptorPool = mDeviceInstance->device().createDescriptorPoolUnique(poolInfo);
 
-  // Create the descriptor sets, one for each particle buffer
-  for( auto i = 0u; i < mMaxFramesInFlight; ++i ) {
+  // Create the descriptor sets
+  for( auto i = 0u; i < numSets; ++i ) {
     const vk::DescriptorSetLayout dsLayouts[] = {mComputePipeline->descriptorSetLayouts()[0].get()};
 
     auto dsInfo = vk::DescriptorSetAllocateInfo()
@@ -365,9 +1177,10 @@ void VulkanApp::createComputeDescriptorSet() {
     mComputeDescriptorSets.emplace_back(std::move(sets.front())); sets.clear();
   }
 
-  for( auto i = 0u; i < mMaxFramesInFlight; ++i ) {
-    auto& sourceBuffer = mComputeDataBuffers[i];
-    auto& destBuffer = mComputeDataBuffers[i == mMaxFramesInFlight - 1 ? 0 : i + 1];
+  for( auto source = 0u; source < mNumParticleBuffers; ++source ) for( auto target = 0u; target < mNumParticleBuffers; ++target ) {
+    if( source == target ) continue;
+    auto& sourceBuffer = mComputeDataBuffers[source];
+    auto& destBuffer = mComputeDataBuffers[target];
 
     // Update the descriptor set to map to the buffers
     std::vector<vk::DescriptorBufferInfo> uInfos;
@@ -383,8 +1196,39 @@ void VulkanApp::createComputeDescriptorSet() {
         .setRange(VK_WHOLE_SIZE);
     uInfos.emplace_back(uInfo2);
 
+    // Without reordering the shader never reads this, but it still needs something valid bound
+    auto uInfo3 = vk::DescriptorBufferInfo()
+        .setBuffer(mReorderSort ? mReorderSort->values().buffer() : sourceBuffer->buffer())
+        .setOffset(0)
+        .setRange(VK_WHOLE_SIZE);
+    uInfos.emplace_back(uInfo3);
+
+    auto uInfo4 = vk::DescriptorBufferInfo()
+        .setBuffer(mParticleSlots->buffer())
+        .setOffset(0)
+        .setRange(VK_WHOLE_SIZE);
+    uInfos.emplace_back(uInfo4);
+
+    auto uInfo5 = vk::DescriptorBufferInfo()
+        .setBuffer(mForceFieldBuffers[computePairIndex(source, target)]->buffer())
+        .setOffset(0)
+        .setRange(VK_WHOLE_SIZE);
+    uInfos.emplace_back(uInfo5);
+
+    auto uInfo6 = vk::DescriptorBufferInfo()
+        .setBuffer(mTimeStepBuffer->buffer())
+        .setOffset(0)
+        .setRange(VK_WHOLE_SIZE);
+    uInfos.emplace_back(uInfo6);
+
+    auto uInfo7 = vk::DescriptorBufferInfo()
+        .setBuffer(mSimulationBuffer->buffer())
+        .setOffset(0)
+        .setRange(VK_WHOLE_SIZE);
+    uInfos.emplace_back(uInfo7);
+
     auto wInfo = vk::WriteDescriptorSet()
-        .setDstSet(mComputeDescriptorSets[i])
+        .setDstSet(mComputeDescriptorSets[computePairIndex(source, target)])
         .setDstBinding(0)
         .setDstArrayElement(0)
         .setDescriptorCount(static_cast<uint32_t>(uInfos.size()))
@@ -397,6 +1241,831 @@ void VulkanApp::createComputeDescriptorSet() {
   }
 }
 
+void VulkanApp::createDiagnostics() {
+  // See diagnostics.glsl for what's in each vec4
+  using Op = ParallelReduction::Op;
+  std::vector<Op> ops = { Op::Sum, Op::Sum, Op::Sum, Op::Min, Op::Max };
+
+  std::vector<vk::Buffer> inputs;
+  for( auto& b : mComputeDataBuffers ) inputs.emplace_back(b->buffer());
+
+  ParallelReduction::FirstPass firstPass;
+  firstPass.shader = &shader_diagnostics_comp;
+  firstPass.subgroupShader = &shader_diagnostics_subgroup_comp;
+
+  auto numPairs = mNumParticleBuffers * (mNumParticleBuffers - 1);
+  mDiagnosticsReduction.reset(new ParallelReduction(*mDeviceInstance.get(), ops, static_cast<uint32_t>(mParticles.size()), inputs, numPairs, firstPass));
+  std::cout << "Diagnostics: " << mDiagnosticsReduction->numPasses() << " reduction passes, "
+            << (mDiagnosticsReduction->usingSubgroups() ? "subgroup arithmetic" : "shared memory") << std::endl;
+}
+
+void VulkanApp::createReorderResources() {
+  auto numParticles = static_cast<uint32_t>(mParticles.size());
+
+  // 10 bits per axis
+  mReorderSort.reset(new RadixSort(*mDeviceInstance.get(), numParticles, RadixSort::KeyType::Uint32, 30));
+
+  mMortonPipeline.reset(new ComputePipeline(*mDeviceInstance.get()));
+  mMortonPipeline->shaders()[vk::ShaderStageFlagBits::eCompute] = mMortonPipeline->createShaderModule(shader_morton_comp);
+  // Particles, keys, values
+  mMortonPipeline->addDescriptorSetLayoutBinding(0, 0, vk::DescriptorType::eStorageBuffer, 1, vk::ShaderStageFlagBits::eCompute);
+  mMortonPipeline->addDescriptorSetLayoutBinding(0, 1, vk::DescriptorType::eStorageBuffer, 1, vk::ShaderStageFlagBits::eCompute);
+  mMortonPipeline->addDescriptorSetLayoutBinding(0, 2, vk::DescriptorType::eStorageBuffer, 1, vk::ShaderStageFlagBits::eCompute);
+  mMortonPipeline->pushConstants().emplace_back(vk::ShaderStageFlagBits::eCompute, 0, sizeof(MortonParams));
+
+  mMortonSpecConstants.numParticles = numParticles;
+  // Enough bits for the simulation index, if there's more than one
+  while( (1u << mMortonSpecConstants.simulationBits) < mNumSimulations ) ++mMortonSpecConstants.simulationBits;
+  std::vector<vk::SpecializationMapEntry> specs = {
+    {0, offsetof(MortonSpecConstants, numParticles), sizeof(uint32_t)},
+    {1, offsetof(MortonSpecConstants, groupSizeX), sizeof(uint32_t)},
+    {2, offsetof(MortonSpecConstants, simulationBits), sizeof(uint32_t)},
+  };
+  mMortonPipeline->specialisationConstants()[vk::ShaderStageFlagBits::eCompute] = vk::SpecializationInfo(static_cast<uint32_t>(specs.size()), specs.data(), sizeof(MortonSpecConstants), &mMortonSpecConstants);
+  mMortonPipeline->build();
+
+  // Keys come from the step's source buffer
+  auto poolSize = vk::DescriptorPoolSize(vk::DescriptorType::eStorageBuffer, mNumParticleBuffers * 3);
+  auto poolInfo = vk::DescriptorPoolCreateInfo()
+      .setFlags({})
+      .setMaxSets(mNumParticleBuffers)
+      .setPoolSizeCount(1)
+      .setPPoolSizes(&poolSize);
+  mMortonDescriptorPool = mDeviceInstance->device().createDescriptorPoolUnique(poolInfo);
+
+  std::vector<vk::DescriptorSetLayout> dsLayouts(mNumParticleBuffers, mMortonPipeline->descriptorSetLayouts()[0].get());
+  auto dsInfo = vk::DescriptorSetAllocateInfo()
+      .setDescriptorPool(mMortonDescriptorPool.get())
+      .setDescriptorSetCount(mNumParticleBuffers)
+      .setPSetLayouts(dsLayouts.data());
+  mMortonDescriptorSets = mDeviceInstance->device().allocateDescriptorSets(dsInfo);
+
+  for( auto i = 0u; i < mNumParticleBuffers; ++i ) {
+    std::vector<vk::DescriptorBufferInfo> infos = {
+      {mComputeDataBuffers[i]->buffer(), 0, VK_WHOLE_SIZE},
+      {mReorderSort->keys().buffer(), 0, VK_WHOLE_SIZE},
+      {mReorderSort->values().buffer(), 0, VK_WHOLE_SIZE},
+    };
+    auto write = vk::WriteDescriptorSet(mMortonDescriptorSets[i], 0, 0, static_cast<uint32_t>(infos.size()), vk::DescriptorType::eStorageBuffer, nullptr, infos.data(), nullptr);
+    mDeviceInstance->device().updateDescriptorSets(1, &write, 0, nullptr);
+  }
+
+  std::cout << "Reordering: Every " << mReorderInterval << " steps, " << mReorderSort->numPasses() << " sort passes" << std::endl;
+}
+
+void VulkanApp::createLookupResources() {
+  auto numPairs = mNumParticleBuffers * (mNumParticleBuffers - 1);
+
+  mLookupPipeline.reset(new ComputePipeline(*mDeviceInstance.get()));
+  mLookupPipeline->shaders()[vk::ShaderStageFlagBits::eCompute] = mLookupPipeline->createShaderModule(shader_lookup_comp);
+  // Particles, slots, requests/results
+  mLookupPipeline->addDescriptorSetLayoutBinding(0, 0, vk::DescriptorType::eStorageBuffer, 1, vk::ShaderStageFlagBits::eCompute);
+  mLookupPipeline->addDescriptorSetLayoutBinding(0, 1, vk::DescriptorType::eStorageBuffer, 1, vk::ShaderStageFlagBits::eCompute);
+  mLookupPipeline->addDescriptorSetLayoutBinding(0, 2, vk::DescriptorType::eStorageBuffer, 1, vk::ShaderStageFlagBits::eCompute);
+  std::vector<vk::SpecializationMapEntry> specs = {
+    {0, offsetof(LookupSpecConstants, maxLookups), sizeof(uint32_t)},
+  };
+  mLookupPipeline->specialisationConstants()[vk::ShaderStageFlagBits::eCompute] = vk::SpecializationInfo(static_cast<uint32_t>(specs.size()), specs.data(), sizeof(LookupSpecConstants), &mLookupSpecConstants);
+  mLookupPipeline->build();
+
+  // Small enough that host visible is fine, and saves a copy
+  for( auto i = 0u; i < numPairs; ++i ) {
+    mLookupBuffers.emplace_back( new SimpleBuffer(
+                                   *mDeviceInstance.get(),
+                                   sizeof(LookupBuffer),
+                                   vk::BufferUsageFlagBits::eStorageBuffer,
+                                   vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent ) );
+    mLookupBuffersMapped.emplace_back( static_cast<LookupBuffer*>(mLookupBuffers.back()->map()) );
+    mLookupBuffersMapped.back()->count = 0;
+  }
+  mLookupsInFlight.resize(numPairs);
+
+  auto poolSize = vk::DescriptorPoolSize(vk::DescriptorType::eStorageBuffer, numPairs * 3);
+  auto poolInfo = vk::DescriptorPoolCreateInfo()
+      .setFlags({})
+      .setMaxSets(numPairs)
+      .setPoolSizeCount(1)
+      .setPPoolSizes(&poolSize);
+  mLookupDescriptorPool = mDeviceInstance->device().createDescriptorPoolUnique(poolInfo);
+
+  std::vector<vk::DescriptorSetLayout> dsLayouts(numPairs, mLookupPipeline->descriptorSetLayouts()[0].get());
+  auto dsInfo = vk::DescriptorSetAllocateInfo()
+      .setDescriptorPool(mLookupDescriptorPool.get())
+      .setDescriptorSetCount(numPairs)
+      .setPSetLayouts(dsLayouts.data());
+  mLookupDescriptorSets = mDeviceInstance->device().allocateDescriptorSets(dsInfo);
+
+  // Lookups read the step's target buffer
+  for( auto source = 0u; source < mNumParticleBuffers; ++source ) for( auto target = 0u; target < mNumParticleBuffers; ++target ) {
+    if( source == target ) continue;
+    auto pair = computePairIndex(source, target);
+    std::vector<vk::DescriptorBufferInfo> infos = {
+      {mComputeDataBuffers[target]->buffer(), 0, VK_WHOLE_SIZE},
+      {mParticleSlots->buffer(), 0, VK_WHOLE_SIZE},
+      {mLookupBuffers[pair]->buffer(), 0, VK_WHOLE_SIZE},
+    };
+    auto write = vk::WriteDescriptorSet(mLookupDescriptorSets[pair], 0, 0, static_cast<uint32_t>(infos.size()), vk::DescriptorType::eStorageBuffer, nullptr, infos.data(), nullptr);
+    mDeviceInstance->device().updateDescriptorSets(1, &write, 0, nullptr);
+  }
+}
+
+void VulkanApp::createCollisionMesh() {
+  auto start = now();
+  auto mesh = Mesh::load(mCollisionMeshFile);
+  Bvh bvh(mesh);
+  std::cout << "Collision mesh: " << mCollisionMeshFile << ", " << mesh.numTriangles() << " triangles, "
+            << bvh.nodes().size() << " BVH nodes, depth " << bvh.depth() << ", built in " << now() - start << "s" << std::endl;
+
+  // Only ever read by compute, staged through host visible buffers and copied over with the initial upload
+  auto nodeBytes = sizeof(Bvh::Node) * bvh.nodes().size();
+  auto triangleBytes = sizeof(Bvh::Triangle) * bvh.triangles().size();
+  mBvhNodes.reset(new SimpleBuffer(*mDeviceInstance.get(), nodeBytes,
+                                   vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eTransferDst,
+                                   vk::MemoryPropertyFlagBits::eDeviceLocal));
+  mBvhTriangles.reset(new SimpleBuffer(*mDeviceInstance.get(), triangleBytes,
+                                       vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eTransferDst,
+                                       vk::MemoryPropertyFlagBits::eDeviceLocal));
+  for( auto bytes : {nodeBytes, triangleBytes} ) {
+    mBvhStaging.emplace_back(new SimpleBuffer(*mDeviceInstance.get(), bytes,
+                                              vk::BufferUsageFlagBits::eTransferSrc,
+                                              vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent));
+  }
+  std::memcpy(mBvhStaging[0]->map(), bvh.nodes().data(), nodeBytes);
+  mBvhStaging[0]->unmap();
+  std::memcpy(mBvhStaging[1]->map(), bvh.triangles().data(), triangleBytes);
+  mBvhStaging[1]->unmap();
+
+  mCollidePipeline.reset(new ComputePipeline(*mDeviceInstance.get()));
+  mCollidePipeline->shaders()[vk::ShaderStageFlagBits::eCompute] = mCollidePipeline->createShaderModule(shader_collide_comp);
+  // Particles, BVH nodes, triangles
+  mCollidePipeline->addDescriptorSetLayoutBinding(0, 0, vk::DescriptorType::eStorageBuffer, 1, vk::ShaderStageFlagBits::eCompute);
+  mCollidePipeline->addDescriptorSetLayoutBinding(0, 1, vk::DescriptorType::eStorageBuffer, 1, vk::ShaderStageFlagBits::eCompute);
+  mCollidePipeline->addDescriptorSetLayoutBinding(0, 2, vk::DescriptorType::eStorageBuffer, 1, vk::ShaderStageFlagBits::eCompute);
+
+  mCollideSpecConstants.numParticles = static_cast<uint32_t>(mParticles.size());
+  std::vector<vk::SpecializationMapEntry> specs = {
+    {0, offsetof(CollideSpecConstants, numParticles), sizeof(uint32_t)},
+    {1, offsetof(CollideSpecConstants, groupSizeX), sizeof(uint32_t)},
+  };
+  mCollidePipeline->specialisationConstants()[vk::ShaderStageFlagBits::eCompute] = vk::SpecializationInfo(static_cast<uint32_t>(specs.size()), specs.data(), sizeof(CollideSpecConstants), &mCollideSpecConstants);
+  mCollidePipeline->build();
+
+  auto poolSize = vk::DescriptorPoolSize(vk::DescriptorType::eStorageBuffer, mNumParticleBuffers * 3);
+  auto poolInfo = vk::DescriptorPoolCreateInfo()
+      .setFlags({})
+      .setMaxSets(mNumParticleBuffers)
+      .setPoolSizeCount(1)
+      .setPPoolSizes(&poolSize);
+  mCollideDescriptorPool = mDeviceInstance->device().createDescriptorPoolUnique(poolInfo);
+
+  std::vector<vk::DescriptorSetLayout> dsLayouts(mNumParticleBuffers, mCollidePipeline->descriptorSetLayouts()[0].get());
+  auto dsInfo = vk::DescriptorSetAllocateInfo()
+      .setDescriptorPool(mCollideDescriptorPool.get())
+      .setDescriptorSetCount(mNumParticleBuffers)
+      .setPSetLayouts(dsLayouts.data());
+  mCollideDescriptorSets = mDeviceInstance->device().allocateDescriptorSets(dsInfo);
+
+  for( auto i = 0u; i < mNumParticleBuffers; ++i ) {
+    std::vector<vk::DescriptorBufferInfo> infos = {
+      {mComputeDataBuffers[i]->buffer(), 0, VK_WHOLE_SIZE},
+      {mBvhNodes->buffer(), 0, VK_WHOLE_SIZE},
+      {mBvhTriangles->buffer(), 0, VK_WHOLE_SIZE},
+    };
+    auto write = vk::WriteDescriptorSet(mCollideDescriptorSets[i], 0, 0, static_cast<uint32_t>(infos.size()), vk::DescriptorType::eStorageBuffer, nullptr, infos.data(), nullptr);
+    mDeviceInstance->device().updateDescriptorSets(1, &write, 0, nullptr);
+  }
+}
+
+void VulkanApp::createCollisionField() {
+  auto start = now();
+  auto field = [&]() {
+    if( mSdfSource == "primitives" ) {
+      // Something for the particles to land on, above the floor
+      return SignedDistanceField::fromPrimitives({
+        SignedDistanceField::Primitive::sphere({0, -40, 0}, 25),
+        SignedDistanceField::Primitive::box({0, -85, 0}, {60, 5, 60}),
+        SignedDistanceField::Primitive::capsule({-50, -60, -50}, {50, -60, 50}, 6),
+      }, mSdfResolution, 5.f, mThreadPool.get());
+    }
+    return SignedDistanceField::fromMesh(Mesh::load(mSdfSource), mSdfResolution, 5.f, mThreadPool.get());
+  }();
+  auto res = field.resolution();
+  std::cout << "Collision field: " << mSdfSource << ", " << res.x << "x" << res.y << "x" << res.z
+            << " samples, baked in " << now() - start << "s" << std::endl;
+
+  mSdfParams.boundsMin = glm::vec4(field.min(), 1.f);
+  mSdfParams.boundsMax = glm::vec4(field.max(), 1.f);
+
+  // Linear filtering is what makes the field smooth between samples
+  // 32 bit floats aren't required to filter, halves are, so fall back to those
+  auto format = vk::Format::eR32Sfloat;
+  auto formatProps = mDeviceInstance->physicalDevice().getFormatProperties(format);
+  if( !(formatProps.optimalTilingFeatures & vk::FormatFeatureFlagBits::eSampledImageFilterLinear) ) format = vk::Format::eR16Sfloat;
+
+  auto& distances = field.distances();
+  auto texelBytes = format == vk::Format::eR32Sfloat ? sizeof(float) : sizeof(uint16_t);
+  auto bytes = texelBytes * distances.size();
+  mSdfStaging.reset(new SimpleBuffer(*mDeviceInstance.get(), bytes,
+                                     vk::BufferUsageFlagBits::eTransferSrc,
+                                     vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent));
+  auto mapped = mSdfStaging->map();
+  if( format == vk::Format::eR32Sfloat ) {
+    std::memcpy(mapped, distances.data(), bytes);
+  } else {
+    // Halves top out at 65504, which is more than far enough away
+    auto halves = static_cast<uint16_t*>(mapped);
+    for( auto i = 0u; i < distances.size(); ++i ) halves[i] = static_cast<uint16_t>(glm::packHalf1x16(std::min(distances[i], 65504.f)));
+  }
+  mSdfStaging->unmap();
+
+  mSdfImage.reset(new SimpleImage(*mDeviceInstance.get(), vk::ImageType::e3D, format, {res.x, res.y, res.z},
+                                  vk::ImageUsageFlagBits::eSampled | vk::ImageUsageFlagBits::eTransferDst));
+
+  // Clamp to edge, the shader skips anything outside the field anyway
+  auto samplerInfo = vk::SamplerCreateInfo()
+      .setMagFilter(vk::Filter::eLinear)
+      .setMinFilter(vk::Filter::eLinear)
+      .setMipmapMode(vk::SamplerMipmapMode::eNearest)
+      .setAddressModeU(vk::SamplerAddressMode::eClampToEdge)
+      .setAddressModeV(vk::SamplerAddressMode::eClampToEdge)
+      .setAddressModeW(vk::SamplerAddressMode::eClampToEdge)
+      .setMinLod(0.f)
+      .setMaxLod(0.f);
+  mSdfSampler = mDeviceInstance->device().createSamplerUnique(samplerInfo);
+
+  mSdfPipeline.reset(new ComputePipeline(*mDeviceInstance.get()));
+  mSdfPipeline->shaders()[vk::ShaderStageFlagBits::eCompute] = mSdfPipeline->createShaderModule(shader_sdfcollide_comp);
+  // Particles, the field (sampler baked into the layout)
+  mSdfPipeline->addDescriptorSetLayoutBinding(0, 0, vk::DescriptorType::eStorageBuffer, 1, vk::ShaderStageFlagBits::eCompute);
+  mSdfPipeline->addDescriptorSetLayoutBinding(0, 1, vk::DescriptorType::eCombinedImageSampler, vk::ShaderStageFlagBits::eCompute, {mSdfSampler.get()});
+  mSdfPipeline->pushConstants().emplace_back(vk::ShaderStageFlagBits::eCompute, 0, sizeof(SdfParams));
+
+  mSdfSpecConstants.numParticles = static_cast<uint32_t>(mParticles.size());
+  std::vector<vk::SpecializationMapEntry> specs = {
+    {0, offsetof(CollideSpecConstants, numParticles), sizeof(uint32_t)},
+    {1, offsetof(CollideSpecConstants, groupSizeX), sizeof(uint32_t)},
+  };
+  mSdfPipeline->specialisationConstants()[vk::ShaderStageFlagBits::eCompute] = vk::SpecializationInfo(static_cast<uint32_t>(specs.size()), specs.data(), sizeof(CollideSpecConstants), &mSdfSpecConstants);
+  mSdfPipeline->build();
+
+  std::vector<vk::DescriptorPoolSize> poolSizes = {
+    {vk::DescriptorType::eStorageBuffer, mNumParticleBuffers},
+    {vk::DescriptorType::eCombinedImageSampler, mNumParticleBuffers},
+  };
+  auto poolInfo = vk::DescriptorPoolCreateInfo()
+      .setFlags({})
+      .setMaxSets(mNumParticleBuffers)
+      .setPoolSizeCount(static_cast<uint32_t>(poolSizes.size()))
+      .setPPoolSizes(poolSizes.data());
+  mSdfDescriptorPool = mDeviceInstance->device().createDescriptorPoolUnique(poolInfo);
+
+  std::vector<vk::DescriptorSetLayout> dsLayouts(mNumParticleBuffers, mSdfPipeline->descriptorSetLayouts()[0].get());
+  auto dsInfo = vk::DescriptorSetAllocateInfo()
+      .setDescriptorPool(mSdfDescriptorPool.get())
+      .setDescriptorSetCount(mNumParticleBuffers)
+      .setPSetLayouts(dsLayouts.data());
+  mSdfDescriptorSets = mDeviceInstance->device().allocateDescriptorSets(dsInfo);
+
+  // Sampler is immutable, ignored here
+  auto imageInfo = vk::DescriptorImageInfo({}, mSdfImage->view(), vk::ImageLayout::eShaderReadOnlyOptimal);
+  for( auto i = 0u; i < mNumParticleBuffers; ++i ) {
+    auto bufferInfo = vk::DescriptorBufferInfo(mComputeDataBuffers[i]->buffer(), 0, VK_WHOLE_SIZE);
+    std::vector<vk::WriteDescriptorSet> writes = {
+      vk::WriteDescriptorSet(mSdfDescriptorSets[i], 0, 0, 1, vk::DescriptorType::eStorageBuffer, nullptr, &bufferInfo, nullptr),
+      vk::WriteDescriptorSet(mSdfDescriptorSets[i], 1, 0, 1, vk::DescriptorType::eCombinedImageSampler, &imageInfo, nullptr, nullptr),
+    };
+    mDeviceInstance->device().updateDescriptorSets(static_cast<uint32_t>(writes.size()), writes.data(), 0, nullptr);
+  }
+}
+
+void VulkanApp::createForceFieldBuffers() {
+  auto numPairs = mNumParticleBuffers * (mNumParticleBuffers - 1);
+  // Read once per workgroup, so host visible is fine here too
+  for( auto i = 0u; i < numPairs; ++i ) {
+    mForceFieldBuffers.emplace_back( new SimpleBuffer(
+                                       *mDeviceInstance.get(),
+                                       sizeof(ForceFieldBuffer),
+                                       vk::BufferUsageFlagBits::eStorageBuffer,
+                                       vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent ) );
+    mForceFieldBuffersMapped.emplace_back( static_cast<ForceFieldBuffer*>(mForceFieldBuffers.back()->map()) );
+    mForceFieldBuffersMapped.back()->numFields = 0;
+  }
+  // Nothing's been copied yet, so every buffer's out of date
+  mForceFieldBufferVersions.resize(numPairs, 0);
+  mForceFieldBufferGravity.resize(numPairs, glm::vec3(0.f));
+}
+
+void VulkanApp::adaptiveTimeStep(float minDt, float maxDt, float courant) {
+  if( minDt <= 0.f || maxDt < minDt ) throw std::runtime_error("VulkanApp::adaptiveTimeStep: Invalid time step range");
+  if( courant <= 0.f ) throw std::runtime_error("VulkanApp::adaptiveTimeStep: Courant number must be positive");
+  mComputeSpecConstants.mAdaptiveTimeStep = 1;
+  mTimeStepParams.minDt = minDt;
+  mTimeStepParams.maxDt = maxDt;
+  mTimeStepParams.courant = courant;
+}
+
+void VulkanApp::createTimeStepResources() {
+  mTimeStepBuffer.reset(new SimpleBuffer(*mDeviceInstance.get(), sizeof(TimeStepState),
+                                         vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eTransferDst,
+                                         vk::MemoryPropertyFlagBits::eDeviceLocal));
+  if( !mComputeSpecConstants.mAdaptiveTimeStep ) return;
+
+  // See timestepreduce.glsl for what's in each vec4
+  using Op = ParallelReduction::Op;
+  std::vector<Op> ops = { Op::Max, Op::Min };
+  std::vector<vk::Buffer> inputs;
+  for( auto& b : mComputeDataBuffers ) inputs.emplace_back(b->buffer());
+  ParallelReduction::FirstPass firstPass;
+  firstPass.shader = &shader_timestepreduce_comp;
+  firstPass.subgroupShader = &shader_timestepreduce_subgroup_comp;
+  auto numPairs = mNumParticleBuffers * (mNumParticleBuffers - 1);
+  mTimeStepReduction.reset(new ParallelReduction(*mDeviceInstance.get(), ops, static_cast<uint32_t>(mParticles.size()), inputs, numPairs, firstPass));
+
+  mTimeStepLogBuffer.reset(new SimpleBuffer(*mDeviceInstance.get(), sizeof(TimeStepState) * numPairs,
+                                            vk::BufferUsageFlagBits::eStorageBuffer,
+                                            vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent));
+  mTimeStepLogMapped = static_cast<TimeStepState*>(mTimeStepLogBuffer->map());
+
+  mTimeStepPipeline.reset(new ComputePipeline(*mDeviceInstance.get()));
+  mTimeStepPipeline->shaders()[vk::ShaderStageFlagBits::eCompute] = mTimeStepPipeline->createShaderModule(shader_timestep_comp);
+  // Reduction results, state, log
+  mTimeStepPipeline->addDescriptorSetLayoutBinding(0, 0, vk::DescriptorType::eStorageBuffer, 1, vk::ShaderStageFlagBits::eCompute);
+  mTimeStepPipeline->addDescriptorSetLayoutBinding(0, 1, vk::DescriptorType::eStorageBuffer, 1, vk::ShaderStageFlagBits::eCompute);
+  mTimeStepPipeline->addDescriptorSetLayoutBinding(0, 2, vk::DescriptorType::eStorageBuffer, 1, vk::ShaderStageFlagBits::eCompute);
+  mTimeStepPipeline->pushConstants().emplace_back(vk::ShaderStageFlagBits::eCompute, 0, sizeof(TimeStepParams));
+  mTimeStepPipeline->build();
+
+  auto poolSize = vk::DescriptorPoolSize(vk::DescriptorType::eStorageBuffer, 3);
+  auto poolInfo = vk::DescriptorPoolCreateInfo()
+      .setFlags({})
+      .setMaxSets(1)
+      .setPoolSizeCount(1)
+      .setPPoolSizes(&poolSize);
+  mTimeStepDescriptorPool = mDeviceInstance->device().createDescriptorPoolUnique(poolInfo);
+
+  auto dsLayout = mTimeStepPipeline->descriptorSetLayouts()[0].get();
+  auto dsInfo = vk::DescriptorSetAllocateInfo()
+      .setDescriptorPool(mTimeStepDescriptorPool.get())
+      .setDescriptorSetCount(1)
+      .setPSetLayouts(&dsLayout);
+  mTimeStepDescriptorSet = mDeviceInstance->device().allocateDescriptorSets(dsInfo).front();
+
+  // Slots are picked with a push constant, offsets into the result buffer wouldn't be aligned
+  std::vector<vk::DescriptorBufferInfo> infos = {
+    {mTimeStepReduction->resultBuffer(), 0, VK_WHOLE_SIZE},
+    {mTimeStepBuffer->buffer(), 0, VK_WHOLE_SIZE},
+    {mTimeStepLogBuffer->buffer(), 0, VK_WHOLE_SIZE},
+  };
+  auto write = vk::WriteDescriptorSet(mTimeStepDescriptorSet, 0, 0, static_cast<uint32_t>(infos.size()), vk::DescriptorType::eStorageBuffer, nullptr, infos.data(), nullptr);
+  mDeviceInstance->device().updateDescriptorSets(1, &write, 0, nullptr);
+
+  if( !mTimeStepLogFile.empty() ) {
+    mTimeStepLog.open(mTimeStepLogFile);
+    if( !mTimeStepLog.is_open() ) throw std::runtime_error("VulkanApp::createTimeStepResources: Failed to open " + mTimeStepLogFile);
+    mTimeStepLog << "step,time,dt,max speed,max acceleration" << std::endl;
+  }
+}
+
+void VulkanApp::readTimeStep(uint32_t slot, uint64_t step) {
+  auto s = mTimeStepLogMapped[slot];
+  if( mTimeStepLog.is_open() ) mTimeStepLog << step << "," << s.time << "," << s.dt << "," << s.maxSpeed << "," << s.maxAcceleration << "\n";
+
+  std::lock_guard<std::mutex> lock(mDiagnosticsMutex);
+  auto& stats = mTimeStepStats;
+  if( stats.minDt == 0.f || s.dt < stats.minDt ) stats.minDt = s.dt;
+  stats.maxDt = std::max(stats.maxDt, s.dt);
+  stats.step = step;
+  stats.latest = s;
+}
+
+void VulkanApp::reportTimeStep() {
+  TimeStepStats stats;
+  {
+    std::lock_guard<std::mutex> lock(mDiagnosticsMutex);
+    stats = mTimeStepStats;
+    mTimeStepStats.minDt = 0.f;
+    mTimeStepStats.maxDt = 0.f;
+  }
+  if( stats.step == 0 ) return;
+  std::cout << "Step " << stats.step << ": dt " << stats.latest.dt << " (" << stats.minDt << " - " << stats.maxDt << " since last report), "
+            << "simulated time " << stats.latest.time << "s, max speed " << stats.latest.maxSpeed
+            << ", max acceleration " << stats.latest.maxAcceleration << std::endl;
+}
+
+void VulkanApp::forceFields(const std::vector<ForceField>& fields) {
+  if( fields.size() > maxForceFields ) throw std::runtime_error("VulkanApp::forceFields: Too many fields, max is " + std::to_string(maxForceFields));
+  // Grouped by type, so a workgroup walking the list doesn't hop between cases every iteration
+  auto sorted = fields;
+  std::stable_sort(sorted.begin(), sorted.end(), [](auto& a, auto& b) { return a.type < b.type; });
+  for( auto& f : sorted ) {
+    if( f.type == ForceField::Type::Vortex && glm::length(glm::vec3(f.direction)) > 0.f ) {
+      f.direction = glm::vec4(glm::normalize(glm::vec3(f.direction)), 0.f);
+    }
+  }
+
+  std::lock_guard<std::mutex> lock(mForceFieldMutex);
+  mForceFields = std::move(sorted);
+  ++mForceFieldVersion;
+}
+
+std::vector<VulkanApp::ForceField> VulkanApp::forceFields() {
+  std::lock_guard<std::mutex> lock(mForceFieldMutex);
+  return mForceFields;
+}
+
+void VulkanApp::submitForceFields(uint32_t pair) {
+  std::lock_guard<std::mutex> lock(mForceFieldMutex);
+  if( mForceFieldBufferVersions[pair] == mForceFieldVersion ) return;
+  // Host coherent, and the submit makes host writes visible
+  auto& buffer = *mForceFieldBuffersMapped[pair];
+  std::copy(mForceFields.begin(), mForceFields.end(), buffer.fields);
+  buffer.numFields = static_cast<uint32_t>(mForceFields.size());
+  mForceFieldBufferVersions[pair] = mForceFieldVersion;
+
+  // Potential energy only makes sense for gravity that's the same everywhere
+  // So anything with a radius doesn't count, those particles' energy won't add up
+  glm::vec3 gravity(0.f);
+  for( auto& f : mForceFields ) {
+    if( f.type == ForceField::Type::Gravity && f.radius <= 0.f ) gravity += glm::vec3(f.direction) * f.strength;
+  }
+  mForceFieldBufferGravity[pair] = gravity;
+}
+
+std::future<VulkanApp::ParticleLookup> VulkanApp::lookupParticle(uint32_t id) {
+  if( id >= mParticles.size() ) throw std::runtime_error("VulkanApp::lookupParticle: No particle with ID " + std::to_string(id));
+  PendingLookup lookup;
+  lookup.id = id;
+  auto future = lookup.promise.get_future();
+  std::lock_guard<std::mutex> lock(mLookupMutex);
+  mPendingLookups.emplace_back(std::move(lookup));
+  return future;
+}
+
+void VulkanApp::submitLookups(uint32_t pair, uint64_t step, vk::Fence fence) {
+  auto& inFlight = mLookupsInFlight[pair];
+  auto& buffer = *mLookupBuffersMapped[pair];
+  {
+    std::lock_guard<std::mutex> lock(mLookupMutex);
+    auto count = std::min(static_cast<uint32_t>(mPendingLookups.size()), maxLookups);
+    for( auto i = 0u; i < count; ++i ) {
+      buffer.ids[i] = mPendingLookups[i].id;
+      inFlight.lookups.emplace_back(std::move(mPendingLookups[i]));
+    }
+    mPendingLookups.erase(mPendingLookups.begin(), mPendingLookups.begin() + count);
+  }
+  // Host coherent, and the submit makes host writes visible
+  buffer.count = static_cast<uint32_t>(inFlight.lookups.size());
+  inFlight.step = step;
+  inFlight.fence = fence;
+}
+
+void VulkanApp::finishLookups(uint32_t pair, uint64_t step) {
+  auto& inFlight = mLookupsInFlight[pair];
+  if( inFlight.lookups.empty() || inFlight.step != step ) return;
+  auto& buffer = *mLookupBuffersMapped[pair];
+
+  for( auto i = 0u; i < inFlight.lookups.size(); ++i ) {
+    ParticleLookup result;
+    result.step = step;
+    result.slot = buffer.slots[i];
+    result.particle = buffer.particles[i];
+    inFlight.lookups[i].promise.set_value(result);
+  }
+  inFlight.lookups.clear();
+  buffer.count = 0;
+}
+
+void VulkanApp::updateTrackedParticle() {
+  if( !mTrackParticle ) return;
+  if( mTrackedParticleLookup.valid() ) {
+    if( mTrackedParticleLookup.wait_for(std::chrono::seconds(0)) != std::future_status::ready ) return;
+    mTrackedParticle = mTrackedParticleLookup.get();
+  }
+  mTrackedParticleLookup = lookupParticle(mTrackedParticleId);
+}
+
+float VulkanApp::potentialEnergy(uint32_t pair, float gravityScale, float mass, const glm::vec3& massWeightedPosition) const {
+  // Gravity comes from the step's force fields, which the GPU passes don't know about
+  // It's linear in position though, so the mass weighted position sum is all we need
+  auto gravity = mForceFieldBufferGravity[pair] * gravityScale;
+  return -glm::dot(gravity, massWeightedPosition - (mass * glm::vec3(0.f, floorHeight, 0.f)));
+}
+
+void VulkanApp::readDiagnostics(uint32_t slot, uint64_t step) {
+  auto r = mDiagnosticsReduction->result(slot);
+
+  Diagnostics d;
+  d.step = step;
+  d.kineticEnergy = r[0][0];
+  d.mass = r[0][2];
+  d.numParticles = static_cast<uint32_t>(r[0][3]);
+  d.momentum = {r[1][0], r[1][1], r[1][2]};
+  if( d.mass > 0.f ) d.centreOfMass = glm::vec3(r[2][0], r[2][1], r[2][2]) / d.mass;
+  d.boundsMin = {r[3][0], r[3][1], r[3][2]};
+  d.boundsMax = {r[4][0], r[4][1], r[4][2]};
+
+  // An ensemble's members each scale gravity differently, so that's summed up from the members instead
+  if( mNumSimulations == 1 ) d.potentialEnergy = potentialEnergy(slot, mSimulationParams[0].gravityScale, d.mass, glm::vec3(r[2][0], r[2][1], r[2][2]));
+
+  std::lock_guard<std::mutex> lock(mDiagnosticsMutex);
+  mDiagnostics = d;
+}
+
+void VulkanApp::createEnsembleDiagnostics() {
+  auto numPairs = mNumParticleBuffers * (mNumParticleBuffers - 1);
+  constexpr uint32_t recordSize = 5 * 4; // floats, see ensemblediagnostics.comp
+
+  mEnsemblePipeline.reset(new ComputePipeline(*mDeviceInstance.get()));
+  mEnsemblePipeline->shaders()[vk::ShaderStageFlagBits::eCompute] = mEnsemblePipeline->createShaderModule(shader_ensemblediagnostics_comp);
+  // Particles, results
+  mEnsemblePipeline->addDescriptorSetLayoutBinding(0, 0, vk::DescriptorType::eStorageBuffer, 1, vk::ShaderStageFlagBits::eCompute);
+  mEnsemblePipeline->addDescriptorSetLayoutBinding(0, 1, vk::DescriptorType::eStorageBuffer, 1, vk::ShaderStageFlagBits::eCompute);
+  mEnsemblePipeline->pushConstants().emplace_back(vk::ShaderStageFlagBits::eCompute, 0, sizeof(uint32_t));
+
+  mEnsembleSpecConstants.particlesPerMember = mParticlesPerSimulation;
+  mEnsembleSpecConstants.numMembers = mNumSimulations;
+  std::vector<vk::SpecializationMapEntry> specs = {
+    {0, offsetof(EnsembleSpecConstants, groupSize), sizeof(uint32_t)},
+    {1, offsetof(EnsembleSpecConstants, particlesPerMember), sizeof(uint32_t)},
+    {2, offsetof(EnsembleSpecConstants, numMembers), sizeof(uint32_t)},
+  };
+  mEnsemblePipeline->specialisationConstants()[vk::ShaderStageFlagBits::eCompute] = vk::SpecializationInfo(static_cast<uint32_t>(specs.size()), specs.data(), sizeof(EnsembleSpecConstants), &mEnsembleSpecConstants);
+  mEnsemblePipeline->build();
+
+  mEnsembleResults.reset(new SimpleBuffer(*mDeviceInstance.get(), sizeof(float) * recordSize * mNumSimulations * numPairs,
+                                          vk::BufferUsageFlagBits::eStorageBuffer,
+                                          vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent));
+  mEnsembleResultsMapped = static_cast<const float*>(mEnsembleResults->map());
+
+  auto poolSize = vk::DescriptorPoolSize(vk::DescriptorType::eStorageBuffer, mNumParticleBuffers * 2);
+  auto poolInfo = vk::DescriptorPoolCreateInfo()
+      .setFlags({})
+      .setMaxSets(mNumParticleBuffers)
+      .setPoolSizeCount(1)
+      .setPPoolSizes(&poolSize);
+  mEnsembleDescriptorPool = mDeviceInstance->device().createDescriptorPoolUnique(poolInfo);
+
+  std::vector<vk::DescriptorSetLayout> dsLayouts(mNumParticleBuffers, mEnsemblePipeline->descriptorSetLayouts()[0].get());
+  auto dsInfo = vk::DescriptorSetAllocateInfo()
+      .setDescriptorPool(mEnsembleDescriptorPool.get())
+      .setDescriptorSetCount(mNumParticleBuffers)
+      .setPSetLayouts(dsLayouts.data());
+  mEnsembleDescriptorSets = mDeviceInstance->device().allocateDescriptorSets(dsInfo);
+
+  for( auto i = 0u; i < mNumParticleBuffers; ++i ) {
+    std::vector<vk::DescriptorBufferInfo> infos = {
+      {mComputeDataBuffers[i]->buffer(), 0, VK_WHOLE_SIZE},
+      {mEnsembleResults->buffer(), 0, VK_WHOLE_SIZE},
+    };
+    auto write = vk::WriteDescriptorSet(mEnsembleDescriptorSets[i], 0, 0, static_cast<uint32_t>(infos.size()), vk::DescriptorType::eStorageBuffer, nullptr, infos.data(), nullptr);
+    mDeviceInstance->device().updateDescriptorSets(1, &write, 0, nullptr);
+  }
+  std::cout << "Ensemble: " << mNumSimulations << " simulations of " << mParticlesPerSimulation << " particles" << std::endl;
+}
+
+void VulkanApp::readEnsembleDiagnostics(uint32_t slot, uint64_t step) {
+  constexpr uint32_t recordSize = 5 * 4;
+  std::vector<Diagnostics> results(mNumSimulations);
+  auto totalPotentialEnergy = 0.f;
+  for( auto sim = 0u; sim < mNumSimulations; ++sim ) {
+    auto r = mEnsembleResultsMapped + ((static_cast<size_t>(slot) * mNumSimulations) + sim) * recordSize;
+    auto& d = results[sim];
+    d.step = step;
+    d.kineticEnergy = r[0];
+    d.mass = r[2];
+    d.numParticles = static_cast<uint32_t>(r[3]);
+    d.momentum = {r[4], r[5], r[6]};
+    if( d.mass > 0.f ) d.centreOfMass = glm::vec3(r[8], r[9], r[10]) / d.mass;
+    d.boundsMin = {r[12], r[13], r[14]};
+    d.boundsMax = {r[16], r[17], r[18]};
+    d.potentialEnergy = potentialEnergy(slot, mSimulationParams[sim].gravityScale, d.mass, glm::vec3(r[8], r[9], r[10]));
+    totalPotentialEnergy += d.potentialEnergy;
+  }
+
+  std::lock_guard<std::mutex> lock(mDiagnosticsMutex);
+  mEnsembleDiagnostics = std::move(results);
+  // The system's potential energy is left to us, see readDiagnostics
+  if( mDiagnostics.step == step ) mDiagnostics.potentialEnergy = totalPotentialEnergy;
+}
+
+void VulkanApp::reportEnsemble(bool all) {
+  std::vector<Diagnostics> results;
+  {
+    std::lock_guard<std::mutex> lock(mDiagnosticsMutex);
+    results = mEnsembleDiagnostics;
+  }
+  if( results.empty() ) return;
+
+  auto energy = [](const Diagnostics& d) { return d.kineticEnergy + d.potentialEnergy; };
+  if( all ) {
+    for( auto sim = 0u; sim < results.size(); ++sim ) {
+      auto& d = results[sim];
+      auto& params = mSimulationParams[sim];
+      std::cout << "Simulation " << sim << " (gravity x" << params.gravityScale << ", fields x" << params.fieldScale
+                << ", drag " << params.drag << ", restitution " << params.restitution << "): "
+                << "E " << energy(d) << " (KE " << d.kineticEnergy << ", PE " << d.potentialEnergy << "), "
+                << "COM (" << d.centreOfMass.x << ", " << d.centreOfMass.y << ", " << d.centreOfMass.z << ")" << std::endl;
+    }
+    return;
+  }
+
+  auto [lowest, highest] = std::minmax_element(results.begin(), results.end(), [&](auto& a, auto& b) { return energy(a) < energy(b); });
+  std::cout << "Step " << results.front().step << ": " << results.size() << " simulations, "
+            << "E " << energy(*lowest) << " (simulation " << lowest - results.begin() << ") - "
+            << energy(*highest) << " (simulation " << highest - results.begin() << ")" << std::endl;
+}
+
+void VulkanApp::reportDiagnostics() {
+  Diagnostics d;
+  {
+    std::lock_guard<std::mutex> lock(mDiagnosticsMutex);
+    d = mDiagnostics;
+  }
+  if( d.step == 0 ) return;
+
+  auto str = [](const glm::vec3& v) {
+    return "(" + std::to_string(v.x) + ", " + std::to_string(v.y) + ", " + std::to_string(v.z) + ")";
+  };
+  std::cout << "Step " << d.step << ": "
+            << "E " << d.kineticEnergy + d.potentialEnergy << " (KE " << d.kineticEnergy << ", PE " << d.potentialEnergy << "), "
+            << "p " << str(d.momentum) << ", "
+            << "COM " << str(d.centreOfMass) << ", "
+            << "bounds " << str(d.boundsMin) << " - " << str(d.boundsMax) << std::endl;
+}
+
+void VulkanApp::createGraphicsDescriptorSets() {
+  auto numImages = static_cast<uint32_t>(mWindowIntegration->swapChainImages().size());
+
+  // One uniform buffer per swapchain image, kept mapped for the lifetime of the app
+  for( auto i = 0u; i < numImages; ++i ) {
+    mFrameUniformBuffers.emplace_back( new SimpleBuffer(
+                                         *mDeviceInstance.get(),
+                                         sizeof(FrameUniforms),
+                                         vk::BufferUsageFlagBits::eUniformBuffer,
+                                         vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent ) );
+    mFrameUniformsMapped.emplace_back( static_cast<FrameUniforms*>(mFrameUniformBuffers.back()->map()) );
+  }
+
+  auto poolSize = vk::DescriptorPoolSize()
+      .setType(vk::DescriptorType::eUniformBuffer)
+      .setDescriptorCount(numImages);
+
+  auto poolInfo = vk::DescriptorPoolCreateInfo()
+      .setFlags({})
+      .setMaxSets(numImages)
+      .setPoolSizeCount(1)
+      .setPPoolSizes(&poolSize);
+  mGraphicsDescriptorPool = mDeviceInstance->device().createDescriptorPoolUnique(poolInfo);
+
+  std::vector<vk::DescriptorSetLayout> dsLayouts(numImages, mGraphicsPipeline->descriptorSetLayouts()[0].get());
+  auto dsInfo = vk::DescriptorSetAllocateInfo()
+      .setDescriptorPool(mGraphicsDescriptorPool.get())
+      .setDescriptorSetCount(numImages)
+      .setPSetLayouts(dsLayouts.data());
+  mGraphicsDescriptorSets = mDeviceInstance->device().allocateDescriptorSets(dsInfo);
+
+  for( auto i = 0u; i < numImages; ++i ) {
+    auto uInfo = vk::DescriptorBufferInfo()
+        .setBuffer(mFrameUniformBuffers[i]->buffer())
+        .setOffset(0)
+        .setRange(VK_WHOLE_SIZE);
+
+    auto wInfo = vk::WriteDescriptorSet()
+        .setDstSet(mGraphicsDescriptorSets[i])
+        .setDstBinding(0)
+        .setDstArrayElement(0)
+        .setDescriptorCount(1)
+        .setDescriptorType(vk::DescriptorType::eUniformBuffer)
+        .setPImageInfo(nullptr)
+        .setPBufferInfo(&uInfo)
+        .setPTexelBufferView(nullptr);
+
+    mDeviceInstance->device().updateDescriptorSets(1, &wInfo, 0, nullptr);
+  }
+}
+
+void VulkanApp::createCullBuffers() {
+  auto numImages = static_cast<uint32_t>(mWindowIntegration->swapChainImages().size());
+
+  // Output of the cull pass for each swapchain image
+  // Sized for everything being visible
+  for( auto i = 0u; i < numImages; ++i ) {
+    mVisibleIndexBuffers.emplace_back( new SimpleBuffer(
+                                         *mDeviceInstance.get(),
+                                         sizeof(uint32_t) * mCullSpecConstants.numParticles,
+                                         vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eIndexBuffer,
+                                         vk::MemoryPropertyFlagBits::eDeviceLocal,
+                                         {},
+                                         "culling" ) );
+    mDrawCommandBuffers.emplace_back( new SimpleBuffer(
+                                         *mDeviceInstance.get(),
+                                         sizeof(vk::DrawIndexedIndirectCommand),
+                                         vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eIndirectBuffer | vk::BufferUsageFlagBits::eTransferDst,
+                                         vk::MemoryPropertyFlagBits::eDeviceLocal ) );
+  }
+
+  // One set for each swapchain image/particle buffer pair, same as the render command buffers
+  auto numSets = numImages * mNumParticleBuffers;
+  std::vector<vk::DescriptorPoolSize> poolSizes = {
+    {vk::DescriptorType::eStorageBuffer, numSets * 3},
+    {vk::DescriptorType::eUniformBuffer, numSets},
+  };
+  auto poolInfo = vk::DescriptorPoolCreateInfo()
+      .setFlags({})
+      .setMaxSets(numSets)
+      .setPoolSizeCount(static_cast<uint32_t>(poolSizes.size()))
+      .setPPoolSizes(poolSizes.data());
+  mCullDescriptorPool = mDeviceInstance->device().createDescriptorPoolUnique(poolInfo);
+
+  std::vector<vk::DescriptorSetLayout> dsLayouts(numSets, mCullPipeline->descriptorSetLayouts()[0].get());
+  auto dsInfo = vk::DescriptorSetAllocateInfo()
+      .setDescriptorPool(mCullDescriptorPool.get())
+      .setDescriptorSetCount(numSets)
+      .setPSetLayouts(dsLayouts.data());
+  mCullDescriptorSets = mDeviceInstance->device().allocateDescriptorSets(dsInfo);
+
+  for( auto image = 0u; image < numImages; ++image ) for( auto particleBuffer = 0u; particleBuffer < mNumParticleBuffers; ++particleBuffer ) {
+    auto set = mCullDescriptorSets[(image * mNumParticleBuffers) + particleBuffer];
+
+    vk::DescriptorBufferInfo particleInfo(mComputeDataBuffers[particleBuffer]->buffer(), 0, VK_WHOLE_SIZE);
+    vk::DescriptorBufferInfo uniformInfo(mFrameUniformBuffers[image]->buffer(), 0, VK_WHOLE_SIZE);
+    vk::DescriptorBufferInfo visibleInfo(mVisibleIndexBuffers[image]->buffer(), 0, VK_WHOLE_SIZE);
+    vk::DescriptorBufferInfo drawInfo(mDrawCommandBuffers[image]->buffer(), 0, VK_WHOLE_SIZE);
+
+    std::vector<vk::WriteDescriptorSet> writes = {
+      vk::WriteDescriptorSet(set, 0, 0, 1, vk::DescriptorType::eStorageBuffer, nullptr, &particleInfo, nullptr),
+      vk::WriteDescriptorSet(set, 1, 0, 1, vk::DescriptorType::eUniformBuffer, nullptr, &uniformInfo, nullptr),
+      vk::WriteDescriptorSet(set, 2, 0, 1, vk::DescriptorType::eStorageBuffer, nullptr, &visibleInfo, nullptr),
+      vk::WriteDescriptorSet(set, 3, 0, 1, vk::DescriptorType::eStorageBuffer, nullptr, &drawInfo, nullptr),
+    };
+    mDeviceInstance->device().updateDescriptorSets(static_cast<uint32_t>(writes.size()), writes.data(), 0, nullptr);
+  }
+}
+
+void VulkanApp::createSplatResources() {
+  auto numImages = static_cast<uint32_t>(mWindowIntegration->swapChainImages().size());
+  auto extent = mWindowIntegration->extent();
+
+  // One for each swapchain image, the resolve reads a pixel for each fragment
+  for( auto i = 0u; i < numImages; ++i ) {
+    mSplatImages.emplace_back( new SimpleImage(
+                                 *mDeviceInstance.get(),
+                                 vk::ImageType::e2D,
+                                 vk::Format::eR32Uint, // Atomics on this format are always supported
+                                 vk::Extent3D(extent.width, extent.height, 1),
+                                 vk::ImageUsageFlagBits::eStorage | vk::ImageUsageFlagBits::eTransferDst ) );
+  }
+
+  // Splat sets for each swapchain image/particle buffer pair, resolve sets for each swapchain image
+  auto numSplatSets = numImages * mNumParticleBuffers;
+  std::vector<vk::DescriptorPoolSize> poolSizes = {
+    {vk::DescriptorType::eStorageBuffer, numSplatSets},
+    {vk::DescriptorType::eUniformBuffer, numSplatSets},
+    {vk::DescriptorType::eStorageImage, numSplatSets + numImages},
+  };
+  auto poolInfo = vk::DescriptorPoolCreateInfo()
+      .setFlags({})
+      .setMaxSets(numSplatSets + numImages)
+      .setPoolSizeCount(static_cast<uint32_t>(poolSizes.size()))
+      .setPPoolSizes(poolSizes.data());
+  mSplatDescriptorPool = mDeviceInstance->device().createDescriptorPoolUnique(poolInfo);
+
+  std::vector<vk::DescriptorSetLayout> splatLayouts(numSplatSets, mSplatPipeline->descriptorSetLayouts()[0].get());
+  auto splatInfo = vk::DescriptorSetAllocateInfo()
+      .setDescriptorPool(mSplatDescriptorPool.get())
+      .setDescriptorSetCount(numSplatSets)
+      .setPSetLayouts(splatLayouts.data());
+  mSplatDescriptorSets = mDeviceInstance->device().allocateDescriptorSets(splatInfo);
+
+  std::vector<vk::DescriptorSetLayout> resolveLayouts(numImages, mResolvePipeline->descriptorSetLayouts()[0].get());
+  auto resolveInfo = vk::DescriptorSetAllocateInfo()
+      .setDescriptorPool(mSplatDescriptorPool.get())
+      .setDescriptorSetCount(numImages)
+      .setPSetLayouts(resolveLayouts.data());
+  mResolveDescriptorSets = mDeviceInstance->device().allocateDescriptorSets(resolveInfo);
+
+  for( auto image = 0u; image < numImages; ++image ) {
+    vk::DescriptorImageInfo imageInfo({}, mSplatImages[image]->view(), vk::ImageLayout::eGeneral);
+
+    auto resolveWrite = vk::WriteDescriptorSet(mResolveDescriptorSets[image], 0, 0, 1, vk::DescriptorType::eStorageImage, &imageInfo, nullptr, nullptr);
+    mDeviceInstance->device().updateDescriptorSets(1, &resolveWrite, 0, nullptr);
+
+    for( auto particleBuffer = 0u; particleBuffer < mNumParticleBuffers; ++particleBuffer ) {
+      auto set = mSplatDescriptorSets[(image * mNumParticleBuffers) + particleBuffer];
+
+      vk::DescriptorBufferInfo particleInfo(mComputeDataBuffers[particleBuffer]->buffer(), 0, VK_WHOLE_SIZE);
+      vk::DescriptorBufferInfo uniformInfo(mFrameUniformBuffers[image]->buffer(), 0, VK_WHOLE_SIZE);
+
+      std::vector<vk::WriteDescriptorSet> writes = {
+        vk::WriteDescriptorSet(set, 0, 0, 1, vk::DescriptorType::eStorageBuffer, nullptr, &particleInfo, nullptr),
+        vk::WriteDescriptorSet(set, 1, 0, 1, vk::DescriptorType::eUniformBuffer, nullptr, &uniformInfo, nullptr),
+        vk::WriteDescriptorSet(set, 2, 0, 1, vk::DescriptorType::eStorageImage, &imageInfo, nullptr, nullptr),
+      };
+      mDeviceInstance->device().updateDescriptorSets(static_cast<uint32_t>(writes.size()), writes.data(), 0, nullptr);
+    }
+  }
+}
+
 void VulkanApp::loop() {
   auto frameIndex = 0u;
 
@@ -404,47 +2073,120 @@ void VulkanApp::loop() {
   float modelRot = 0.f;
 
   // Seed the particle buffer with data
+  // This is step 0 as far as the scheduler is concerned, so done before it gets going
   {
-    buildComputeCommandBufferDataUpload(mComputeCommandBuffers[0].get(), *mComputeDataBuffers[0].get());
+    auto commandBufferAllocateInfo = vk::CommandBufferAllocateInfo()
+        .setCommandPool(mComputeCommandPool.get())
+        .setCommandBufferCount(1)
+        .setLevel(vk::CommandBufferLevel::ePrimary);
+    auto uploadCommandBuffers = mDeviceInstance->device().allocateCommandBuffersUnique(commandBufferAllocateInfo);
+    buildComputeCommandBufferDataUpload(uploadCommandBuffers[0].get(), *mComputeDataBuffers[0].get());
     auto subInfo = vk::SubmitInfo()
         .setCommandBufferCount(1)
-        .setPCommandBuffers(&mComputeCommandBuffers[0].get());
+        .setPCommandBuffers(&uploadCommandBuffers[0].get());
     auto fence = mDeviceInstance->device().createFenceUnique({});
-    mComputeQueue->queue.submit(1, &subInfo, fence.get());
+    {
+      std::lock_guard<std::mutex> lock(*mComputeQueue->mutex);
+      mComputeQueue->queue.submit(1, &subInfo, fence.get());
+    }
     mDeviceInstance->device().waitForFences(1, &fence.get(), true, std::numeric_limits<uint64_t>::max());
+    if( mProfiler ) mProfiler->collect(0);
+    mBvhStaging.clear();
+    mSdfStaging.reset();
   }
 
   // Build the compute command buffers for running the pipeline
-  for( auto i = 0u; i < mMaxFramesInFlight; ++i ) {
-    // Vertex buffer used to pass data from compute -> graphics, one ahead of current frame
-    // both pipelines have barriers to synchronise access to this
-    auto vertBufIndex = frameIndex + 1;
-    if( vertBufIndex == mMaxFramesInFlight ) vertBufIndex = 0;
-    buildComputeCommandBuffer(mComputeCommandBuffers[i].get(), mComputeDescriptorSets[i], mComputeDataBuffers[i]->buffer());
-  }
+  buildComputeCommandBuffers();
 
   glfwShowWindow(mWindow);
 
   mLastTime = now();
   mCurTime = mLastTime;
+  auto startTime = mLastTime;
+  auto numFrames = 0ull;
+
+  TRACE_THREAD_NAME("Main");
 
-  while(!glfwWindowShouldClose(mWindow) ) {
+  // Rendering starts on buffer 0 (the initial upload), simulation takes it from there
+  mParticleBufferSteps[mParticleHandoff.front()] = 0;
+  mSimRunning = true;
+  if( !mSingleSubmit ) mSimThread = std::thread(&VulkanApp::simulationLoop, this);
 
-    glfwPollEvents();
+  while(!glfwWindowShouldClose(mWindow) && mSimRunning ) {
+    TRACE_SCOPE("frame");
+
+    {
+      TRACE_SCOPE("glfwPollEvents");
+      glfwPollEvents();
+    }
 
     // Wait for the last frame to finish rendering
-    mDeviceInstance->device().waitForFences(1, &mFrameInFlightFences[frameIndex].get(), true, std::numeric_limits<uint64_t>::max());
+    {
+      TRACE_SCOPE("waitForFences");
+      mDeviceInstance->device().waitForFences(1, &mFrameInFlightFences[frameIndex].get(), true, std::numeric_limits<uint64_t>::max());
+    }
+
+    // When we're running the simulation it's covered by the fence too
+    // Unless enough frames are in flight that the pair's been resubmitted, then skip this one
+    if( mSingleSubmit && mFrameSteps[frameIndex] > 0 ) {
+      auto step = mFrameSteps[frameIndex];
+      auto source = static_cast<uint32_t>((step - 1) % mNumParticleBuffers);
+      auto target = static_cast<uint32_t>(step % mNumParticleBuffers);
+      auto pair = computePairIndex(source, target);
+      if( mDiagnosticsReduction && mSingleSubmitStep < step + mNumParticleBuffers ) readDiagnostics(pair, step);
+      if( mEnsemblePipeline && mSingleSubmitStep < step + mNumParticleBuffers ) readEnsembleDiagnostics(pair, step);
+      if( mTimeStepReduction && mSingleSubmitStep < step + mNumParticleBuffers ) readTimeStep(pair, step);
+      finishLookups(pair, step);
+    }
+    updateTrackedParticle();
+    if( mDiagnosticsReportInterval > 0. && mCurTime - mLastDiagnosticsReport >= mDiagnosticsReportInterval ) {
+      if( mDiagnosticsReduction ) reportDiagnostics();
+      if( mEnsemblePipeline ) reportEnsemble(false);
+      if( mTimeStepReduction ) reportTimeStep();
+      if( mTrackParticle && mTrackedParticle.step > 0 ) {
+        auto& p = mTrackedParticle.particle.position;
+        std::cout << "Particle " << mTrackedParticleId << " (slot " << mTrackedParticle.slot << ", step " << mTrackedParticle.step << "): "
+                  << "(" << p.x << ", " << p.y << ", " << p.z << ")" << std::endl;
+      }
+      mLastDiagnosticsReport = mCurTime;
+    }
 
     // Physics hacks
     mLastTime = mCurTime;
     mCurTime = now();
 
-    // Run the compute pipeline
-    {
-      auto subInfo = vk::SubmitInfo()
-          .setCommandBufferCount(1)
-          .setPCommandBuffers(&mComputeCommandBuffers[frameIndex].get());
-      mComputeQueue->queue.submit(1, &subInfo, {});
+    // Render whatever the simulation finished most recently
+    // If nothing new has come along since last frame we just draw the same thing again
+    //
+    // Or if we're running the simulation ourselves, step through the buffers in order
+    // The step goes in the same submission as rendering, ordered by barriers alone
+    uint32_t renderBuffer = 0;
+    uint64_t renderStep = 0;
+    vk::CommandBuffer computeCommandBuffer;
+    auto frameFence = mFrameInFlightFences[frameIndex].get();
+    if( mSingleSubmit ) {
+      auto source = static_cast<uint32_t>(mSingleSubmitStep % mNumParticleBuffers);
+      renderStep = ++mSingleSubmitStep;
+      renderBuffer = static_cast<uint32_t>(renderStep % mNumParticleBuffers);
+      auto pair = computePairIndex(source, renderBuffer);
+      if( mProfiler ) mProfiler->collect(pair);
+      computeCommandBuffer = this->computeCommandBuffer(pair, renderStep);
+      mFrameSteps[frameIndex] = renderStep;
+
+      // If there's more frames in flight than buffers the pair's last step may still be running,
+      // and its lookup and force field buffers can't be touched until it's done. Its frame has been
+      // submitted (only this frame's fence is waiting to be reset), so waiting is safe
+      auto& inFlight = mLookupsInFlight[pair];
+      if( inFlight.fence ) {
+        mDeviceInstance->device().waitForFences(1, &inFlight.fence, true, std::numeric_limits<uint64_t>::max());
+        finishLookups(pair, inFlight.step);
+      }
+      submitLookups(pair, renderStep, frameFence);
+      submitForceFields(pair);
+    } else {
+      mParticleHandoff.update();
+      renderBuffer = mParticleHandoff.front();
+      renderStep = mParticleBufferSteps[renderBuffer];
     }
 
     // Setup matrices
@@ -454,70 +2196,213 @@ void VulkanApp::loop() {
     //if( eyePos.y < 20 ) eyePos.y += 0.05;
 
     modelRot += .1f;
-    mPushConstants.modelMatrix = glm::mat4(1);//glm::rotate(glm::mat4(1), glm::radians(modelRot), glm::vec3(0.f,-1.f,0.f));
-    mPushConstants.viewMatrix = glm::lookAt( eyePos, glm::vec3(0,-100,0), glm::vec3(0,-1,0));
-    mPushConstants.projMatrix = glm::perspective(glm::radians(90.f),static_cast<float>(mWindowWidth / mWindowHeight), 0.001f,1000.f);
+    mFrameUniforms.modelMatrix = glm::mat4(1);//glm::rotate(glm::mat4(1), glm::radians(modelRot), glm::vec3(0.f,-1.f,0.f));
+    mFrameUniforms.viewMatrix = glm::lookAt( eyePos, glm::vec3(0,-100,0), glm::vec3(0,-1,0));
+    mFrameUniforms.projMatrix = glm::perspective(glm::radians(90.f),static_cast<float>(mWindowWidth / mWindowHeight), 0.001f,1000.f);
+
+    // Acquire and image from the swap chain
+    uint32_t imageIndex = 0;
+    {
+      TRACE_SCOPE("acquireNextImageKHR");
+      imageIndex = mDeviceInstance->device().acquireNextImageKHR(
+            mWindowIntegration->swapChain(), // Get an image from this
+            std::numeric_limits<uint64_t>::max(), // Don't timeout
+            mImageAvailableSemaphores[frameIndex].get(), // semaphore to signal once presentation is finished with the image
+            vk::Fence()).value; // Dummy fence, we don't care here
+    }
+
+    // The image may still be in use by an earlier frame, if frames are acquired out of order
+    // Must finish before we can touch its uniform buffer
+    if( mImagesInFlight[imageIndex] ) {
+      TRACE_SCOPE("waitForFences");
+      mDeviceInstance->device().waitForFences(1, &mImagesInFlight[imageIndex], true, std::numeric_limits<uint64_t>::max());
+    }
+    mImagesInFlight[imageIndex] = frameFence;
+
+    // Render passes are recorded per image, so their timings are in the image's slot
+    if( mProfiler ) mProfiler->collect(imageIndex);
 
     // Reset the fence - fences must be reset before being submitted
-    auto frameFence = mFrameInFlightFences[frameIndex].get();
     mDeviceInstance->device().resetFences(1, &frameFence);
 
-    // Acquire and image from the swap chain
-    auto imageIndex = mDeviceInstance->device().acquireNextImageKHR(
-          mWindowIntegration->swapChain(), // Get an image from this
-          std::numeric_limits<uint64_t>::max(), // Don't timeout
-          mImageAvailableSemaphores[frameIndex].get(), // semaphore to signal once presentation is finished with the image
-          vk::Fence()).value; // Dummy fence, we don't care here
+    // Per-frame data goes through the uniform buffer (host coherent, no flush needed)
+    *mFrameUniformsMapped[imageIndex] = mFrameUniforms;
 
     // Submit the command buffer
-    vk::SubmitInfo submitInfo = {};
-    auto commandBuffer = mCommandBuffers[frameIndex].get();
-    auto frameBuffer = mFrameBuffer->frameBuffers()[imageIndex].get();
-
-    // Rebuild the command buffer every frame
-    // This isn't the most efficient but we're at least re-using the command buffer
-    // In a most complex application we would have multiple command buffers and only rebuild
-    // the section that needs changing..I think
+    // Command buffers are only recorded the first time each image/particle buffer pair is used
     //
-    // Data buffer here is the output buffer of the compute pass, so 1 ahead of frameIndex
-    auto vertBufIndex = frameIndex + 1;
-    if( vertBufIndex == mMaxFramesInFlight ) vertBufIndex = 0;
-    buildCommandBuffer(commandBuffer, frameBuffer, mComputeDataBuffers[vertBufIndex]->buffer());
+    auto commandBuffer = renderCommandBuffer(imageIndex, renderBuffer);
 
     // Don't execute until this is ready
-    vk::Semaphore waitSemaphores[] = {mImageAvailableSemaphores[frameIndex].get()};
     // place the wait before writing to the colour attachment
-
-    vk::PipelineStageFlags waitStages[] {vk::PipelineStageFlagBits::eColorAttachmentOutput};
+    // The scheduler adds the wait on the compute step itself, if there is one
+    std::vector<vk::Semaphore> waitSemaphores = {mImageAvailableSemaphores[frameIndex].get()};
+    std::vector<vk::PipelineStageFlags> waitStages = {vk::PipelineStageFlagBits::eColorAttachmentOutput};
     // Signal this semaphore when rendering is done
-    vk::Semaphore signalSemaphores[] = {mRenderFinishedSemaphores[frameIndex].get()};
-    submitInfo.setWaitSemaphoreCount(1)
-        .setPWaitSemaphores(waitSemaphores)
-        .setPWaitDstStageMask(waitStages)
-        .setCommandBufferCount(1)
-        .setPCommandBuffers(&commandBuffer)
-        .setSignalSemaphoreCount(1)
-        .setPSignalSemaphores(signalSemaphores)
-        ;
+    std::vector<vk::Semaphore> signalSemaphores = {mRenderFinishedSemaphores[frameIndex].get()};
 
-    vk::ArrayProxy<vk::SubmitInfo> submits(submitInfo);
     // submit, signal the frame fence at the end
-    mGraphicsQueue->queue.submit(submits.size(), submits.data(), frameFence);
+    if( mSingleSubmit ) {
+      TRACE_SCOPE("submitComputeRender");
+      // Compute has nothing at the colour attachment stage, so isn't held up by the image wait
+      vk::CommandBuffer commandBuffers[] = {computeCommandBuffer, commandBuffer};
+      auto submitInfo = vk::SubmitInfo()
+          .setWaitSemaphoreCount(static_cast<uint32_t>(waitSemaphores.size()))
+          .setPWaitSemaphores(waitSemaphores.data())
+          .setPWaitDstStageMask(waitStages.data())
+          .setCommandBufferCount(2)
+          .setPCommandBuffers(commandBuffers)
+          .setSignalSemaphoreCount(static_cast<uint32_t>(signalSemaphores.size()))
+          .setPSignalSemaphores(signalSemaphores.data());
+      std::lock_guard<std::mutex> lock(*mGraphicsQueue->mutex);
+      mGraphicsQueue->queue.submit(1, &submitInfo, frameFence);
+    } else {
+      TRACE_SCOPE("submitRender");
+      mScheduler->submitRender(*mGraphicsQueue, commandBuffer, renderStep, renderBuffer, waitSemaphores, waitStages, signalSemaphores, frameFence);
+    }
 
     // Present the results of a frame to the swap chain
     vk::SwapchainKHR swapChains[] = {mWindowIntegration->swapChain()};
     vk::PresentInfoKHR presentInfo = {};
     presentInfo.setWaitSemaphoreCount(1)
-        .setPWaitSemaphores(signalSemaphores) // Wait before presentation can start
+        .setPWaitSemaphores(signalSemaphores.data()) // Wait before presentation can start
         .setSwapchainCount(1)
         .setPSwapchains(swapChains)
         .setPImageIndices(&imageIndex)
         .setPResults(nullptr);
-    mGraphicsQueue->queue.presentKHR(presentInfo);
+    {
+      TRACE_SCOPE("presentKHR");
+      std::lock_guard<std::mutex> lock(*mGraphicsQueue->mutex);
+      mGraphicsQueue->queue.presentKHR(presentInfo);
+    }
 
     // Advance to next frame index, loop at max
     frameIndex++;
     if( frameIndex == mMaxFramesInFlight ) frameIndex = 0;
+    numFrames++;
+  }
+
+  mSimRunning = false;
+  if( mSimThread.joinable() ) mSimThread.join();
+  if( mSimError ) std::rethrow_exception(mSimError);
+
+  auto elapsed = now() - startTime;
+  if( elapsed > 0. ) {
+    auto numSteps = mSingleSubmit ? mSingleSubmitStep : mScheduler->completedStep();
+    std::cout << "Simulation: " << numSteps / elapsed << " steps/s, "
+              << "Rendering: " << numFrames / elapsed << " frames/s" << std::endl;
+  }
+
+  // Where each ensemble member ended up
+  if( mEnsemblePipeline ) reportEnsemble(true);
+
+  // Each step reads and writes every particle once, how close that gets to the memory bandwidth
+  // depends on how scattered the particles are. Compare with reordering off to see what it's worth
+  if( mProfiler ) {
+    auto stats = mProfiler->statistics(mProfileScopeCompute);
+    if( stats.samples > 0 && stats.avgMs > 0. ) {
+      auto bytes = 2. * sizeof(Particle) * mParticles.size();
+      std::cout << "Compute: " << bytes / (stats.avgMs * 1e6) << " GB/s effective"
+                << (mReorderInterval ? ", reordering every " + std::to_string(mReorderInterval) + " steps" : ", no reordering") << std::endl;
+
+      // What a simulated second costs, which is what matters when comparing integrators
+      // A higher order one costs more per step, but may get away with bigger steps
+      // With an adaptive step that's the average over the run
+      auto integrator = static_cast<Integrator>(mComputeSpecConstants.mIntegrator);
+      auto dt = mComputeSpecConstants.mTimeStep;
+      if( mTimeStepReduction ) {
+        std::lock_guard<std::mutex> lock(mDiagnosticsMutex);
+        if( mTimeStepStats.step > 0 ) dt = mTimeStepStats.latest.time / mTimeStepStats.step;
+      }
+      std::cout << "Integrator: " << integratorName(integrator) << (mTimeStepReduction ? ", average dt " : ", dt ") << dt
+                << ", " << stats.avgMs << "ms per step, " << stats.avgMs / dt << "ms per simulated second" << std::endl;
+    }
+  }
+}
+
+const char* VulkanApp::integratorName(Integrator i) {
+  switch( i ) {
+    case Integrator::Euler: return "euler";
+    case Integrator::Verlet: return "verlet";
+    case Integrator::Leapfrog: return "leapfrog";
+    case Integrator::RK4: return "rk4";
+  }
+  return "unknown";
+}
+
+uint32_t VulkanApp::integratorEvaluations(Integrator i) {
+  return i == Integrator::RK4 ? 4 : 1;
+}
+
+void VulkanApp::simulationLoop() {
+  TRACE_THREAD_NAME("Simulation");
+
+  // Steps submitted but not yet handed to rendering, oldest first
+  struct InFlightStep {
+    uint64_t step;
+    uint32_t buffer;
+    uint32_t pair;
+  };
+  std::deque<InFlightStep> inFlight;
+
+  // Rendering only wants finished steps, so they're published here once the GPU is done
+  // Publishing hands back an older buffer, nothing on the GPU reads that any more
+  auto retire = [&]() {
+    auto& s = inFlight.front();
+    if( mProfiler ) mProfiler->collect(s.pair);
+    if( mDiagnosticsReduction ) readDiagnostics(s.pair, s.step);
+    if( mEnsemblePipeline ) readEnsembleDiagnostics(s.pair, s.step);
+    if( mTimeStepReduction ) readTimeStep(s.pair, s.step);
+    finishLookups(s.pair, s.step);
+    mParticleBufferSteps[s.buffer] = s.step;
+    auto freed = mParticleHandoff.publish(s.buffer);
+    inFlight.pop_front();
+    return freed;
+  };
+
+  try {
+    // Buffer 0 has the initial upload in it, and the handoff owns 1
+    // Everything else is ours to write to
+    auto source = mParticleHandoff.front();
+    std::vector<uint32_t> freeBuffers;
+    for( auto i = 2u; i < mNumParticleBuffers; ++i ) freeBuffers.emplace_back(i);
+
+    while( mSimRunning ) {
+      TRACE_SCOPE("simulationStep");
+
+      auto completed = mScheduler->completedStep();
+      while( !inFlight.empty() && inFlight.front().step <= completed ) freeBuffers.emplace_back(retire());
+
+      // Up to mComputeLead steps in flight, past that wait for the oldest
+      if( inFlight.size() >= mComputeLead ) {
+        {
+          TRACE_SCOPE("waitStep");
+          mScheduler->waitStep(inFlight.front().step);
+        }
+        freeBuffers.emplace_back(retire());
+      }
+
+      // The target may have been drawn recently, the scheduler makes the GPU wait for that
+      auto target = freeBuffers.back();
+      freeBuffers.pop_back();
+      auto pair = computePairIndex(source, target);
+      auto nextStep = mScheduler->submittedStep() + 1;
+      auto commandBuffer = computeCommandBuffer(pair, nextStep);
+      // The target was free, so the pair's last step has been retired and its lookup and force field buffers are free
+      submitLookups(pair, nextStep, {});
+      submitForceFields(pair);
+      auto step = mScheduler->submitCompute(*mComputeQueue, commandBuffer, target);
+      inFlight.push_back({step, target, pair});
+      source = target;
+    }
+
+    // Let the last few steps finish, so nothing is left half done
+    if( !inFlight.empty() ) mScheduler->waitStep(inFlight.back().step);
+    while( !inFlight.empty() ) retire();
+  } catch( ... ) {
+    // Picked up by the render thread once it notices we've stopped
+    mSimError = std::current_exception();
+    mSimRunning = false;
   }
 }
 
@@ -532,9 +2417,55 @@ void VulkanApp::cleanup() {
   mImageAvailableSemaphores.clear();
   mCommandBuffers.clear();
   mCommandPool.reset();
+  mGraphicsDescriptorPool.reset();
+  mCullDescriptorPool.reset();
+  mDrawCommandBuffers.clear();
+  mVisibleIndexBuffers.clear();
+  mCullPipeline.reset();
+  mSplatDescriptorPool.reset();
+  mSplatImages.clear();
+  mResolvePipeline.reset();
+  mSplatPipeline.reset();
+  mFrameUniformsMapped.clear();
+  mFrameUniformBuffers.clear();
+  mScheduler.reset();
+  mReorderCommandBuffers.clear();
   mComputeCommandBuffers.clear();
+  mComputeCommandPools.reset();
   mComputeCommandPool.reset();
+  mMortonDescriptorPool.reset();
+  mLookupDescriptorPool.reset();
+  mLookupBuffersMapped.clear();
+  mLookupBuffers.clear();
+  mLookupPipeline.reset();
+  mParticleSlots.reset();
+  mForceFieldBuffersMapped.clear();
+  mTimeStepDescriptorPool.reset();
+  mTimeStepPipeline.reset();
+  mTimeStepLogMapped = nullptr;
+  mTimeStepLogBuffer.reset();
+  mTimeStepReduction.reset();
+  mTimeStepBuffer.reset();
+  mForceFieldBuffers.clear();
+  mCollideDescriptorPool.reset();
+  mCollidePipeline.reset();
+  mBvhTriangles.reset();
+  mBvhNodes.reset();
+  mSdfDescriptorPool.reset();
+  mSdfPipeline.reset();
+  mSdfSampler.reset();
+  mSdfImage.reset();
+  mMortonPipeline.reset();
+  mReorderSort.reset();
+  mDiagnosticsReduction.reset();
+  mEnsembleDescriptorPool.reset();
+  mEnsembleResultsMapped = nullptr;
+  mEnsembleResults.reset();
+  mEnsemblePipeline.reset();
+  mSimulationBuffer.reset();
+  mProfiler.reset();
   mGraphicsPipeline.reset();
+  mComputeVariants.reset();
   mComputePipeline.reset();
   mFrameBuffer.reset();
   mWindowIntegration.reset();
@@ -546,6 +2477,8 @@ void VulkanApp::cleanup() {
 
   mDeviceInstance.reset();
 
+  TRACE_WRITE("physics-trace.json");
+
   // TODO: Could wrap the glfw stuff in a smart pointer and
   // remove the need for this method
   glfwDestroyWindow(mWindow);
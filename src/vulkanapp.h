@@ -12,8 +12,22 @@
 #include "util/deviceinstance.h"
 #include "util/framebuffer.h"
 #include "util/simplebuffer.h"
+#include "util/simpleimage.h"
+#include "util/queryprofiler.h"
 #include "util/pipelines/graphicspipeline.h"
 #include "util/pipelines/computepipeline.h"
+#include "util/pipelines/computepipelinevariants.h"
+#include "util/threadpool.h"
+#include "util/timelinescheduler.h"
+#include "util/triplebuffer.h"
+#include "util/queueownership.h"
+#include "util/parallelreduction.h"
+#include "util/radixsort.h"
+#include "util/mesh.h"
+#include "util/bvh.h"
+#include "util/signeddistancefield.h"
+#include "util/taskgraph.h"
+#include "util/commandpools.h"
 
 #ifdef USE_GLFW
 # define GLFW_INCLUDE_VULKAN
@@ -25,10 +39,16 @@
 
 #include "glm/glm.hpp"
 
+#include <atomic>
+#include <exception>
+#include <fstream>
+#include <future>
 #include <iostream>
 #include <stdexcept>
+#include <thread>
 #include <vector>
 #include <map>
+#include <mutex>
 #include <string>
 
 class FrameBuffer;
@@ -43,6 +63,41 @@ public:
   VulkanApp();
   ~VulkanApp();
 
+  /// How particles get onto the screen
+  enum class RenderMode {
+    Points,       // One point primitive per particle, through the graphics pipeline
+    SplatNearest, // Compute rasteriser, nearest particle's colour
+    SplatDensity, // Compute rasteriser, number of particles per pixel
+  };
+  /// Must be set before run
+  void renderMode(RenderMode mode) { mRenderMode = mode; }
+  RenderMode renderMode() const { return mRenderMode; }
+
+  /// Sort the particles into Morton order every interval steps, 0 to never reorder. Must be set before run
+  void reorderInterval(uint32_t interval) { mReorderInterval = interval; }
+  uint32_t reorderInterval() const { return mReorderInterval; }
+
+  /**
+   * Pass the simulation step its buffers by address (VK_KHR_buffer_device_address), rather than
+   * through a descriptor set per pair of particle buffers. Falls back to descriptors if the
+   * device doesn't support it. Must be set before run
+   */
+  void bufferDeviceAddress(bool enable) { mBufferDeviceAddress = enable; }
+
+  /// Print the memory heaps and what's been allocated once everything is set up, see DeviceInstance::reportMemory
+  void memoryReport(bool enable) { mMemoryReport = enable; }
+
+  /**
+   * Which physical device to use, an index into the device list printed at startup or part of a name
+   * Overrides VULKANUTILS_DEVICE and benchmarkDevices. Must be set before run
+   */
+  void device(const std::string& device) { mDevice = device; }
+  /**
+   * Time the integrator on every device and use the fastest, rather than going by the device scores
+   * The pick is cached in physics-devices.cache until the devices or drivers change. Must be set before run
+   */
+  void benchmarkDevices(bool enable) { mBenchmarkDevices = enable; }
+
   void run() {
     initWindow();
     initVK();
@@ -50,8 +105,19 @@ public:
     cleanup();
   }
 
-  // sizeof must be multiple of 4 here, no checking performed later
-  struct PushConstants {
+  /// Time each pass on the GPU, reported on exit. The queries aren't free so it's off by default. Must be set before run
+  void profileGPU(bool enable) { mProfileGPU = enable; }
+  /// How many steps the simulation may run ahead of the screen, at least 1. Each step costs a particle buffer. Must be set before run
+  void computeLead(uint32_t lead) { mComputeLead = lead; }
+  /**
+   * Reduce energy, momentum and so on after every step. Off by default, it's an extra few passes per step
+   * @param reportInterval Seconds between summaries printed to stdout, 0 to keep quiet
+   * Must be set before run
+   */
+  void diagnostics(bool enable, double reportInterval = 1.0) { mDiagnosticsEnabled = enable; mDiagnosticsReportInterval = reportInterval; }
+
+  // Per-frame data for rendering, std140 layout
+  struct FrameUniforms {
     glm::mat4 modelMatrix;
     glm::mat4 viewMatrix;
     glm::mat4 projMatrix;
@@ -72,25 +138,181 @@ public:
     glm::vec4 colour = {1,1,1,1};
     float mass = 1; // Kg
     float radius = 1;
-    float pad2;
-    float pad3;
+    uint32_t id = 0; // Stays with the particle, wherever it ends up in the buffer
+    uint32_t simulation = 0; // Ensemble member, always 0 outside ensemble mode
+  };
+
+  /// A particle fetched by ID
+  struct ParticleLookup {
+    uint64_t step = 0; // Step the particle's state is from
+    uint32_t slot = 0; // Where it was in the particle buffer
+    Particle particle;
   };
 
+  /**
+   * Fetch a particle by ID
+   *
+   * The request goes along with the next simulation step, the future is ready once that's finished.
+   * Only the requested particles come back to the host, not the buffer. May be called from any thread
+   */
+  std::future<ParticleLookup> lookupParticle(uint32_t id);
+
+  /// Collide the particles with a static mesh (.obj or .stl), in world space. Must be set before run
+  void collisionMesh(const std::string& fileName) { mCollisionMeshFile = fileName; }
+  /**
+   * Collide the particles with a signed distance field, baked at startup. Must be set before run
+   * @param source A mesh (.obj or .stl), or "primitives" for a built in scene of simple shapes
+   * @param resolution Samples along the field's longest side
+   */
+  void collisionField(const std::string& source, uint32_t resolution = 64) { mSdfSource = source; mSdfResolution = resolution; }
+
+  /// Matches test.comp
+  struct ForceField {
+    enum class Type : uint32_t {
+      Gravity = 0,   // Constant acceleration along direction
+      Attractor = 1, // Towards position, inverse square (negative strength repels)
+      Vortex = 2,    // Spins around the direction axis (normalised), through position
+      Drag = 3,      // Against velocity
+      Wind = 4,      // Drag towards a velocity of direction
+    };
+    glm::vec4 position = {0,0,0,1};
+    glm::vec4 direction = {0,-1,0,0};
+    Type type = Type::Gravity;
+    float radius = 0.f; // Only affects particles this close to position, 0 for everywhere
+    float strength = 1.f;
+    float pad0;
+  };
+  static constexpr uint32_t maxForceFields = 1024;
+
+  /// How the simulation steps forward, matches test.comp
+  enum class Integrator : uint32_t {
+    Euler = 0,    // Semi-implicit Euler
+    Verlet = 1,   // Velocity Verlet
+    Leapfrog = 2, // Drift-kick-drift
+    RK4 = 3,      // 4th order Runge-Kutta, 4x the force evaluations
+  };
+  static const char* integratorName(Integrator i);
+  /// Force evaluations per step, which is most of a step's cost once there's a few force fields
+  static uint32_t integratorEvaluations(Integrator i);
+
+  /// Select the integrator, and the (simulated) seconds per step. Must be set before run
+  void integrator(Integrator i, float timeStep = 0.1f) { mComputeSpecConstants.mIntegrator = static_cast<uint32_t>(i); mComputeSpecConstants.mTimeStep = timeStep; }
+
+  /**
+   * Let the GPU pick each step's size, from the fastest particle after the last step
+   * Nothing should move more than courant * its radius in a step. The first step uses the
+   * integrator's time step (clamped). Must be set before run
+   */
+  void adaptiveTimeStep(float minDt = 0.001f, float maxDt = 1.f, float courant = 0.5f);
+  /// Write every step's size to a CSV file, must be set before run
+  void timeStepLog(const std::string& fileName) { mTimeStepLogFile = fileName; }
+
+  /// Settings for one simulation, matches test.comp
+  struct SimulationParams {
+    float gravityScale = 1.f; // Scales gravity fields
+    float fieldScale = 1.f; // Scales every other force field
+    float drag = 0.f; // On top of any drag fields
+    float restitution = 0.9f; // How much speed is kept bouncing off the walls
+  };
+  static constexpr uint32_t maxSimulations = 4096;
+
+  /**
+   * Run many independent simulations side by side, for parameter sweeps
+   *
+   * Every simulation starts from the same particles, and they're all stepped by the same
+   * dispatches. Each one gets its own diagnostics. Replaces the particles, must be set before run
+   */
+  void ensemble(uint32_t numSimulations, uint32_t particlesPerSimulation);
+  /// One per simulation, must be set before run
+  void simulationParameters(const std::vector<SimulationParams>& params);
+
+  /**
+   * Replace the force fields, takes effect from the next simulation step
+   * May be called from any thread, whenever. Starts out with plain gravity
+   */
+  void forceFields(const std::vector<ForceField>& fields);
+  std::vector<ForceField> forceFields();
+
+  /// Print a particle along with the diagnostics, by ID. Must be set before run
+  void trackParticle(uint32_t id) { mTrackParticle = true; mTrackedParticleId = id; }
+
 private:
+  /// The same random particles for each simulation, back to back
+  void createParticles(uint32_t numSimulations, uint32_t particlesPerSimulation);
   void initWindow();
   void initVK();
+  /// Device memory which scales with the particle count, per particle (an estimate, the driver may pad)
+  vk::DeviceSize deviceBytesPerParticle() const;
+  /// Before allocating anything per particle, report how many particles would fit
+  void checkMemoryBudget();
+  /// Seconds per step of the integrator on its own, on a temporary device (see benchmarkDevices)
+  double benchmarkStep(DeviceInstance& deviceInstance);
   void createComputeBuffers();
   void createComputeDescriptorSet();
+  void createGraphicsDescriptorSets();
+  void createCullBuffers();
+  void createSplatResources();
+  void createDiagnostics();
+  void createReorderResources();
+  void createLookupResources();
+  void createForceFieldBuffers();
+  void createTimeStepResources();
+  /// Pick up the time step a finished step chose, from its log slot
+  void readTimeStep(uint32_t slot, uint64_t step);
+  void reportTimeStep();
+  /// Copy the force fields over for the step about to run on a compute pair, if they've changed
+  void submitForceFields(uint32_t pair);
+  void createCollisionMesh();
+  void createCollisionField();
+  /// Hand pending lookups to the step about to run on a compute pair
+  void submitLookups(uint32_t pair, uint64_t step, vk::Fence fence);
+  /// Pass results back for a pair's lookups, if they were submitted with step
+  void finishLookups(uint32_t pair, uint64_t step);
+  void updateTrackedParticle();
+  /// Potential energy relative to floorHeight, from the uniform gravity in a compute pair's force fields
+  float potentialEnergy(uint32_t pair, float gravityScale, float mass, const glm::vec3& massWeightedPosition) const;
+  /// Pick up the diagnostics for a finished step, from its result slot
+  void readDiagnostics(uint32_t slot, uint64_t step);
+  void reportDiagnostics();
+  void createEnsembleDiagnostics();
+  void readEnsembleDiagnostics(uint32_t slot, uint64_t step);
+  /// Spread of the ensemble, or every simulation's numbers if all is set
+  void reportEnsemble(bool all);
 
   /// Setup for rendering
-  void buildCommandBuffer(vk::CommandBuffer& commandBuffer, const vk::Framebuffer& frameBuffer, vk::Buffer& particleVertexBuffer);
+  void buildCommandBuffer(vk::CommandBuffer commandBuffer, uint32_t imageIndex, uint32_t particleBufferIndex);
+  /// What the render graph's passes share, see buildCommandBuffer
+  struct RenderResources {
+    TaskGraph::Resource particles = 0;
+    TaskGraph::Resource drawCommands = 0; // Only when culling
+    TaskGraph::Resource visibleIndices = 0;
+    TaskGraph::Resource splatImage = 0; // Only when splatting
+  };
+  /// Add the culling passes to the render graph
+  void buildCullCommands(TaskGraph& graph, RenderResources& resources, uint32_t imageIndex, uint32_t particleBufferIndex);
+  /// Add the compute rasteriser's passes to the render graph
+  void buildSplatCommands(TaskGraph& graph, RenderResources& resources, uint32_t imageIndex, uint32_t particleBufferIndex);
+  /// Get the render command buffer for an image/particle buffer pair, recording it if needed
+  vk::CommandBuffer renderCommandBuffer(uint32_t imageIndex, uint32_t particleBufferIndex);
+  /// Force all render command buffers to be re-recorded, waits for the device to be idle
+  void invalidateRenderCommandBuffers();
 
   /// Setup for initial upload of particle buffer
   void buildComputeCommandBufferDataUpload(vk::CommandBuffer& commandBuffer, SimpleBuffer& targetBuffer);
-  /// Setup for particle simulation
-  void buildComputeCommandBuffer(vk::CommandBuffer& commandBuffer, vk::DescriptorSet& descriptorSet, vk::Buffer& particleVertexBuffer);
+  /// Setup for particle simulation, one step from the source particle buffer to target
+  /// If reorder is set the step also sorts the particles, for mReorderCommandBuffers
+  /// commandBuffer has already been begun, and may be on any thread (see buildComputeCommandBuffers)
+  void buildComputeCommandBuffer(vk::CommandBuffer commandBuffer, uint32_t source, uint32_t target, bool reorder);
+  /// Record all the step command buffers, in parallel on mThreadPool
+  void buildComputeCommandBuffers();
+  /// The command buffer to run a step with, reordering if it's time to
+  vk::CommandBuffer computeCommandBuffer(uint32_t pair, uint64_t step);
+  /// Index of the compute descriptor set/command buffer which reads source and writes target
+  uint32_t computePairIndex(uint32_t source, uint32_t target) const;
 
   void loop();
+  /// Runs on mSimThread, submits compute steps as fast as the GPU will take them
+  void simulationLoop();
   void cleanup();
   double now();
 
@@ -99,7 +321,51 @@ private:
   int mWindowWidth = 800;
   int mWindowHeight = 600;
 
-  PushConstants mPushConstants;
+  FrameUniforms mFrameUniforms;
+  std::vector<std::unique_ptr<SimpleBuffer>> mFrameUniformBuffers; // One per swapchain image
+  std::vector<FrameUniforms*> mFrameUniformsMapped;
+  vk::UniqueDescriptorPool mGraphicsDescriptorPool;
+  std::vector<vk::DescriptorSet> mGraphicsDescriptorSets; // Owned by pool, one per swapchain image
+
+  // Frustum culling, visible particles are compacted into an index buffer and drawn indirectly
+  struct CullSpecConstants {
+    uint32_t numParticles = 0;
+    uint32_t groupSizeX = 64;
+  };
+  struct CullParams {
+    float minPixelSize = 0.f; // 0 - Only cull by frustum
+    float viewportHeight = 0.f;
+  };
+  bool mCullParticles = true;
+  CullSpecConstants mCullSpecConstants;
+  CullParams mCullParams;
+  std::unique_ptr<ComputePipeline> mCullPipeline;
+  std::vector<std::unique_ptr<SimpleBuffer>> mVisibleIndexBuffers; // One per swapchain image
+  std::vector<std::unique_ptr<SimpleBuffer>> mDrawCommandBuffers; // One per swapchain image, vk::DrawIndexedIndirectCommand
+  vk::UniqueDescriptorPool mCullDescriptorPool;
+  std::vector<vk::DescriptorSet> mCullDescriptorSets; // Owned by pool, (swapchain image * num particle buffers) + particle buffer
+
+  // Compute rasteriser, particles are splatted into a storage image with atomics
+  // then a fullscreen triangle resolves that onto the swapchain image
+  struct SplatSpecConstants {
+    uint32_t numParticles = 0;
+    uint32_t groupSizeX = 64;
+    uint32_t mode = 0; // 0 - nearest, 1 - density
+  };
+  struct ResolveSpecConstants {
+    uint32_t mode = 0;
+    float densityExposure = 0.05f;
+  };
+  RenderMode mRenderMode = RenderMode::Points;
+  SplatSpecConstants mSplatSpecConstants;
+  ResolveSpecConstants mResolveSpecConstants;
+  std::unique_ptr<ComputePipeline> mSplatPipeline;
+  std::unique_ptr<GraphicsPipeline> mResolvePipeline;
+  std::vector<std::unique_ptr<SimpleImage>> mSplatImages; // One per swapchain image, R32_UINT
+  vk::UniqueDescriptorPool mSplatDescriptorPool;
+  std::vector<vk::DescriptorSet> mSplatDescriptorSets; // Owned by pool, (swapchain image * num particle buffers) + particle buffer
+  std::vector<vk::DescriptorSet> mResolveDescriptorSets; // Owned by pool, one per swapchain image
+
   float mPushConstantsScaleFactorDelta = 0.025f;
   int scaleCount = 0;
 
@@ -110,13 +376,244 @@ private:
     uint32_t mComputeGroupSizeX = 1;
     uint32_t mComputeGroupSizeY = 1;
     uint32_t mComputeGroupSizeZ = 1;
+    uint32_t mIntegrator = static_cast<uint32_t>(Integrator::Euler);
+    float mTimeStep = 0.1f;
+    uint32_t mAdaptiveTimeStep = 0;
   };
   ComputeSpecConstants mComputeSpecConstants;
+  static std::vector<vk::SpecializationMapEntry> computeSpecialisationEntries();
   std::vector<std::unique_ptr<SimpleBuffer>> mComputeDataBuffers;
   vk::UniqueDescriptorPool mComputeDescriptorPool;
-  std::vector<vk::DescriptorSet> mComputeDescriptorSets; // Owned by pool
-  vk::UniqueCommandPool mComputeCommandPool;
-  std::vector<vk::UniqueCommandBuffer> mComputeCommandBuffers;
+  std::vector<vk::DescriptorSet> mComputeDescriptorSets; // Owned by pool, one per computePairIndex
+  vk::UniqueCommandPool mComputeCommandPool; // Main thread only, for the initial upload
+  std::unique_ptr<CommandPools> mComputeCommandPools; // Per thread, for recording the steps in parallel
+  std::vector<vk::UniqueCommandBuffer> mComputeCommandBuffers; // One per computePairIndex
+
+  // Push constants for the simulation step
+  // The addresses are only read by test_bda.comp, see bufferDeviceAddress
+  struct ComputeParams {
+    uint32_t reorder = 0; // Read the source particles in sorted order
+    uint32_t pad0 = 0;
+    vk::DeviceAddress inParticles = 0;
+    vk::DeviceAddress outParticles = 0;
+    vk::DeviceAddress order = 0; // Only valid when reordering
+    vk::DeviceAddress slots = 0;
+    vk::DeviceAddress forceFields = 0;
+    vk::DeviceAddress timeStep = 0;
+    vk::DeviceAddress simulations = 0;
+  };
+  bool mBufferDeviceAddress = false; // No compute descriptor sets when set
+  bool mMemoryReport = false;
+  std::string mDevice;
+  bool mBenchmarkDevices = false;
+  static constexpr uint32_t benchmarkParticles = 1000000;
+  static constexpr uint32_t benchmarkSteps = 20;
+
+  // Particles which are close in space drift apart in the buffer as the simulation runs
+  // Every so often a step sorts them by the Morton code of their position, so neighbours
+  // end up near each other in memory again. The sort gives the order, the step itself does the gather
+  struct MortonSpecConstants {
+    uint32_t numParticles = 0;
+    uint32_t groupSizeX = 64;
+    uint32_t simulationBits = 0; // Top bits of the key, to keep ensemble members together
+  };
+  struct MortonParams {
+    glm::vec4 boundsMin = {-100, -100, -100, 0}; // Region covered by the codes, particles outside get clamped to the edge
+    glm::vec4 boundsMax = {100, 100, 100, 0};
+  };
+  uint32_t mReorderInterval = 100; // Steps, 0 to disable
+  MortonSpecConstants mMortonSpecConstants;
+  MortonParams mMortonParams;
+  std::unique_ptr<RadixSort> mReorderSort;
+  std::unique_ptr<ComputePipeline> mMortonPipeline;
+  vk::UniqueDescriptorPool mMortonDescriptorPool;
+  std::vector<vk::DescriptorSet> mMortonDescriptorSets; // Owned by pool, one per particle buffer (the source)
+  std::vector<vk::UniqueCommandBuffer> mReorderCommandBuffers; // One per computePairIndex, same as mComputeCommandBuffers plus the sort
+
+  // Particle IDs don't change, but where the particles are in the buffer does
+  // mParticleSlots maps ID -> slot, and is updated on the GPU by anything which moves particles around
+  // Lookups ride along with a simulation step, after it's written the target buffer. Each compute pair
+  // has a small host visible buffer for requests and results
+  static constexpr uint32_t maxLookups = 64; // Per step, any more wait for the next one
+  struct LookupSpecConstants {
+    uint32_t maxLookups = VulkanApp::maxLookups;
+  };
+  // Matches lookup.comp
+  struct LookupBuffer {
+    uint32_t count = 0;
+    uint32_t pad[3];
+    uint32_t ids[maxLookups];
+    uint32_t slots[maxLookups];
+    Particle particles[maxLookups];
+  };
+  struct PendingLookup {
+    uint32_t id = 0;
+    std::promise<ParticleLookup> promise;
+  };
+  struct LookupsInFlight {
+    std::vector<PendingLookup> lookups;
+    uint64_t step = 0;
+    vk::Fence fence; // Not owned, single submit only
+  };
+  LookupSpecConstants mLookupSpecConstants;
+  std::unique_ptr<SimpleBuffer> mParticleSlots;
+  std::unique_ptr<ComputePipeline> mLookupPipeline;
+  std::vector<std::unique_ptr<SimpleBuffer>> mLookupBuffers; // One per computePairIndex, host visible
+  std::vector<LookupBuffer*> mLookupBuffersMapped;
+  vk::UniqueDescriptorPool mLookupDescriptorPool;
+  std::vector<vk::DescriptorSet> mLookupDescriptorSets; // Owned by pool, one per computePairIndex
+  std::mutex mLookupMutex;
+  std::vector<PendingLookup> mPendingLookups; // Guarded by mLookupMutex
+  std::vector<LookupsInFlight> mLookupsInFlight; // One per computePairIndex, only touched by whoever submits compute
+
+  // Static mesh collider, particles are tested against it after each step
+  // The BVH is built on the host, and uploaded along with the initial particles
+  struct CollideSpecConstants {
+    uint32_t numParticles = 0;
+    uint32_t groupSizeX = 64;
+  };
+  std::string mCollisionMeshFile;
+  CollideSpecConstants mCollideSpecConstants;
+  std::unique_ptr<SimpleBuffer> mBvhNodes;
+  std::unique_ptr<SimpleBuffer> mBvhTriangles;
+  std::vector<std::unique_ptr<SimpleBuffer>> mBvhStaging; // Host visible copies, gone once uploaded
+  std::unique_ptr<ComputePipeline> mCollidePipeline;
+  vk::UniqueDescriptorPool mCollideDescriptorPool;
+  std::vector<vk::DescriptorSet> mCollideDescriptorSets; // Owned by pool, one per particle buffer (the target)
+
+  // Signed distance field collider, same idea but a constant cost per particle
+  // Baked on the host into a 3D image, also uploaded with the initial particles
+  struct SdfParams {
+    glm::vec4 boundsMin;
+    glm::vec4 boundsMax;
+  };
+  std::string mSdfSource;
+  uint32_t mSdfResolution = 64;
+  CollideSpecConstants mSdfSpecConstants;
+  SdfParams mSdfParams;
+  std::unique_ptr<SimpleImage> mSdfImage;
+  std::unique_ptr<SimpleBuffer> mSdfStaging; // Gone once uploaded
+  vk::UniqueSampler mSdfSampler;
+  std::unique_ptr<ComputePipeline> mSdfPipeline;
+  vk::UniqueDescriptorPool mSdfDescriptorPool;
+  std::vector<vk::DescriptorSet> mSdfDescriptorSets; // Owned by pool, one per particle buffer (the target)
+
+  // Force fields, edited on the host and copied into the step's buffer when it's submitted
+  // Like the lookups each compute pair has its own host visible buffer, so a step
+  // that's still running doesn't get its fields changed underneath it
+  // Matches test.comp
+  struct ForceFieldBuffer {
+    uint32_t numFields = 0;
+    uint32_t pad[3];
+    ForceField fields[maxForceFields];
+  };
+  std::mutex mForceFieldMutex;
+  std::vector<ForceField> mForceFields; // Guarded by mForceFieldMutex
+  std::atomic<uint64_t> mForceFieldVersion{1}; // Bumped on every change, under mForceFieldMutex
+  std::vector<std::unique_ptr<SimpleBuffer>> mForceFieldBuffers; // One per computePairIndex, host visible
+  std::vector<ForceFieldBuffer*> mForceFieldBuffersMapped;
+  std::vector<uint64_t> mForceFieldBufferVersions; // What's in each buffer, only touched by whoever submits compute
+  std::vector<glm::vec3> mForceFieldBufferGravity; // Uniform gravity in each buffer, for the diagnostics. Same rules as the versions
+
+  // Adaptive time step, chosen on the GPU after each step from a reduction over the particles
+  // The integrator reads dt from mTimeStepBuffer, so the host only ever sees the log
+  // Matches timestep.comp
+  struct TimeStepState {
+    float dt = 0.f; // For the next step
+    float time = 0.f; // Simulated seconds
+    float maxSpeed = 0.f;
+    float maxAcceleration = 0.f;
+  };
+  struct TimeStepParams {
+    float courant = 0.5f;
+    float minDt = 0.001f;
+    float maxDt = 1.f;
+    float maxGrowth = 1.1f;
+    uint32_t slot = 0; // Result/log slot, the compute pair
+  };
+  TimeStepParams mTimeStepParams;
+  std::unique_ptr<SimpleBuffer> mTimeStepBuffer; // Always there, test.comp binds it either way
+  std::unique_ptr<ParallelReduction> mTimeStepReduction;
+  std::unique_ptr<ComputePipeline> mTimeStepPipeline;
+  std::unique_ptr<SimpleBuffer> mTimeStepLogBuffer; // Host visible, one TimeStepState per computePairIndex
+  TimeStepState* mTimeStepLogMapped = nullptr;
+  vk::UniqueDescriptorPool mTimeStepDescriptorPool;
+  vk::DescriptorSet mTimeStepDescriptorSet; // Owned by pool
+  std::string mTimeStepLogFile;
+  std::ofstream mTimeStepLog; // Only written by whoever submits compute
+  struct TimeStepStats {
+    uint64_t step = 0;
+    TimeStepState latest;
+    float minDt = 0.f; // Since the last report
+    float maxDt = 0.f;
+  };
+  TimeStepStats mTimeStepStats; // Guarded by mDiagnosticsMutex
+
+  bool mTrackParticle = false;
+  uint32_t mTrackedParticleId = 0;
+  std::future<ParticleLookup> mTrackedParticleLookup;
+  ParticleLookup mTrackedParticle; // Latest, main thread only
+
+  // Totals for the whole system, reduced on the GPU after each step
+  // Only the result comes back to the host, one slot per compute command buffer
+  // Potential energy is measured from the floor (the bottom wall in test.comp)
+  static constexpr float floorHeight = -100.f;
+  struct Diagnostics {
+    uint64_t step = 0;
+    float kineticEnergy = 0.f;
+    float potentialEnergy = 0.f;
+    float mass = 0.f;
+    uint32_t numParticles = 0;
+    glm::vec3 momentum = {0,0,0};
+    glm::vec3 centreOfMass = {0,0,0};
+    glm::vec3 boundsMin = {0,0,0};
+    glm::vec3 boundsMax = {0,0,0};
+  };
+  bool mDiagnosticsEnabled = false;
+  double mDiagnosticsReportInterval = 1.0; // Seconds, 0 to keep quiet
+  double mLastDiagnosticsReport = 0.;
+  std::unique_ptr<ParallelReduction> mDiagnosticsReduction;
+  std::mutex mDiagnosticsMutex;
+  Diagnostics mDiagnostics; // Latest, guarded by mDiagnosticsMutex
+
+  // Ensemble mode, simulation i's particles are at [i * mParticlesPerSimulation, (i + 1) * mParticlesPerSimulation)
+  // Outside ensemble mode that's one simulation, with everything in it
+  struct EnsembleSpecConstants {
+    uint32_t groupSize = 128;
+    uint32_t particlesPerMember = 0;
+    uint32_t numMembers = 1;
+  };
+  uint32_t mNumSimulations = 1;
+  uint32_t mParticlesPerSimulation = 0;
+  std::vector<SimulationParams> mSimulationParams;
+  std::unique_ptr<SimpleBuffer> mSimulationBuffer;
+  EnsembleSpecConstants mEnsembleSpecConstants;
+  std::unique_ptr<ComputePipeline> mEnsemblePipeline; // Only with more than one simulation
+  std::unique_ptr<SimpleBuffer> mEnsembleResults; // Host visible, a record per simulation per computePairIndex
+  const float* mEnsembleResultsMapped = nullptr;
+  vk::UniqueDescriptorPool mEnsembleDescriptorPool;
+  std::vector<vk::DescriptorSet> mEnsembleDescriptorSets; // Owned by pool, one per particle buffer
+  std::vector<Diagnostics> mEnsembleDiagnostics; // Latest, guarded by mDiagnosticsMutex
+  std::vector<uint64_t> mFrameSteps; // Single submit only, the step each frame in flight ran
+
+  // Orders compute steps against rendering
+  std::unique_ptr<TimelineScheduler> mScheduler;
+  // Compute may run up to mComputeLead steps ahead of what's been handed to rendering
+  uint32_t mComputeLead = 2;
+
+  // The simulation runs on its own thread, handing finished particle buffers over to rendering
+  // mComputeLead + 2 of them, the steps in flight plus the one waiting in the handoff and the one on screen
+  // Only the simulation thread writes a buffer's step, before publishing it
+  uint32_t mNumParticleBuffers = 0;
+  TripleBuffer mParticleHandoff;
+  std::vector<uint64_t> mParticleBufferSteps;
+  // If compute and rendering share a queue there's no point in a separate thread, or semaphores
+  // Each frame runs one simulation step then renders it, in a single submission
+  bool mSingleSubmit = false;
+  uint64_t mSingleSubmitStep = 0;
+  std::thread mSimThread;
+  std::atomic<bool> mSimRunning{false};
+  std::exception_ptr mSimError;
 
   // Our classyboys to obfuscate the verbosity of vulkan somewhat
   // Remember deletion order matters
@@ -126,19 +623,40 @@ private:
   std::unique_ptr<GraphicsPipeline> mGraphicsPipeline;
 
   std::unique_ptr<ComputePipeline> mComputePipeline;
+  // Workgroup size variants of mComputePipeline
+  std::unique_ptr<ComputePipelineVariants> mComputeVariants;
+  std::vector<uint32_t> mComputeVariantGroupSizes;
+  uint32_t mComputeVariant = 0;
+
+  // General purpose workers, for pipeline compilation and such
+  std::unique_ptr<ThreadPool> mThreadPool;
+
+  // GPU timings, one query slot per frame in flight
+  bool mProfileGPU = false;
+  std::unique_ptr<QueryProfiler> mProfiler;
+  uint32_t mProfileScopeUpload = 0;
+  uint32_t mProfileScopeCompute = 0;
+  uint32_t mProfileScopeRender = 0;
+  uint32_t mProfileScopeCull = 0;
+  uint32_t mProfileScopeSplat = 0;
+  uint32_t mProfileScopeReorder = 0;
+  uint32_t mProfileScopeCollide = 0;
+  uint32_t mProfileScopeSdf = 0;
+  uint32_t mProfileScopeTimeStep = 0;
 
   DeviceInstance::QueueRef* mGraphicsQueue = nullptr;
   DeviceInstance::QueueRef* mComputeQueue = nullptr;
 
   vk::UniqueCommandPool mCommandPool;
+  // Indexed by (swapchain image * num particle buffers) + particle buffer
   std::vector<vk::UniqueCommandBuffer> mCommandBuffers;
+  std::vector<bool> mCommandBuffersValid;
 
   uint32_t mMaxFramesInFlight = 3u;
   std::vector<vk::UniqueSemaphore> mImageAvailableSemaphores;
   std::vector<vk::UniqueSemaphore> mRenderFinishedSemaphores;
   std::vector<vk::UniqueFence> mFrameInFlightFences;
-
-  vk::PushConstantRange mPushContantsRange;
+  std::vector<vk::Fence> mImagesInFlight; // Not owned, the frame fence which last used each image
 
   std::vector<Particle> mParticles;
   double mLastTime = 0.;
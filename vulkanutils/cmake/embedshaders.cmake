@@ -0,0 +1,62 @@
+# embed_shaders( <target> <header> <shader>... )
+#
+# Compiles glsl shaders to SPIR-V at build time and links them into <target>
+# Each shader becomes an EmbeddedShader (util/embeddedshader.h) named after
+# the file, e.g. test.comp -> shader_test_comp
+#
+# <header> is generated in the current binary dir and declares all of the shaders,
+# it's added to the target's include path
+#
+# Shaders may #include (GL_GOOGLE_include_directive) .glsl files next to them,
+# or vulkanutils' own helpers in util/shaders. Shaders are rebuilt if any of those change
+#
+# Requires glslCompiler to be set to the path of glslangValidator
+
+set( VULKANUTILS_CMAKE_DIR "${CMAKE_CURRENT_LIST_DIR}" )
+set( VULKANUTILS_SHADER_DIR "${CMAKE_CURRENT_LIST_DIR}/../util/shaders" )
+# Subgroup operations need SPIR-V 1.3, so at least vulkan1.1
+set( VULKANUTILS_SHADER_TARGET_ENV "vulkan1.1" CACHE STRING "glslangValidator --target-env for embedded shaders" )
+
+function( embed_shaders target header )
+  set( outDir "${CMAKE_CURRENT_BINARY_DIR}/shaders" )
+  file( MAKE_DIRECTORY "${outDir}" )
+
+  set( declarations "" )
+  foreach( shader ${ARGN} )
+    get_filename_component( shaderPath "${shader}" ABSOLUTE )
+    get_filename_component( shaderDir "${shaderPath}" DIRECTORY )
+    file( GLOB shaderIncludes "${shaderDir}/*.glsl" "${VULKANUTILS_SHADER_DIR}/*.glsl" )
+    get_filename_component( shaderFile "${shader}" NAME )
+    string( MAKE_C_IDENTIFIER "shader_${shaderFile}" symbol )
+    set( spv "${outDir}/${shaderFile}.spv" )
+    set( cpp "${outDir}/${shaderFile}.cpp" )
+
+    add_custom_command(
+      OUTPUT "${cpp}"
+      COMMAND ${glslCompiler} -V --target-env ${VULKANUTILS_SHADER_TARGET_ENV} "-I${VULKANUTILS_SHADER_DIR}" "${shaderPath}" -o "${spv}"
+      COMMAND ${CMAKE_COMMAND} -DSPIRV_FILE=${spv} -DOUTPUT_FILE=${cpp} -DSYMBOL_NAME=${symbol} -DSHADER_NAME=${shaderFile} -P "${VULKANUTILS_CMAKE_DIR}/spirvtocpp.cmake"
+      DEPENDS "${shaderPath}" ${shaderIncludes} "${VULKANUTILS_CMAKE_DIR}/spirvtocpp.cmake"
+      COMMENT "Compiling shader ${shaderFile}"
+      VERBATIM )
+
+    target_sources( ${target} PRIVATE "${shaderPath}" "${cpp}" )
+    string( APPEND declarations "extern const EmbeddedShader ${symbol};\n" )
+  endforeach()
+
+  string( MAKE_C_IDENTIFIER "${header}" guard )
+  string( TOUPPER "${guard}" guard )
+  file( WRITE "${outDir}/${header}.tmp"
+    "// Generated by embed_shaders, do not edit\n"
+    "#ifndef ${guard}\n"
+    "#define ${guard}\n"
+    "\n"
+    "#include \"util/embeddedshader.h\"\n"
+    "\n"
+    "${declarations}"
+    "\n"
+    "#endif\n" )
+  configure_file( "${outDir}/${header}.tmp" "${outDir}/${header}" COPYONLY )
+  file( REMOVE "${outDir}/${header}.tmp" )
+
+  target_include_directories( ${target} PUBLIC "${outDir}" )
+endfunction()
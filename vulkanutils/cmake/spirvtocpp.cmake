@@ -0,0 +1,39 @@
+# Converts a SPIR-V binary into a C++ source file containing an EmbeddedShader
+# Run in script mode by embed_shaders, see embedshaders.cmake
+#
+# Inputs:
+# SPIRV_FILE  - The compiled shader
+# OUTPUT_FILE - The .cpp file to write
+# SYMBOL_NAME - Name of the EmbeddedShader variable
+# SHADER_NAME - Name of the shader, for debugging
+
+file( READ "${SPIRV_FILE}" spirvHex HEX )
+string( LENGTH "${spirvHex}" spirvHexLength )
+math( EXPR spirvPartialWord "${spirvHexLength} % 8" )
+if( spirvHexLength EQUAL 0 OR NOT spirvPartialWord EQUAL 0 )
+  message( FATAL_ERROR "Invalid SPIR-V, size must be a multiple of 4 bytes: ${SPIRV_FILE}" )
+endif()
+
+# SPIR-V is a stream of little endian words
+string( REGEX REPLACE "([0-9a-f][0-9a-f])([0-9a-f][0-9a-f])([0-9a-f][0-9a-f])([0-9a-f][0-9a-f])" "  0x\\4\\3\\2\\1u,\n" spirvWords "${spirvHex}" )
+
+# Shader modules are cached by this, so pipelines sharing a shader share a module
+file( SHA256 "${SPIRV_FILE}" spirvHash )
+string( SUBSTRING "${spirvHash}" 0 16 spirvHash )
+
+file( WRITE "${OUTPUT_FILE}.tmp"
+"// Generated from ${SHADER_NAME} by spirvtocpp.cmake, do not edit\n"
+"#include \"util/embeddedshader.h\"\n"
+"\n"
+"namespace {\n"
+"  alignas(4) const uint32_t spirv[] = {\n"
+"${spirvWords}"
+"  };\n"
+"}\n"
+"\n"
+"extern const EmbeddedShader ${SYMBOL_NAME};\n"
+"const EmbeddedShader ${SYMBOL_NAME} = { \"${SHADER_NAME}\", spirv, sizeof(spirv), 0x${spirvHash}ull };\n"
+)
+# Only touch the output if it changed, saves rebuilding when a comment in the glsl changes
+configure_file( "${OUTPUT_FILE}.tmp" "${OUTPUT_FILE}" COPYONLY )
+file( REMOVE "${OUTPUT_FILE}.tmp" )
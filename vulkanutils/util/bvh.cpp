@@ -0,0 +1,285 @@
+/*
+ * Provided under the BSD 3-Clause License, see LICENSE.
+ *
+ * Copyright (c) 2019, Gareth Francis
+ * All rights reserved.
+ */
+
+#include "bvh.h"
+#include "mesh.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+
+namespace {
+  constexpr uint32_t numBins = 16;
+  // Relative cost of testing a triangle, against stepping through a node
+  constexpr float triangleCost = 1.f;
+  constexpr float nodeCost = 1.f;
+
+  float surfaceArea(const glm::vec3& min, const glm::vec3& max) {
+    auto d = glm::max(max - min, glm::vec3(0.f));
+    return 2.f * ((d.x * d.y) + (d.y * d.z) + (d.z * d.x));
+  }
+
+  // Same as bvhClosestPointOnTriangle
+  glm::vec3 closestPointOnTriangle(const glm::vec3& p, const glm::vec3& a, const glm::vec3& b, const glm::vec3& c) {
+    auto ab = b - a;
+    auto ac = c - a;
+    auto ap = p - a;
+    auto d1 = glm::dot(ab, ap);
+    auto d2 = glm::dot(ac, ap);
+    if( d1 <= 0.f && d2 <= 0.f ) return a;
+
+    auto bp = p - b;
+    auto d3 = glm::dot(ab, bp);
+    auto d4 = glm::dot(ac, bp);
+    if( d3 >= 0.f && d4 <= d3 ) return b;
+
+    auto vc = (d1 * d4) - (d3 * d2);
+    if( vc <= 0.f && d1 >= 0.f && d3 <= 0.f ) return a + (ab * (d1 / (d1 - d3)));
+
+    auto cp = p - c;
+    auto d5 = glm::dot(ab, cp);
+    auto d6 = glm::dot(ac, cp);
+    if( d6 >= 0.f && d5 <= d6 ) return c;
+
+    auto vb = (d5 * d2) - (d1 * d6);
+    if( vb <= 0.f && d2 >= 0.f && d6 <= 0.f ) return a + (ac * (d2 / (d2 - d6)));
+
+    auto va = (d3 * d6) - (d5 * d4);
+    if( va <= 0.f && (d4 - d3) >= 0.f && (d5 - d6) >= 0.f ) return b + ((c - b) * ((d4 - d3) / ((d4 - d3) + (d5 - d6))));
+
+    auto denom = 1.f / (va + vb + vc);
+    return a + (ab * (vb * denom)) + (ac * (vc * denom));
+  }
+
+  // Moller-Trumbore, only hits in front of the origin count
+  bool rayHitsTriangle(const glm::vec3& origin, const glm::vec3& dir, const glm::vec3& a, const glm::vec3& b, const glm::vec3& c) {
+    auto ab = b - a;
+    auto ac = c - a;
+    auto pv = glm::cross(dir, ac);
+    auto det = glm::dot(ab, pv);
+    if( std::abs(det) < 1e-12f ) return false;
+    auto invDet = 1.f / det;
+    auto tv = origin - a;
+    auto u = glm::dot(tv, pv) * invDet;
+    if( u < 0.f || u > 1.f ) return false;
+    auto qv = glm::cross(tv, ab);
+    auto v = glm::dot(dir, qv) * invDet;
+    if( v < 0.f || u + v > 1.f ) return false;
+    return glm::dot(ac, qv) * invDet > 0.f;
+  }
+}
+
+Bvh::Bvh(const Mesh& mesh, uint32_t maxLeafTriangles)
+  : mMaxLeafTriangles(maxLeafTriangles) {
+  auto numTriangles = mesh.numTriangles();
+  if( numTriangles == 0 ) throw std::runtime_error("Bvh: Mesh has no triangles");
+  if( numTriangles >= maxTriangles ) throw std::runtime_error("Bvh: Too many triangles");
+  if( mMaxLeafTriangles == 0 || mMaxLeafTriangles > maxLeafSize ) throw std::runtime_error("Bvh: Leaf size must be 1 - " + std::to_string(maxLeafSize));
+
+  auto& vertices = mesh.vertices();
+  auto& indices = mesh.indices();
+  std::vector<BuildTriangle> tris(numTriangles);
+  for( auto t = 0u; t < numTriangles; ++t ) {
+    auto& a = vertices[indices[(t * 3) + 0]];
+    auto& b = vertices[indices[(t * 3) + 1]];
+    auto& c = vertices[indices[(t * 3) + 2]];
+    tris[t].min = glm::min(a, glm::min(b, c));
+    tris[t].max = glm::max(a, glm::max(b, c));
+    tris[t].centroid = (a + b + c) / 3.f;
+    tris[t].index = t;
+  }
+
+  // A binary tree with n leaves has 2n - 1 nodes, worst case is a leaf per triangle
+  mNodes.reserve((2 * numTriangles) - 1);
+  build(tris, 0, numTriangles, 1);
+
+  // The build shuffled the triangles, copy them out in that order
+  mTriangles.resize(numTriangles);
+  for( auto t = 0u; t < numTriangles; ++t ) {
+    auto src = tris[t].index;
+    mTriangles[t].v0 = glm::vec4(vertices[indices[(src * 3) + 0]], 1.f);
+    mTriangles[t].v1 = glm::vec4(vertices[indices[(src * 3) + 1]], 1.f);
+    mTriangles[t].v2 = glm::vec4(vertices[indices[(src * 3) + 2]], 1.f);
+  }
+  mNodes.shrink_to_fit();
+}
+
+void Bvh::build(std::vector<BuildTriangle>& tris, uint32_t begin, uint32_t end, uint32_t depth) {
+  auto nodeIndex = static_cast<uint32_t>(mNodes.size());
+  mNodes.emplace_back();
+  mDepth = std::max(mDepth, depth);
+
+  // Node bounds, and the bounds of the centroids to bin over
+  glm::vec3 min(std::numeric_limits<float>::max());
+  glm::vec3 max(-std::numeric_limits<float>::max());
+  glm::vec3 cmin = min;
+  glm::vec3 cmax = max;
+  for( auto i = begin; i < end; ++i ) {
+    min = glm::min(min, tris[i].min);
+    max = glm::max(max, tris[i].max);
+    cmin = glm::min(cmin, tris[i].centroid);
+    cmax = glm::max(cmax, tris[i].centroid);
+  }
+  mNodes[nodeIndex].min = min;
+  mNodes[nodeIndex].max = max;
+
+  auto count = end - begin;
+  auto makeLeaf = [&]() {
+    mNodes[nodeIndex].leaf = (count << leafCountShift) | begin;
+    mNodes[nodeIndex].miss = nodeIndex + 1;
+  };
+  if( count <= 1 ) {
+    makeLeaf();
+    return;
+  }
+
+  // Find the best split along any axis, by binning the centroids
+  struct Bin {
+    glm::vec3 min = glm::vec3(std::numeric_limits<float>::max());
+    glm::vec3 max = glm::vec3(-std::numeric_limits<float>::max());
+    uint32_t count = 0;
+  };
+  auto bestCost = std::numeric_limits<float>::max();
+  auto bestAxis = -1;
+  auto bestSplit = 0u;
+  auto extent = cmax - cmin;
+  for( auto axis = 0; axis < 3; ++axis ) {
+    if( extent[axis] <= 0.f ) continue;
+    std::array<Bin, numBins> bins;
+    auto scale = numBins / extent[axis];
+    for( auto i = begin; i < end; ++i ) {
+      auto b = std::min(numBins - 1, static_cast<uint32_t>((tris[i].centroid[axis] - cmin[axis]) * scale));
+      bins[b].min = glm::min(bins[b].min, tris[i].min);
+      bins[b].max = glm::max(bins[b].max, tris[i].max);
+      bins[b].count++;
+    }
+
+    // Sweep from the right to get the area/count of everything right of each split
+    std::array<float, numBins> rightArea;
+    std::array<uint32_t, numBins> rightCount;
+    Bin right;
+    for( auto b = numBins - 1; b > 0; --b ) {
+      right.min = glm::min(right.min, bins[b].min);
+      right.max = glm::max(right.max, bins[b].max);
+      right.count += bins[b].count;
+      rightArea[b] = surfaceArea(right.min, right.max);
+      rightCount[b] = right.count;
+    }
+    // Then from the left, split s puts bins < s on the left
+    Bin left;
+    for( auto s = 1u; s < numBins; ++s ) {
+      left.min = glm::min(left.min, bins[s - 1].min);
+      left.max = glm::max(left.max, bins[s - 1].max);
+      left.count += bins[s - 1].count;
+      if( left.count == 0 || rightCount[s] == 0 ) continue;
+      auto cost = (surfaceArea(left.min, left.max) * left.count) + (rightArea[s] * rightCount[s]);
+      if( cost < bestCost ) {
+        bestCost = cost;
+        bestAxis = axis;
+        bestSplit = s;
+      }
+    }
+  }
+
+  // Relative to the node's area, which cancels out of the split costs
+  auto leafCost = triangleCost * count;
+  auto area = surfaceArea(min, max);
+  auto splitCost = area > 0.f ? nodeCost + (triangleCost * bestCost / area) : leafCost;
+  if( count <= mMaxLeafTriangles && splitCost >= leafCost ) {
+    makeLeaf();
+    return;
+  }
+
+  uint32_t mid = 0;
+  if( bestAxis >= 0 ) {
+    auto scale = numBins / extent[bestAxis];
+    auto it = std::partition(tris.begin() + begin, tris.begin() + end, [&](const BuildTriangle& t) {
+      return std::min(numBins - 1, static_cast<uint32_t>((t.centroid[bestAxis] - cmin[bestAxis]) * scale)) < bestSplit;
+    });
+    mid = static_cast<uint32_t>(it - tris.begin());
+  }
+  // All the centroids are in the same place, no good split. Halve it so the leaves stay small enough
+  if( mid <= begin || mid >= end ) mid = begin + (count / 2);
+
+  build(tris, begin, mid, depth + 1);
+  build(tris, mid, end, depth + 1);
+
+  // Depth-first, so skipping this node means going to whatever comes after its subtree
+  mNodes[nodeIndex].miss = static_cast<uint32_t>(mNodes.size());
+}
+
+bool Bvh::closestPoint(const glm::vec3& p, float maxDistance, glm::vec3& closest, uint32_t& triangle) const {
+  auto best = maxDistance * maxDistance;
+  auto found = false;
+  auto numNodes = static_cast<uint32_t>(mNodes.size());
+  for( auto i = 0u; i < numNodes; ) {
+    auto& node = mNodes[i];
+    auto d = glm::clamp(p, node.min, node.max) - p;
+    if( glm::dot(d, d) > best ) {
+      i = node.miss;
+      continue;
+    }
+
+    auto count = node.leaf >> leafCountShift;
+    if( count == 0 ) {
+      ++i;
+      continue;
+    }
+
+    auto first = node.leaf & (maxTriangles - 1);
+    for( auto t = first; t < first + count; ++t ) {
+      auto& tri = mTriangles[t];
+      auto c = closestPointOnTriangle(p, glm::vec3(tri.v0), glm::vec3(tri.v1), glm::vec3(tri.v2));
+      auto cp = c - p;
+      auto dist = glm::dot(cp, cp);
+      if( dist < best ) {
+        best = dist;
+        closest = c;
+        triangle = t;
+        found = true;
+      }
+    }
+    i = node.miss;
+  }
+  return found;
+}
+
+uint32_t Bvh::countCrossings(const glm::vec3& origin, const glm::vec3& dir) const {
+  // Slab test, infinities from zero direction components work out fine
+  auto invDir = 1.f / dir;
+  auto crossings = 0u;
+  auto numNodes = static_cast<uint32_t>(mNodes.size());
+  for( auto i = 0u; i < numNodes; ) {
+    auto& node = mNodes[i];
+    auto t0 = (node.min - origin) * invDir;
+    auto t1 = (node.max - origin) * invDir;
+    auto tmin = glm::min(t0, t1);
+    auto tmax = glm::max(t0, t1);
+    auto enter = std::max(std::max(tmin.x, tmin.y), tmin.z);
+    auto exit = std::min(std::min(tmax.x, tmax.y), tmax.z);
+    if( exit < std::max(enter, 0.f) ) {
+      i = node.miss;
+      continue;
+    }
+
+    auto count = node.leaf >> leafCountShift;
+    if( count == 0 ) {
+      ++i;
+      continue;
+    }
+
+    auto first = node.leaf & (maxTriangles - 1);
+    for( auto t = first; t < first + count; ++t ) {
+      auto& tri = mTriangles[t];
+      if( rayHitsTriangle(origin, dir, glm::vec3(tri.v0), glm::vec3(tri.v1), glm::vec3(tri.v2)) ) ++crossings;
+    }
+    i = node.miss;
+  }
+  return crossings;
+}
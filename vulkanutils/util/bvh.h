@@ -0,0 +1,86 @@
+/*
+ * Provided under the BSD 3-Clause License, see LICENSE.
+ *
+ * Copyright (c) 2019, Gareth Francis
+ * All rights reserved.
+ */
+
+#ifndef BVH_H
+#define BVH_H
+
+#include "glm/glm.hpp"
+
+#include <cstdint>
+#include <vector>
+
+class Mesh;
+
+/**
+ * Bounding volume hierarchy over a triangle mesh, built on the host
+ *
+ * The tree is flattened in depth-first order, so a node's first child is always the next node.
+ * Rather than child pointers each node has a miss index, the node to go to when its box
+ * is missed (or it's a leaf that's been done with). That's the next node after its subtree,
+ * so traversal needs no stack: go to i + 1 on a hit, miss on a miss, until past the end.
+ * See shaders/bvh.glsl for the GPU side.
+ *
+ * Triangles are copied out in leaf order, so a leaf's triangles are next to each other.
+ * The build is a binned surface area heuristic, so queries stay logarithmic in the triangle count.
+ */
+class Bvh
+{
+public:
+  /// Matches BvhNode in bvh.glsl, 32 bytes
+  struct Node {
+    glm::vec3 min;
+    uint32_t miss = 0;
+    glm::vec3 max;
+    uint32_t leaf = 0; // Triangle count << leafCountShift | first triangle, 0 for interior nodes
+  };
+  /// Matches BvhTriangle in bvh.glsl
+  struct Triangle {
+    glm::vec4 v0;
+    glm::vec4 v1;
+    glm::vec4 v2;
+  };
+
+  static constexpr uint32_t leafCountShift = 28;
+  static constexpr uint32_t maxLeafSize = (1u << (32 - leafCountShift)) - 1;
+  static constexpr uint32_t maxTriangles = 1u << leafCountShift;
+
+  Bvh() = delete;
+  /// @param maxLeafTriangles Leaves have at most this many triangles, up to maxLeafSize
+  Bvh(const Mesh& mesh, uint32_t maxLeafTriangles = 4);
+  ~Bvh() {}
+
+  const std::vector<Node>& nodes() const { return mNodes; }
+  const std::vector<Triangle>& triangles() const { return mTriangles; }
+  /// Deepest leaf, the root is depth 1
+  uint32_t depth() const { return mDepth; }
+
+  /**
+   * Closest point on the mesh to p, within maxDistance
+   * Same as bvhClosestPoint in bvh.glsl, for when the host needs it
+   * @return false if there's nothing that close
+   */
+  bool closestPoint(const glm::vec3& p, float maxDistance, glm::vec3& closest, uint32_t& triangle) const;
+  /// Number of triangles a ray from origin along dir passes through
+  uint32_t countCrossings(const glm::vec3& origin, const glm::vec3& dir) const;
+
+private:
+  struct BuildTriangle {
+    glm::vec3 min;
+    glm::vec3 max;
+    glm::vec3 centroid;
+    uint32_t index = 0;
+  };
+
+  void build(std::vector<BuildTriangle>& tris, uint32_t begin, uint32_t end, uint32_t depth);
+
+  uint32_t mMaxLeafTriangles = 4;
+  uint32_t mDepth = 0;
+  std::vector<Node> mNodes;
+  std::vector<Triangle> mTriangles;
+};
+
+#endif
@@ -0,0 +1,103 @@
+/*
+ * Provided under the BSD 3-Clause License, see LICENSE.
+ *
+ * Copyright (c) 2019, Gareth Francis
+ * All rights reserved.
+ */
+
+#include "commandpools.h"
+#include "threadpool.h"
+
+#include <algorithm>
+#include <exception>
+#include <future>
+#include <stdexcept>
+
+CommandPools::CommandPools(DeviceInstance& deviceInstance, DeviceInstance::QueueRef& queue, vk::CommandPoolCreateFlags flags)
+  : mDeviceInstance(deviceInstance)
+  , mQueue(queue)
+  , mFlags(flags)
+{}
+
+CommandPools::~CommandPools() {}
+
+vk::CommandPool CommandPools::pool() {
+  std::lock_guard<std::mutex> lock(mMutex);
+  auto& pool = mPools[std::this_thread::get_id()];
+  if( !pool ) pool = mDeviceInstance.createCommandPool(mFlags, mQueue);
+  return pool.get();
+}
+
+std::vector<vk::UniqueCommandBuffer> CommandPools::allocate(uint32_t count, vk::CommandBufferLevel level) {
+  auto info = vk::CommandBufferAllocateInfo()
+      .setCommandPool(pool())
+      .setCommandBufferCount(count)
+      .setLevel(level);
+  return mDeviceInstance.device().allocateCommandBuffersUnique(info);
+}
+
+std::vector<vk::UniqueCommandBuffer> CommandPools::record(ThreadPool* threadPool, uint32_t count, vk::CommandBufferLevel level, RecordFunc func,
+                                                          vk::CommandBufferUsageFlags usage,
+                                                          const vk::CommandBufferInheritanceInfo* inheritance) {
+  if( level == vk::CommandBufferLevel::eSecondary && !inheritance ) throw std::runtime_error("CommandPools::record: Secondary command buffers need inheritance info");
+  if( inheritance && inheritance->renderPass ) usage |= vk::CommandBufferUsageFlagBits::eRenderPassContinue;
+
+  auto beginInfo = vk::CommandBufferBeginInfo()
+      .setFlags(usage)
+      .setPInheritanceInfo(level == vk::CommandBufferLevel::eSecondary ? inheritance : nullptr);
+
+  std::vector<vk::UniqueCommandBuffer> commandBuffers(count);
+
+  // A contiguous range per task, so each worker only allocates once
+  // Each task writes to its own part of commandBuffers, no locking needed
+  auto recordRange = [&](uint32_t begin, uint32_t end) {
+    auto allocated = allocate(end - begin, level);
+    for( auto i = begin; i < end; ++i ) {
+      auto& commandBuffer = allocated[i - begin];
+      commandBuffer->begin(beginInfo);
+      func(commandBuffer.get(), i);
+      commandBuffer->end();
+      commandBuffers[i] = std::move(commandBuffer);
+    }
+  };
+
+  if( !threadPool || threadPool->size() < 2 || count < 2 ) {
+    if( count ) recordRange(0, count);
+    return commandBuffers;
+  }
+
+  auto numTasks = std::min(count, threadPool->size());
+  auto perTask = (count + numTasks - 1) / numTasks;
+  std::vector<std::future<void>> results;
+  for( auto begin = 0u; begin < count; begin += perTask ) {
+    auto end = std::min(count, begin + perTask);
+    results.emplace_back(threadPool->run([&recordRange, begin, end]() { recordRange(begin, end); }));
+  }
+
+  // Everything has to finish before leaving, the tasks reference our locals
+  std::exception_ptr error;
+  for( auto& r : results ) {
+    try {
+      r.get();
+    } catch( ... ) {
+      if( !error ) error = std::current_exception();
+    }
+  }
+  if( error ) std::rethrow_exception(error);
+  return commandBuffers;
+}
+
+std::vector<vk::UniqueCommandBuffer> CommandPools::recordSecondary(ThreadPool* threadPool, uint32_t count, RecordFunc func,
+                                                                   vk::RenderPass renderPass, uint32_t subpass, vk::Framebuffer framebuffer,
+                                                                   vk::CommandBufferUsageFlags usage) {
+  auto inheritance = vk::CommandBufferInheritanceInfo()
+      .setRenderPass(renderPass)
+      .setSubpass(subpass)
+      .setFramebuffer(framebuffer);
+  return record(threadPool, count, vk::CommandBufferLevel::eSecondary, func, usage, &inheritance);
+}
+
+uint32_t CommandPools::numPools() {
+  std::lock_guard<std::mutex> lock(mMutex);
+  return static_cast<uint32_t>(mPools.size());
+}
@@ -0,0 +1,82 @@
+/*
+ * Provided under the BSD 3-Clause License, see LICENSE.
+ *
+ * Copyright (c) 2019, Gareth Francis
+ * All rights reserved.
+ */
+
+#ifndef COMMANDPOOLS_H
+#define COMMANDPOOLS_H
+
+#include <vulkan/vulkan.hpp>
+
+#include "deviceinstance.h"
+
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class ThreadPool;
+
+/**
+ * A command pool per thread, for recording command buffers in parallel
+ *
+ * A command pool (and anything recording into buffers from it) can only be used by one thread
+ * at a time, so rather than locking a single pool each thread gets its own, made the first time
+ * that thread asks for one. After that the only lock is a quick lookup.
+ *
+ * record() is the easy way in - it hands out the buffers to a ThreadPool, and each one is
+ * allocated and recorded on the worker which gets it. Secondary buffers recorded like this
+ * can then be run from a single primary with vkCmdExecuteCommands.
+ *
+ * Rules:
+ * - Only re-record or free a command buffer when nothing else is recording from its pool.
+ *   In practice: record in parallel, then wait, then everything else from one thread
+ * - Free all the command buffers before destroying this
+ */
+class CommandPools
+{
+public:
+  /// Called for each buffer, with its index, between begin and end
+  using RecordFunc = std::function<void(vk::CommandBuffer, uint32_t)>;
+
+  CommandPools() = delete;
+  CommandPools(const CommandPools&) = delete;
+  CommandPools(DeviceInstance& deviceInstance, DeviceInstance::QueueRef& queue, vk::CommandPoolCreateFlags flags = vk::CommandPoolCreateFlagBits::eResetCommandBuffer);
+  ~CommandPools();
+
+  /// The calling thread's pool, made if needed. Only use it from the calling thread
+  vk::CommandPool pool();
+  /// Allocate from the calling thread's pool
+  std::vector<vk::UniqueCommandBuffer> allocate(uint32_t count, vk::CommandBufferLevel level = vk::CommandBufferLevel::ePrimary);
+
+  /**
+   * Record count command buffers, in parallel if there's a threadPool
+   * Returns once they're all recorded, in index order. If a func throws the first exception is passed on.
+   * @param usage Begin flags, eRenderPassContinue is added for secondaries inheriting a render pass
+   * @param inheritance Required for secondaries
+   */
+  std::vector<vk::UniqueCommandBuffer> record(ThreadPool* threadPool, uint32_t count, vk::CommandBufferLevel level, RecordFunc func,
+                                              vk::CommandBufferUsageFlags usage = {},
+                                              const vk::CommandBufferInheritanceInfo* inheritance = nullptr);
+
+  /// Secondaries for use inside subpass of renderPass, framebuffer is optional but may help performance
+  std::vector<vk::UniqueCommandBuffer> recordSecondary(ThreadPool* threadPool, uint32_t count, RecordFunc func,
+                                                       vk::RenderPass renderPass, uint32_t subpass, vk::Framebuffer framebuffer = {},
+                                                       vk::CommandBufferUsageFlags usage = {});
+
+  /// Number of threads which have a pool so far
+  uint32_t numPools();
+
+private:
+  DeviceInstance& mDeviceInstance;
+  DeviceInstance::QueueRef& mQueue;
+  vk::CommandPoolCreateFlags mFlags;
+
+  std::mutex mMutex; // Just for mPools, not the pools themselves
+  std::map<std::thread::id, vk::UniqueCommandPool> mPools;
+};
+
+#endif
@@ -9,6 +9,17 @@
 
 #include "util.h"
 
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <numeric>
+#include <sstream>
+
 DeviceInstance::DeviceInstance(
     const std::vector<const char*>& requiredInstanceExtensions,
     const std::vector<const char*>& requiredDeviceExtensions,
@@ -16,13 +27,55 @@ DeviceInstance::DeviceInstance(
     uint32_t appVer,
     uint32_t vulkanApiVer,
     std::vector<vk::QueueFlags> qFlags,
-    const std::vector<const char*>& enabledLayers) {
+    const std::vector<const char*>& enabledLayers,
+    const std::vector<const char*>& optionalDeviceExtensions,
+    const DeviceSelection& selection) {
   createVulkanInstance(requiredInstanceExtensions, appName, appVer, vulkanApiVer, enabledLayers);
+  mFilter = selection.filter;
+  mFilterReason = selection.filterReason.empty() ? "failed the device filter" : selection.filterReason;
+  sortPhysicalDevices();
+
+  // An explicit choice beats everything, then the benchmark, then the scores
+  auto preferred = selection.preferred;
+  if( preferred.empty() ) {
+    auto env = std::getenv("VULKANUTILS_DEVICE");
+    if( env ) preferred = env;
+  }
+  auto numUsable = std::count_if(mPhysicalDevices.begin(), mPhysicalDevices.end(), [&](auto& d) { return usablePhysicalDevice(d); });
+  if( preferred.empty() && selection.benchmark && numUsable > 1 ) {
+    preferred = benchmarkPhysicalDevices(selection, [&](uint32_t i) {
+      // Exactly the same setup, just pinned to one device and without benchmarking again
+      DeviceSelection only;
+      only.preferred = std::to_string(i);
+      only.filter = selection.filter;
+      only.filterReason = selection.filterReason;
+      return std::make_unique<DeviceInstance>(requiredInstanceExtensions, requiredDeviceExtensions, appName, appVer, vulkanApiVer,
+                                              qFlags, enabledLayers, optionalDeviceExtensions, only);
+    });
+#ifdef DEBUG
+    // The temporary instances took over the debug callback
+    Util::initDidl(mInstance.get());
+    Util::initDebugMessenger(mInstance.get());
+#endif
+  }
+  if( !preferred.empty() ) preferPhysicalDevice(preferred);
+
   // TODO: Need to split device and queue creation apart
-  createLogicalDevice(qFlags);
+  createLogicalDevice(qFlags, requiredDeviceExtensions, optionalDeviceExtensions);
 }
 
 DeviceInstance::~DeviceInstance() {
+  if( !mPipelineCacheFile.empty() ) {
+    // Not the end of the world if this fails, we'll just compile everything again next time
+    try {
+      savePipelineCache(mPipelineCacheFile);
+    } catch( std::exception& e ) {
+      std::cerr << "DeviceInstance: Failed to save pipeline cache: " << e.what() << std::endl;
+    }
+  }
+  mPipelineCache.reset();
+  mShaderModules.clear();
+
   // Make sure the debug callback has been cleaned up before the vulkan instance
   mDevice.reset();
   Util::reset();
@@ -81,55 +134,192 @@ void DeviceInstance::createVulkanInstance(const std::vector<const char*>& requir
 
   mPhysicalDevices = mInstance->enumeratePhysicalDevices();
   if( mPhysicalDevices.empty() ) throw std::runtime_error("Failed to enumerate physical devices");
+}
+
+double DeviceInstance::deviceScore(vk::PhysicalDevice device) {
+  auto props = device.getProperties();
+
+  // The type is most of it, no amount of memory should put a CPU implementation ahead of a GPU
+  double score = 0.0;
+  switch( props.deviceType ) {
+    case vk::PhysicalDeviceType::eDiscreteGpu: score = 4000.0; break;
+    case vk::PhysicalDeviceType::eIntegratedGpu: score = 3000.0; break;
+    case vk::PhysicalDeviceType::eVirtualGpu: score = 2000.0; break;
+    case vk::PhysicalDeviceType::eOther: score = 1000.0; break;
+    case vk::PhysicalDeviceType::eCpu: score = 0.0; break;
+  }
+
+  // Device local memory limits how many particles fit, up to 640 for 64GB
+  vk::DeviceSize deviceLocal = 0;
+  auto memory = device.getMemoryProperties();
+  for( auto i = 0u; i < memory.memoryHeapCount; ++i ) {
+    if( memory.memoryHeaps[i].flags & vk::MemoryHeapFlagBits::eDeviceLocal ) deviceLocal = std::max(deviceLocal, memory.memoryHeaps[i].size);
+  }
+  score += std::min(static_cast<double>(deviceLocal) / (1024.0 * 1024.0 * 1024.0), 64.0) * 10.0;
+
+  // Bigger workgroups and subgroups suit the reductions and the sort, up to 128 and 64
+  score += std::min(props.limits.maxComputeWorkGroupInvocations, 2048u) / 16.0;
+  if( props.apiVersion >= VK_API_VERSION_1_1 ) {
+    auto props2 = device.getProperties2<vk::PhysicalDeviceProperties2, vk::PhysicalDeviceSubgroupProperties>();
+    score += std::min(props2.get<vk::PhysicalDeviceSubgroupProperties>().subgroupSize, 128u) / 2.0;
+  }
+
+  // Newer API as a tie break
+  score += VK_VERSION_MINOR(props.apiVersion);
+  return score;
+}
+
+bool DeviceInstance::usablePhysicalDevice(vk::PhysicalDevice device) {
+  return !mFilter || mFilter(mInstance.get(), device);
+}
 
+void DeviceInstance::sortPhysicalDevices() {
   // Device order in the list isn't guaranteed, likely the integrated gpu is first
-  std::sort(mPhysicalDevices.begin(), mPhysicalDevices.end(), [&](auto& a, auto& b) {
-    vk::PhysicalDeviceProperties propsA;
-    a.getProperties(&propsA);
-    vk::PhysicalDeviceProperties propsB;
-    b.getProperties(&propsB);
-    // For now just ensure discrete GPUs are first, then order by support vulkan api version
-    if( propsA.deviceType == vk::PhysicalDeviceType::eDiscreteGpu ) return true;
-    if( propsA.apiVersion > propsB.apiVersion ) return true;
-    return false;
-  });
+  // Score each once, comparing the scores keeps the sort a strict weak ordering
+  std::vector<std::pair<double, vk::PhysicalDevice>> scored;
+  for( auto& d : mPhysicalDevices ) scored.emplace_back(deviceScore(d), d);
+  std::stable_sort(scored.begin(), scored.end(), [](auto& a, auto& b) { return a.first > b.first; });
+  for( auto i = 0u; i < scored.size(); ++i ) mPhysicalDevices[i] = scored[i].second;
+
+  // Rejects go to the back so they still show up in reportDevices, but never end up first by default
+  // A headless device winning on score would only fail later, when it's asked to present
+  auto usableEnd = std::stable_partition(mPhysicalDevices.begin(), mPhysicalDevices.end(), [&](auto& d) { return usablePhysicalDevice(d); });
+  if( usableEnd == mPhysicalDevices.begin() ) throw std::runtime_error("DeviceInstance::sortPhysicalDevices: No usable physical device, they all " + mFilterReason);
+  mScoredPhysicalDevices = mPhysicalDevices;
 }
 
-void DeviceInstance::createLogicalDevice(std::vector<vk::QueueFlags> qFlags) {
+void DeviceInstance::preferPhysicalDevice(const std::string& preferred) {
+  auto it = mPhysicalDevices.end();
+  if( std::all_of(preferred.begin(), preferred.end(), [](char c) { return std::isdigit(static_cast<unsigned char>(c)); }) ) {
+    auto index = std::stoul(preferred);
+    if( index < mPhysicalDevices.size() ) it = mPhysicalDevices.begin() + index;
+  } else {
+    it = std::find_if(mPhysicalDevices.begin(), mPhysicalDevices.end(), [&](auto& d) {
+      return std::string(d.getProperties().deviceName).find(preferred) != std::string::npos;
+    });
+  }
+  if( it == mPhysicalDevices.end() ) throw std::runtime_error("DeviceInstance::preferPhysicalDevice: No physical device matching: " + preferred);
+  if( !usablePhysicalDevice(*it) ) throw std::runtime_error("DeviceInstance::preferPhysicalDevice: Physical device " + preferred + " (" + std::string(it->getProperties().deviceName) + ") " + mFilterReason);
 
-  std::vector<vk::DeviceQueueCreateInfo> queueInfo;
+  // The rest keep their order, in case anyone's looking at the others
+  std::rotate(mPhysicalDevices.begin(), it, it + 1);
+}
+
+std::string DeviceInstance::physicalDevicesSignature() {
+  std::stringstream signature;
+  for( auto& d : mScoredPhysicalDevices ) {
+    auto props = d.getProperties();
+    signature << props.vendorID << ":" << props.deviceID << ":" << props.driverVersion << ":" << props.deviceName << ";";
+  }
+  return signature.str();
+}
+
+std::string DeviceInstance::benchmarkPhysicalDevices(const DeviceSelection& selection, std::function<std::unique_ptr<DeviceInstance>(uint32_t)> create) {
+  // Cache is the signature, then the winning index
+  auto signature = physicalDevicesSignature();
+  if( !selection.benchmarkCacheFile.empty() && std::filesystem::exists(selection.benchmarkCacheFile) ) {
+    std::ifstream file(selection.benchmarkCacheFile);
+    std::string cachedSignature, cachedIndex;
+    std::getline(file, cachedSignature);
+    std::getline(file, cachedIndex);
+    if( cachedSignature == signature && !cachedIndex.empty() ) {
+      std::cout << "DeviceInstance: Using benchmarked device " << cachedIndex << " from " << selection.benchmarkCacheFile << std::endl;
+      return cachedIndex;
+    }
+  }
+
+  std::cout << "DeviceInstance: Benchmarking " << mPhysicalDevices.size() << " devices" << std::endl;
+  auto best = std::numeric_limits<double>::max();
+  std::string bestIndex;
+  for( auto i = 0u; i < mPhysicalDevices.size(); ++i ) {
+    std::string name = mPhysicalDevices[i].getProperties().deviceName;
+    if( !usablePhysicalDevice(mPhysicalDevices[i]) ) {
+      std::cout << "  " << i << " " << name << ": skipped, " << mFilterReason << std::endl;
+      continue;
+    }
+    try {
+      auto instance = create(i);
+      auto seconds = selection.benchmark(*instance.get());
+      std::cout << "  " << i << " " << name << ": " << seconds * 1000.0 << "ms" << std::endl;
+      if( seconds < best ) {
+        best = seconds;
+        bestIndex = std::to_string(i);
+      }
+    } catch( std::exception& e ) {
+      // Not every device can run everything, CPU implementations especially
+      std::cout << "  " << i << " " << name << ": failed, " << e.what() << std::endl;
+    }
+  }
+
+  if( !bestIndex.empty() && !selection.benchmarkCacheFile.empty() ) {
+    std::ofstream file(selection.benchmarkCacheFile, std::ios::trunc);
+    if( file.is_open() ) file << signature << "\n" << bestIndex << "\n";
+    else std::cerr << "DeviceInstance::benchmarkPhysicalDevices: Failed to write cache: " << selection.benchmarkCacheFile << std::endl;
+  }
+  return bestIndex;
+}
+
+void DeviceInstance::reportDevices(std::ostream& stream) {
+  stream << "Physical devices (VULKANUTILS_DEVICE to override):\n";
+  for( auto i = 0u; i < mScoredPhysicalDevices.size(); ++i ) {
+    auto& device = mScoredPhysicalDevices[i];
+    auto props = device.getProperties();
+    stream << "  " << i << ": " << props.deviceName << " (" << Util::physicalDeviceTypeToString(props.deviceType)
+           << ", score " << deviceScore(device) << ")" << (usablePhysicalDevice(device) ? "" : " " + mFilterReason)
+           << (device == physicalDevice() ? " <- using" : "") << "\n";
+  }
+  stream << std::flush;
+}
+
+void DeviceInstance::createLogicalDevice(std::vector<vk::QueueFlags> qFlags, const std::vector<const char*>& requiredExtensions, const std::vector<const char*>& optionalExtensions) {
+
+  // Pick a family and queue index for each request
+  // Compute on its own wants a family without graphics, so it can run alongside rendering
+  // Past that each request gets the next queue in the family, until the family runs out
   auto qFamProps = mPhysicalDevices[0].getQueueFamilyProperties();
-  float queuePriorities = 1.f;
+  std::vector<uint32_t> qFamCounts(qFamProps.size(), 0);
+  std::vector<std::pair<uint32_t, uint32_t>> qSelections;
   for( auto& qF : qFlags ) {
-    auto it = std::find_if(qFamProps.begin(), qFamProps.end(), [&](auto& p) {
-      if( p.queueFlags & qF ) return true;
-      throw std::runtime_error("DeviceInstance::createLogicalDevice: Physical device doesn't support requested queue types");
-      return false;
-    });
-    if( it == qFamProps.end() ) continue;
+    auto matches = [&](auto& p) { return (p.queueFlags & qF) == qF; };
+    auto it = qFamProps.end();
+    if( !(qF & vk::QueueFlagBits::eGraphics) ) {
+      it = std::find_if(qFamProps.begin(), qFamProps.end(), [&](auto& p) {
+        return matches(p) && !(p.queueFlags & vk::QueueFlagBits::eGraphics);
+      });
+    }
+    if( it == qFamProps.end() ) it = std::find_if(qFamProps.begin(), qFamProps.end(), matches);
+    if( it == qFamProps.end() ) throw std::runtime_error("DeviceInstance::createLogicalDevice: Physical device doesn't support requested queue types");
 
     auto qFamIdx = static_cast<uint32_t>(it - qFamProps.begin());
+    auto qIdx = std::min(qFamCounts[qFamIdx], it->queueCount - 1);
+    qFamCounts[qFamIdx] = std::max(qFamCounts[qFamIdx], qIdx + 1);
+    qSelections.emplace_back(qFamIdx, qIdx);
+  }
 
-    auto it2 = std::find_if(queueInfo.begin(), queueInfo.end(), [&](auto& p) {
-      return p.queueFamilyIndex == qFamIdx;
-    });
-    if( it2 != queueInfo.end() ) continue;
-
+  std::vector<vk::DeviceQueueCreateInfo> queueInfo;
+  std::vector<std::vector<float>> queuePriorities(qFamProps.size());
+  for( auto i = 0u; i < qFamCounts.size(); ++i ) {
+    if( qFamCounts[i] == 0 ) continue;
+    queuePriorities[i].resize(qFamCounts[i], 1.f);
     auto qInfo = vk::DeviceQueueCreateInfo()
         .setFlags({})
-        .setQueueFamilyIndex(qFamIdx)
-        .setQueueCount(1)
-        .setPQueuePriorities(&queuePriorities);
+        .setQueueFamilyIndex(i)
+        .setQueueCount(qFamCounts[i])
+        .setPQueuePriorities(queuePriorities[i].data());
     queueInfo.emplace_back(qInfo);
   }
-  //if( queueInfo.size() != qFlags.size() )  throw std::runtime_error("DeviceInstance::createLogicalDevice: Physical device doesn't support requested queue types");
 
   auto supportedExtensions = mPhysicalDevices.front().enumerateDeviceExtensionProperties();
-  std::vector<const char*> enabledDeviceExtensions;
+  std::vector<const char*> enabledDeviceExtensions = requiredExtensions;
 #if defined(VK_USE_PLATFORM_WIN32_KHR) || defined(VK_USE_PLATFORM_XLIB_KHR) || defined(VK_USE_PLATFORM_LIB_XCB_KHR) || defined(USE_GLFW)
   enabledDeviceExtensions.push_back("VK_KHR_swapchain");
-  for( auto& e : enabledDeviceExtensions ) Util::ensureExtension(supportedExtensions, e);
 #endif
+  for( auto& e : enabledDeviceExtensions ) Util::ensureExtension(supportedExtensions, e);
+  for( auto& e : optionalExtensions ) {
+    auto supported = std::find_if(supportedExtensions.begin(), supportedExtensions.end(), [&](auto& p) { return std::string(p.extensionName) == e; }) != supportedExtensions.end();
+    if( supported ) enabledDeviceExtensions.push_back(e);
+  }
+  for( auto& e : enabledDeviceExtensions ) mEnabledDeviceExtensions.emplace_back(e);
 
 #ifdef DEBUG
   uint32_t enabledLayerCount = 1;
@@ -147,13 +337,33 @@ void DeviceInstance::createLogicalDevice(std::vector<vk::QueueFlags> qFlags) {
 
   // The features we require, we get very little without requesting these
   // As listed page 17
-  // TODO: After creation the enabled features are set in this struct, will want to keep it for later
-  auto deviceRequiredFeatures = vk::PhysicalDeviceFeatures()
+  // Optional features are enabled if supported, users should check enabledFeatures() before relying on them
+  mEnabledFeatures = vk::PhysicalDeviceFeatures()
       .setMultiDrawIndirect(deviceSupportedFeatures.multiDrawIndirect)
+      .setPipelineStatisticsQuery(deviceSupportedFeatures.pipelineStatisticsQuery)
       .setTessellationShader(true)
       .setGeometryShader(true);
 
+  // Extension features, chained onto the create info
+  // Only query these if the extension is there, otherwise the struct isn't valid to pass to the driver
+  void* featureChain = nullptr;
+  if( deviceExtensionEnabled(VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME) ) {
+    auto features = mPhysicalDevices.front().getFeatures2<vk::PhysicalDeviceFeatures2, vk::PhysicalDeviceTimelineSemaphoreFeaturesKHR>();
+    mTimelineSemaphoreFeatures = features.get<vk::PhysicalDeviceTimelineSemaphoreFeaturesKHR>();
+    mTimelineSemaphoreFeatures.setPNext(featureChain);
+    featureChain = &mTimelineSemaphoreFeatures;
+  }
+  if( deviceExtensionEnabled(VK_KHR_BUFFER_DEVICE_ADDRESS_EXTENSION_NAME) ) {
+    auto features = mPhysicalDevices.front().getFeatures2<vk::PhysicalDeviceFeatures2, vk::PhysicalDeviceBufferDeviceAddressFeaturesKHR>();
+    // Only the basic feature, capture/replay and multi device aren't needed
+    mBufferDeviceAddressFeatures = vk::PhysicalDeviceBufferDeviceAddressFeaturesKHR()
+        .setBufferDeviceAddress(features.get<vk::PhysicalDeviceBufferDeviceAddressFeaturesKHR>().bufferDeviceAddress);
+    mBufferDeviceAddressFeatures.setPNext(featureChain);
+    featureChain = &mBufferDeviceAddressFeatures;
+  }
+
   auto info = vk::DeviceCreateInfo()
+      .setPNext(featureChain)
       .setFlags({})
       .setQueueCreateInfoCount(queueInfo.size())
       .setPQueueCreateInfos(queueInfo.data())
@@ -161,21 +371,30 @@ void DeviceInstance::createLogicalDevice(std::vector<vk::QueueFlags> qFlags) {
       .setPpEnabledLayerNames(enabledLayerNames)
       .setEnabledExtensionCount(static_cast<uint32_t>(enabledDeviceExtensions.size()))
       .setPpEnabledExtensionNames(enabledDeviceExtensions.data())
-      .setPEnabledFeatures(&deviceRequiredFeatures)
+      .setPEnabledFeatures(&mEnabledFeatures)
       ;
 
   mDevice = mPhysicalDevices.front().createDeviceUnique(info);
+  mDispatch.init(mInstance.get(), ::vkGetInstanceProcAddr, mDevice.get(), ::vkGetDeviceProcAddr);
 
-  for( auto i=0u; i < queueInfo.size(); ++i ) {
-    auto famIdx = queueInfo[i].queueFamilyIndex;
-    auto famProps = mPhysicalDevices.front().getQueueFamilyProperties();
-
+  for( auto& sel : qSelections ) {
     auto qRef = QueueRef();
-    qRef.famIndex = famIdx;
-    qRef.queue = mDevice->getQueue(famIdx, 0);
-    qRef.flags = famProps[famIdx].queueFlags;
+    qRef.famIndex = sel.first;
+    qRef.index = sel.second;
+    qRef.queue = mDevice->getQueue(sel.first, sel.second);
+    qRef.flags = qFamProps[sel.first].queueFlags;
+
+    auto shared = std::find_if(mQueues.begin(), mQueues.end(), [&](auto& q) { return q.queue == qRef.queue; });
+    qRef.mutex = shared != mQueues.end() ? shared->mutex : std::make_shared<std::mutex>();
     mQueues.emplace_back( qRef );
   }
+
+  // Empty until loadPipelineCache is called
+  mPipelineCache = mDevice->createPipelineCacheUnique(vk::PipelineCacheCreateInfo());
+}
+
+bool DeviceInstance::deviceExtensionEnabled(const std::string& name) const {
+  return std::find(mEnabledDeviceExtensions.begin(), mEnabledDeviceExtensions.end(), name) != mEnabledDeviceExtensions.end();
 }
 
 DeviceInstance::QueueRef* DeviceInstance::getQueue( vk::QueueFlags flags ) {
@@ -186,6 +405,11 @@ DeviceInstance::QueueRef* DeviceInstance::getQueue( vk::QueueFlags flags ) {
   return &(*it);
 }
 
+DeviceInstance::QueueRef* DeviceInstance::queue( uint32_t i ) {
+  if( i >= mQueues.size() ) return nullptr;
+  return &mQueues[i];
+}
+
 void DeviceInstance::waitAllDevicesIdle() {
   mDevice->waitIdle();
 }
@@ -198,15 +422,100 @@ vk::UniqueCommandPool DeviceInstance::createCommandPool( vk::CommandPoolCreateFl
   return mDevice->createCommandPoolUnique(info);
 }
 
-vk::UniqueBuffer DeviceInstance::createBuffer( vk::DeviceSize size, vk::BufferUsageFlags usageFlags ) {
+vk::UniqueBuffer DeviceInstance::createBuffer( vk::DeviceSize size, vk::BufferUsageFlags usageFlags, const std::vector<uint32_t>& queueFamilies ) {
   // Exclusive buffer of size, for usageFlags
+  // Unless it's going to be used by multiple families, then concurrent
+  std::vector<uint32_t> families = queueFamilies;
+  std::sort(families.begin(), families.end());
+  families.erase(std::unique(families.begin(), families.end()), families.end());
+
   auto info = vk::BufferCreateInfo()
       .setFlags({})
       .setSize(size)
       .setUsage(usageFlags);
+  if( families.size() > 1 ) {
+    info.setSharingMode(vk::SharingMode::eConcurrent)
+        .setQueueFamilyIndexCount(static_cast<uint32_t>(families.size()))
+        .setPQueueFamilyIndices(families.data());
+  }
   return mDevice->createBufferUnique(info);
 }
 
+DeviceInstance::PipelineCacheHeader DeviceInstance::pipelineCacheHeader() {
+  auto props = mPhysicalDevices.front().getProperties();
+  PipelineCacheHeader header;
+  header.magic = 0x43505556; // 'VUPC'
+  header.headerVersion = 1;
+  header.vendorID = props.vendorID;
+  header.deviceID = props.deviceID;
+  header.driverVersion = props.driverVersion;
+  std::memcpy(header.pipelineCacheUUID, props.pipelineCacheUUID, VK_UUID_SIZE);
+  header.dataSize = 0;
+  return header;
+}
+
+void DeviceInstance::loadPipelineCache(const std::string& fileName) {
+  mPipelineCacheFile = fileName;
+  if( !std::filesystem::exists(fileName) ) return;
+
+  auto fileData = Util::readFile(fileName);
+  auto expected = pipelineCacheHeader();
+  PipelineCacheHeader header;
+  if( fileData.size() < sizeof(header) ) return;
+  std::memcpy(&header, fileData.data(), sizeof(header));
+
+  // Drivers are meant to validate the cache data themselves, but not all of them are reliable about it
+  if( header.magic != expected.magic ||
+      header.headerVersion != expected.headerVersion ||
+      header.vendorID != expected.vendorID ||
+      header.deviceID != expected.deviceID ||
+      header.driverVersion != expected.driverVersion ||
+      std::memcmp(header.pipelineCacheUUID, expected.pipelineCacheUUID, VK_UUID_SIZE) != 0 ||
+      header.dataSize != fileData.size() - sizeof(header) ) {
+    std::cerr << "DeviceInstance::loadPipelineCache: Discarding pipeline cache from a different device/driver: " << fileName << std::endl;
+    return;
+  }
+
+  auto info = vk::PipelineCacheCreateInfo()
+      .setFlags({})
+      .setInitialDataSize(static_cast<size_t>(header.dataSize))
+      .setPInitialData(fileData.data() + sizeof(header));
+  mPipelineCache = mDevice->createPipelineCacheUnique(info);
+}
+
+void DeviceInstance::savePipelineCache(const std::string& fileName) {
+  auto data = mDevice->getPipelineCacheData(mPipelineCache.get());
+  auto header = pipelineCacheHeader();
+  header.dataSize = data.size();
+
+  // Write to a temporary file then move into place, rename is atomic so readers
+  // either get the old cache or the new one
+  auto tmpFileName = fileName + ".tmp";
+  {
+    std::ofstream file(tmpFileName, std::ios::binary | std::ios::trunc);
+    if( !file.is_open() ) throw std::runtime_error("DeviceInstance::savePipelineCache: Failed to open file: " + tmpFileName);
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char*>(data.data()), static_cast<std::streamsize>(data.size()));
+    if( !file.good() ) throw std::runtime_error("DeviceInstance::savePipelineCache: Failed to write file: " + tmpFileName);
+  }
+  std::filesystem::rename(tmpFileName, fileName);
+}
+
+vk::ShaderModule DeviceInstance::shaderModule(const EmbeddedShader& shader) {
+  std::lock_guard<std::mutex> lock(mShaderModulesMutex);
+  auto it = mShaderModules.find(shader.hash);
+  if( it != mShaderModules.end() ) return it->second.get();
+
+  auto info = vk::ShaderModuleCreateInfo()
+      .setFlags({})
+      .setCodeSize(shader.size)
+      .setPCode(shader.code);
+  auto module = mDevice->createShaderModuleUnique(info);
+  auto result = module.get();
+  mShaderModules.emplace(shader.hash, std::move(module));
+  return result;
+}
+
 /// Select a device memory heap based on flags (vk::MemoryRequirements::memoryTypeBits)
 uint32_t DeviceInstance::selectDeviceMemoryHeap( vk::MemoryRequirements memoryRequirements, vk::MemoryPropertyFlags requiredFlags ) {
   // Initial implementation doesn't have any real requirements, just select the first compatible heap
@@ -225,12 +534,15 @@ uint32_t DeviceInstance::selectDeviceMemoryHeap( vk::MemoryRequirements memoryRe
 }
 
 /// Allocate device memory suitable for the specified buffer
-vk::UniqueDeviceMemory DeviceInstance::allocateDeviceMemoryForBuffer( vk::Buffer& buffer, vk::MemoryPropertyFlags userReqs ) {
+vk::UniqueDeviceMemory DeviceInstance::allocateDeviceMemoryForBuffer( vk::Buffer& buffer, vk::MemoryPropertyFlags userReqs, vk::MemoryAllocateFlags allocFlags ) {
   // Find out what kind of memory the buffer needs
   vk::MemoryRequirements memReq = mDevice->getBufferMemoryRequirements(buffer);
 
   auto heapIdx = selectDeviceMemoryHeap(memReq, userReqs );
+  auto flagsInfo = vk::MemoryAllocateFlagsInfo()
+      .setFlags(allocFlags);
   auto info = vk::MemoryAllocateInfo()
+      .setPNext(allocFlags ? &flagsInfo : nullptr)
       .setAllocationSize(memReq.size)
       .setMemoryTypeIndex(heapIdx);
 
@@ -242,6 +554,23 @@ void DeviceInstance::bindMemoryToBuffer(vk::Buffer& buffer, vk::DeviceMemory& me
   mDevice->bindBufferMemory(buffer, memory, offset);
 }
 
+/// Allocate device memory suitable for the specified image
+vk::UniqueDeviceMemory DeviceInstance::allocateDeviceMemoryForImage( vk::Image& image, vk::MemoryPropertyFlags userReqs ) {
+  vk::MemoryRequirements memReq = mDevice->getImageMemoryRequirements(image);
+
+  auto heapIdx = selectDeviceMemoryHeap(memReq, userReqs );
+  auto info = vk::MemoryAllocateInfo()
+      .setAllocationSize(memReq.size)
+      .setMemoryTypeIndex(heapIdx);
+
+  return mDevice->allocateMemoryUnique(info);
+}
+
+/// Bind memory to an image
+void DeviceInstance::bindMemoryToImage(vk::Image& image, vk::DeviceMemory& memory, vk::DeviceSize offset) {
+  mDevice->bindImageMemory(image, memory, offset);
+}
+
 /// Map a region of device memory to host memory
 void* DeviceInstance::mapMemory( vk::DeviceMemory& deviceMem, vk::DeviceSize offset, vk::DeviceSize size ) {
   return mDevice->mapMemory(deviceMem, offset, size);
@@ -257,3 +586,90 @@ void DeviceInstance::flushMemoryRanges( vk::ArrayProxy<const vk::MappedMemoryRan
   mDevice->flushMappedMemoryRanges(mem.size(), mem.data());
 }
 
+
+bool DeviceInstance::memoryBudgetEnabled() const {
+  return deviceExtensionEnabled(VK_EXT_MEMORY_BUDGET_EXTENSION_NAME);
+}
+
+std::vector<DeviceInstance::HeapBudget> DeviceInstance::memoryBudget() {
+  // Budgets change as anything (including other processes) allocates, so ask every time
+  vk::PhysicalDeviceMemoryProperties memoryProperties;
+  vk::PhysicalDeviceMemoryBudgetPropertiesEXT budgetProperties;
+  if( memoryBudgetEnabled() ) {
+    auto properties = mPhysicalDevices.front().getMemoryProperties2<vk::PhysicalDeviceMemoryProperties2, vk::PhysicalDeviceMemoryBudgetPropertiesEXT>();
+    memoryProperties = properties.get<vk::PhysicalDeviceMemoryProperties2>().memoryProperties;
+    budgetProperties = properties.get<vk::PhysicalDeviceMemoryBudgetPropertiesEXT>();
+  } else {
+    memoryProperties = mPhysicalDevices.front().getMemoryProperties();
+  }
+
+  std::lock_guard<std::mutex> lock(mMemoryMutex);
+  std::vector<HeapBudget> heaps(memoryProperties.memoryHeapCount);
+  for( auto i = 0u; i < heaps.size(); ++i ) {
+    auto& heap = heaps[i];
+    heap.size = memoryProperties.memoryHeaps[i].size;
+    heap.deviceLocal = static_cast<bool>(memoryProperties.memoryHeaps[i].flags & vk::MemoryHeapFlagBits::eDeviceLocal);
+    heap.tracked = i < mTrackedHeapUsage.size() ? mTrackedHeapUsage[i] : 0;
+    if( memoryBudgetEnabled() ) {
+      heap.budget = budgetProperties.heapBudget[i];
+      heap.usage = budgetProperties.heapUsage[i];
+    } else {
+      heap.budget = heap.size;
+      heap.usage = heap.tracked;
+    }
+  }
+  return heaps;
+}
+
+uint32_t DeviceInstance::memoryHeap(uint32_t memoryType) {
+  auto memoryProperties = mPhysicalDevices.front().getMemoryProperties();
+  if( memoryType >= memoryProperties.memoryTypeCount ) throw std::runtime_error("DeviceInstance::memoryHeap: Invalid memory type");
+  return memoryProperties.memoryTypes[memoryType].heapIndex;
+}
+
+void DeviceInstance::trackAllocation(const std::string& category, uint32_t heap, vk::DeviceSize size) {
+  std::lock_guard<std::mutex> lock(mMemoryMutex);
+  auto& c = mMemoryCategories[category];
+  c.allocations++;
+  c.bytes += size;
+  c.peakBytes = std::max(c.peakBytes, c.bytes);
+  if( heap >= mTrackedHeapUsage.size() ) mTrackedHeapUsage.resize(heap + 1, 0);
+  mTrackedHeapUsage[heap] += size;
+}
+
+void DeviceInstance::trackFree(const std::string& category, uint32_t heap, vk::DeviceSize size) {
+  // Called from destructors, so a mismatch is ignored rather than thrown
+  std::lock_guard<std::mutex> lock(mMemoryMutex);
+  auto it = mMemoryCategories.find(category);
+  if( it == mMemoryCategories.end() || it->second.allocations == 0 || it->second.bytes < size ) return;
+  if( heap >= mTrackedHeapUsage.size() || mTrackedHeapUsage[heap] < size ) return;
+  it->second.allocations--;
+  it->second.bytes -= size;
+  mTrackedHeapUsage[heap] -= size;
+}
+
+std::map<std::string, DeviceInstance::MemoryCategory> DeviceInstance::memoryCategories() {
+  std::lock_guard<std::mutex> lock(mMemoryMutex);
+  return mMemoryCategories;
+}
+
+void DeviceInstance::reportMemory(std::ostream& stream) {
+  auto mb = [](vk::DeviceSize bytes) { return static_cast<double>(bytes) / (1024.0 * 1024.0); };
+
+  stream << "Memory heaps" << (memoryBudgetEnabled() ? "" : " (no VK_EXT_memory_budget, budget is the heap size)") << ":\n";
+  auto heaps = memoryBudget();
+  for( auto i = 0u; i < heaps.size(); ++i ) {
+    auto& heap = heaps[i];
+    stream << "  " << i << (heap.deviceLocal ? " (device local)" : " (host)")
+           << ": " << mb(heap.usage) << "/" << mb(heap.budget) << "MB used"
+           << ", " << mb(heap.tracked) << "MB tracked"
+           << ", heap " << mb(heap.size) << "MB\n";
+  }
+
+  stream << "Tracked allocations:\n";
+  for( auto& c : memoryCategories() ) {
+    stream << "  " << c.first << ": " << c.second.allocations << " allocations, "
+           << mb(c.second.bytes) << "MB (peak " << mb(c.second.peakBytes) << "MB)\n";
+  }
+  stream << std::flush;
+}
@@ -10,6 +10,14 @@
 
 #include <vulkan/vulkan.hpp>
 
+#include "embeddedshader.h"
+
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
 #include <vector>
 
 /**
@@ -24,7 +32,34 @@ public:
   struct QueueRef {
     vk::Queue queue;
     uint32_t famIndex;
+    uint32_t index; // Within the family
     vk::QueueFlags flags;
+    // Queue submission must be externally synchronised. QueueRefs which
+    // ended up sharing a vk::Queue share the mutex too
+    std::shared_ptr<std::mutex> mutex;
+  };
+
+  /**
+   * How to pick the physical device, see the constructor
+   * No initialisers so {} works as a default argument
+   */
+  struct DeviceSelection {
+    /// Index into physicalDevices() (best scoring first), or part of a device name. VULKANUTILS_DEVICE is used if empty
+    std::string preferred;
+    /**
+     * Optional, time a workload in seconds (lower is better)
+     * Each device is tried on a temporary DeviceInstance, throw if the device can't run it
+     */
+    std::function<double(DeviceInstance&)> benchmark;
+    /// Where to remember the benchmark's pick, it only runs again when the devices or drivers change. Empty to always run
+    std::string benchmarkCacheFile;
+    /**
+     * Optional, whether a device can be used at all. e.g. whether it can present to the window
+     * Rejected devices are never picked or benchmarked, and naming one in preferred is an error
+     */
+    std::function<bool(vk::Instance, vk::PhysicalDevice)> filter;
+    /// What filter checks for, for the error message. e.g. "can't present to the window"
+    std::string filterReason;
   };
 
   DeviceInstance() = delete;
@@ -38,6 +73,12 @@ public:
    * TODO: To use this you need to know what you want in the first place including what physical devices are on the system
    * There should be callbacks and such to let the application interact with the startup process and make decisions based
    * on information that's unknown when this class starts construction
+   *
+   * optionalDeviceExtensions are enabled if the device supports them, check deviceExtensionEnabled before use
+   *
+   * Physical devices are ordered by deviceScore (any selection.filter rejects go last), and the best is used unless selection says otherwise:
+   * - selection.preferred, or the VULKANUTILS_DEVICE environment variable, picks one directly
+   * - Otherwise selection.benchmark (if set) is run on each device, and the fastest wins
    */
   DeviceInstance(
       const std::vector<const char*>& requiredInstanceExtensions,
@@ -46,13 +87,43 @@ public:
       uint32_t appVer,
       uint32_t vulkanApiVer,
       std::vector<vk::QueueFlags> qFlags,
-      const std::vector<const char*>& enabledLayers = {});
+      const std::vector<const char*>& enabledLayers = {},
+      const std::vector<const char*>& optionalDeviceExtensions = {},
+      const DeviceSelection& selection = {});
 
 
   vk::Instance& instance() { return mInstance.get(); }
   vk::Device& device() { return mDevice.get(); }
+  /// All the physical devices, the one in use first then the rest by deviceScore, then any the filter rejected
   std::vector<vk::PhysicalDevice>& physicalDevices() { return mPhysicalDevices; }
+  /// The physical device in use
   vk::PhysicalDevice& physicalDevice() { return mPhysicalDevices.front(); }
+  /**
+   * How good a device looks for compute, from its properties alone (higher is better)
+   * Device type first (discrete, integrated, virtual, other, cpu), then device local memory,
+   * max workgroup invocations and subgroup size
+   */
+  static double deviceScore(vk::PhysicalDevice device);
+  /// Print the physical devices and their scores
+  void reportDevices(std::ostream& stream = std::cout);
+  /// The features enabled on the logical device
+  const vk::PhysicalDeviceFeatures& enabledFeatures() const { return mEnabledFeatures; }
+  /// Whether a device extension was enabled
+  bool deviceExtensionEnabled(const std::string& name) const;
+  /// Whether timeline semaphores are supported (VK_KHR_timeline_semaphore)
+  bool timelineSemaphoresEnabled() const { return mTimelineSemaphoreFeatures.timelineSemaphore; }
+  /// Whether buffers can be accessed by address from shaders (VK_KHR_buffer_device_address), see SimpleBuffer::deviceAddress
+  bool bufferDeviceAddressEnabled() const { return mBufferDeviceAddressFeatures.bufferDeviceAddress; }
+  /// Whether the driver reports real heap budgets (VK_EXT_memory_budget), see memoryBudget
+  bool memoryBudgetEnabled() const;
+
+  /**
+   * Dispatcher for extension functions
+   *
+   * The loader only exports core functions, anything from an extension
+   * must be called through here
+   */
+  vk::DispatchLoaderDynamic& dispatch() { return mDispatch; }
 
   /**
    * Get the nth queue for the request flags
@@ -61,19 +132,57 @@ public:
    */
   DeviceInstance::QueueRef* getQueue( vk::QueueFlags flags );
 
+  /**
+   * The queue created for qFlags[i], as passed to the constructor
+   *
+   * Each entry in qFlags gets its own queue if the device has enough of them.
+   * Compute-only requests prefer a family without graphics, if there is one.
+   * Otherwise queues are shared, compare QueueRef::queue to check.
+   */
+  DeviceInstance::QueueRef* queue( uint32_t i );
+
   /// Wait until all physical devices are idle
   void waitAllDevicesIdle();
 
+  /**
+   * Pipeline cache, shared by all pipelines built against this device
+   *
+   * Starts empty unless loadPipelineCache is called
+   */
+  vk::PipelineCache& pipelineCache() { return mPipelineCache.get(); }
+  /**
+   * Load the pipeline cache from disk
+   *
+   * Data is discarded if it was saved by a different device or driver version.
+   * The cache will be saved back to the same file on destruction
+   */
+  void loadPipelineCache(const std::string& fileName);
+  /// Save the pipeline cache, via a temporary file so a crash can't leave a truncated cache behind
+  void savePipelineCache(const std::string& fileName);
+
+  /**
+   * Get the shader module for an embedded shader
+   *
+   * Modules are created on first use and kept until the device is destroyed,
+   * so pipelines using the same shader share one module
+   */
+  vk::ShaderModule shaderModule(const EmbeddedShader& shader);
+
 
   // Buffer/etc creation functions
   vk::UniqueCommandPool createCommandPool( vk::CommandPoolCreateFlags flags, DeviceInstance::QueueRef& queue );
-  vk::UniqueBuffer createBuffer( vk::DeviceSize size, vk::BufferUsageFlags usageFlags );
+  /// Exclusive buffer, or concurrent if queueFamilies contains more than one family
+  vk::UniqueBuffer createBuffer( vk::DeviceSize size, vk::BufferUsageFlags usageFlags, const std::vector<uint32_t>& queueFamilies = {} );
   /// Select a device memory heap based on flags (vk::MemoryRequirements::memoryTypeBits)
   uint32_t selectDeviceMemoryHeap( vk::MemoryRequirements memoryRequirements, vk::MemoryPropertyFlags requiredFlags );
-  /// Allocate device memory suitable for the specified buffer
-  vk::UniqueDeviceMemory allocateDeviceMemoryForBuffer( vk::Buffer& buffer, vk::MemoryPropertyFlags userReqs );
+  /// Allocate device memory suitable for the specified buffer, allocFlags must include eDeviceAddressKHR for buffers used by address
+  vk::UniqueDeviceMemory allocateDeviceMemoryForBuffer( vk::Buffer& buffer, vk::MemoryPropertyFlags userReqs, vk::MemoryAllocateFlags allocFlags = {} );
   /// Bind memory to a buffer
   void bindMemoryToBuffer(vk::Buffer& buffer, vk::DeviceMemory& memory, vk::DeviceSize offset);
+  /// Allocate device memory suitable for the specified image
+  vk::UniqueDeviceMemory allocateDeviceMemoryForImage( vk::Image& image, vk::MemoryPropertyFlags userReqs );
+  /// Bind memory to an image
+  void bindMemoryToImage(vk::Image& image, vk::DeviceMemory& memory, vk::DeviceSize offset);
   /// Map a region of device memory to host memory
   void* mapMemory( vk::DeviceMemory& deviceMem, vk::DeviceSize offset, vk::DeviceSize size );
   /// Unmap a region of device memory
@@ -82,17 +191,95 @@ public:
   void flushMemoryRanges( vk::ArrayProxy<const vk::MappedMemoryRange> mem );
 
 
+  // Memory telemetry
+  /// One memory heap
+  struct HeapBudget {
+    vk::DeviceSize size = 0;
+    vk::DeviceSize budget = 0; // How much this process can have before things go wrong, the heap size without VK_EXT_memory_budget
+    vk::DeviceSize usage = 0; // This process's usage according to the driver, the tracked usage without VK_EXT_memory_budget
+    vk::DeviceSize tracked = 0; // Just what's been through trackAllocation
+    bool deviceLocal = false;
+  };
+  /**
+   * Current usage and budget of each heap
+   *
+   * With VK_EXT_memory_budget these come from the driver and cover everything (including other
+   * allocations in this process). Without it the budget is the whole heap, which is optimistic
+   */
+  std::vector<HeapBudget> memoryBudget();
+  /// Heap a memory type is from
+  uint32_t memoryHeap(uint32_t memoryType);
+
+  /// Tracked allocations in one category
+  struct MemoryCategory {
+    uint32_t allocations = 0;
+    vk::DeviceSize bytes = 0;
+    vk::DeviceSize peakBytes = 0;
+  };
+  /**
+   * Record an allocation against a category (SimpleBuffer does this for itself)
+   * Categories are just names, e.g. particles/staging/scratch
+   */
+  void trackAllocation(const std::string& category, uint32_t heap, vk::DeviceSize size);
+  /// Undo trackAllocation
+  void trackFree(const std::string& category, uint32_t heap, vk::DeviceSize size);
+  std::map<std::string, MemoryCategory> memoryCategories();
+  /// Print the heaps and categories
+  void reportMemory(std::ostream& stream = std::cout);
+
+
 private:
   void createVulkanInstance(const std::vector<const char*>& requiredExtensions, std::string appName, uint32_t appVer, uint32_t apiVer, const std::vector<const char*>& enabledLayers);
-  void createLogicalDevice(std::vector<vk::QueueFlags> qFlags);
+  void createLogicalDevice(std::vector<vk::QueueFlags> qFlags, const std::vector<const char*>& requiredExtensions, const std::vector<const char*>& optionalExtensions);
 
+  /// Whether selection.filter lets a device be used
+  bool usablePhysicalDevice(vk::PhysicalDevice device);
+  /// Order mPhysicalDevices by deviceScore, best first, then the ones the filter rejected
+  void sortPhysicalDevices();
+  /// Move the device matching preferred (see DeviceSelection) to the front
+  void preferPhysicalDevice(const std::string& preferred);
+  /// Identifies the set of devices and drivers, for the benchmark cache
+  std::string physicalDevicesSignature();
+  /// Run selection.benchmark on each device, returns the index of the fastest (empty if none of them managed it)
+  std::string benchmarkPhysicalDevices(const DeviceSelection& selection, std::function<std::unique_ptr<DeviceInstance>(uint32_t)> create);
+
+  /// Header written before the driver's cache data, to check the cache is for this device/driver
+  struct PipelineCacheHeader {
+    uint32_t magic;
+    uint32_t headerVersion;
+    uint32_t vendorID;
+    uint32_t deviceID;
+    uint32_t driverVersion;
+    uint8_t pipelineCacheUUID[VK_UUID_SIZE];
+    uint64_t dataSize;
+  };
+  PipelineCacheHeader pipelineCacheHeader();
 
   std::vector<vk::PhysicalDevice> mPhysicalDevices;
+  std::vector<vk::PhysicalDevice> mScoredPhysicalDevices; // Before preferPhysicalDevice, the indices DeviceSelection::preferred uses
+  std::function<bool(vk::Instance, vk::PhysicalDevice)> mFilter;
+  std::string mFilterReason;
 
   vk::UniqueInstance mInstance;
   vk::UniqueDevice mDevice;
+  vk::PhysicalDeviceFeatures mEnabledFeatures;
+  vk::PhysicalDeviceTimelineSemaphoreFeaturesKHR mTimelineSemaphoreFeatures;
+  vk::PhysicalDeviceBufferDeviceAddressFeaturesKHR mBufferDeviceAddressFeatures;
+  std::vector<std::string> mEnabledDeviceExtensions;
+  vk::DispatchLoaderDynamic mDispatch;
 
   std::vector<QueueRef> mQueues;
+
+  vk::UniquePipelineCache mPipelineCache;
+  std::string mPipelineCacheFile;
+
+  /// Shader modules by EmbeddedShader::hash
+  std::map<uint64_t, vk::UniqueShaderModule> mShaderModules;
+  std::mutex mShaderModulesMutex;
+
+  std::map<std::string, MemoryCategory> mMemoryCategories;
+  std::vector<vk::DeviceSize> mTrackedHeapUsage;
+  std::mutex mMemoryMutex;
 };
 
 #endif // DEVICEINSTANCE_H
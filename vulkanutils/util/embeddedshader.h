@@ -0,0 +1,27 @@
+/*
+ * Provided under the BSD 3-Clause License, see LICENSE.
+ *
+ * Copyright (c) 2019, Gareth Francis
+ * All rights reserved.
+ */
+
+#ifndef EMBEDDEDSHADER_H
+#define EMBEDDEDSHADER_H
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * A SPIR-V shader compiled into the binary
+ *
+ * These are generated at build time by embed_shaders (vulkanutils/cmake/embedshaders.cmake)
+ * rather than created by hand
+ */
+struct EmbeddedShader {
+  const char* name;
+  const uint32_t* code; // 4-byte aligned, as required by vkCreateShaderModule
+  size_t size; // In bytes
+  uint64_t hash; // Hash of the SPIR-V, identical shaders have identical hashes
+};
+
+#endif
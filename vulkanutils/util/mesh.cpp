@@ -0,0 +1,108 @@
+/*
+ * Provided under the BSD 3-Clause License, see LICENSE.
+ *
+ * Copyright (c) 2019, Gareth Francis
+ * All rights reserved.
+ */
+
+#include "mesh.h"
+#include "util.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+Mesh::Mesh(const std::vector<glm::vec3>& vertices, const std::vector<uint32_t>& indices)
+  : mVertices(vertices)
+  , mIndices(indices) {
+  if( mIndices.size() % 3 ) throw std::runtime_error("Mesh: Index count must be a multiple of 3");
+  for( auto i : mIndices ) if( i >= mVertices.size() ) throw std::runtime_error("Mesh: Index out of range");
+}
+
+Mesh Mesh::load(const std::string& fileName) {
+  auto dot = fileName.find_last_of('.');
+  auto ext = dot == std::string::npos ? std::string() : fileName.substr(dot + 1);
+  std::transform(ext.begin(), ext.end(), ext.begin(), [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+  if( ext == "obj" ) return loadOBJ(fileName);
+  if( ext == "stl" ) return loadSTL(fileName);
+  throw std::runtime_error("Mesh::load: Unknown mesh format: " + fileName);
+}
+
+Mesh Mesh::loadOBJ(const std::string& fileName) {
+  std::ifstream file(fileName);
+  if( !file.is_open() ) throw std::runtime_error("Mesh::loadOBJ: Failed to open file: " + fileName);
+
+  std::vector<glm::vec3> vertices;
+  std::vector<uint32_t> indices;
+  std::string line;
+  std::vector<uint32_t> face;
+  auto lineNumber = 0u;
+  while( std::getline(file, line) ) {
+    ++lineNumber;
+    std::istringstream str(line);
+    std::string type;
+    str >> type;
+
+    if( type == "v" ) {
+      glm::vec3 v;
+      if( !(str >> v.x >> v.y >> v.z) ) throw std::runtime_error("Mesh::loadOBJ: Bad vertex at line " + std::to_string(lineNumber));
+      vertices.emplace_back(v);
+    } else if( type == "f" ) {
+      // v, v/vt, v//vn or v/vt/vn, only the first part matters
+      // Indices start at 1, negative ones count back from the latest vertex
+      face.clear();
+      std::string vert;
+      while( str >> vert ) {
+        auto index = std::stol(vert.substr(0, vert.find('/')));
+        if( index < 0 ) index += static_cast<long>(vertices.size());
+        else index -= 1;
+        if( index < 0 || index >= static_cast<long>(vertices.size()) ) throw std::runtime_error("Mesh::loadOBJ: Bad face index at line " + std::to_string(lineNumber));
+        face.emplace_back(static_cast<uint32_t>(index));
+      }
+      if( face.size() < 3 ) throw std::runtime_error("Mesh::loadOBJ: Face with less than 3 vertices at line " + std::to_string(lineNumber));
+      for( auto i = 2u; i < face.size(); ++i ) {
+        indices.emplace_back(face[0]);
+        indices.emplace_back(face[i - 1]);
+        indices.emplace_back(face[i]);
+      }
+    }
+    // Everything else (normals, texture coords, materials, groups) isn't needed
+  }
+  return Mesh(vertices, indices);
+}
+
+Mesh Mesh::loadSTL(const std::string& fileName) {
+  // 80 byte header, triangle count, then per triangle a normal, 3 vertices and 2 bytes of attributes
+  constexpr size_t headerSize = 84;
+  constexpr size_t triangleSize = 50;
+  auto data = Util::readFile(fileName);
+  if( data.size() < headerSize ) throw std::runtime_error("Mesh::loadSTL: File too small: " + fileName);
+
+  uint32_t numTriangles = 0;
+  std::memcpy(&numTriangles, data.data() + 80, sizeof(uint32_t));
+  if( data.size() < headerSize + (numTriangles * triangleSize) ) {
+    // ASCII files start with 'solid', but so do plenty of binary ones. The size is the giveaway
+    if( std::strncmp(data.data(), "solid", 5) == 0 ) throw std::runtime_error("Mesh::loadSTL: ASCII STL isn't supported: " + fileName);
+    throw std::runtime_error("Mesh::loadSTL: File truncated: " + fileName);
+  }
+
+  std::vector<glm::vec3> vertices(numTriangles * 3);
+  std::vector<uint32_t> indices(numTriangles * 3);
+  for( auto t = 0u; t < numTriangles; ++t ) {
+    auto tri = data.data() + headerSize + (t * triangleSize) + (3 * sizeof(float)); // Skip the normal
+    for( auto v = 0u; v < 3; ++v ) {
+      float p[3];
+      std::memcpy(p, tri + (v * sizeof(p)), sizeof(p));
+      vertices[(t * 3) + v] = {p[0], p[1], p[2]};
+      indices[(t * 3) + v] = (t * 3) + v;
+    }
+  }
+  return Mesh(vertices, indices);
+}
+
+void Mesh::transform(const glm::mat4& m) {
+  for( auto& v : mVertices ) v = glm::vec3(m * glm::vec4(v, 1.f));
+}
@@ -0,0 +1,49 @@
+/*
+ * Provided under the BSD 3-Clause License, see LICENSE.
+ *
+ * Copyright (c) 2019, Gareth Francis
+ * All rights reserved.
+ */
+
+#ifndef MESH_H
+#define MESH_H
+
+#include "glm/glm.hpp"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ * An indexed triangle mesh, on the host
+ *
+ * Just positions, there's nothing here for rendering. Meant for collision
+ * geometry and the like, see Bvh.
+ */
+class Mesh
+{
+public:
+  Mesh() {}
+  Mesh(const std::vector<glm::vec3>& vertices, const std::vector<uint32_t>& indices);
+
+  /// Load a mesh, .obj or (binary) .stl going by the extension
+  static Mesh load(const std::string& fileName);
+  /// Wavefront OBJ, only the vertices and faces are read. Polygons are split into fans
+  static Mesh loadOBJ(const std::string& fileName);
+  /// Binary STL, vertices aren't shared between triangles
+  static Mesh loadSTL(const std::string& fileName);
+
+  /// Transform all vertices, e.g. to place the mesh in the world
+  void transform(const glm::mat4& m);
+
+  const std::vector<glm::vec3>& vertices() const { return mVertices; }
+  /// 3 per triangle
+  const std::vector<uint32_t>& indices() const { return mIndices; }
+  uint32_t numTriangles() const { return static_cast<uint32_t>(mIndices.size() / 3); }
+
+private:
+  std::vector<glm::vec3> mVertices;
+  std::vector<uint32_t> mIndices;
+};
+
+#endif
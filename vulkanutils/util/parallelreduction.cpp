@@ -0,0 +1,214 @@
+/*
+ * Provided under the BSD 3-Clause License, see LICENSE.
+ *
+ * Copyright (c) 2019, Gareth Francis
+ * All rights reserved.
+ */
+
+#include "parallelreduction.h"
+#include "deviceinstance.h"
+#include "simplebuffer.h"
+#include "pipelines/computepipeline.h"
+
+#include "vulkanutilsshaders.h"
+
+#include <cstring>
+
+ParallelReduction::ParallelReduction(DeviceInstance& deviceInstance,
+                                     const std::vector<Op>& ops,
+                                     uint32_t count,
+                                     const std::vector<vk::Buffer>& inputs,
+                                     uint32_t numResultSlots,
+                                     FirstPass firstPass,
+                                     uint32_t groupSize,
+                                     uint32_t itemsPerInvocation)
+  : mDeviceInstance(deviceInstance)
+  , mOps(ops)
+  , mCount(count)
+  , mNumResultSlots(numResultSlots) {
+  if( mOps.empty() || mOps.size() > 8 ) throw std::runtime_error("ParallelReduction: Records must be 1-8 vec4s");
+  if( mCount == 0 ) throw std::runtime_error("ParallelReduction: Nothing to reduce");
+  if( inputs.empty() ) throw std::runtime_error("ParallelReduction: No inputs");
+  if( mNumResultSlots == 0 ) throw std::runtime_error("ParallelReduction: Need at least 1 result slot");
+  if( groupSize == 0 || (groupSize & (groupSize - 1)) ) throw std::runtime_error("ParallelReduction: Group size must be a power of 2");
+  if( itemsPerInvocation == 0 ) throw std::runtime_error("ParallelReduction: Need at least 1 item per invocation");
+  if( (firstPass.shader == nullptr) != (firstPass.subgroupShader == nullptr) ) throw std::runtime_error("ParallelReduction: First pass needs both shader variants");
+
+  auto limits = mDeviceInstance.physicalDevice().getProperties().limits;
+  while( groupSize > limits.maxComputeWorkGroupInvocations || groupSize > limits.maxComputeWorkGroupSize[0] ) groupSize /= 2;
+
+  mUseSubgroups = subgroupsSupported(mDeviceInstance);
+  mSpecConstants.groupSize = groupSize;
+  mSpecConstants.width = width();
+  mSpecConstants.itemsPerInvocation = itemsPerInvocation;
+  for( auto i = 0u; i < mOps.size(); ++i ) mSpecConstants.ops |= static_cast<uint32_t>(mOps[i]) << (i * 2);
+
+  // Work out the passes up front, each one cuts the count down by a workgroup's worth
+  auto recordsPerGroup = groupSize * itemsPerInvocation;
+  for( auto c = mCount; ; c = (c + recordsPerGroup - 1) / recordsPerGroup ) {
+    mPassCounts.emplace_back(c);
+    if( c <= recordsPerGroup ) break;
+  }
+
+  // Even passes write scratch 0, odd passes scratch 1, apart from the last which writes the result
+  auto recordSize = sizeof(float) * 4 * width();
+  for( auto p = 0u; p + 1 < numPasses(); ++p ) {
+    auto& scratch = mScratch[p % 2];
+    if( scratch ) continue; // Later passes are always smaller
+    scratch.reset(new SimpleBuffer(mDeviceInstance,
+                                   mPassCounts[p + 1] * recordSize,
+                                   vk::BufferUsageFlagBits::eStorageBuffer,
+                                   vk::MemoryPropertyFlagBits::eDeviceLocal,
+                                   {},
+                                   "scratch"));
+  }
+  mResults.reset(new SimpleBuffer(mDeviceInstance,
+                                  mNumResultSlots * recordSize,
+                                  vk::BufferUsageFlagBits::eStorageBuffer,
+                                  vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent));
+  mResultsMapped = mResults->map();
+  std::memset(mResultsMapped, 0, mResults->size());
+
+  mPipeline = createPipeline(mUseSubgroups ? shader_reduce_subgroup_comp : shader_reduce_comp);
+  if( firstPass.shader ) mFirstPipeline = createPipeline(mUseSubgroups ? *firstPass.subgroupShader : *firstPass.shader);
+
+  auto numSets = static_cast<uint32_t>(inputs.size()) + numPasses() - 1;
+  auto poolSize = vk::DescriptorPoolSize()
+      .setType(vk::DescriptorType::eStorageBuffer)
+      .setDescriptorCount(numSets * 2);
+  auto poolInfo = vk::DescriptorPoolCreateInfo()
+      .setFlags({})
+      .setMaxSets(numSets)
+      .setPoolSizeCount(1)
+      .setPPoolSizes(&poolSize);
+  mDescriptorPool = mDeviceInstance.device().createDescriptorPoolUnique(poolInfo);
+
+  auto& firstPipeline = mFirstPipeline ? *mFirstPipeline.get() : *mPipeline.get();
+  auto firstOutput = numPasses() == 1 ? mResults->buffer() : mScratch[0]->buffer();
+  for( auto& input : inputs ) mInputDescriptorSets.emplace_back(createDescriptorSet(firstPipeline, input, firstOutput));
+  for( auto p = 1u; p < numPasses(); ++p ) {
+    auto output = p + 1 == numPasses() ? mResults->buffer() : mScratch[p % 2]->buffer();
+    mPassDescriptorSets.emplace_back(createDescriptorSet(*mPipeline.get(), mScratch[(p - 1) % 2]->buffer(), output));
+  }
+}
+
+ParallelReduction::~ParallelReduction() {}
+
+bool ParallelReduction::subgroupsSupported(DeviceInstance& deviceInstance) {
+  // Subgroup properties are core in 1.1, a 1.0 device doesn't know about them
+  auto& physicalDevice = deviceInstance.physicalDevice();
+  if( physicalDevice.getProperties().apiVersion < VK_API_VERSION_1_1 ) return false;
+
+  auto props = physicalDevice.getProperties2<vk::PhysicalDeviceProperties2, vk::PhysicalDeviceSubgroupProperties>();
+  auto& subgroup = props.get<vk::PhysicalDeviceSubgroupProperties>();
+  auto requiredOps = vk::SubgroupFeatureFlagBits::eBasic | vk::SubgroupFeatureFlagBits::eArithmetic;
+  return (subgroup.supportedStages & vk::ShaderStageFlagBits::eCompute) &&
+         (subgroup.supportedOperations & requiredOps) == requiredOps;
+}
+
+std::unique_ptr<ComputePipeline> ParallelReduction::createPipeline(const EmbeddedShader& shader) {
+  std::unique_ptr<ComputePipeline> pipeline(new ComputePipeline(mDeviceInstance));
+  pipeline->shaders()[vk::ShaderStageFlagBits::eCompute] = pipeline->createShaderModule(shader);
+  // Output, input
+  pipeline->addDescriptorSetLayoutBinding(0, 0, vk::DescriptorType::eStorageBuffer, 1, vk::ShaderStageFlagBits::eCompute);
+  pipeline->addDescriptorSetLayoutBinding(0, 1, vk::DescriptorType::eStorageBuffer, 1, vk::ShaderStageFlagBits::eCompute);
+  pipeline->pushConstants().emplace_back(vk::ShaderStageFlagBits::eCompute, 0, sizeof(PushConstants));
+
+  std::vector<vk::SpecializationMapEntry> specs = {
+    {0, offsetof(SpecConstants, groupSize), sizeof(uint32_t)},
+    {1, offsetof(SpecConstants, width), sizeof(uint32_t)},
+    {2, offsetof(SpecConstants, ops), sizeof(uint32_t)},
+    {3, offsetof(SpecConstants, itemsPerInvocation), sizeof(uint32_t)},
+  };
+  pipeline->specialisationConstants()[vk::ShaderStageFlagBits::eCompute] = vk::SpecializationInfo(static_cast<uint32_t>(specs.size()), specs.data(), sizeof(SpecConstants), &mSpecConstants);
+  pipeline->build();
+  return pipeline;
+}
+
+vk::DescriptorSet ParallelReduction::createDescriptorSet(ComputePipeline& pipeline, vk::Buffer input, vk::Buffer output) {
+  const vk::DescriptorSetLayout dsLayouts[] = {pipeline.descriptorSetLayouts()[0].get()};
+  auto dsInfo = vk::DescriptorSetAllocateInfo()
+      .setDescriptorPool(mDescriptorPool.get())
+      .setDescriptorSetCount(1)
+      .setPSetLayouts(dsLayouts);
+  auto set = mDeviceInstance.device().allocateDescriptorSets(dsInfo).front();
+
+  std::vector<vk::DescriptorBufferInfo> infos = {
+    {output, 0, VK_WHOLE_SIZE},
+    {input, 0, VK_WHOLE_SIZE},
+  };
+  auto wInfo = vk::WriteDescriptorSet()
+      .setDstSet(set)
+      .setDstBinding(0)
+      .setDstArrayElement(0)
+      .setDescriptorCount(static_cast<uint32_t>(infos.size()))
+      .setDescriptorType(vk::DescriptorType::eStorageBuffer)
+      .setPImageInfo(nullptr)
+      .setPBufferInfo(infos.data())
+      .setPTexelBufferView(nullptr);
+  mDeviceInstance.device().updateDescriptorSets(1, &wInfo, 0, nullptr);
+  return set;
+}
+
+void ParallelReduction::cmdReduce(vk::CommandBuffer commandBuffer, uint32_t input, uint32_t resultSlot) {
+  if( input >= mInputDescriptorSets.size() ) throw std::runtime_error("ParallelReduction::cmdReduce: Invalid input");
+  if( resultSlot >= mNumResultSlots ) throw std::runtime_error("ParallelReduction::cmdReduce: Invalid result slot");
+
+  // The last reduction on this queue may still be using the scratch buffers
+  auto reuseBarrier = vk::MemoryBarrier()
+      .setSrcAccessMask(vk::AccessFlagBits::eShaderRead | vk::AccessFlagBits::eShaderWrite)
+      .setDstAccessMask(vk::AccessFlagBits::eShaderWrite);
+  commandBuffer.pipelineBarrier(
+        vk::PipelineStageFlagBits::eComputeShader,
+        vk::PipelineStageFlagBits::eComputeShader,
+        {},
+        1, &reuseBarrier,
+        0, nullptr,
+        0, nullptr
+        );
+
+  auto recordsPerGroup = mSpecConstants.groupSize * mSpecConstants.itemsPerInvocation;
+  for( auto p = 0u; p < numPasses(); ++p ) {
+    auto& pipeline = (p == 0 && mFirstPipeline) ? *mFirstPipeline.get() : *mPipeline.get();
+    auto& descriptorSet = p == 0 ? mInputDescriptorSets[input] : mPassDescriptorSets[p - 1];
+    auto last = p + 1 == numPasses();
+
+    PushConstants params;
+    params.count = mPassCounts[p];
+    params.outputOffset = last ? resultSlot : 0;
+
+    commandBuffer.bindPipeline(vk::PipelineBindPoint::eCompute, pipeline.pipeline());
+    commandBuffer.bindDescriptorSets(vk::PipelineBindPoint::eCompute,
+                                     pipeline.pipelineLayout(),
+                                     0, 1,
+                                     &descriptorSet,
+                                     0, nullptr);
+    commandBuffer.pushConstants(pipeline.pipelineLayout(), vk::ShaderStageFlagBits::eCompute, 0, sizeof(PushConstants), &params);
+    commandBuffer.dispatch((params.count + recordsPerGroup - 1) / recordsPerGroup, 1, 1);
+
+    // Next pass reads what this one wrote, or the host (or later shaders) if that was the last
+    auto passBarrier = vk::MemoryBarrier()
+        .setSrcAccessMask(vk::AccessFlagBits::eShaderWrite)
+        .setDstAccessMask(last ? vk::AccessFlagBits::eHostRead | vk::AccessFlagBits::eShaderRead : vk::AccessFlagBits::eShaderRead);
+    commandBuffer.pipelineBarrier(
+          vk::PipelineStageFlagBits::eComputeShader,
+          last ? vk::PipelineStageFlagBits::eHost | vk::PipelineStageFlagBits::eComputeShader : vk::PipelineStageFlagBits::eComputeShader,
+          {},
+          1, &passBarrier,
+          0, nullptr,
+          0, nullptr
+          );
+  }
+}
+
+vk::Buffer ParallelReduction::resultBuffer() const {
+  return mResults->buffer();
+}
+
+std::vector<std::array<float, 4>> ParallelReduction::result(uint32_t slot) const {
+  if( slot >= mNumResultSlots ) throw std::runtime_error("ParallelReduction::result: Invalid result slot");
+  std::vector<std::array<float, 4>> res(width());
+  auto src = static_cast<const float*>(mResultsMapped) + (slot * width() * 4);
+  std::memcpy(res.data(), src, sizeof(float) * 4 * width());
+  return res;
+}
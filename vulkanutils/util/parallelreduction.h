@@ -0,0 +1,138 @@
+/*
+ * Provided under the BSD 3-Clause License, see LICENSE.
+ *
+ * Copyright (c) 2019, Gareth Francis
+ * All rights reserved.
+ */
+
+#ifndef PARALLELREDUCTION_H
+#define PARALLELREDUCTION_H
+
+#include <vulkan/vulkan.hpp>
+
+#include "util/embeddedshader.h"
+
+#include <array>
+#include <memory>
+#include <vector>
+
+class DeviceInstance;
+class ComputePipeline;
+class SimpleBuffer;
+
+/**
+ * Reduce a buffer down to a handful of values on the GPU (totals, bounds, etc)
+ *
+ * Input is a list of records, each up to 8 vec4s, and each vec4 can be summed or
+ * have its min or max taken. Every pass reduces a workgroup's worth of records to one,
+ * and passes repeat until there's a single record left, which is written to a
+ * host visible result slot. So only a few bytes ever come back to the host.
+ * Results are visible to later compute shaders in the same queue too, so they can
+ * feed more GPU work without a round trip (see resultBuffer).
+ *
+ * Workgroups reduce with subgroup arithmetic if the device supports it in compute shaders,
+ * and fall back to a shared memory tree otherwise.
+ *
+ * If the records aren't sitting in a buffer already (e.g. they're worked out from particles)
+ * the first pass can use a custom shader, which includes reduce.glsl and provides its own
+ * reduceLoad. It needs both a subgroup and shared memory variant.
+ */
+class ParallelReduction
+{
+public:
+  enum class Op : uint32_t {
+    Sum = 0,
+    Min = 1,
+    Max = 2,
+  };
+
+  /// Custom first pass, see reduce.glsl
+  struct FirstPass {
+    const EmbeddedShader* shader = nullptr;
+    const EmbeddedShader* subgroupShader = nullptr;
+  };
+
+  ParallelReduction() = delete;
+  ParallelReduction(const ParallelReduction&) = delete;
+
+  /**
+   * @param ops Operation for each vec4 of a record, also sets the record size
+   * @param count Number of records in each input
+   * @param inputs Buffers which may be reduced, bound to binding 1 of the first pass
+   * @param numResultSlots Number of results which may be in flight at once
+   * @param groupSize Workgroup size, must be a power of 2
+   * @param itemsPerInvocation Records each invocation folds in before the group reduces
+   */
+  ParallelReduction(DeviceInstance& deviceInstance,
+                    const std::vector<Op>& ops,
+                    uint32_t count,
+                    const std::vector<vk::Buffer>& inputs,
+                    uint32_t numResultSlots,
+                    FirstPass firstPass = {},
+                    uint32_t groupSize = 256,
+                    uint32_t itemsPerInvocation = 8);
+  ~ParallelReduction();
+
+  /// Whether the device can do subgroup arithmetic in compute shaders
+  static bool subgroupsSupported(DeviceInstance& deviceInstance);
+  bool usingSubgroups() const { return mUseSubgroups; }
+
+  uint32_t width() const { return static_cast<uint32_t>(mOps.size()); }
+  uint32_t count() const { return mCount; }
+  uint32_t numPasses() const { return static_cast<uint32_t>(mPassCounts.size()); }
+  uint32_t numResultSlots() const { return mNumResultSlots; }
+
+  /**
+   * Record the reduction of an input into a result slot
+   *
+   * The input must already be visible to compute shaders, that's up to the caller.
+   * Once the command buffer has completed the result can be read, until it's resubmitted.
+   */
+  void cmdReduce(vk::CommandBuffer commandBuffer, uint32_t input, uint32_t resultSlot);
+
+  /// Read a result, width() vec4s
+  std::vector<std::array<float, 4>> result(uint32_t slot) const;
+
+  /// Where the results live, for binding to shaders. Each slot is width() vec4s
+  vk::Buffer resultBuffer() const;
+  vk::DeviceSize resultOffset(uint32_t slot) const { return slot * resultSize(); }
+  vk::DeviceSize resultSize() const { return width() * 4 * sizeof(float); }
+
+private:
+  struct SpecConstants {
+    uint32_t groupSize = 256;
+    uint32_t width = 1;
+    uint32_t ops = 0;
+    uint32_t itemsPerInvocation = 8;
+  };
+  struct PushConstants {
+    uint32_t count = 0;
+    uint32_t outputOffset = 0;
+  };
+
+  std::unique_ptr<ComputePipeline> createPipeline(const EmbeddedShader& shader);
+  vk::DescriptorSet createDescriptorSet(ComputePipeline& pipeline, vk::Buffer input, vk::Buffer output);
+
+  DeviceInstance& mDeviceInstance;
+  std::vector<Op> mOps;
+  uint32_t mCount = 0;
+  uint32_t mNumResultSlots = 0;
+  bool mUseSubgroups = false;
+  SpecConstants mSpecConstants;
+
+  // Number of records going into each pass, the last pass produces a single record
+  std::vector<uint32_t> mPassCounts;
+
+  std::unique_ptr<ComputePipeline> mFirstPipeline; // Only if there's a custom first pass
+  std::unique_ptr<ComputePipeline> mPipeline;
+  // Intermediate results ping-pong between these
+  std::unique_ptr<SimpleBuffer> mScratch[2];
+  std::unique_ptr<SimpleBuffer> mResults;
+  void* mResultsMapped = nullptr;
+
+  vk::UniqueDescriptorPool mDescriptorPool;
+  std::vector<vk::DescriptorSet> mInputDescriptorSets; // Owned by pool, first pass for each input
+  std::vector<vk::DescriptorSet> mPassDescriptorSets; // Owned by pool, passes after the first
+};
+
+#endif
@@ -0,0 +1,88 @@
+/*
+ * Provided under the BSD 3-Clause License, see LICENSE.
+ *
+ * Copyright (c) 2019, Gareth Francis
+ * All rights reserved.
+ */
+
+#include "computepipelinevariants.h"
+#include "computepipeline.h"
+#include "deviceinstance.h"
+#include "threadpool.h"
+
+#include <algorithm>
+#include <future>
+
+ComputePipelineVariants::ComputePipelineVariants(DeviceInstance& deviceInstance, ComputePipeline& base)
+  : mDeviceInstance(deviceInstance)
+  , mBase(base) {
+  if( !mBase.pipelineLayout() ) throw std::runtime_error("ComputePipelineVariants: Base pipeline must be built first");
+}
+
+uint32_t ComputePipelineVariants::addVariant(const std::string& name, const Specialisation& spec) {
+  if( !mPipelines.empty() ) throw std::runtime_error("ComputePipelineVariants::addVariant: Variants already built");
+  if( mVariantIndices.find(name) != mVariantIndices.end() ) throw std::runtime_error("ComputePipelineVariants::addVariant: Duplicate variant: " + name);
+  auto index = static_cast<uint32_t>(mVariants.size());
+  mVariants.push_back({name, spec});
+  mVariantIndices[name] = index;
+  return index;
+}
+
+void ComputePipelineVariants::build(ThreadPool& threadPool, uint32_t batchSize) {
+  if( !mPipelines.empty() ) throw std::runtime_error("ComputePipelineVariants::build: Variants already built");
+  auto shader = mBase.shaders().find(vk::ShaderStageFlagBits::eCompute);
+  if( shader == mBase.shaders().end() ) throw std::runtime_error("ComputePipelineVariants::build: Base pipeline has no compute shader");
+  auto module = shader->second;
+  auto layout = mBase.pipelineLayout();
+  auto cache = mDeviceInstance.pipelineCache();
+  auto& device = mDeviceInstance.device();
+  if( batchSize == 0 ) batchSize = 1;
+
+  mPipelines.resize(mVariants.size());
+  std::vector<std::future<void>> batches;
+  for( auto first = 0u; first < mVariants.size(); first += batchSize ) {
+    auto count = std::min(batchSize, static_cast<uint32_t>(mVariants.size()) - first);
+
+    batches.emplace_back(threadPool.run([&, first, count]() {
+      // Create info points into these, so they need to stay put until the pipelines are created
+      std::vector<vk::SpecializationInfo> specInfos(count);
+      std::vector<vk::ComputePipelineCreateInfo> infos(count);
+      for( auto i = 0u; i < count; ++i ) {
+        auto& spec = mVariants[first + i].spec;
+        specInfos[i] = vk::SpecializationInfo(static_cast<uint32_t>(spec.entries.size()), spec.entries.data(), spec.data.size(), spec.data.data());
+
+        auto stage = vk::PipelineShaderStageCreateInfo()
+            .setFlags({})
+            .setStage(vk::ShaderStageFlagBits::eCompute)
+            .setModule(module)
+            .setPName("main")
+            .setPSpecializationInfo(&specInfos[i]);
+
+        infos[i] = vk::ComputePipelineCreateInfo()
+            .setFlags({})
+            .setStage(stage)
+            .setLayout(layout)
+            .setBasePipelineHandle({})
+            .setBasePipelineIndex(-1);
+      }
+
+      // Each batch writes to its own range of mPipelines, no locking needed
+      auto pipelines = device.createComputePipelinesUnique(cache, infos);
+      for( auto i = 0u; i < count; ++i ) mPipelines[first + i] = std::move(pipelines[i]);
+    }));
+  }
+
+  // Let everything finish before rethrowing any failures, the workers reference locals here
+  for( auto& b : batches ) b.wait();
+  for( auto& b : batches ) b.get();
+}
+
+uint32_t ComputePipelineVariants::index(const std::string& name) const {
+  auto it = mVariantIndices.find(name);
+  if( it == mVariantIndices.end() ) throw std::runtime_error("ComputePipelineVariants::index: No such variant: " + name);
+  return it->second;
+}
+
+vk::PipelineLayout& ComputePipelineVariants::pipelineLayout() {
+  return mBase.pipelineLayout();
+}
@@ -0,0 +1,91 @@
+/*
+ * Provided under the BSD 3-Clause License, see LICENSE.
+ *
+ * Copyright (c) 2019, Gareth Francis
+ * All rights reserved.
+ */
+
+#ifndef COMPUTEPIPELINEVARIANTS_H
+#define COMPUTEPIPELINEVARIANTS_H
+
+#include <vulkan/vulkan.hpp>
+
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+class DeviceInstance;
+class ComputePipeline;
+class ThreadPool;
+
+/**
+ * A set of variants of a compute pipeline, differing only in specialisation constants
+ *
+ * Variants share the shader module and pipeline layout of a built ComputePipeline,
+ * so descriptor sets and push constants are compatible between all of them.
+ * All variants are compiled up front, so switching between them is just binding
+ * a different pipeline.
+ */
+class ComputePipelineVariants
+{
+public:
+  /// Specialisation constant values for a variant
+  struct Specialisation {
+    std::vector<vk::SpecializationMapEntry> entries;
+    std::vector<uint8_t> data;
+
+    /// Copy constants out of a struct, entry offsets are relative to the start of the struct
+    template<typename T>
+    static Specialisation fromStruct(const std::vector<vk::SpecializationMapEntry>& entries, const T& constants) {
+      Specialisation spec;
+      spec.entries = entries;
+      spec.data.resize(sizeof(T));
+      std::memcpy(spec.data.data(), &constants, sizeof(T));
+      return spec;
+    }
+  };
+
+  ComputePipelineVariants() = delete;
+  ComputePipelineVariants(const ComputePipelineVariants&) = delete;
+  /// @param base The pipeline to take the shader and layout from, must have been built
+  ComputePipelineVariants(DeviceInstance& deviceInstance, ComputePipeline& base);
+  ~ComputePipelineVariants() {}
+
+  /**
+   * Add a variant, must be called before build
+   * @return Index of the variant, for use with pipeline()
+   */
+  uint32_t addVariant(const std::string& name, const Specialisation& spec);
+
+  /**
+   * Compile all variants
+   *
+   * Variants are split into batches of batchSize, each batch compiled with a single
+   * vkCreateComputePipelines call on the thread pool. All calls use the device's pipeline cache.
+   */
+  void build(ThreadPool& threadPool, uint32_t batchSize = 4);
+
+  uint32_t size() const { return static_cast<uint32_t>(mVariants.size()); }
+  /// Index of a named variant, throws if it doesn't exist
+  uint32_t index(const std::string& name) const;
+  const std::string& name(uint32_t index) const { return mVariants[index].name; }
+  vk::Pipeline pipeline(uint32_t index) const { return mPipelines[index].get(); }
+  vk::Pipeline pipeline(const std::string& name) const { return pipeline(index(name)); }
+  /// The layout shared by all variants
+  vk::PipelineLayout& pipelineLayout();
+
+private:
+  struct Variant {
+    std::string name;
+    Specialisation spec;
+  };
+
+  DeviceInstance& mDeviceInstance;
+  ComputePipeline& mBase;
+  std::vector<Variant> mVariants;
+  std::map<std::string, uint32_t> mVariantIndices;
+  std::vector<vk::UniquePipeline> mPipelines;
+};
+
+#endif
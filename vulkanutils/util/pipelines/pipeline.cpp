@@ -24,7 +24,7 @@ vk::Pipeline& Pipeline::build() {
   return mPipeline.get();
 }
 
-vk::UniqueShaderModule Pipeline::createShaderModule(const std::string& fileName) {
+vk::ShaderModule Pipeline::createShaderModule(const std::string& fileName) {
   auto shaderCode = Util::readFile(fileName);
   // Note that data passed to info is as uint32_t*, so must be 4-byte aligned
   // According to tutorial std::vector already satisfies worst case alignment needs
@@ -34,7 +34,12 @@ vk::UniqueShaderModule Pipeline::createShaderModule(const std::string& fileName)
       .setCodeSize(shaderCode.size())
       .setPCode(reinterpret_cast<const uint32_t*>(shaderCode.data()))
       ;
-  return mDeviceInstance.device().createShaderModuleUnique(info);
+  mOwnedShaderModules.emplace_back(mDeviceInstance.device().createShaderModuleUnique(info));
+  return mOwnedShaderModules.back().get();
+}
+
+vk::ShaderModule Pipeline::createShaderModule(const EmbeddedShader& shader) {
+  return mDeviceInstance.shaderModule(shader);
 }
 
 void Pipeline::addDescriptorSetLayoutBinding( uint32_t layoutIndex, uint32_t binding, vk::DescriptorType type, uint32_t count, vk::ShaderStageFlags stageFlags) {
@@ -43,12 +48,29 @@ void Pipeline::addDescriptorSetLayoutBinding( uint32_t layoutIndex, uint32_t bin
       .setDescriptorType(type)
       .setDescriptorCount(count)
       .setStageFlags(stageFlags);
-  if( mDescriptorSetLayoutBindings.size() <= layoutIndex ) mDescriptorSetLayoutBindings.resize(layoutIndex + 1);
+  if( mDescriptorSetLayoutBindings.size() <= layoutIndex ) {
+    mDescriptorSetLayoutBindings.resize(layoutIndex + 1);
+    mImmutableSamplers.resize(layoutIndex + 1);
+  }
   mDescriptorSetLayoutBindings[layoutIndex].emplace_back(dslBinding);
+  mImmutableSamplers[layoutIndex].emplace_back();
+}
+
+void Pipeline::addDescriptorSetLayoutBinding( uint32_t layoutIndex, uint32_t binding, vk::DescriptorType type, vk::ShaderStageFlags stageFlags, const std::vector<vk::Sampler>& immutableSamplers) {
+  if( type != vk::DescriptorType::eSampler && type != vk::DescriptorType::eCombinedImageSampler ) throw std::runtime_error("Pipeline::addDescriptorSetLayoutBinding: Immutable samplers need a sampler type");
+  if( immutableSamplers.empty() ) throw std::runtime_error("Pipeline::addDescriptorSetLayoutBinding: No samplers");
+  addDescriptorSetLayoutBinding(layoutIndex, binding, type, static_cast<uint32_t>(immutableSamplers.size()), stageFlags);
+  mImmutableSamplers[layoutIndex].back() = immutableSamplers;
 }
 
 void Pipeline::createDescriptorSetLayouts() {
-  for( auto& dslB : mDescriptorSetLayoutBindings ) {
+  for( auto l = 0u; l < mDescriptorSetLayoutBindings.size(); ++l ) {
+    auto& dslB = mDescriptorSetLayoutBindings[l];
+    // Point at the samplers now they've stopped moving around
+    for( auto b = 0u; b < dslB.size(); ++b ) {
+      auto& samplers = mImmutableSamplers[l][b];
+      dslB[b].setPImmutableSamplers(samplers.empty() ? nullptr : samplers.data());
+    }
     auto createInfo = vk::DescriptorSetLayoutCreateInfo()
         .setBindingCount(dslB.size())
         .setPBindings(dslB.data());
@@ -63,7 +85,7 @@ std::vector<vk::PipelineShaderStageCreateInfo> Pipeline::createShaderStageInfo()
     auto info = vk::PipelineShaderStageCreateInfo()
         .setFlags({})
         .setStage(s.first)
-        .setModule(s.second.get())
+        .setModule(s.second)
         .setPName("main")
         .setPSpecializationInfo(specConstants == mSpecialisationConstants.end() ? nullptr : &(specConstants->second));
     shaderStages.emplace_back(info);
@@ -10,6 +10,8 @@
 
 #include <vulkan/vulkan.hpp>
 
+#include "util/embeddedshader.h"
+
 #include <vector>
 #include <map>
 
@@ -37,13 +39,19 @@ public:
   /**
    * Load a shader from file and build a shader module
    *
-   * The caller is responsible for management of the returned module
-   * It must not be deleted until all pipelines which reference the shader
-   * have been initialised.
+   * The module is owned by this pipeline and destroyed along with it
+   */
+  vk::ShaderModule createShaderModule(const std::string& fileName);
+
+  /**
+   * Get the shader module for an embedded shader
+   *
+   * The module is owned by the DeviceInstance and may be shared with other pipelines
    */
-  vk::UniqueShaderModule createShaderModule(const std::string& fileName);
+  vk::ShaderModule createShaderModule(const EmbeddedShader& shader);
 
-  std::map<vk::ShaderStageFlagBits, vk::UniqueShaderModule>& shaders() { return mShaders; }
+  /// Shaders for each stage, modules are not owned by the map
+  std::map<vk::ShaderStageFlagBits, vk::ShaderModule>& shaders() { return mShaders; }
 
   vk::Pipeline& pipeline() { return mPipeline.get(); }
   vk::PipelineLayout& pipelineLayout() { return mPipelineLayout.get(); }
@@ -61,6 +69,13 @@ public:
    * @param stageFlags Shader stage flags (likely vk::ShaderStageFlagBits::eCompute)
    */
   void addDescriptorSetLayoutBinding( uint32_t layoutIndex, uint32_t binding, vk::DescriptorType type, uint32_t count, vk::ShaderStageFlags stageFlags);
+  /**
+   * Descriptor set layout binding with immutable samplers, one per descriptor
+   *
+   * For samplers/combined image samplers which never change. The samplers are baked into
+   * the layout, so descriptor set writes only need the image. Samplers must outlive the pipeline
+   */
+  void addDescriptorSetLayoutBinding( uint32_t layoutIndex, uint32_t binding, vk::DescriptorType type, vk::ShaderStageFlags stageFlags, const std::vector<vk::Sampler>& immutableSamplers);
   const std::vector<vk::UniqueDescriptorSetLayout>& descriptorSetLayouts() const { return mDescriptorSetLayouts; }
 
   /// Push Constants
@@ -72,10 +87,13 @@ protected:
   std::vector<vk::PipelineShaderStageCreateInfo> createShaderStageInfo();
 
   DeviceInstance& mDeviceInstance;
-  std::map<vk::ShaderStageFlagBits, vk::UniqueShaderModule> mShaders;
+  std::map<vk::ShaderStageFlagBits, vk::ShaderModule> mShaders;
+  std::vector<vk::UniqueShaderModule> mOwnedShaderModules;
   std::map<vk::ShaderStageFlagBits, vk::SpecializationInfo> mSpecialisationConstants;
   /// Layout index, binding info
   std::vector<std::vector<vk::DescriptorSetLayoutBinding>> mDescriptorSetLayoutBindings;
+  /// Layout index, binding info index, samplers (empty if not immutable)
+  std::vector<std::vector<std::vector<vk::Sampler>>> mImmutableSamplers;
   std::vector<vk::UniqueDescriptorSetLayout> mDescriptorSetLayouts;
 
   std::vector<vk::PushConstantRange> mPushConstants;
@@ -0,0 +1,292 @@
+/*
+ * Provided under the BSD 3-Clause License, see LICENSE.
+ *
+ * Copyright (c) 2019, Gareth Francis
+ * All rights reserved.
+ */
+
+#include "queryprofiler.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+
+namespace {
+  // Statistic flags must be listed in bit order, as that's the order results are written in
+  const vk::QueryPipelineStatisticFlags computeStatistics =
+      vk::QueryPipelineStatisticFlagBits::eComputeShaderInvocations;
+  const vk::QueryPipelineStatisticFlags graphicsStatistics =
+      vk::QueryPipelineStatisticFlagBits::eInputAssemblyVertices |
+      vk::QueryPipelineStatisticFlagBits::eVertexShaderInvocations |
+      vk::QueryPipelineStatisticFlagBits::eClippingPrimitives |
+      vk::QueryPipelineStatisticFlagBits::eFragmentShaderInvocations;
+}
+
+QueryProfiler::QueryProfiler(DeviceInstance& deviceInstance, uint32_t numSlots, uint32_t maxScopes, uint32_t historySize)
+  : mDeviceInstance(deviceInstance)
+  , mNumSlots(numSlots)
+  , mMaxScopes(maxScopes)
+  , mHistorySize(historySize) {
+  auto props = mDeviceInstance.physicalDevice().getProperties();
+  // If this isn't set individual queues may still support timestamps
+  // but for simplicity just don't bother in that case
+  mEnabled = props.limits.timestampComputeAndGraphics;
+  mTimestampPeriod = props.limits.timestampPeriod;
+  mStatisticsEnabled = mEnabled && mDeviceInstance.enabledFeatures().pipelineStatisticsQuery;
+  if( !mEnabled ) return;
+
+  auto numQueries = mNumSlots * mMaxScopes;
+  auto info = vk::QueryPoolCreateInfo()
+      .setFlags({})
+      .setQueryType(vk::QueryType::eTimestamp)
+      .setQueryCount(numQueries * 2);
+  mTimestampPool = mDeviceInstance.device().createQueryPoolUnique(info);
+
+  if( mStatisticsEnabled ) {
+    info.setQueryType(vk::QueryType::ePipelineStatistics)
+        .setQueryCount(numQueries)
+        .setPipelineStatistics(computeStatistics);
+    mComputeStatisticsPool = mDeviceInstance.device().createQueryPoolUnique(info);
+    mComputeStatisticsNames = {"cs invocations"};
+
+    info.setPipelineStatistics(graphicsStatistics);
+    mGraphicsStatisticsPool = mDeviceInstance.device().createQueryPoolUnique(info);
+    mGraphicsStatisticsNames = {"ia vertices", "vs invocations", "clip primitives", "fs invocations"};
+  }
+}
+
+QueryProfiler::~QueryProfiler() {
+  if( mReportOnExit ) report(std::cout);
+}
+
+uint32_t QueryProfiler::addScope(const std::string& name, ScopeType type, const DeviceInstance::QueueRef& queue) {
+  std::lock_guard<std::mutex> lock(mMutex);
+  if( mScopes.size() == mMaxScopes ) throw std::runtime_error("QueryProfiler::addScope: Too many scopes");
+
+  Scope scope;
+  scope.name = name;
+  scope.type = type;
+  scope.timestampMask = timestampMask(queue.famIndex);
+  scope.queueFamily = queue.famIndex;
+  scope.traceTrack = "GPU queue family " + std::to_string(queue.famIndex);
+  scope.lastBeginTimestamp.resize(mNumSlots, 0);
+  scope.historyMs.reserve(mHistorySize);
+  scope.historyStats.reserve(mHistorySize);
+  mScopes.emplace_back(scope);
+
+  // No valid bits means the queue doesn't support timestamps, scope will never record anything
+  if( scope.timestampMask == 0 ) std::cerr << "QueryProfiler::addScope: Queue doesn't support timestamps, scope '" << name << "' disabled" << std::endl;
+  return static_cast<uint32_t>(mScopes.size() - 1);
+}
+
+uint64_t QueryProfiler::timestampMask(uint32_t queueFamily) {
+  auto validBits = mDeviceInstance.physicalDevice().getQueueFamilyProperties()[queueFamily].timestampValidBits;
+  return validBits >= 64 ? ~0ull : (1ull << validBits) - 1;
+}
+
+vk::QueryPool QueryProfiler::statisticsPool(ScopeType type) {
+  if( !mStatisticsEnabled ) return {};
+  switch(type) {
+    case ScopeType::Compute: return mComputeStatisticsPool.get();
+    case ScopeType::Graphics: return mGraphicsStatisticsPool.get();
+    case ScopeType::Transfer: return {};
+  }
+  return {};
+}
+
+const std::vector<std::string>& QueryProfiler::statisticsNames(ScopeType type) const {
+  static const std::vector<std::string> none;
+  if( !mStatisticsEnabled ) return none;
+  switch(type) {
+    case ScopeType::Compute: return mComputeStatisticsNames;
+    case ScopeType::Graphics: return mGraphicsStatisticsNames;
+    case ScopeType::Transfer: return none;
+  }
+  return none;
+}
+
+void QueryProfiler::cmdBeginScope(vk::CommandBuffer& commandBuffer, uint32_t slot, uint32_t scope) {
+  if( !mEnabled || mScopes[scope].timestampMask == 0 ) return;
+  auto q = queryIndex(slot, scope);
+
+  // Queries must be reset before use, and resetting inside the command buffer
+  // means we don't care whether it's re-recorded every frame or not
+  commandBuffer.resetQueryPool(mTimestampPool.get(), q * 2, 2);
+  auto statsPool = statisticsPool(mScopes[scope].type);
+  if( statsPool ) commandBuffer.resetQueryPool(statsPool, q, 1);
+
+  commandBuffer.writeTimestamp(vk::PipelineStageFlagBits::eTopOfPipe, mTimestampPool.get(), q * 2);
+  if( statsPool ) commandBuffer.beginQuery(statsPool, q, {});
+}
+
+void QueryProfiler::cmdEndScope(vk::CommandBuffer& commandBuffer, uint32_t slot, uint32_t scope) {
+  if( !mEnabled || mScopes[scope].timestampMask == 0 ) return;
+  auto q = queryIndex(slot, scope);
+
+  auto statsPool = statisticsPool(mScopes[scope].type);
+  if( statsPool ) commandBuffer.endQuery(statsPool, q);
+  commandBuffer.writeTimestamp(vk::PipelineStageFlagBits::eBottomOfPipe, mTimestampPool.get(), (q * 2) + 1);
+}
+
+void QueryProfiler::collect(uint32_t slot) {
+  if( !mEnabled ) return;
+  std::lock_guard<std::mutex> lock(mMutex);
+  auto& device = mDeviceInstance.device();
+
+  for( auto s = 0u; s < mScopes.size(); ++s ) {
+    auto& scope = mScopes[s];
+    if( scope.timestampMask == 0 ) continue;
+    auto q = queryIndex(slot, s);
+
+    // Each query returns value, availability
+    // No wait flag here, if it isn't ready we'll get it next time
+    uint64_t ts[4] = {0, 0, 0, 0};
+    auto res = device.getQueryPoolResults(mTimestampPool.get(), q * 2, 2, sizeof(ts), ts, sizeof(uint64_t) * 2,
+                                          vk::QueryResultFlagBits::e64 | vk::QueryResultFlagBits::eWithAvailability);
+    if( res != vk::Result::eSuccess && res != vk::Result::eNotReady ) continue;
+    if( ts[1] == 0 || ts[3] == 0 ) continue;
+
+    auto begin = ts[0] & scope.timestampMask;
+    auto end = ts[2] & scope.timestampMask;
+    // Same submission as last time, command buffer hasn't been resubmitted yet
+    if( begin == scope.lastBeginTimestamp[slot] ) continue;
+
+    std::vector<double> stats;
+    auto statsPool = statisticsPool(scope.type);
+    if( statsPool ) {
+      auto numStats = statisticsNames(scope.type).size();
+      std::vector<uint64_t> statsResult(numStats + 1, 0);
+      res = device.getQueryPoolResults(statsPool, q, 1, statsResult.size() * sizeof(uint64_t), statsResult.data(), statsResult.size() * sizeof(uint64_t),
+                                       vk::QueryResultFlagBits::e64 | vk::QueryResultFlagBits::eWithAvailability);
+      // Timestamps are written after the statistics query ends, so this really should be ready
+      if( res != vk::Result::eSuccess || statsResult.back() == 0 ) continue;
+      for( auto i = 0u; i < numStats; ++i ) stats.emplace_back(static_cast<double>(statsResult[i]));
+    }
+
+    scope.lastBeginTimestamp[slot] = begin;
+    auto ms = static_cast<double>((end - begin) & scope.timestampMask) * mTimestampPeriod / 1000000.0;
+
+#ifdef VULKANUTILS_TRACE
+    auto calibration = mCalibrations.find(scope.queueFamily);
+    if( calibration != mCalibrations.end() ) {
+      // Timestamps wrap at the valid bits, so the difference is modulo the mask
+      // Slots are collected out of order, so more than half way round means the sample is behind
+      auto& c = calibration->second;
+      auto ahead = (begin - c.gpuTimestamp) & scope.timestampMask;
+      auto behind = (c.gpuTimestamp - begin) & scope.timestampMask;
+      auto offsetTicks = ahead <= (scope.timestampMask >> 1) ? static_cast<double>(ahead) : -static_cast<double>(behind);
+      auto startUs = c.cpuUs + (offsetTicks * mTimestampPeriod / 1000.0);
+      Trace::gpuEvent(scope.name, scope.traceTrack, startUs, ms * 1000.0);
+      c.cpuUs = startUs;
+      c.gpuTimestamp = begin;
+    }
+#endif
+
+    if( scope.historyMs.size() < mHistorySize ) {
+      scope.historyMs.emplace_back(ms);
+      scope.historyStats.emplace_back(stats);
+    } else {
+      scope.historyMs[scope.historyNext] = ms;
+      scope.historyStats[scope.historyNext] = stats;
+    }
+    scope.historyNext = (scope.historyNext + 1) % mHistorySize;
+    scope.samples++;
+  }
+}
+
+void QueryProfiler::calibrate(DeviceInstance::QueueRef& queue) {
+  auto mask = timestampMask(queue.famIndex);
+  if( !mEnabled || mask == 0 ) return;
+  auto& device = mDeviceInstance.device();
+
+  auto poolInfo = vk::QueryPoolCreateInfo()
+      .setFlags({})
+      .setQueryType(vk::QueryType::eTimestamp)
+      .setQueryCount(1);
+  auto queryPool = device.createQueryPoolUnique(poolInfo);
+  auto commandPool = mDeviceInstance.createCommandPool({vk::CommandPoolCreateFlagBits::eTransient}, queue);
+  auto commandBuffers = device.allocateCommandBuffersUnique(vk::CommandBufferAllocateInfo()
+                                                            .setCommandPool(commandPool.get())
+                                                            .setCommandBufferCount(1)
+                                                            .setLevel(vk::CommandBufferLevel::ePrimary));
+  auto& commandBuffer = commandBuffers.front().get();
+  commandBuffer.begin(vk::CommandBufferBeginInfo().setFlags(vk::CommandBufferUsageFlagBits::eOneTimeSubmit));
+  commandBuffer.resetQueryPool(queryPool.get(), 0, 1);
+  commandBuffer.writeTimestamp(vk::PipelineStageFlagBits::eTopOfPipe, queryPool.get(), 0);
+  commandBuffer.end();
+
+  // The timestamp is written somewhere between submit and the fence wait returning
+  // so take the midpoint. Without VK_EXT_calibrated_timestamps this is about the best we can do
+  auto fence = device.createFenceUnique({});
+  auto subInfo = vk::SubmitInfo()
+      .setCommandBufferCount(1)
+      .setPCommandBuffers(&commandBuffer);
+  auto cpuStart = Trace::nowUs();
+  {
+    std::lock_guard<std::mutex> queueLock(*queue.mutex);
+    queue.queue.submit(1, &subInfo, fence.get());
+  }
+  device.waitForFences(1, &fence.get(), true, std::numeric_limits<uint64_t>::max());
+  auto cpuEnd = Trace::nowUs();
+
+  uint64_t gpuTimestamp = 0;
+  auto res = device.getQueryPoolResults(queryPool.get(), 0, 1, sizeof(gpuTimestamp), &gpuTimestamp, sizeof(gpuTimestamp),
+                                        vk::QueryResultFlagBits::e64 | vk::QueryResultFlagBits::eWait);
+  if( res != vk::Result::eSuccess ) return;
+
+  std::lock_guard<std::mutex> lock(mMutex);
+  auto& c = mCalibrations[queue.famIndex];
+  c.cpuUs = (cpuStart + cpuEnd) / 2.0;
+  c.gpuTimestamp = gpuTimestamp & mask;
+}
+
+QueryProfiler::Statistics QueryProfiler::statistics(uint32_t scope) const {
+  std::lock_guard<std::mutex> lock(mMutex);
+  auto& s = mScopes[scope];
+
+  Statistics result;
+  result.name = s.name;
+  result.samples = s.samples;
+  if( s.historyMs.empty() ) return result;
+
+  auto sorted = s.historyMs;
+  std::sort(sorted.begin(), sorted.end());
+  double total = 0.;
+  for( auto& v : sorted ) total += v;
+  auto p99Index = static_cast<size_t>(std::ceil(sorted.size() * 0.99)) - 1;
+
+  result.minMs = sorted.front();
+  result.avgMs = total / sorted.size();
+  result.p99Ms = sorted[std::min(p99Index, sorted.size() - 1)];
+
+  auto& names = statisticsNames(s.type);
+  for( auto i = 0u; i < names.size(); ++i ) {
+    double statTotal = 0.;
+    for( auto& h : s.historyStats ) statTotal += h[i];
+    result.pipelineStatistics.emplace_back(names[i], statTotal / s.historyStats.size());
+  }
+  return result;
+}
+
+void QueryProfiler::report(std::ostream& stream) const {
+  stream << "==== GPU Pass Timings (ms) ====" << "\n";
+  if( !mEnabled ) {
+    stream << "Timestamps not supported by device" << "\n" << std::endl;
+    return;
+  }
+
+  for( auto i = 0u; i < mScopes.size(); ++i ) {
+    auto stats = statistics(i);
+    stream << std::left << std::setw(16) << stats.name << std::right << std::fixed << std::setprecision(3)
+           << " min: " << std::setw(8) << stats.minMs
+           << " avg: " << std::setw(8) << stats.avgMs
+           << " p99: " << std::setw(8) << stats.p99Ms
+           << " samples: " << stats.samples << "\n";
+    for( auto& p : stats.pipelineStatistics ) {
+      stream << "    " << std::left << std::setw(16) << p.first << std::right << std::setprecision(0) << p.second << "\n";
+    }
+  }
+  stream << std::endl;
+}
@@ -0,0 +1,164 @@
+/*
+ * Provided under the BSD 3-Clause License, see LICENSE.
+ *
+ * Copyright (c) 2019, Gareth Francis
+ * All rights reserved.
+ */
+
+#ifndef QUERYPROFILER_H
+#define QUERYPROFILER_H
+
+#include <vulkan/vulkan.hpp>
+
+#include "deviceinstance.h"
+
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+/**
+ * GPU timing of recorded passes via query pools
+ *
+ * Each scope gets a pair of timestamps, and if the device supports it
+ * a pipeline statistics query, written into the command buffer around a pass.
+ *
+ * Queries are split into slots, one per command buffer set that may be in flight at once
+ * (normally one per frame in flight). Each scope resets its own queries when it begins, so
+ * command buffers which are recorded once and resubmitted are fine.
+ *
+ * Results are never waited on, collect(slot) grabs whatever is available and skips the
+ * rest. Collected samples are kept in a rolling window per scope.
+ */
+class QueryProfiler
+{
+public:
+  /// What kind of work a scope surrounds, determines which pipeline statistics are captured
+  enum class ScopeType {
+    Compute,
+    Graphics,
+    Transfer,
+  };
+
+  struct Statistics {
+    std::string name;
+    uint64_t samples = 0; // Total samples collected, not just those in the window
+    double minMs = 0.;
+    double avgMs = 0.;
+    double p99Ms = 0.;
+    /// Averaged pipeline statistics, as pairs of (name, value)
+    std::vector<std::pair<std::string, double>> pipelineStatistics;
+  };
+
+  QueryProfiler() = delete;
+  QueryProfiler(const QueryProfiler&) = delete;
+  QueryProfiler(QueryProfiler&&) = delete;
+
+  /**
+   * @param numSlots Number of query sets, one for each frame which may be in flight
+   * @param maxScopes Maximum number of scopes which may be registered
+   * @param historySize Number of samples in the rolling window used for statistics
+   */
+  QueryProfiler(DeviceInstance& deviceInstance, uint32_t numSlots, uint32_t maxScopes = 16, uint32_t historySize = 512);
+  ~QueryProfiler();
+
+  /// Whether the device supports timestamps, if not all cmd methods are no-ops
+  bool enabled() const { return mEnabled; }
+
+  /**
+   * Register a scope
+   * @param queue The queue the scope will be submitted to, used to check timestamp support
+   * @return Scope ID to pass to cmdBeginScope/cmdEndScope
+   */
+  uint32_t addScope(const std::string& name, ScopeType type, const DeviceInstance::QueueRef& queue);
+
+  /**
+   * Begin a scope
+   * Must be called outside of a render pass
+   */
+  void cmdBeginScope(vk::CommandBuffer& commandBuffer, uint32_t slot, uint32_t scope);
+  /**
+   * End a scope
+   * Must be called outside of a render pass, in the same command buffer as cmdBeginScope
+   */
+  void cmdEndScope(vk::CommandBuffer& commandBuffer, uint32_t slot, uint32_t scope);
+
+  /**
+   * Read back any completed results for a slot
+   * Doesn't wait for the GPU, scopes which aren't available yet are picked up
+   * on a later call
+   */
+  void collect(uint32_t slot);
+
+  /**
+   * Measure the offset between a queue family's GPU timestamp clock and the trace clock
+   *
+   * Submits a single timestamp write and waits for it, so call during startup.
+   * Families don't share a clock, so calibrate a queue from each family with scopes on it.
+   * Once calibrated collected samples are also added to the CPU trace, when enabled
+   */
+  void calibrate(DeviceInstance::QueueRef& queue);
+
+  /// Rolling statistics for a scope
+  Statistics statistics(uint32_t scope) const;
+  uint32_t numScopes() const { return static_cast<uint32_t>(mScopes.size()); }
+
+  /// Print statistics for all scopes
+  void report(std::ostream& stream) const;
+  /// Print a report to std::cout on destruction
+  void reportOnExit(bool enable) { mReportOnExit = enable; }
+
+private:
+  struct Scope {
+    std::string name;
+    ScopeType type;
+    uint64_t timestampMask = 0;
+    uint32_t queueFamily = 0;
+    std::string traceTrack;
+
+    /// Raw begin timestamp of the last sample collected for each slot, to avoid counting samples twice
+    std::vector<uint64_t> lastBeginTimestamp;
+
+    uint64_t samples = 0;
+    std::vector<double> historyMs;
+    std::vector<std::vector<double>> historyStats;
+    uint32_t historyNext = 0;
+  };
+
+  vk::QueryPool statisticsPool(ScopeType type);
+  const std::vector<std::string>& statisticsNames(ScopeType type) const;
+  uint32_t queryIndex(uint32_t slot, uint32_t scope) const { return (slot * mMaxScopes) + scope; }
+  /// Valid bits of a queue family's timestamps, 0 if it has none
+  uint64_t timestampMask(uint32_t queueFamily);
+
+  DeviceInstance& mDeviceInstance;
+  uint32_t mNumSlots;
+  uint32_t mMaxScopes;
+  uint32_t mHistorySize;
+  double mTimestampPeriod = 1.0; // ns per tick
+  bool mEnabled = false;
+  bool mStatisticsEnabled = false;
+  bool mReportOnExit = false;
+
+  // Trace clock time of a known GPU timestamp, for each calibrated queue family
+  // Moved along to each sample as it's collected, so the offset to the next one is never
+  // more than a frame or so, however many times the timestamps wrap in a long run
+  struct Calibration {
+    double cpuUs = 0.;
+    uint64_t gpuTimestamp = 0;
+  };
+  std::map<uint32_t, Calibration> mCalibrations;
+
+  // Timestamp pool has 2 queries per scope per slot, statistics pools 1
+  vk::UniqueQueryPool mTimestampPool;
+  vk::UniqueQueryPool mComputeStatisticsPool;
+  vk::UniqueQueryPool mGraphicsStatisticsPool;
+  std::vector<std::string> mComputeStatisticsNames;
+  std::vector<std::string> mGraphicsStatisticsNames;
+
+  std::vector<Scope> mScopes;
+  mutable std::mutex mMutex;
+};
+
+#endif
@@ -0,0 +1,89 @@
+/*
+ * Provided under the BSD 3-Clause License, see LICENSE.
+ *
+ * Copyright (c) 2019, Gareth Francis
+ * All rights reserved.
+ */
+
+#include "queueownership.h"
+#include "simplebuffer.h"
+
+bool QueueOwnership::transferNeeded(const DeviceInstance::QueueRef& srcQueue, const DeviceInstance::QueueRef& dstQueue, const SimpleBuffer& buffer) {
+  return srcQueue.famIndex != dstQueue.famIndex && !buffer.concurrent();
+}
+
+void QueueOwnership::cmdRelease(vk::CommandBuffer commandBuffer,
+                                const DeviceInstance::QueueRef& srcQueue, const DeviceInstance::QueueRef& dstQueue,
+                                SimpleBuffer& buffer, Access src, Access dst) {
+  // Nothing to release within a family, the acquire side deals with it
+  if( !transferNeeded(srcQueue, dstQueue, buffer) ) return;
+
+  // dst access is ignored for a release, the destination queue can't be synchronised with from here
+  auto barrier = vk::BufferMemoryBarrier()
+      .setSrcAccessMask(src.access)
+      .setDstAccessMask({})
+      .setSrcQueueFamilyIndex(srcQueue.famIndex)
+      .setDstQueueFamilyIndex(dstQueue.famIndex)
+      .setBuffer(buffer.buffer())
+      .setOffset(0)
+      .setSize(VK_WHOLE_SIZE);
+
+  commandBuffer.pipelineBarrier(
+        src.stages,
+        vk::PipelineStageFlagBits::eBottomOfPipe,
+        {},
+        0, nullptr,
+        1, &barrier,
+        0, nullptr
+        );
+}
+
+void QueueOwnership::cmdAcquire(vk::CommandBuffer commandBuffer,
+                                const DeviceInstance::QueueRef& srcQueue, const DeviceInstance::QueueRef& dstQueue,
+                                SimpleBuffer& buffer, Access src, Access dst) {
+  if( transferNeeded(srcQueue, dstQueue, buffer) ) {
+    // Must match the release exactly, other than the access masks
+    // The semaphore wait has already handled execution order
+    auto barrier = vk::BufferMemoryBarrier()
+        .setSrcAccessMask({})
+        .setDstAccessMask(dst.access)
+        .setSrcQueueFamilyIndex(srcQueue.famIndex)
+        .setDstQueueFamilyIndex(dstQueue.famIndex)
+        .setBuffer(buffer.buffer())
+        .setOffset(0)
+        .setSize(VK_WHOLE_SIZE);
+
+    commandBuffer.pipelineBarrier(
+          vk::PipelineStageFlagBits::eTopOfPipe,
+          dst.stages,
+          {},
+          0, nullptr,
+          1, &barrier,
+          0, nullptr
+          );
+    return;
+  }
+
+  // Concurrent buffer on another family, the semaphore is all that's needed
+  // (src stages might not even exist on this queue)
+  if( srcQueue.famIndex != dstQueue.famIndex ) return;
+
+  // Same family, just a normal barrier
+  auto barrier = vk::BufferMemoryBarrier()
+      .setSrcAccessMask(src.access)
+      .setDstAccessMask(dst.access)
+      .setSrcQueueFamilyIndex(VK_QUEUE_FAMILY_IGNORED)
+      .setDstQueueFamilyIndex(VK_QUEUE_FAMILY_IGNORED)
+      .setBuffer(buffer.buffer())
+      .setOffset(0)
+      .setSize(VK_WHOLE_SIZE);
+
+  commandBuffer.pipelineBarrier(
+        src.stages,
+        dst.stages,
+        {},
+        0, nullptr,
+        1, &barrier,
+        0, nullptr
+        );
+}
@@ -0,0 +1,53 @@
+/*
+ * Provided under the BSD 3-Clause License, see LICENSE.
+ *
+ * Copyright (c) 2019, Gareth Francis
+ * All rights reserved.
+ */
+
+#ifndef QUEUEOWNERSHIP_H
+#define QUEUEOWNERSHIP_H
+
+#include <vulkan/vulkan.hpp>
+
+#include "deviceinstance.h"
+
+class SimpleBuffer;
+
+/**
+ * Barriers for handing a buffer from one queue to another
+ *
+ * Exclusive buffers moving between queue families need a release barrier on the source queue
+ * and a matching acquire barrier on the destination queue, with a semaphore in between.
+ * Within a family ownership doesn't change, so a plain barrier on the destination is enough,
+ * which is also what orders things when both sides are on the same queue.
+ * Concurrent buffers moving between families need nothing, the semaphore covers it.
+ *
+ * Call both cmdRelease and cmdAcquire with the same arguments, and let these work out
+ * which (if any) barriers are needed.
+ */
+class QueueOwnership
+{
+public:
+  /// Stages and access on one side of the transfer
+  struct Access {
+    vk::PipelineStageFlags stages;
+    vk::AccessFlags access;
+  };
+
+  QueueOwnership() = delete;
+
+  /// Whether a release/acquire pair is needed to move buffer between the queues
+  static bool transferNeeded(const DeviceInstance::QueueRef& srcQueue, const DeviceInstance::QueueRef& dstQueue, const SimpleBuffer& buffer);
+
+  /// Record the source side, on a command buffer for srcQueue
+  static void cmdRelease(vk::CommandBuffer commandBuffer,
+                         const DeviceInstance::QueueRef& srcQueue, const DeviceInstance::QueueRef& dstQueue,
+                         SimpleBuffer& buffer, Access src, Access dst);
+  /// Record the destination side, on a command buffer for dstQueue
+  static void cmdAcquire(vk::CommandBuffer commandBuffer,
+                         const DeviceInstance::QueueRef& srcQueue, const DeviceInstance::QueueRef& dstQueue,
+                         SimpleBuffer& buffer, Access src, Access dst);
+};
+
+#endif
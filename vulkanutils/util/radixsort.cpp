@@ -0,0 +1,183 @@
+/*
+ * Provided under the BSD 3-Clause License, see LICENSE.
+ *
+ * Copyright (c) 2019, Gareth Francis
+ * All rights reserved.
+ */
+
+#include "radixsort.h"
+#include "deviceinstance.h"
+#include "simplebuffer.h"
+#include "pipelines/computepipeline.h"
+
+#include "vulkanutilsshaders.h"
+
+namespace {
+  constexpr uint32_t radixBits = 4;
+  constexpr uint32_t radixBuckets = 1 << radixBits;
+}
+
+RadixSort::RadixSort(DeviceInstance& deviceInstance,
+                     uint32_t maxCount,
+                     KeyType keyType,
+                     uint32_t keyBits,
+                     vk::MemoryPropertyFlags memFlags,
+                     uint32_t groupSize,
+                     uint32_t itemsPerInvocation)
+  : mDeviceInstance(deviceInstance)
+  , mMaxCount(maxCount)
+  , mKeyType(keyType) {
+  auto keyWords = mKeyType == KeyType::Uint64 ? 2u : 1u;
+  if( keyBits == 0 || keyBits > keyWords * 32 ) keyBits = keyWords * 32;
+  if( mMaxCount == 0 ) throw std::runtime_error("RadixSort: Nothing to sort");
+  if( groupSize < radixBuckets || (groupSize & (groupSize - 1)) ) throw std::runtime_error("RadixSort: Group size must be a power of 2, and at least 16");
+  if( itemsPerInvocation == 0 ) throw std::runtime_error("RadixSort: Need at least 1 item per invocation");
+
+  auto limits = mDeviceInstance.physicalDevice().getProperties().limits;
+  while( groupSize > limits.maxComputeWorkGroupInvocations || groupSize > limits.maxComputeWorkGroupSize[0] ) groupSize /= 2;
+
+  // Round up to an even number of passes, so the result lands back in the first buffers
+  mNumPasses = (keyBits + radixBits - 1) / radixBits;
+  mNumPasses += mNumPasses % 2;
+
+  mSpecConstants.groupSize = groupSize;
+  mSpecConstants.keyWords = keyWords;
+  mSpecConstants.itemsPerInvocation = itemsPerInvocation;
+
+  auto usage = vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eTransferSrc | vk::BufferUsageFlagBits::eTransferDst;
+  for( auto i = 0u; i < 2; ++i ) {
+    auto flags = i == 0 ? memFlags : vk::MemoryPropertyFlags(vk::MemoryPropertyFlagBits::eDeviceLocal);
+    mKeys[i].reset(new SimpleBuffer(mDeviceInstance, sizeof(uint32_t) * keyWords * mMaxCount, usage, flags, {}, "scratch"));
+    mValues[i].reset(new SimpleBuffer(mDeviceInstance, sizeof(uint32_t) * mMaxCount, usage, flags, {}, "scratch"));
+  }
+  auto maxGroups = (mMaxCount + (groupSize * itemsPerInvocation) - 1) / (groupSize * itemsPerInvocation);
+  mHistogram.reset(new SimpleBuffer(mDeviceInstance, sizeof(uint32_t) * radixBuckets * maxGroups, vk::BufferUsageFlagBits::eStorageBuffer, vk::MemoryPropertyFlagBits::eDeviceLocal, {}, "scratch"));
+
+  mCountPipeline = createPipeline(shader_radixsort_count_comp);
+  mScanPipeline = createPipeline(shader_radixsort_scan_comp);
+  mScatterPipeline = createPipeline(shader_radixsort_scatter_comp);
+
+  // All passes share the same bindings, so the sets are the same apart from the layout they're allocated with
+  std::vector<ComputePipeline*> pipelines = { mCountPipeline.get(), mScanPipeline.get(), mScatterPipeline.get() };
+  auto numSets = static_cast<uint32_t>(pipelines.size()) * 2;
+  auto poolSize = vk::DescriptorPoolSize()
+      .setType(vk::DescriptorType::eStorageBuffer)
+      .setDescriptorCount(numSets * 5);
+  auto poolInfo = vk::DescriptorPoolCreateInfo()
+      .setFlags({})
+      .setMaxSets(numSets)
+      .setPoolSizeCount(1)
+      .setPPoolSizes(&poolSize);
+  mDescriptorPool = mDeviceInstance.device().createDescriptorPoolUnique(poolInfo);
+
+  for( auto pipeline : pipelines ) {
+    std::vector<vk::DescriptorSetLayout> dsLayouts(2, pipeline->descriptorSetLayouts()[0].get());
+    auto dsInfo = vk::DescriptorSetAllocateInfo()
+        .setDescriptorPool(mDescriptorPool.get())
+        .setDescriptorSetCount(2)
+        .setPSetLayouts(dsLayouts.data());
+    auto sets = mDeviceInstance.device().allocateDescriptorSets(dsInfo);
+
+    for( auto direction = 0u; direction < 2; ++direction ) {
+      auto src = direction;
+      auto dst = 1 - direction;
+      std::vector<vk::DescriptorBufferInfo> infos = {
+        {mKeys[src]->buffer(), 0, VK_WHOLE_SIZE},
+        {mValues[src]->buffer(), 0, VK_WHOLE_SIZE},
+        {mKeys[dst]->buffer(), 0, VK_WHOLE_SIZE},
+        {mValues[dst]->buffer(), 0, VK_WHOLE_SIZE},
+        {mHistogram->buffer(), 0, VK_WHOLE_SIZE},
+      };
+      auto wInfo = vk::WriteDescriptorSet()
+          .setDstSet(sets[direction])
+          .setDstBinding(0)
+          .setDstArrayElement(0)
+          .setDescriptorCount(static_cast<uint32_t>(infos.size()))
+          .setDescriptorType(vk::DescriptorType::eStorageBuffer)
+          .setPImageInfo(nullptr)
+          .setPBufferInfo(infos.data())
+          .setPTexelBufferView(nullptr);
+      mDeviceInstance.device().updateDescriptorSets(1, &wInfo, 0, nullptr);
+    }
+    mDescriptorSets.emplace_back(sets);
+  }
+}
+
+RadixSort::~RadixSort() {}
+
+std::unique_ptr<ComputePipeline> RadixSort::createPipeline(const EmbeddedShader& shader) {
+  std::unique_ptr<ComputePipeline> pipeline(new ComputePipeline(mDeviceInstance));
+  pipeline->shaders()[vk::ShaderStageFlagBits::eCompute] = pipeline->createShaderModule(shader);
+  // Keys in, values in, keys out, values out, histogram
+  for( auto b = 0u; b < 5; ++b ) pipeline->addDescriptorSetLayoutBinding(0, b, vk::DescriptorType::eStorageBuffer, 1, vk::ShaderStageFlagBits::eCompute);
+  pipeline->pushConstants().emplace_back(vk::ShaderStageFlagBits::eCompute, 0, sizeof(PushConstants));
+
+  std::vector<vk::SpecializationMapEntry> specs = {
+    {0, offsetof(SpecConstants, groupSize), sizeof(uint32_t)},
+    {1, offsetof(SpecConstants, keyWords), sizeof(uint32_t)},
+    {2, offsetof(SpecConstants, itemsPerInvocation), sizeof(uint32_t)},
+  };
+  pipeline->specialisationConstants()[vk::ShaderStageFlagBits::eCompute] = vk::SpecializationInfo(static_cast<uint32_t>(specs.size()), specs.data(), sizeof(SpecConstants), &mSpecConstants);
+  pipeline->build();
+  return pipeline;
+}
+
+void RadixSort::cmdSort(vk::CommandBuffer commandBuffer, uint32_t count) {
+  if( count > mMaxCount ) throw std::runtime_error("RadixSort::cmdSort: Too many keys");
+  if( count < 2 ) return;
+
+  PushConstants params;
+  params.count = count;
+  params.numGroups = (count + (mSpecConstants.groupSize * mSpecConstants.itemsPerInvocation) - 1) / (mSpecConstants.groupSize * mSpecConstants.itemsPerInvocation);
+
+  // Each step reads what the last one wrote, and (between passes) writes what it read
+  auto stepBarrier = vk::MemoryBarrier()
+      .setSrcAccessMask(vk::AccessFlagBits::eShaderRead | vk::AccessFlagBits::eShaderWrite)
+      .setDstAccessMask(vk::AccessFlagBits::eShaderRead | vk::AccessFlagBits::eShaderWrite);
+  auto barrier = [&]() {
+    commandBuffer.pipelineBarrier(
+          vk::PipelineStageFlagBits::eComputeShader,
+          vk::PipelineStageFlagBits::eComputeShader,
+          {},
+          1, &stepBarrier,
+          0, nullptr,
+          0, nullptr
+          );
+  };
+  auto dispatch = [&](ComputePipeline& pipeline, uint32_t pipelineIndex, uint32_t direction, uint32_t numGroups) {
+    commandBuffer.bindPipeline(vk::PipelineBindPoint::eCompute, pipeline.pipeline());
+    commandBuffer.bindDescriptorSets(vk::PipelineBindPoint::eCompute,
+                                     pipeline.pipelineLayout(),
+                                     0, 1,
+                                     &mDescriptorSets[pipelineIndex][direction],
+                                     0, nullptr);
+    commandBuffer.pushConstants(pipeline.pipelineLayout(), vk::ShaderStageFlagBits::eCompute, 0, sizeof(PushConstants), &params);
+    commandBuffer.dispatch(numGroups, 1, 1);
+  };
+
+  // The last thing to touch the temporary buffers may have been a previous sort
+  barrier();
+  for( auto pass = 0u; pass < mNumPasses; ++pass ) {
+    auto direction = pass % 2;
+    params.shift = pass * radixBits;
+    dispatch(*mCountPipeline.get(), 0, direction, params.numGroups);
+    barrier();
+    dispatch(*mScanPipeline.get(), 1, direction, 1);
+    barrier();
+    dispatch(*mScatterPipeline.get(), 2, direction, params.numGroups);
+    barrier();
+  }
+
+  // Sorted, over to whoever wants it
+  auto doneBarrier = vk::MemoryBarrier()
+      .setSrcAccessMask(vk::AccessFlagBits::eShaderWrite)
+      .setDstAccessMask(vk::AccessFlagBits::eShaderRead | vk::AccessFlagBits::eTransferRead);
+  commandBuffer.pipelineBarrier(
+        vk::PipelineStageFlagBits::eComputeShader,
+        vk::PipelineStageFlagBits::eComputeShader | vk::PipelineStageFlagBits::eTransfer,
+        {},
+        1, &doneBarrier,
+        0, nullptr,
+        0, nullptr
+        );
+}
@@ -0,0 +1,108 @@
+/*
+ * Provided under the BSD 3-Clause License, see LICENSE.
+ *
+ * Copyright (c) 2019, Gareth Francis
+ * All rights reserved.
+ */
+
+#ifndef RADIXSORT_H
+#define RADIXSORT_H
+
+#include <vulkan/vulkan.hpp>
+
+#include "util/embeddedshader.h"
+
+#include <memory>
+#include <vector>
+
+class DeviceInstance;
+class ComputePipeline;
+class SimpleBuffer;
+
+/**
+ * GPU key/value sort
+ *
+ * Least significant digit radix sort, 4 bits per pass. Each pass counts the digits in each
+ * block of keys, scans those counts to get where each block's keys go, then scatters.
+ * It's stable, so keys which compare equal keep the order of their values.
+ *
+ * Keys are 32 or 64 bit (as pairs of uints, low word first) and values are 32 bit.
+ * Fill keys() and values() (from the GPU, or map them if they're host visible)
+ * and cmdSort leaves them sorted in place.
+ */
+class RadixSort
+{
+public:
+  enum class KeyType {
+    Uint32,
+    Uint64,
+  };
+
+  RadixSort() = delete;
+  RadixSort(const RadixSort&) = delete;
+
+  /**
+   * @param maxCount Maximum number of keys to sort
+   * @param keyBits Number of low bits of the key to sort on, the rest are ignored. 0 for all of them
+   * @param memFlags Memory for the key/value buffers, the temporary ones are always device local
+   */
+  RadixSort(DeviceInstance& deviceInstance,
+            uint32_t maxCount,
+            KeyType keyType = KeyType::Uint32,
+            uint32_t keyBits = 0,
+            vk::MemoryPropertyFlags memFlags = {vk::MemoryPropertyFlagBits::eDeviceLocal},
+            uint32_t groupSize = 256,
+            uint32_t itemsPerInvocation = 16);
+  ~RadixSort();
+
+  uint32_t maxCount() const { return mMaxCount; }
+  KeyType keyType() const { return mKeyType; }
+  uint32_t numPasses() const { return mNumPasses; }
+
+  /// Keys to sort, maxCount of them
+  SimpleBuffer& keys() { return *mKeys[0].get(); }
+  /// Values to go along with them
+  SimpleBuffer& values() { return *mValues[0].get(); }
+
+  /**
+   * Record the sort of the first count keys
+   * The keys and values must already be visible to compute shaders, that's up to the caller.
+   * Afterwards they're visible to compute shaders (reads) and transfers.
+   */
+  void cmdSort(vk::CommandBuffer commandBuffer, uint32_t count);
+
+private:
+  struct SpecConstants {
+    uint32_t groupSize = 256;
+    uint32_t keyWords = 1;
+    uint32_t itemsPerInvocation = 16;
+  };
+  struct PushConstants {
+    uint32_t count = 0;
+    uint32_t shift = 0;
+    uint32_t numGroups = 0;
+  };
+
+  std::unique_ptr<ComputePipeline> createPipeline(const EmbeddedShader& shader);
+
+  DeviceInstance& mDeviceInstance;
+  uint32_t mMaxCount = 0;
+  KeyType mKeyType = KeyType::Uint32;
+  uint32_t mNumPasses = 0;
+  SpecConstants mSpecConstants;
+
+  // Passes ping-pong between 0 and 1, there's always an even number so it ends up back in 0
+  std::unique_ptr<SimpleBuffer> mKeys[2];
+  std::unique_ptr<SimpleBuffer> mValues[2];
+  std::unique_ptr<SimpleBuffer> mHistogram;
+
+  std::unique_ptr<ComputePipeline> mCountPipeline;
+  std::unique_ptr<ComputePipeline> mScanPipeline;
+  std::unique_ptr<ComputePipeline> mScatterPipeline;
+
+  vk::UniqueDescriptorPool mDescriptorPool;
+  // Owned by pool, [pipeline][direction], direction 0 reads buffers 0 and writes 1
+  std::vector<std::vector<vk::DescriptorSet>> mDescriptorSets;
+};
+
+#endif
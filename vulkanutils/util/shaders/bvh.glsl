@@ -0,0 +1,137 @@
+/*
+ * Provided under the BSD 3-Clause License, see LICENSE.
+ *
+ * Copyright (c) 2019, Gareth Francis
+ * All rights reserved.
+ */
+
+// Stackless traversal of a Bvh (see bvh.h)
+//
+// Nodes are in depth-first order, each with the index to carry on from if it's skipped.
+// So a query just walks forward through the array: into a node's children (i + 1) if it
+// overlaps, or straight past its subtree (miss) if not. No stack, and no backtracking.
+//
+// Include after #version
+// - BVH_NODE_BINDING - Binding of the node buffer, default 1
+// - BVH_TRIANGLE_BINDING - Binding of the triangle buffer, default 2
+// - BVH_SET - Descriptor set of both, default 0
+
+#ifndef BVH_NODE_BINDING
+#define BVH_NODE_BINDING 1
+#endif
+#ifndef BVH_TRIANGLE_BINDING
+#define BVH_TRIANGLE_BINDING 2
+#endif
+#ifndef BVH_SET
+#define BVH_SET 0
+#endif
+
+#define BVH_LEAF_COUNT_SHIFT 28
+#define BVH_LEAF_FIRST_MASK 0x0fffffffu
+
+// Matches Bvh::Node
+struct BvhNode {
+  float minX, minY, minZ;
+  uint miss;
+  float maxX, maxY, maxZ;
+  uint leaf; // count << BVH_LEAF_COUNT_SHIFT | first triangle, 0 for interior nodes
+};
+
+// Matches Bvh::Triangle
+struct BvhTriangle {
+  vec4 v0;
+  vec4 v1;
+  vec4 v2;
+};
+
+layout(set = BVH_SET, binding = BVH_NODE_BINDING) readonly buffer bvhNodeBuffer {
+  BvhNode bvhNodes[];
+};
+
+layout(set = BVH_SET, binding = BVH_TRIANGLE_BINDING) readonly buffer bvhTriangleBuffer {
+  BvhTriangle bvhTriangles[];
+};
+
+// Closest point on triangle abc to p
+// From Real-Time Collision Detection (Ericson), 5.1.5
+vec3 bvhClosestPointOnTriangle(vec3 p, vec3 a, vec3 b, vec3 c) {
+  vec3 ab = b - a;
+  vec3 ac = c - a;
+  vec3 ap = p - a;
+  float d1 = dot(ab, ap);
+  float d2 = dot(ac, ap);
+  if( d1 <= 0.0 && d2 <= 0.0 ) return a;
+
+  vec3 bp = p - b;
+  float d3 = dot(ab, bp);
+  float d4 = dot(ac, bp);
+  if( d3 >= 0.0 && d4 <= d3 ) return b;
+
+  float vc = d1 * d4 - d3 * d2;
+  if( vc <= 0.0 && d1 >= 0.0 && d3 <= 0.0 ) return a + ab * (d1 / (d1 - d3));
+
+  vec3 cp = p - c;
+  float d5 = dot(ab, cp);
+  float d6 = dot(ac, cp);
+  if( d6 >= 0.0 && d5 <= d6 ) return c;
+
+  float vb = d5 * d2 - d1 * d6;
+  if( vb <= 0.0 && d2 >= 0.0 && d6 <= 0.0 ) return a + ac * (d2 / (d2 - d6));
+
+  float va = d3 * d6 - d5 * d4;
+  if( va <= 0.0 && (d4 - d3) >= 0.0 && (d5 - d6) >= 0.0 ) return b + (c - b) * ((d4 - d3) / ((d4 - d3) + (d5 - d6)));
+
+  float denom = 1.0 / (va + vb + vc);
+  return a + ab * (vb * denom) + ac * (vc * denom);
+}
+
+// Find the closest point on the mesh to p, within maxDistance
+// Boxes further away than the best so far are skipped, so the search narrows as it goes
+// Returns false if there's nothing that close
+bool bvhClosestPoint(vec3 p, float maxDistance, out vec3 closest, out uint triangle) {
+  float best = maxDistance * maxDistance;
+  bool found = false;
+  closest = p;
+  triangle = 0;
+
+  uint numNodes = bvhNodes.length();
+  uint i = 0;
+  while( i < numNodes ) {
+    BvhNode node = bvhNodes[i];
+
+    vec3 d = clamp(p, vec3(node.minX, node.minY, node.minZ), vec3(node.maxX, node.maxY, node.maxZ)) - p;
+    if( dot(d, d) > best ) {
+      i = node.miss;
+      continue;
+    }
+
+    uint count = node.leaf >> BVH_LEAF_COUNT_SHIFT;
+    if( count == 0 ) {
+      // Interior, on to the first child
+      i++;
+      continue;
+    }
+
+    uint first = node.leaf & BVH_LEAF_FIRST_MASK;
+    for( uint t = first; t < first + count; ++t ) {
+      BvhTriangle tri = bvhTriangles[t];
+      vec3 c = bvhClosestPointOnTriangle(p, tri.v0.xyz, tri.v1.xyz, tri.v2.xyz);
+      vec3 cp = c - p;
+      float dist = dot(cp, cp);
+      if( dist < best ) {
+        best = dist;
+        closest = c;
+        triangle = t;
+        found = true;
+      }
+    }
+    i = node.miss;
+  }
+  return found;
+}
+
+// Unit face normal of a triangle, wound anticlockwise
+vec3 bvhTriangleNormal(uint triangle) {
+  BvhTriangle tri = bvhTriangles[triangle];
+  return normalize(cross(tri.v1.xyz - tri.v0.xyz, tri.v2.xyz - tri.v0.xyz));
+}
@@ -0,0 +1,55 @@
+/*
+ * Provided under the BSD 3-Clause License, see LICENSE.
+ *
+ * Copyright (c) 2019, Gareth Francis
+ * All rights reserved.
+ */
+
+// Shared by the radix sort passes, see RadixSort
+//
+// Keys are 1 or 2 uints (32 or 64 bit, low word first), values are a uint each
+// Every pass sorts on 4 bits of the key, starting at radixParams.shift
+// Each workgroup handles a block of radixGroupSize * radixItemsPerInvocation keys
+
+#extension GL_ARB_separate_shader_objects : enable
+
+#define RADIX_BITS 4
+#define RADIX_BUCKETS 16
+
+layout(constant_id = 0) const uint radixGroupSize = 256; // Must be a power of 2
+layout(constant_id = 1) const uint radixKeyWords = 1;
+layout(constant_id = 2) const uint radixItemsPerInvocation = 16;
+
+layout(local_size_x_id = 0, local_size_y = 1, local_size_z = 1) in;
+
+layout(push_constant) uniform RadixParams {
+  uint count;
+  uint shift;     // First bit of the digit
+  uint numGroups; // Number of blocks
+} radixParams;
+
+layout(set = 0, binding = 0) readonly buffer keysInBuffer {
+  uint keysIn[];
+};
+layout(set = 0, binding = 1) readonly buffer valuesInBuffer {
+  uint valuesIn[];
+};
+layout(set = 0, binding = 2) writeonly buffer keysOutBuffer {
+  uint keysOut[];
+};
+layout(set = 0, binding = 3) writeonly buffer valuesOutBuffer {
+  uint valuesOut[];
+};
+// Count of each digit in each block, bucket major so one scan gives the output offsets
+layout(set = 0, binding = 4) buffer histogramBuffer {
+  uint histogram[];
+};
+
+uint radixDigit(uint index) {
+  uint word = keysIn[(index * radixKeyWords) + (radixParams.shift / 32u)];
+  return (word >> (radixParams.shift % 32u)) & (RADIX_BUCKETS - 1u);
+}
+
+uint radixBlockStart() {
+  return gl_WorkGroupID.x * radixGroupSize * radixItemsPerInvocation;
+}
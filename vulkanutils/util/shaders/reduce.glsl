@@ -0,0 +1,147 @@
+/*
+ * Provided under the BSD 3-Clause License, see LICENSE.
+ *
+ * Copyright (c) 2019, Gareth Francis
+ * All rights reserved.
+ */
+
+// One pass of a parallel reduction, see ParallelReduction
+//
+// Each workgroup reduces reduceGroupSize * reduceItemsPerInvocation records down to one,
+// written to reduceOutput[reduceParams.outputOffset + group]. Passes are repeated until
+// there's only one record left.
+//
+// A record is up to REDUCE_MAX_WIDTH vec4s, each with its own operation (sum/min/max)
+//
+// Include this straight after #version and the include extension
+// - REDUCE_SUBGROUPS - Define to reduce with subgroup arithmetic rather than shared memory.
+//                      Only valid if the device supports it, ParallelReduction checks that
+// - REDUCE_CUSTOM_LOAD - Define to provide your own reduceLoad, after including this.
+//                        Binding 1 is free for its input. Otherwise binding 1 holds records
+//
+// Specialisation constants 0-3 and the push constants belong to the reduction
+
+#extension GL_ARB_separate_shader_objects : enable
+#ifdef REDUCE_SUBGROUPS
+#extension GL_KHR_shader_subgroup_basic : require
+#extension GL_KHR_shader_subgroup_arithmetic : require
+#endif
+
+#define REDUCE_MAX_WIDTH 8
+
+layout(constant_id = 0) const uint reduceGroupSize = 256; // Must be a power of 2
+layout(constant_id = 1) const uint reduceWidth = 1;
+layout(constant_id = 2) const uint reduceOps = 0; // 2 bits per vec4, see REDUCE_OP_
+layout(constant_id = 3) const uint reduceItemsPerInvocation = 8;
+
+layout(local_size_x_id = 0, local_size_y = 1, local_size_z = 1) in;
+
+const uint REDUCE_OP_SUM = 0;
+const uint REDUCE_OP_MIN = 1;
+const uint REDUCE_OP_MAX = 2;
+
+layout(push_constant) uniform ReduceParams {
+  uint count;        // Number of records going in
+  uint outputOffset; // Record index the first group writes to
+} reduceParams;
+
+layout(set = 0, binding = 0) writeonly buffer reduceOutputBuffer {
+  vec4 reduceOutput[];
+};
+
+/// Fetch a record, only called for index < reduceParams.count
+void reduceLoad(uint index, inout vec4 record[REDUCE_MAX_WIDTH]);
+
+uint reduceOp(uint column) {
+  return (reduceOps >> (column * 2u)) & 3u;
+}
+
+vec4 reduceIdentity(uint op) {
+  if( op == REDUCE_OP_MIN ) return vec4(3.402823466e38);
+  if( op == REDUCE_OP_MAX ) return vec4(-3.402823466e38);
+  return vec4(0.0);
+}
+
+vec4 reduceCombine(uint op, vec4 a, vec4 b) {
+  if( op == REDUCE_OP_MIN ) return min(a, b);
+  if( op == REDUCE_OP_MAX ) return max(a, b);
+  return a + b;
+}
+
+// Results are only valid in invocation 0
+// Partials per subgroup, or per invocation without subgroups
+shared vec4 reduceScratch[reduceGroupSize];
+
+#ifdef REDUCE_SUBGROUPS
+vec4 reduceSubgroup(uint op, vec4 v) {
+  if( op == REDUCE_OP_MIN ) return subgroupMin(v);
+  if( op == REDUCE_OP_MAX ) return subgroupMax(v);
+  return subgroupAdd(v);
+}
+
+vec4 reduceGroup(uint op, vec4 v) {
+  // Reduce within each subgroup, then have the first subgroup reduce those
+  vec4 r = reduceSubgroup(op, v);
+  if( subgroupElect() ) reduceScratch[gl_SubgroupID] = r;
+  barrier();
+
+  if( gl_SubgroupID == 0 ) {
+    // Small subgroups may leave more partials than there are invocations to pick them up
+    vec4 partial = reduceIdentity(op);
+    for( uint i = gl_SubgroupInvocationID; i < gl_NumSubgroups; i += gl_SubgroupSize ) {
+      partial = reduceCombine(op, partial, reduceScratch[i]);
+    }
+    r = reduceSubgroup(op, partial);
+  }
+  // Scratch is reused for the next column
+  barrier();
+  return r;
+}
+#else
+vec4 reduceGroup(uint op, vec4 v) {
+  uint i = gl_LocalInvocationIndex;
+  reduceScratch[i] = v;
+  barrier();
+
+  for( uint s = reduceGroupSize / 2u; s > 0u; s >>= 1 ) {
+    if( i < s ) reduceScratch[i] = reduceCombine(op, reduceScratch[i], reduceScratch[i + s]);
+    barrier();
+  }
+
+  vec4 r = reduceScratch[0];
+  barrier();
+  return r;
+}
+#endif
+
+#ifndef REDUCE_CUSTOM_LOAD
+layout(set = 0, binding = 1) readonly buffer reduceInputBuffer {
+  vec4 reduceInput[];
+};
+
+void reduceLoad(uint index, inout vec4 record[REDUCE_MAX_WIDTH]) {
+  for( uint c = 0u; c < reduceWidth; ++c ) record[c] = reduceInput[(index * reduceWidth) + c];
+}
+#endif
+
+void main() {
+  vec4 acc[REDUCE_MAX_WIDTH];
+  for( uint c = 0u; c < reduceWidth; ++c ) acc[c] = reduceIdentity(reduceOp(c));
+
+  // Each invocation folds a few records in first, consecutive invocations read consecutive records
+  uint first = (gl_WorkGroupID.x * reduceGroupSize * reduceItemsPerInvocation) + gl_LocalInvocationIndex;
+  for( uint k = 0u; k < reduceItemsPerInvocation; ++k ) {
+    uint index = first + (k * reduceGroupSize);
+    if( index >= reduceParams.count ) break;
+
+    vec4 record[REDUCE_MAX_WIDTH];
+    reduceLoad(index, record);
+    for( uint c = 0u; c < reduceWidth; ++c ) acc[c] = reduceCombine(reduceOp(c), acc[c], record[c]);
+  }
+
+  // Every invocation has to get here, for the barriers
+  for( uint c = 0u; c < reduceWidth; ++c ) {
+    vec4 r = reduceGroup(reduceOp(c), acc[c]);
+    if( gl_LocalInvocationIndex == 0 ) reduceOutput[((reduceParams.outputOffset + gl_WorkGroupID.x) * reduceWidth) + c] = r;
+  }
+}
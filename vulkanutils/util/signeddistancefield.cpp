@@ -0,0 +1,164 @@
+/*
+ * Provided under the BSD 3-Clause License, see LICENSE.
+ *
+ * Copyright (c) 2019, Gareth Francis
+ * All rights reserved.
+ */
+
+#include "signeddistancefield.h"
+#include "mesh.h"
+#include "bvh.h"
+#include "threadpool.h"
+
+#include <algorithm>
+#include <cmath>
+#include <future>
+#include <limits>
+#include <stdexcept>
+
+SignedDistanceField::Primitive SignedDistanceField::Primitive::sphere(const glm::vec3& centre, float radius) {
+  Primitive p;
+  p.type = Type::Sphere;
+  p.a = centre;
+  p.radius = radius;
+  return p;
+}
+
+SignedDistanceField::Primitive SignedDistanceField::Primitive::box(const glm::vec3& centre, const glm::vec3& halfExtents) {
+  Primitive p;
+  p.type = Type::Box;
+  p.a = centre;
+  p.b = halfExtents;
+  return p;
+}
+
+SignedDistanceField::Primitive SignedDistanceField::Primitive::capsule(const glm::vec3& start, const glm::vec3& end, float radius) {
+  Primitive p;
+  p.type = Type::Capsule;
+  p.a = start;
+  p.b = end;
+  p.radius = radius;
+  return p;
+}
+
+float SignedDistanceField::Primitive::distance(const glm::vec3& p) const {
+  switch( type ) {
+    case Type::Sphere:
+      return glm::length(p - a) - radius;
+    case Type::Box: {
+      // Outside distance, plus how far in we are if we're inside
+      auto q = glm::abs(p - a) - b;
+      return glm::length(glm::max(q, glm::vec3(0.f))) + std::min(std::max(q.x, std::max(q.y, q.z)), 0.f);
+    }
+    case Type::Capsule: {
+      auto pa = p - a;
+      auto ba = b - a;
+      auto h = glm::clamp(glm::dot(pa, ba) / std::max(glm::dot(ba, ba), 1e-12f), 0.f, 1.f);
+      return glm::length(pa - (ba * h)) - radius;
+    }
+  }
+  return std::numeric_limits<float>::max();
+}
+
+glm::vec3 SignedDistanceField::Primitive::min() const {
+  switch( type ) {
+    case Type::Sphere: return a - glm::vec3(radius);
+    case Type::Box: return a - b;
+    case Type::Capsule: return glm::min(a, b) - glm::vec3(radius);
+  }
+  return a;
+}
+
+glm::vec3 SignedDistanceField::Primitive::max() const {
+  switch( type ) {
+    case Type::Sphere: return a + glm::vec3(radius);
+    case Type::Box: return a + b;
+    case Type::Capsule: return glm::max(a, b) + glm::vec3(radius);
+  }
+  return a;
+}
+
+SignedDistanceField::SignedDistanceField(const glm::uvec3& resolution, const glm::vec3& min, const glm::vec3& max)
+  : mResolution(resolution)
+  , mMin(min)
+  , mMax(max) {
+  if( mResolution.x < 2 || mResolution.y < 2 || mResolution.z < 2 ) throw std::runtime_error("SignedDistanceField: Need at least 2 samples on each axis");
+  if( mMax.x <= mMin.x || mMax.y <= mMin.y || mMax.z <= mMin.z ) throw std::runtime_error("SignedDistanceField: Empty bounds");
+  mDistances.resize(mResolution.x * mResolution.y * mResolution.z, std::numeric_limits<float>::max());
+}
+
+glm::uvec3 SignedDistanceField::fitResolution(const glm::vec3& min, const glm::vec3& max, uint32_t resolution) {
+  auto size = max - min;
+  auto longest = std::max(size.x, std::max(size.y, size.z));
+  glm::uvec3 res;
+  for( auto i = 0; i < 3; ++i ) res[i] = std::max(2u, static_cast<uint32_t>(std::ceil(resolution * size[i] / longest)));
+  return res;
+}
+
+glm::vec3 SignedDistanceField::samplePosition(uint32_t x, uint32_t y, uint32_t z) const {
+  return mMin + ((glm::vec3(x, y, z) + glm::vec3(0.5f)) * spacing());
+}
+
+void SignedDistanceField::bake(const std::function<float(const glm::vec3&)>& f, ThreadPool* threadPool) {
+  auto slice = [&](uint32_t z) {
+    for( auto y = 0u; y < mResolution.y; ++y ) {
+      for( auto x = 0u; x < mResolution.x; ++x ) mDistances[index(x, y, z)] = f(samplePosition(x, y, z));
+    }
+  };
+
+  if( !threadPool ) {
+    for( auto z = 0u; z < mResolution.z; ++z ) slice(z);
+    return;
+  }
+
+  // Each slice writes its own part of mDistances, no locking needed
+  std::vector<std::future<void>> slices;
+  for( auto z = 0u; z < mResolution.z; ++z ) slices.emplace_back(threadPool->run([&, z]() { slice(z); }));
+  for( auto& s : slices ) s.wait();
+  for( auto& s : slices ) s.get();
+}
+
+SignedDistanceField SignedDistanceField::fromMesh(const Mesh& mesh, uint32_t resolution, float padding, ThreadPool* threadPool) {
+  Bvh bvh(mesh);
+  auto min = bvh.nodes().front().min - glm::vec3(padding);
+  auto max = bvh.nodes().front().max + glm::vec3(padding);
+  SignedDistanceField sdf(fitResolution(min, max, resolution), min, max);
+
+  // Slightly off the axes, so the rays don't run along edges of axis aligned geometry
+  const glm::vec3 rays[] = {
+    glm::normalize(glm::vec3(1.f, 0.0013f, 0.0027f)),
+    glm::normalize(glm::vec3(0.0031f, 1.f, 0.0017f)),
+    glm::normalize(glm::vec3(0.0023f, 0.0011f, 1.f)),
+  };
+  sdf.bake([&](const glm::vec3& p) {
+    glm::vec3 closest;
+    uint32_t triangle = 0;
+    if( !bvh.closestPoint(p, std::numeric_limits<float>::max(), closest, triangle) ) return std::numeric_limits<float>::max();
+    auto dist = glm::length(closest - p);
+
+    auto inside = 0u;
+    for( auto& r : rays ) inside += bvh.countCrossings(p, r) % 2;
+    return inside >= 2 ? -dist : dist;
+  }, threadPool);
+  return sdf;
+}
+
+SignedDistanceField SignedDistanceField::fromPrimitives(const std::vector<Primitive>& primitives, uint32_t resolution, float padding, ThreadPool* threadPool) {
+  if( primitives.empty() ) throw std::runtime_error("SignedDistanceField::fromPrimitives: No primitives");
+  auto min = primitives.front().min();
+  auto max = primitives.front().max();
+  for( auto& p : primitives ) {
+    min = glm::min(min, p.min());
+    max = glm::max(max, p.max());
+  }
+  min -= glm::vec3(padding);
+  max += glm::vec3(padding);
+  SignedDistanceField sdf(fitResolution(min, max, resolution), min, max);
+
+  sdf.bake([&](const glm::vec3& p) {
+    auto d = std::numeric_limits<float>::max();
+    for( auto& prim : primitives ) d = std::min(d, prim.distance(p));
+    return d;
+  }, threadPool);
+  return sdf;
+}
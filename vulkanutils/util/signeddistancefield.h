@@ -0,0 +1,93 @@
+/*
+ * Provided under the BSD 3-Clause License, see LICENSE.
+ *
+ * Copyright (c) 2019, Gareth Francis
+ * All rights reserved.
+ */
+
+#ifndef SIGNEDDISTANCEFIELD_H
+#define SIGNEDDISTANCEFIELD_H
+
+#include "glm/glm.hpp"
+
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+class Mesh;
+class ThreadPool;
+
+/**
+ * A signed distance field on a regular grid, baked on the host
+ *
+ * Negative inside, positive outside. Samples are at cell centres, x varies fastest then y then z,
+ * so it can go straight into a 3D image and be sampled with normalised coordinates
+ * ((p - min) / (max - min)) and linear filtering.
+ */
+class SignedDistanceField
+{
+public:
+  /// Analytic shapes to bake, the field is their union
+  struct Primitive {
+    enum class Type {
+      Sphere,
+      Box,
+      Capsule,
+    };
+    Type type = Type::Sphere;
+    glm::vec3 a = {0, 0, 0}; // Sphere/box centre, capsule start
+    glm::vec3 b = {0, 0, 0}; // Box half extents, capsule end
+    float radius = 1.f; // Sphere/capsule radius
+
+    static Primitive sphere(const glm::vec3& centre, float radius);
+    static Primitive box(const glm::vec3& centre, const glm::vec3& halfExtents);
+    static Primitive capsule(const glm::vec3& start, const glm::vec3& end, float radius);
+
+    float distance(const glm::vec3& p) const;
+    glm::vec3 min() const;
+    glm::vec3 max() const;
+  };
+
+  SignedDistanceField() = delete;
+  /// A field with nothing in it, every sample is a long way from anything
+  SignedDistanceField(const glm::uvec3& resolution, const glm::vec3& min, const glm::vec3& max);
+
+  /**
+   * Bake from a closed mesh
+   *
+   * Distance comes from a BVH query. Inside/outside is by counting crossings along 3 rays
+   * and taking the majority, so a ray clipping an edge or a small hole won't flip the sign.
+   *
+   * @param resolution Samples along the longest side, the others get the same spacing
+   * @param padding Added around the mesh's bounds, so there's room to push things away before they touch
+   * @param threadPool Spread the bake over the pool, if there is one
+   */
+  static SignedDistanceField fromMesh(const Mesh& mesh, uint32_t resolution, float padding, ThreadPool* threadPool = nullptr);
+  /// Bake the union of some primitives
+  static SignedDistanceField fromPrimitives(const std::vector<Primitive>& primitives, uint32_t resolution, float padding, ThreadPool* threadPool = nullptr);
+
+  glm::uvec3 resolution() const { return mResolution; }
+  glm::vec3 min() const { return mMin; }
+  glm::vec3 max() const { return mMax; }
+  /// Size of a cell
+  glm::vec3 spacing() const { return (mMax - mMin) / glm::vec3(mResolution); }
+
+  const std::vector<float>& distances() const { return mDistances; }
+  float distance(uint32_t x, uint32_t y, uint32_t z) const { return mDistances[index(x, y, z)]; }
+  /// Where a sample is, the centre of its cell
+  glm::vec3 samplePosition(uint32_t x, uint32_t y, uint32_t z) const;
+
+private:
+  uint32_t index(uint32_t x, uint32_t y, uint32_t z) const { return (((z * mResolution.y) + y) * mResolution.x) + x; }
+  /// Grid covering min-max with roughly cubic cells
+  static glm::uvec3 fitResolution(const glm::vec3& min, const glm::vec3& max, uint32_t resolution);
+  /// Fill in every sample from f(position), z slices are handed out to the thread pool
+  void bake(const std::function<float(const glm::vec3&)>& f, ThreadPool* threadPool);
+
+  glm::uvec3 mResolution;
+  glm::vec3 mMin;
+  glm::vec3 mMax;
+  std::vector<float> mDistances;
+};
+
+#endif
@@ -9,19 +9,55 @@
 
 #include "deviceinstance.h"
 
+#include <algorithm>
+#include <stdexcept>
+
 SimpleBuffer::SimpleBuffer(
     DeviceInstance& deviceInstance,
     vk::DeviceSize size,
     vk::BufferUsageFlags usageFlags,
-    vk::MemoryPropertyFlags memFlags)
+    vk::MemoryPropertyFlags memFlags,
+    const std::vector<uint32_t>& queueFamilies,
+    const std::string& category)
   : mDeviceInstance(deviceInstance)
   , mSize(size)
   , mBufferUsageFlags(usageFlags)
   , mMemoryPropertyFlags(memFlags)
+  , mCategory(category)
 {
-  mBuffer =  mDeviceInstance.createBuffer(mSize, mBufferUsageFlags);
-  mDeviceMemory =  mDeviceInstance.allocateDeviceMemoryForBuffer(mBuffer.get(), mMemoryPropertyFlags);
+  // Any storage buffer might be handed to a shader by address, it's just a flag so give them all one
+  vk::MemoryAllocateFlags allocFlags;
+  if( mDeviceInstance.bufferDeviceAddressEnabled() && (mBufferUsageFlags & vk::BufferUsageFlagBits::eStorageBuffer) ) {
+    mBufferUsageFlags |= vk::BufferUsageFlagBits::eShaderDeviceAddressKHR;
+    allocFlags = vk::MemoryAllocateFlagBits::eDeviceAddressKHR;
+  }
+
+  mBuffer =  mDeviceInstance.createBuffer(mSize, mBufferUsageFlags, queueFamilies);
+  mConcurrent = std::any_of(queueFamilies.begin(), queueFamilies.end(), [&](auto f) { return f != queueFamilies.front(); });
+  mDeviceMemory =  mDeviceInstance.allocateDeviceMemoryForBuffer(mBuffer.get(), mMemoryPropertyFlags, allocFlags);
   mDeviceInstance.bindMemoryToBuffer(mBuffer.get(), mDeviceMemory.get(), 0);
+
+  // Same choice allocateDeviceMemoryForBuffer made, so the tracking matches what was really allocated
+  auto memReq = mDeviceInstance.device().getBufferMemoryRequirements(mBuffer.get());
+  mHeap = mDeviceInstance.memoryHeap(mDeviceInstance.selectDeviceMemoryHeap(memReq, mMemoryPropertyFlags));
+  mAllocationSize = memReq.size;
+  // Have a guess if we weren't told
+  if( mCategory.empty() ) {
+    if( usageFlags == vk::BufferUsageFlagBits::eTransferSrc && (mMemoryPropertyFlags & vk::MemoryPropertyFlagBits::eHostVisible) ) mCategory = "staging";
+    else if( usageFlags & vk::BufferUsageFlagBits::eUniformBuffer ) mCategory = "uniform";
+    else mCategory = "other";
+  }
+  mDeviceInstance.trackAllocation(mCategory, mHeap, mAllocationSize);
+
+  // Fixed for the lifetime of the buffer, so only ask once
+  if( allocFlags ) {
+    mDeviceAddress = mDeviceInstance.device().getBufferAddressKHR(vk::BufferDeviceAddressInfoKHR().setBuffer(mBuffer.get()), mDeviceInstance.dispatch());
+  }
+}
+
+vk::DeviceAddress SimpleBuffer::deviceAddress() const {
+  if( !mDeviceAddress ) throw std::runtime_error("SimpleBuffer::deviceAddress: Buffer wasn't created with an address, needs a storage buffer and VK_KHR_buffer_device_address");
+  return mDeviceAddress;
 }
 
 SimpleBuffer::~SimpleBuffer() {
@@ -29,6 +65,7 @@ SimpleBuffer::~SimpleBuffer() {
     flush();
     unmap();
   }
+  mDeviceInstance.trackFree(mCategory, mHeap, mAllocationSize);
 }
 
 void* SimpleBuffer::map() {
@@ -10,6 +10,9 @@
 
 #include <vulkan/vulkan.hpp>
 
+#include <string>
+#include <vector>
+
 class DeviceInstance;
 
 /**
@@ -28,12 +31,21 @@ public:
    * Allocate a buffer
    * Memory will be immediately allocated and bound to the buffer
    * Each buffer will have a separate memory allocation
+   *
+   * If queueFamilies lists more than one family the buffer is shared between them
+   * concurrently, otherwise it's exclusive and ownership must be transferred (see QueueOwnership)
+   *
+   * The allocation is tracked by the DeviceInstance (see DeviceInstance::memoryCategories), under
+   * category, or if that's empty "staging"/"uniform" if it looks like one of those, "other" otherwise.
+   * It's fixed from here on, so the counts only ever see one allocation and one free
    */
   SimpleBuffer(
       DeviceInstance& deviceInstance,
       vk::DeviceSize size,
       vk::BufferUsageFlags usageFlags,
-      vk::MemoryPropertyFlags memFlags = {vk::MemoryPropertyFlagBits::eHostVisible});
+      vk::MemoryPropertyFlags memFlags = {vk::MemoryPropertyFlagBits::eHostVisible},
+      const std::vector<uint32_t>& queueFamilies = {},
+      const std::string& category = {});
   ~SimpleBuffer();
 
   void* map();
@@ -42,6 +54,18 @@ public:
 
   vk::Buffer& buffer();
   vk::DeviceSize size() const { return mSize; }
+  /// Whether the buffer is shared between queue families, no ownership transfers needed
+  bool concurrent() const { return mConcurrent; }
+  /**
+   * Address of the buffer, for passing to shaders (GL_EXT_buffer_reference)
+   *
+   * Storage buffers get one whenever the device has bufferDeviceAddressEnabled,
+   * throws for anything else
+   */
+  vk::DeviceAddress deviceAddress() const;
+
+  /// What the memory is used for, for DeviceInstance's memory tracking
+  const std::string& category() const { return mCategory; }
 
 private:
   SimpleBuffer() = delete;
@@ -53,6 +77,12 @@ private:
   vk::BufferUsageFlags mBufferUsageFlags;
   vk::MemoryPropertyFlags mMemoryPropertyFlags;
 
+  std::string mCategory;
+  uint32_t mHeap = 0;
+  vk::DeviceSize mAllocationSize = 0; // Can be more than mSize
+
+  bool mConcurrent = false;
+  vk::DeviceAddress mDeviceAddress = 0;
   bool mMapped = false;
 };
 
@@ -0,0 +1,55 @@
+/*
+ * Provided under the BSD 3-Clause License, see LICENSE.
+ *
+ * Copyright (c) 2019, Gareth Francis
+ * All rights reserved.
+ */
+
+#include "simpleimage.h"
+
+#include "deviceinstance.h"
+
+SimpleImage::SimpleImage(
+    DeviceInstance& deviceInstance,
+    vk::ImageType type,
+    vk::Format format,
+    vk::Extent3D extent,
+    vk::ImageUsageFlags usageFlags,
+    vk::MemoryPropertyFlags memFlags)
+  : mDeviceInstance(deviceInstance)
+  , mFormat(format)
+  , mExtent(extent)
+{
+  auto info = vk::ImageCreateInfo()
+      .setFlags({})
+      .setImageType(type)
+      .setFormat(mFormat)
+      .setExtent(mExtent)
+      .setMipLevels(1)
+      .setArrayLayers(1)
+      .setSamples(vk::SampleCountFlagBits::e1)
+      .setTiling(vk::ImageTiling::eOptimal)
+      .setUsage(usageFlags)
+      .setSharingMode(vk::SharingMode::eExclusive)
+      .setInitialLayout(vk::ImageLayout::eUndefined);
+  mImage = mDeviceInstance.device().createImageUnique(info);
+
+  mDeviceMemory = mDeviceInstance.allocateDeviceMemoryForImage(mImage.get(), memFlags);
+  mDeviceInstance.bindMemoryToImage(mImage.get(), mDeviceMemory.get(), 0);
+
+  vk::ImageViewType viewType = vk::ImageViewType::e2D;
+  switch( type ) {
+    case vk::ImageType::e1D: viewType = vk::ImageViewType::e1D; break;
+    case vk::ImageType::e2D: viewType = vk::ImageViewType::e2D; break;
+    case vk::ImageType::e3D: viewType = vk::ImageViewType::e3D; break;
+  }
+
+  auto viewInfo = vk::ImageViewCreateInfo()
+      .setFlags({})
+      .setImage(mImage.get())
+      .setViewType(viewType)
+      .setFormat(mFormat)
+      .setComponents({})
+      .setSubresourceRange(subresourceRange());
+  mView = mDeviceInstance.device().createImageViewUnique(viewInfo);
+}
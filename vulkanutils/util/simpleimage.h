@@ -0,0 +1,57 @@
+/*
+ * Provided under the BSD 3-Clause License, see LICENSE.
+ *
+ * Copyright (c) 2019, Gareth Francis
+ * All rights reserved.
+ */
+
+#ifndef SIMPLEIMAGE_H
+#define SIMPLEIMAGE_H
+
+#include <vulkan/vulkan.hpp>
+
+class DeviceInstance;
+
+/**
+ * SimpleBuffer's counterpart for images
+ * - One image, one allocation, one view of the whole thing
+ * - Colour only, single mip level and array layer, optimal tiling
+ *
+ * Layout transitions are up to the user, the image starts out undefined
+ */
+class SimpleImage
+{
+public:
+  /**
+   * Allocate an image
+   * Memory will be immediately allocated and bound to the image
+   * The view type matches the image type (1D/2D/3D)
+   */
+  SimpleImage(
+      DeviceInstance& deviceInstance,
+      vk::ImageType type,
+      vk::Format format,
+      vk::Extent3D extent,
+      vk::ImageUsageFlags usageFlags,
+      vk::MemoryPropertyFlags memFlags = {vk::MemoryPropertyFlagBits::eDeviceLocal});
+  ~SimpleImage() {}
+
+  vk::Image& image() { return mImage.get(); }
+  vk::ImageView& view() { return mView.get(); }
+  vk::Format format() const { return mFormat; }
+  vk::Extent3D extent() const { return mExtent; }
+  /// The whole image, for barriers and clears
+  vk::ImageSubresourceRange subresourceRange() const { return {vk::ImageAspectFlagBits::eColor, 0, 1, 0, 1}; }
+
+private:
+  SimpleImage() = delete;
+
+  DeviceInstance& mDeviceInstance;
+  vk::Format mFormat;
+  vk::Extent3D mExtent;
+  vk::UniqueImage mImage;
+  vk::UniqueDeviceMemory mDeviceMemory;
+  vk::UniqueImageView mView;
+};
+
+#endif
@@ -0,0 +1,347 @@
+/*
+ * Provided under the BSD 3-Clause License, see LICENSE.
+ *
+ * Copyright (c) 2019, Gareth Francis
+ * All rights reserved.
+ */
+
+#include "taskgraph.h"
+
+#include "deviceinstance.h"
+
+#include <algorithm>
+#include <map>
+#include <stdexcept>
+
+namespace {
+  /// The access bits which modify memory, anything else is a read
+  const vk::AccessFlags writeAccessMask =
+      vk::AccessFlagBits::eShaderWrite |
+      vk::AccessFlagBits::eColorAttachmentWrite |
+      vk::AccessFlagBits::eDepthStencilAttachmentWrite |
+      vk::AccessFlagBits::eTransferWrite |
+      vk::AccessFlagBits::eHostWrite |
+      vk::AccessFlagBits::eMemoryWrite;
+}
+
+const TaskGraph::Access TaskGraph::computeRead = {vk::PipelineStageFlagBits::eComputeShader, vk::AccessFlagBits::eShaderRead};
+const TaskGraph::Access TaskGraph::computeWrite = {vk::PipelineStageFlagBits::eComputeShader, vk::AccessFlagBits::eShaderWrite};
+const TaskGraph::Access TaskGraph::computeReadWrite = {vk::PipelineStageFlagBits::eComputeShader, vk::AccessFlagBits::eShaderRead | vk::AccessFlagBits::eShaderWrite};
+const TaskGraph::Access TaskGraph::transferWrite = {vk::PipelineStageFlagBits::eTransfer, vk::AccessFlagBits::eTransferWrite};
+const TaskGraph::Access TaskGraph::hostRead = {vk::PipelineStageFlagBits::eHost, vk::AccessFlagBits::eHostRead};
+const TaskGraph::Access TaskGraph::vertexRead = {vk::PipelineStageFlagBits::eVertexInput, vk::AccessFlagBits::eVertexAttributeRead};
+const TaskGraph::Access TaskGraph::indexRead = {vk::PipelineStageFlagBits::eVertexInput, vk::AccessFlagBits::eIndexRead};
+const TaskGraph::Access TaskGraph::indirectRead = {vk::PipelineStageFlagBits::eDrawIndirect, vk::AccessFlagBits::eIndirectCommandRead};
+
+TaskGraph::Pass& TaskGraph::Pass::read(Resource r, Access a) {
+  mUses.push_back({r, a, false});
+  return *this;
+}
+
+TaskGraph::Pass& TaskGraph::Pass::write(Resource r, Access a) {
+  mUses.push_back({r, a, true});
+  return *this;
+}
+
+TaskGraph::TaskGraph(DeviceInstance& deviceInstance)
+  : mDeviceInstance(deviceInstance)
+{}
+
+TaskGraph::~TaskGraph() {
+  // Buffers before the memory they're bound to
+  mResources.clear();
+  mTransientMemory.reset();
+}
+
+void TaskGraph::checkNotCompiled(const char* method) const {
+  if( mCompiled ) throw std::runtime_error(std::string("TaskGraph::") + method + ": Graph has already been compiled");
+}
+
+TaskGraph::Resource TaskGraph::importBuffer(const std::string& name, vk::Buffer buffer, Access previous) {
+  checkNotCompiled("importBuffer");
+  ResourceInfo info;
+  info.name = name;
+  info.buffer = buffer;
+  info.previous = previous;
+  mResources.emplace_back(std::move(info));
+  return static_cast<Resource>(mResources.size() - 1);
+}
+
+TaskGraph::Resource TaskGraph::importImage(const std::string& name, vk::Image image, vk::ImageSubresourceRange range, Access previous) {
+  checkNotCompiled("importImage");
+  ResourceInfo info;
+  info.name = name;
+  info.isImage = true;
+  info.image = image;
+  info.range = range;
+  info.previous = previous;
+  mResources.emplace_back(std::move(info));
+  return static_cast<Resource>(mResources.size() - 1);
+}
+
+TaskGraph::Resource TaskGraph::transientBuffer(const std::string& name, vk::DeviceSize size, vk::BufferUsageFlags usage) {
+  checkNotCompiled("transientBuffer");
+  if( size == 0 ) throw std::runtime_error("TaskGraph::transientBuffer: " + name + " has no size");
+  ResourceInfo info;
+  info.name = name;
+  info.isTransient = true;
+  info.size = size;
+  info.usage = usage;
+  mResources.emplace_back(std::move(info));
+  return static_cast<Resource>(mResources.size() - 1);
+}
+
+vk::Buffer TaskGraph::buffer(Resource r) const {
+  if( r >= mResources.size() || mResources[r].isImage ) throw std::runtime_error("TaskGraph::buffer: Not a buffer");
+  if( mResources[r].isTransient && !mCompiled ) throw std::runtime_error("TaskGraph::buffer: " + mResources[r].name + " is transient, it doesn't exist until compile");
+  return mResources[r].buffer;
+}
+
+TaskGraph::Pass& TaskGraph::addPass(const std::string& name, RecordFunc record) {
+  checkNotCompiled("addPass");
+  mPasses.emplace_back(new Pass());
+  mPasses.back()->mName = name;
+  mPasses.back()->mRecord = record;
+  return *mPasses.back().get();
+}
+
+void TaskGraph::exportResource(Resource r, Access next) {
+  checkNotCompiled("exportResource");
+  mExports.emplace_back(r, next);
+}
+
+uint32_t TaskGraph::numBarriers() const {
+  return static_cast<uint32_t>(std::count_if(mBarriers.begin(), mBarriers.end(), [](auto& b) { return !b.empty(); }));
+}
+
+void TaskGraph::compile() {
+  checkNotCompiled("compile");
+  for( auto& p : mPasses ) for( auto& u : p->mUses ) {
+    if( u.resource >= mResources.size() ) throw std::runtime_error("TaskGraph::compile: Pass " + p->mName + " uses an unknown resource");
+  }
+  allocateTransients();
+
+  // Starting point for everything imported
+  std::vector<State> states(mResources.size());
+  for( auto r = 0u; r < mResources.size(); ++r ) {
+    auto& prev = mResources[r].previous;
+    auto& state = states[r];
+    if( prev.access & writeAccessMask ) {
+      state.writeStages = prev.stages;
+      state.writeAccess = prev.access & writeAccessMask;
+    }
+    if( (prev.access & ~writeAccessMask) || !prev.access ) state.readStages = prev.stages;
+    state.layout = prev.layout;
+  }
+
+  std::vector<bool> used(mResources.size(), false);
+  for( auto& pass : mPasses ) {
+    // One use per resource, a pass which reads and writes something just writes it
+    std::map<Resource, Pass::Use> uses;
+    for( auto& u : pass->mUses ) {
+      auto it = uses.find(u.resource);
+      if( it == uses.end() ) {
+        uses[u.resource] = u;
+        continue;
+      }
+      if( mResources[u.resource].isImage && it->second.access.layout != u.access.layout ) {
+        throw std::runtime_error("TaskGraph::compile: Pass " + pass->mName + " uses " + mResources[u.resource].name + " in two layouts");
+      }
+      it->second.access.stages |= u.access.stages;
+      it->second.access.access |= u.access.access;
+      it->second.write = it->second.write || u.write;
+    }
+
+    Barrier barrier;
+    for( auto& [r, u] : uses ) {
+      auto& info = mResources[r];
+      if( info.isTransient && !used[r] ) {
+        if( !u.write ) throw std::runtime_error("TaskGraph::compile: Transient " + info.name + " is read by " + pass->mName + " before anything writes it");
+        // Taking over memory from something else, wait for it to be done with
+        for( auto a : info.aliases ) {
+          states[r].writeStages |= states[a].writeStages;
+          states[r].writeAccess |= states[a].writeAccess;
+          states[r].readStages |= states[a].readStages;
+        }
+      }
+      used[r] = true;
+      access(r, u.access, u.write, states, barrier);
+    }
+    mBarriers.emplace_back(std::move(barrier));
+  }
+
+  // And whatever comes after
+  Barrier exportBarrier;
+  for( auto& [r, next] : mExports ) access(r, next, false, states, exportBarrier);
+  mBarriers.emplace_back(std::move(exportBarrier));
+
+  mCompiled = true;
+}
+
+void TaskGraph::access(Resource r, Access a, bool write, std::vector<State>& states, Barrier& barrier) {
+  auto& info = mResources[r];
+  auto& state = states[r];
+  auto transition = info.isImage && a.layout != state.layout;
+
+  // Read after write, or write after write
+  // Readers only need a barrier if the write hasn't already been made visible to them
+  auto srcAccess = vk::AccessFlags();
+  if( state.writeStages ) {
+    auto covered = (state.visibleStages & a.stages) == a.stages && (state.visibleAccess & a.access) == a.access;
+    if( write || transition || !covered ) {
+      barrier.srcStages |= state.writeStages;
+      barrier.dstStages |= a.stages;
+      srcAccess = state.writeAccess;
+      state.visibleStages |= a.stages;
+      state.visibleAccess |= a.access;
+      if( !transition ) {
+        barrier.srcAccess |= state.writeAccess;
+        barrier.dstAccess |= a.access;
+      }
+    }
+  }
+
+  // Write after read, the readers only need to have finished
+  if( (write || transition) && state.readStages ) {
+    barrier.srcStages |= state.readStages;
+    barrier.dstStages |= a.stages;
+  }
+
+  if( transition ) {
+    barrier.dstStages |= a.stages;
+    barrier.images.emplace_back(vk::ImageMemoryBarrier()
+                                .setSrcAccessMask(srcAccess)
+                                .setDstAccessMask(a.access)
+                                .setOldLayout(state.layout)
+                                .setNewLayout(a.layout)
+                                .setSrcQueueFamilyIndex(VK_QUEUE_FAMILY_IGNORED)
+                                .setDstQueueFamilyIndex(VK_QUEUE_FAMILY_IGNORED)
+                                .setImage(info.image)
+                                .setSubresourceRange(info.range));
+    state.layout = a.layout;
+  }
+
+  if( write ) {
+    // Nobody's seen this one yet
+    state.writeStages = a.stages;
+    state.writeAccess = a.access & writeAccessMask;
+    if( !state.writeAccess ) state.writeAccess = a.access;
+    state.readStages = {};
+    state.visibleStages = {};
+    state.visibleAccess = {};
+  } else if( transition ) {
+    // The transition's been made visible to this pass, which is the only reader so far
+    state.writeStages = {};
+    state.writeAccess = {};
+    state.readStages = a.stages;
+    state.visibleStages = a.stages;
+    state.visibleAccess = a.access;
+  } else {
+    state.readStages |= a.stages;
+  }
+}
+
+void TaskGraph::allocateTransients() {
+  std::vector<Resource> transients;
+  for( auto r = 0u; r < mResources.size(); ++r ) if( mResources[r].isTransient ) transients.emplace_back(r);
+  if( transients.empty() ) return;
+
+  // Lifetime of each, in passes
+  std::map<Resource, std::pair<uint32_t, uint32_t>> lifetimes;
+  for( auto p = 0u; p < mPasses.size(); ++p ) for( auto& u : mPasses[p]->mUses ) {
+    if( !mResources[u.resource].isTransient ) continue;
+    auto it = lifetimes.find(u.resource);
+    if( it == lifetimes.end() ) lifetimes[u.resource] = {p, p};
+    else it->second.second = p;
+  }
+  for( auto& [r, next] : mExports ) {
+    if( mResources[r].isTransient ) throw std::runtime_error("TaskGraph::compile: Transient " + mResources[r].name + " can't be exported, it doesn't outlive the graph");
+  }
+
+  struct Placement {
+    Resource resource;
+    vk::DeviceSize offset;
+    vk::DeviceSize size;
+    uint32_t first;
+    uint32_t last;
+  };
+  std::vector<Placement> placed;
+  vk::MemoryRequirements combined;
+  combined.alignment = 1;
+  combined.memoryTypeBits = ~0u;
+
+  // Biggest first, each goes at the lowest offset which doesn't overlap anything alive at the same time
+  std::vector<std::pair<Resource, vk::MemoryRequirements>> requirements;
+  for( auto r : transients ) {
+    auto& info = mResources[r];
+    if( lifetimes.find(r) == lifetimes.end() ) throw std::runtime_error("TaskGraph::compile: Transient " + info.name + " isn't used by any pass");
+    info.ownedBuffer = mDeviceInstance.createBuffer(info.size, info.usage);
+    info.buffer = info.ownedBuffer.get();
+    requirements.emplace_back(r, mDeviceInstance.device().getBufferMemoryRequirements(info.buffer));
+    mTransientRequestedSize += requirements.back().second.size;
+  }
+  std::stable_sort(requirements.begin(), requirements.end(), [](auto& a, auto& b) { return a.second.size > b.second.size; });
+
+  for( auto& [r, req] : requirements ) {
+    auto [first, last] = lifetimes[r];
+    auto alive = [&, first = first, last = last](const Placement& p) { return p.first <= last && first <= p.last; };
+    auto alignUp = [&, alignment = req.alignment](vk::DeviceSize o) { return ((o + alignment - 1) / alignment) * alignment; };
+
+    std::vector<vk::DeviceSize> candidates = {0};
+    for( auto& p : placed ) if( alive(p) ) candidates.emplace_back(alignUp(p.offset + p.size));
+    std::sort(candidates.begin(), candidates.end());
+    auto offset = candidates.back();
+    for( auto c : candidates ) {
+      auto fits = std::none_of(placed.begin(), placed.end(), [&](auto& p) {
+        return alive(p) && c < p.offset + p.size && p.offset < c + req.size;
+      });
+      if( fits ) { offset = c; break; }
+    }
+
+    // Anything else in the same memory must be finished with before the later one starts
+    for( auto& p : placed ) {
+      if( alive(p) || !(offset < p.offset + p.size && p.offset < offset + req.size) ) continue;
+      if( p.last < first ) mResources[r].aliases.emplace_back(p.resource);
+      else mResources[p.resource].aliases.emplace_back(r);
+    }
+
+    placed.push_back({r, offset, req.size, first, last});
+    mResources[r].memoryOffset = offset;
+    combined.size = std::max(combined.size, offset + req.size);
+    combined.alignment = std::max(combined.alignment, req.alignment);
+    combined.memoryTypeBits &= req.memoryTypeBits;
+  }
+  if( !combined.memoryTypeBits ) throw std::runtime_error("TaskGraph::compile: Transient buffers can't share a memory type");
+
+  auto info = vk::MemoryAllocateInfo()
+      .setAllocationSize(combined.size)
+      .setMemoryTypeIndex(mDeviceInstance.selectDeviceMemoryHeap(combined, vk::MemoryPropertyFlagBits::eDeviceLocal));
+  mTransientMemory = mDeviceInstance.device().allocateMemoryUnique(info);
+  mTransientMemorySize = combined.size;
+  for( auto r : transients ) mDeviceInstance.bindMemoryToBuffer(mResources[r].buffer, mTransientMemory.get(), mResources[r].memoryOffset);
+}
+
+void TaskGraph::record(vk::CommandBuffer commandBuffer) {
+  if( !mCompiled ) compile();
+  for( auto p = 0u; p < mPasses.size(); ++p ) {
+    cmdBarrier(commandBuffer, mBarriers[p]);
+    if( mPasses[p]->mRecord ) mPasses[p]->mRecord(commandBuffer);
+  }
+  cmdBarrier(commandBuffer, mBarriers.back());
+}
+
+void TaskGraph::cmdBarrier(vk::CommandBuffer commandBuffer, const Barrier& barrier) {
+  if( barrier.empty() ) return;
+  auto memoryBarrier = vk::MemoryBarrier()
+      .setSrcAccessMask(barrier.srcAccess)
+      .setDstAccessMask(barrier.dstAccess);
+  auto numMemoryBarriers = (barrier.srcAccess || barrier.dstAccess) ? 1u : 0u;
+  commandBuffer.pipelineBarrier(
+        barrier.srcStages ? barrier.srcStages : vk::PipelineStageFlags(vk::PipelineStageFlagBits::eTopOfPipe),
+        barrier.dstStages,
+        {},
+        numMemoryBarriers, &memoryBarrier,
+        0, nullptr,
+        static_cast<uint32_t>(barrier.images.size()), barrier.images.data()
+        );
+}
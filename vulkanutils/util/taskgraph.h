@@ -0,0 +1,175 @@
+/*
+ * Provided under the BSD 3-Clause License, see LICENSE.
+ *
+ * Copyright (c) 2019, Gareth Francis
+ * All rights reserved.
+ */
+
+#ifndef TASKGRAPH_H
+#define TASKGRAPH_H
+
+#include <vulkan/vulkan.hpp>
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+class DeviceInstance;
+
+/**
+ * Works out the barriers between passes, so nobody has to write them by hand
+ *
+ * Each pass says which buffers/images it reads and writes, and how (stages, access, layout).
+ * compile() walks the passes in the order they were added and tracks each resource's state,
+ * only putting in a barrier where there's an actual hazard:
+ * - Read after write: the write is made visible to the reader, once. Later readers which are
+ *   already covered don't get another barrier
+ * - Write after read: an execution dependency on the readers, no memory barrier needed
+ * - Write after write, and image layout changes
+ * Everything a pass needs is merged into a single vkCmdPipelineBarrier before it, with one global
+ * memory barrier for all the buffers and image barriers for any images.
+ *
+ * Passes can't be reordered, they run in the order they were added. Barriers inside a pass
+ * (e.g. between the passes of a RadixSort) are up to the pass.
+ *
+ * Transient buffers only live for the passes which use them, and share memory with any other
+ * transients which aren't alive at the same time. The graph owns them, so it must outlive any
+ * command buffers recorded from it.
+ *
+ * Queue ownership transfers are left to the caller (see QueueOwnership), record the graph between them.
+ */
+class TaskGraph
+{
+public:
+  /**
+   * How a pass uses a resource, layout is only used for images
+   * No initialiser on layout so {} works as a default argument, it's eUndefined when value initialised
+   */
+  struct Access {
+    vk::PipelineStageFlags stages;
+    vk::AccessFlags access;
+    vk::ImageLayout layout;
+  };
+  // The common ones
+  static const Access computeRead;
+  static const Access computeWrite;
+  static const Access computeReadWrite;
+  static const Access transferWrite;
+  static const Access hostRead;
+  static const Access vertexRead;
+  static const Access indexRead;
+  static const Access indirectRead;
+
+  using Resource = uint32_t;
+  using RecordFunc = std::function<void(vk::CommandBuffer)>;
+
+  /// A pass, returned by addPass so resources can be added to it
+  class Pass {
+  public:
+    /// Read only use of r
+    Pass& read(Resource r, Access a);
+    /// Anything which modifies r (include the read flags too if it reads as well)
+    Pass& write(Resource r, Access a);
+
+  private:
+    friend class TaskGraph;
+    struct Use {
+      Resource resource;
+      Access access;
+      bool write;
+    };
+    std::string mName;
+    RecordFunc mRecord;
+    std::vector<Use> mUses;
+  };
+
+  TaskGraph() = delete;
+  TaskGraph(const TaskGraph&) = delete;
+  TaskGraph(DeviceInstance& deviceInstance);
+  ~TaskGraph();
+
+  /**
+   * A buffer which lives outside the graph
+   * @param previous What happened to it before the graph (e.g. the last submission wrote it), empty if nothing needs waiting for
+   */
+  Resource importBuffer(const std::string& name, vk::Buffer buffer, Access previous = {});
+  /// An image which lives outside the graph, previous.layout is its current layout (eUndefined to discard the contents)
+  Resource importImage(const std::string& name, vk::Image image, vk::ImageSubresourceRange range, Access previous = {});
+  /// A device local buffer which only exists while the graph runs, the first pass to use it must write it
+  Resource transientBuffer(const std::string& name, vk::DeviceSize size, vk::BufferUsageFlags usage);
+  /// A resource's buffer, transient buffers don't exist until compile
+  vk::Buffer buffer(Resource r) const;
+
+  /// Add a pass, record is called from record() after any barriers the pass needs
+  Pass& addPass(const std::string& name, RecordFunc record);
+  /// What a resource needs to be ready for once the graph's done (host reads, another queue, etc)
+  void exportResource(Resource r, Access next);
+
+  /// Work out the barriers and allocate the transients, no more passes or resources after this
+  void compile();
+  /// Record everything into commandBuffer, compiles first if needed
+  void record(vk::CommandBuffer commandBuffer);
+
+  uint32_t numPasses() const { return static_cast<uint32_t>(mPasses.size()); }
+  /// vkCmdPipelineBarrier calls between passes, only valid after compile
+  uint32_t numBarriers() const;
+  /// Memory for the transient buffers, and what it would have been without aliasing
+  vk::DeviceSize transientMemorySize() const { return mTransientMemorySize; }
+  vk::DeviceSize transientRequestedSize() const { return mTransientRequestedSize; }
+
+private:
+  struct ResourceInfo {
+    std::string name;
+    bool isImage = false;
+    bool isTransient = false;
+    vk::Buffer buffer;
+    vk::Image image;
+    vk::ImageSubresourceRange range;
+    Access previous = {};
+    // Transients only
+    vk::DeviceSize size = 0;
+    vk::BufferUsageFlags usage;
+    vk::UniqueBuffer ownedBuffer;
+    vk::DeviceSize memoryOffset = 0;
+    std::vector<Resource> aliases; // Earlier transients sharing some of the memory
+  };
+
+  /// Where a resource has got to, while working out the barriers
+  struct State {
+    vk::PipelineStageFlags writeStages; // Last write, if it hasn't been waited on yet
+    vk::AccessFlags writeAccess;
+    vk::PipelineStageFlags readStages; // Reads since the last write
+    vk::PipelineStageFlags visibleStages; // Who's seen the last write
+    vk::AccessFlags visibleAccess;
+    vk::ImageLayout layout = vk::ImageLayout::eUndefined;
+  };
+
+  /// Everything which goes before a pass, or after the last one
+  struct Barrier {
+    vk::PipelineStageFlags srcStages;
+    vk::PipelineStageFlags dstStages;
+    vk::AccessFlags srcAccess;
+    vk::AccessFlags dstAccess;
+    std::vector<vk::ImageMemoryBarrier> images;
+    bool empty() const { return !dstStages; }
+  };
+
+  void checkNotCompiled(const char* method) const;
+  void allocateTransients();
+  void access(Resource r, Access a, bool write, std::vector<State>& states, Barrier& barrier);
+  void cmdBarrier(vk::CommandBuffer commandBuffer, const Barrier& barrier);
+
+  DeviceInstance& mDeviceInstance;
+  std::vector<ResourceInfo> mResources;
+  std::vector<std::unique_ptr<Pass>> mPasses;
+  std::vector<std::pair<Resource, Access>> mExports;
+
+  bool mCompiled = false;
+  std::vector<Barrier> mBarriers; // One per pass, then one for the exports
+  vk::UniqueDeviceMemory mTransientMemory;
+  vk::DeviceSize mTransientMemorySize = 0;
+  vk::DeviceSize mTransientRequestedSize = 0;
+};
+
+#endif
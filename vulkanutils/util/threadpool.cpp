@@ -0,0 +1,41 @@
+/*
+ * Provided under the BSD 3-Clause License, see LICENSE.
+ *
+ * Copyright (c) 2019, Gareth Francis
+ * All rights reserved.
+ */
+
+#include "threadpool.h"
+
+#include <algorithm>
+
+ThreadPool::ThreadPool(uint32_t numThreads) {
+  if( numThreads == 0 ) numThreads = std::max(1u, std::thread::hardware_concurrency());
+  for( auto i = 0u; i < numThreads; ++i ) {
+    mThreads.emplace_back(&ThreadPool::worker, this);
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(mMutex);
+    mStop = true;
+  }
+  mCondition.notify_all();
+  for( auto& t : mThreads ) t.join();
+}
+
+void ThreadPool::worker() {
+  while( true ) {
+    std::function<void()> task;
+    {
+      std::unique_lock<std::mutex> lock(mMutex);
+      mCondition.wait(lock, [&]() { return mStop || !mTasks.empty(); });
+      // Finish off anything queued before stopping
+      if( mTasks.empty() ) return;
+      task = std::move(mTasks.front());
+      mTasks.pop();
+    }
+    task();
+  }
+}
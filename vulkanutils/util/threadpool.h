@@ -0,0 +1,66 @@
+/*
+ * Provided under the BSD 3-Clause License, see LICENSE.
+ *
+ * Copyright (c) 2019, Gareth Francis
+ * All rights reserved.
+ */
+
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+/**
+ * A very simple fixed size thread pool
+ * Tasks are run in the order they're queued, nothing fancy like work stealing
+ */
+class ThreadPool
+{
+public:
+  /// @param numThreads Number of worker threads, 0 to use the number of cores
+  ThreadPool(uint32_t numThreads = 0);
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool(ThreadPool&&) = delete;
+  /// Waits for queued tasks to complete
+  ~ThreadPool();
+
+  uint32_t size() const { return static_cast<uint32_t>(mThreads.size()); }
+
+  /**
+   * Queue a task
+   * Exceptions thrown by the task are passed on through the future
+   */
+  template<typename F>
+  auto run(F&& f) -> std::future<decltype(f())>;
+
+private:
+  void worker();
+
+  std::vector<std::thread> mThreads;
+  std::queue<std::function<void()>> mTasks;
+  std::mutex mMutex;
+  std::condition_variable mCondition;
+  bool mStop = false;
+};
+
+template<typename F>
+auto ThreadPool::run(F&& f) -> std::future<decltype(f())> {
+  // std::function must be copyable, packaged_task isn't
+  auto task = std::make_shared<std::packaged_task<decltype(f())()>>(std::forward<F>(f));
+  auto result = task->get_future();
+  {
+    std::lock_guard<std::mutex> lock(mMutex);
+    mTasks.emplace([task]() { (*task)(); });
+  }
+  mCondition.notify_one();
+  return result;
+}
+
+#endif
@@ -0,0 +1,146 @@
+/*
+ * Provided under the BSD 3-Clause License, see LICENSE.
+ *
+ * Copyright (c) 2019, Gareth Francis
+ * All rights reserved.
+ */
+
+#include "timelinescheduler.h"
+
+#include <algorithm>
+
+TimelineScheduler::TimelineScheduler(DeviceInstance& deviceInstance, uint32_t numBuffers, uint32_t lead)
+  : mDeviceInstance(deviceInstance)
+  , mNumBuffers(numBuffers)
+  , mBufferLastReadFrame(numBuffers) {
+  if( !mDeviceInstance.timelineSemaphoresEnabled() ) throw std::runtime_error("TimelineScheduler: Timeline semaphores not supported by device");
+  if( mNumBuffers < 2 ) throw std::runtime_error("TimelineScheduler: Need at least 2 buffers");
+  this->lead(lead);
+
+  mComputeTimeline = createTimeline();
+  mRenderTimeline = createTimeline();
+}
+
+vk::UniqueSemaphore TimelineScheduler::createTimeline() {
+  auto typeInfo = vk::SemaphoreTypeCreateInfoKHR()
+      .setSemaphoreType(vk::SemaphoreTypeKHR::eTimeline)
+      .setInitialValue(0);
+  auto info = vk::SemaphoreCreateInfo()
+      .setPNext(&typeInfo);
+  return mDeviceInstance.device().createSemaphoreUnique(info);
+}
+
+void TimelineScheduler::lead(uint32_t l) {
+  mLead = std::max(1u, std::min(l, mNumBuffers - 1));
+}
+
+uint64_t TimelineScheduler::completedStep() {
+  return mDeviceInstance.device().getSemaphoreCounterValueKHR(mComputeTimeline.get(), mDeviceInstance.dispatch());
+}
+
+uint64_t TimelineScheduler::submitCompute(DeviceInstance::QueueRef& queue, vk::CommandBuffer commandBuffer, vk::Fence fence) {
+  return submitCompute(queue, commandBuffer, bufferForStep(mSubmittedStep + 1), fence);
+}
+
+uint64_t TimelineScheduler::submitCompute(DeviceInstance::QueueRef& queue, vk::CommandBuffer commandBuffer, uint32_t targetBuffer, vk::Fence fence) {
+  if( targetBuffer >= mNumBuffers ) throw std::runtime_error("TimelineScheduler::submitCompute: Invalid buffer index");
+  auto step = mSubmittedStep + 1;
+
+  // Can't overwrite the target buffer until the last frame to draw it has finished
+  // Binary semaphores don't get a say here, so everything's a timeline value
+  uint64_t waitValue = mBufferLastReadFrame[targetBuffer];
+  auto signalValue = step;
+  vk::Semaphore waitSemaphore = mRenderTimeline.get();
+  vk::PipelineStageFlags waitStage = vk::PipelineStageFlagBits::eComputeShader;
+  vk::Semaphore signalSemaphore = mComputeTimeline.get();
+
+  auto timelineInfo = vk::TimelineSemaphoreSubmitInfoKHR()
+      .setWaitSemaphoreValueCount(1)
+      .setPWaitSemaphoreValues(&waitValue)
+      .setSignalSemaphoreValueCount(1)
+      .setPSignalSemaphoreValues(&signalValue);
+
+  auto info = vk::SubmitInfo()
+      .setPNext(&timelineInfo)
+      .setWaitSemaphoreCount(1)
+      .setPWaitSemaphores(&waitSemaphore)
+      .setPWaitDstStageMask(&waitStage)
+      .setCommandBufferCount(1)
+      .setPCommandBuffers(&commandBuffer)
+      .setSignalSemaphoreCount(1)
+      .setPSignalSemaphores(&signalSemaphore);
+  {
+    std::lock_guard<std::mutex> lock(*queue.mutex);
+    queue.queue.submit(1, &info, fence);
+  }
+
+  mSubmittedStep = step;
+  return step;
+}
+
+void TimelineScheduler::submitRender(DeviceInstance::QueueRef& queue,
+                                     vk::CommandBuffer commandBuffer,
+                                     uint64_t step,
+                                     const std::vector<vk::Semaphore>& waitSemaphores,
+                                     const std::vector<vk::PipelineStageFlags>& waitStages,
+                                     const std::vector<vk::Semaphore>& signalSemaphores,
+                                     vk::Fence fence) {
+  submitRender(queue, commandBuffer, step, bufferForStep(step), waitSemaphores, waitStages, signalSemaphores, fence);
+}
+
+void TimelineScheduler::submitRender(DeviceInstance::QueueRef& queue,
+                                     vk::CommandBuffer commandBuffer,
+                                     uint64_t step,
+                                     uint32_t sourceBuffer,
+                                     const std::vector<vk::Semaphore>& waitSemaphores,
+                                     const std::vector<vk::PipelineStageFlags>& waitStages,
+                                     const std::vector<vk::Semaphore>& signalSemaphores,
+                                     vk::Fence fence) {
+  if( waitSemaphores.size() != waitStages.size() ) throw std::runtime_error("TimelineScheduler::submitRender: Need a wait stage for each semaphore");
+  if( step > mSubmittedStep ) throw std::runtime_error("TimelineScheduler::submitRender: Step hasn't been submitted");
+  if( sourceBuffer >= mNumBuffers ) throw std::runtime_error("TimelineScheduler::submitRender: Invalid buffer index");
+
+  auto frame = ++mRenderFrame;
+  mBufferLastReadFrame[sourceBuffer] = frame;
+
+  // Values for binary semaphores are ignored, but the arrays must match up
+  auto waits = waitSemaphores;
+  auto stages = waitStages;
+  std::vector<uint64_t> waitValues(waits.size(), 0);
+  waits.emplace_back(mComputeTimeline.get());
+  stages.emplace_back(vk::PipelineStageFlagBits::eVertexInput);
+  waitValues.emplace_back(step);
+
+  auto signals = signalSemaphores;
+  std::vector<uint64_t> signalValues(signals.size(), 0);
+  signals.emplace_back(mRenderTimeline.get());
+  signalValues.emplace_back(frame);
+
+  auto timelineInfo = vk::TimelineSemaphoreSubmitInfoKHR()
+      .setWaitSemaphoreValueCount(static_cast<uint32_t>(waitValues.size()))
+      .setPWaitSemaphoreValues(waitValues.data())
+      .setSignalSemaphoreValueCount(static_cast<uint32_t>(signalValues.size()))
+      .setPSignalSemaphoreValues(signalValues.data());
+
+  auto info = vk::SubmitInfo()
+      .setPNext(&timelineInfo)
+      .setWaitSemaphoreCount(static_cast<uint32_t>(waits.size()))
+      .setPWaitSemaphores(waits.data())
+      .setPWaitDstStageMask(stages.data())
+      .setCommandBufferCount(1)
+      .setPCommandBuffers(&commandBuffer)
+      .setSignalSemaphoreCount(static_cast<uint32_t>(signals.size()))
+      .setPSignalSemaphores(signals.data());
+  std::lock_guard<std::mutex> lock(*queue.mutex);
+  queue.queue.submit(1, &info, fence);
+}
+
+bool TimelineScheduler::waitStep(uint64_t step, uint64_t timeout) {
+  vk::Semaphore semaphore = mComputeTimeline.get();
+  auto info = vk::SemaphoreWaitInfoKHR()
+      .setSemaphoreCount(1)
+      .setPSemaphores(&semaphore)
+      .setPValues(&step);
+  auto result = mDeviceInstance.device().waitSemaphoresKHR(info, timeout, mDeviceInstance.dispatch());
+  return result == vk::Result::eSuccess;
+}
@@ -0,0 +1,125 @@
+/*
+ * Provided under the BSD 3-Clause License, see LICENSE.
+ *
+ * Copyright (c) 2019, Gareth Francis
+ * All rights reserved.
+ */
+
+#ifndef TIMELINESCHEDULER_H
+#define TIMELINESCHEDULER_H
+
+#include <vulkan/vulkan.hpp>
+
+#include "deviceinstance.h"
+
+#include <atomic>
+#include <limits>
+#include <vector>
+
+/**
+ * Compute -> render pipelining with timeline semaphores (VK_KHR_timeline_semaphore)
+ *
+ * The simulation writes into a ring of numBuffers buffers. Compute step N reads buffer
+ * (N-1) % numBuffers and writes buffer N % numBuffers, signalling value N on the compute
+ * timeline once done. Step 0 is whatever initialised the first buffer, the timeline starts there.
+ *
+ * Rendering doesn't wait for a particular step, it draws the latest completed one. Each render
+ * submit signals the render timeline, so a later compute step which overwrites a buffer
+ * waits (on the GPU) for the last frame that read it. No CPU fence round trips needed.
+ *
+ * The lead controls how far compute may run ahead of the step being rendered. It's clamped to
+ * numBuffers - 1, any further and compute would be writing the buffer on screen.
+ *
+ * If something else decides which buffer each step goes in (e.g. a TripleBuffer) pass the
+ * buffers explicitly instead. Compute and render submission may then happen on different threads,
+ * as long as each side sticks to one thread and the handoff between them orders buffer reuse.
+ * The lead is then just a number for the caller, which has to limit the steps in flight itself.
+ * Submission locks the QueueRef's mutex, so the queues may be shared.
+ */
+class TimelineScheduler
+{
+public:
+  TimelineScheduler() = delete;
+  TimelineScheduler(const TimelineScheduler&) = delete;
+  TimelineScheduler(TimelineScheduler&&) = delete;
+
+  /**
+   * @param numBuffers Number of buffers in the ring
+   * @param lead Number of steps compute may run ahead of the rendered step
+   */
+  TimelineScheduler(DeviceInstance& deviceInstance, uint32_t numBuffers, uint32_t lead = 1);
+  ~TimelineScheduler() {}
+
+  uint32_t numBuffers() const { return mNumBuffers; }
+  uint32_t lead() const { return mLead; }
+  void lead(uint32_t l);
+
+  /// The buffer a step's results are in
+  uint32_t bufferForStep(uint64_t step) const { return static_cast<uint32_t>(step % mNumBuffers); }
+
+  /// Latest step which has finished on the GPU, doesn't block
+  uint64_t completedStep();
+  /// Latest step submitted
+  uint64_t submittedStep() const { return mSubmittedStep.load(); }
+
+  /// Whether another compute step may be submitted, while renderStep is the one being rendered
+  bool canSubmitCompute(uint64_t renderStep) const { return mSubmittedStep < renderStep + mLead; }
+
+  /**
+   * Submit the next compute step
+   * commandBuffer must read bufferForStep(step - 1) and write bufferForStep(step)
+   * @return The step submitted
+   */
+  uint64_t submitCompute(DeviceInstance::QueueRef& queue, vk::CommandBuffer commandBuffer, vk::Fence fence = {});
+  /// Submit the next compute step, which writes to targetBuffer
+  uint64_t submitCompute(DeviceInstance::QueueRef& queue, vk::CommandBuffer commandBuffer, uint32_t targetBuffer, vk::Fence fence = {});
+
+  /**
+   * Submit a frame which renders a completed step
+   *
+   * Binary semaphores (swapchain acquire/present) can be passed in too, they're
+   * submitted alongside the timeline ones.
+   */
+  void submitRender(DeviceInstance::QueueRef& queue,
+                    vk::CommandBuffer commandBuffer,
+                    uint64_t step,
+                    const std::vector<vk::Semaphore>& waitSemaphores,
+                    const std::vector<vk::PipelineStageFlags>& waitStages,
+                    const std::vector<vk::Semaphore>& signalSemaphores,
+                    vk::Fence fence = {});
+  /// Submit a frame which renders a completed step, from sourceBuffer
+  void submitRender(DeviceInstance::QueueRef& queue,
+                    vk::CommandBuffer commandBuffer,
+                    uint64_t step,
+                    uint32_t sourceBuffer,
+                    const std::vector<vk::Semaphore>& waitSemaphores,
+                    const std::vector<vk::PipelineStageFlags>& waitStages,
+                    const std::vector<vk::Semaphore>& signalSemaphores,
+                    vk::Fence fence = {});
+
+  /**
+   * Block until a step has completed
+   * @return false on timeout
+   */
+  bool waitStep(uint64_t step, uint64_t timeout = std::numeric_limits<uint64_t>::max());
+
+  vk::Semaphore computeTimeline() const { return mComputeTimeline.get(); }
+  vk::Semaphore renderTimeline() const { return mRenderTimeline.get(); }
+
+private:
+  vk::UniqueSemaphore createTimeline();
+
+  DeviceInstance& mDeviceInstance;
+  uint32_t mNumBuffers = 0;
+  uint32_t mLead = 1;
+
+  vk::UniqueSemaphore mComputeTimeline;
+  vk::UniqueSemaphore mRenderTimeline;
+  std::atomic<uint64_t> mSubmittedStep{0};
+  uint64_t mRenderFrame = 0;
+
+  // Render frame (value on the render timeline) which last read each buffer, 0 if never read
+  std::vector<std::atomic<uint64_t>> mBufferLastReadFrame;
+};
+
+#endif
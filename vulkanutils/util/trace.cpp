@@ -0,0 +1,111 @@
+/*
+ * Provided under the BSD 3-Clause License, see LICENSE.
+ *
+ * Copyright (c) 2019, Gareth Francis
+ * All rights reserved.
+ */
+
+#include "trace.h"
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <stdexcept>
+
+std::mutex Trace::mMutex;
+std::vector<std::shared_ptr<Trace::ThreadBuffer>> Trace::mThreadBuffers;
+std::vector<std::string> Trace::mGpuTracks;
+std::vector<Trace::GpuEvent> Trace::mGpuEvents;
+
+namespace {
+  const auto traceEpoch = std::chrono::steady_clock::now();
+
+  std::string escapeJson(const std::string& str) {
+    std::string result;
+    for( auto c : str ) {
+      if( c == '"' || c == '\\' ) result += '\\';
+      result += c;
+    }
+    return result;
+  }
+}
+
+double Trace::nowUs() {
+  return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - traceEpoch).count();
+}
+
+Trace::ThreadBuffer& Trace::threadBuffer() {
+  // The registry holds a reference as well, so events outlive the thread
+  thread_local std::shared_ptr<ThreadBuffer> buffer;
+  if( !buffer ) {
+    buffer = std::make_shared<ThreadBuffer>();
+    buffer->events.resize(threadBufferSize);
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    buffer->tid = static_cast<uint32_t>(mThreadBuffers.size()) + 1;
+    buffer->name = "Thread " + std::to_string(buffer->tid);
+    mThreadBuffers.emplace_back(buffer);
+  }
+  return *buffer;
+}
+
+void Trace::record(const char* name, double startUs, double durationUs) {
+  auto& buffer = threadBuffer();
+  // Only this thread writes to the buffer, the atomic is just for the reader
+  auto head = buffer.head.load(std::memory_order_relaxed);
+  buffer.events[head % threadBufferSize] = {name, startUs, durationUs};
+  buffer.head.store(head + 1, std::memory_order_release);
+}
+
+void Trace::threadName(const std::string& name) {
+  auto& buffer = threadBuffer();
+  std::lock_guard<std::mutex> lock(mMutex);
+  buffer.name = name;
+}
+
+void Trace::gpuEvent(const std::string& name, const std::string& track, double startUs, double durationUs) {
+  std::lock_guard<std::mutex> lock(mMutex);
+  if( mGpuEvents.size() >= maxGpuEvents ) return;
+  auto it = std::find(mGpuTracks.begin(), mGpuTracks.end(), track);
+  if( it == mGpuTracks.end() ) it = mGpuTracks.insert(mGpuTracks.end(), track);
+  mGpuEvents.push_back({name, static_cast<uint32_t>(it - mGpuTracks.begin()), startUs, durationUs});
+}
+
+void Trace::writeChromeTrace(const std::string& fileName) {
+  std::ofstream file(fileName);
+  if( !file.is_open() ) throw std::runtime_error("Trace::writeChromeTrace: Failed to open file: " + fileName);
+
+  std::lock_guard<std::mutex> lock(mMutex);
+  file << std::fixed << std::setprecision(3);
+  file << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+
+  // GPU tracks go after the threads, so they're easy to spot
+  const uint32_t gpuTidBase = 1000;
+  auto first = true;
+  auto metadata = [&](uint32_t tid, const std::string& name) {
+    file << (first ? "" : ",\n") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << tid
+         << ",\"args\":{\"name\":\"" << escapeJson(name) << "\"}}";
+    first = false;
+  };
+  auto event = [&](const std::string& name, uint32_t tid, double startUs, double durationUs) {
+    file << (first ? "" : ",\n") << "{\"name\":\"" << escapeJson(name) << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << tid
+         << ",\"ts\":" << startUs << ",\"dur\":" << durationUs << "}";
+    first = false;
+  };
+
+  for( auto& buffer : mThreadBuffers ) {
+    metadata(buffer->tid, buffer->name);
+    auto head = buffer->head.load(std::memory_order_acquire);
+    auto start = head > threadBufferSize ? head - threadBufferSize : 0;
+    for( auto i = start; i < head; ++i ) {
+      auto& e = buffer->events[i % threadBufferSize];
+      event(e.name, buffer->tid, e.startUs, e.durationUs);
+    }
+  }
+
+  for( auto i = 0u; i < mGpuTracks.size(); ++i ) metadata(gpuTidBase + i, mGpuTracks[i]);
+  for( auto& e : mGpuEvents ) event(e.name, gpuTidBase + e.track, e.startUs, e.durationUs);
+
+  file << "\n]}\n";
+}
@@ -0,0 +1,114 @@
+/*
+ * Provided under the BSD 3-Clause License, see LICENSE.
+ *
+ * Copyright (c) 2019, Gareth Francis
+ * All rights reserved.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/**
+ * Lightweight CPU tracing
+ *
+ * Use the TRACE_ macros rather than the class directly, these compile to nothing
+ * unless VULKANUTILS_TRACE is defined (cmake -DVULKANUTILS_ENABLE_TRACE=ON)
+ *
+ * Each thread writes to its own ring buffer, so recording an event doesn't take a lock.
+ * The buffer registry is only locked the first time a thread records something,
+ * and when dumping the trace.
+ *
+ * Output is Chrome trace JSON, which can be loaded into chrome://tracing or ui.perfetto.dev
+ * GPU timings from QueryProfiler are added on their own tracks, converted to the same clock
+ */
+class Trace
+{
+public:
+  /// Records an event for the lifetime of the object
+  class Scope {
+  public:
+    Scope(const char* name) : mName(name), mStartUs(nowUs()) {}
+    ~Scope() { record(mName, mStartUs, nowUs() - mStartUs); }
+  private:
+    const char* mName;
+    double mStartUs;
+  };
+
+  /// Microseconds since the trace clock started
+  static double nowUs();
+
+  /**
+   * Record an event for the calling thread
+   * name must have static storage duration, typically a string literal
+   */
+  static void record(const char* name, double startUs, double durationUs);
+
+  /// Set the name of the calling thread in the trace output
+  static void threadName(const std::string& name);
+
+  /**
+   * Record a GPU event, in trace clock time
+   * These are less frequent than CPU events and go through a lock
+   */
+  static void gpuEvent(const std::string& name, const std::string& track, double startUs, double durationUs);
+
+  /**
+   * Write all recorded events as Chrome trace JSON
+   * Threads should be idle while this is called, events recorded during the write may be missed
+   */
+  static void writeChromeTrace(const std::string& fileName);
+
+  /// Number of events kept for each thread, older events are overwritten
+  static constexpr uint32_t threadBufferSize = 65536;
+  /// Maximum number of GPU events kept, later events are dropped
+  static constexpr uint32_t maxGpuEvents = 1048576;
+
+private:
+  struct Event {
+    const char* name;
+    double startUs;
+    double durationUs;
+  };
+
+  struct ThreadBuffer {
+    std::vector<Event> events;
+    std::atomic<uint64_t> head = 0; // Total events written, index is head % size
+    uint32_t tid = 0;
+    std::string name;
+  };
+
+  struct GpuEvent {
+    std::string name;
+    uint32_t track;
+    double startUs;
+    double durationUs;
+  };
+
+  static ThreadBuffer& threadBuffer();
+
+  static std::mutex mMutex;
+  static std::vector<std::shared_ptr<ThreadBuffer>> mThreadBuffers;
+  static std::vector<std::string> mGpuTracks;
+  static std::vector<GpuEvent> mGpuEvents;
+};
+
+#ifdef VULKANUTILS_TRACE
+# define TRACE_CONCAT_IMPL(a, b) a##b
+# define TRACE_CONCAT(a, b) TRACE_CONCAT_IMPL(a, b)
+# define TRACE_SCOPE(name) Trace::Scope TRACE_CONCAT(traceScope, __LINE__)(name)
+# define TRACE_THREAD_NAME(name) Trace::threadName(name)
+# define TRACE_WRITE(fileName) Trace::writeChromeTrace(fileName)
+#else
+# define TRACE_SCOPE(name)
+# define TRACE_THREAD_NAME(name)
+# define TRACE_WRITE(fileName)
+#endif
+
+#endif
@@ -0,0 +1,81 @@
+/*
+ * Provided under the BSD 3-Clause License, see LICENSE.
+ *
+ * Copyright (c) 2019, Gareth Francis
+ * All rights reserved.
+ */
+
+#ifndef TRIPLEBUFFER_H
+#define TRIPLEBUFFER_H
+
+#include <atomic>
+#include <cstdint>
+
+/**
+ * Lock-free handoff between one producer and one consumer thread
+ *
+ * This only juggles indices (0-2), the buffers themselves are up to the caller.
+ * The producer always owns the back buffer, and the consumer the front buffer.
+ * The third sits in the middle, holding the most recently published data
+ * until the consumer picks it up (or the producer replaces it).
+ *
+ * A producer with more buffers than that (e.g. to keep several GPU steps in flight)
+ * can publish any index it owns, getting the middle one back in exchange.
+ *
+ * Neither side ever waits on the other. Anything the producer writes before publish
+ * is visible to the consumer after update returns true, and the same goes for anything the
+ * consumer wrote to the old front buffer before update, once the producer gets it back.
+ */
+class TripleBuffer
+{
+public:
+  /// Starts with the consumer holding 0, the producer writing 2
+  TripleBuffer() {}
+  TripleBuffer(const TripleBuffer&) = delete;
+
+  /// Producer: The buffer to write to
+  uint32_t back() const { return mBack; }
+
+  /**
+   * Producer: Hand the back buffer over, and get a new one
+   * @return The new back buffer
+   */
+  uint32_t publish() {
+    mBack = publish(mBack);
+    return mBack;
+  }
+
+  /**
+   * Producer: Hand over a buffer of its own, rather than the back buffer
+   * @return The buffer the producer gets in exchange
+   */
+  uint32_t publish(uint32_t buffer) {
+    auto old = mMiddle.exchange(buffer | freshBit, std::memory_order_acq_rel);
+    return old & indexMask;
+  }
+
+  /// Consumer: The buffer to read from
+  uint32_t front() const { return mFront; }
+
+  /**
+   * Consumer: Swap to the latest published buffer, if there is one
+   * @return true if front changed
+   */
+  bool update() {
+    if( !(mMiddle.load(std::memory_order_relaxed) & freshBit) ) return false;
+    auto old = mMiddle.exchange(mFront, std::memory_order_acq_rel);
+    mFront = old & indexMask;
+    return true;
+  }
+
+private:
+  static constexpr uint32_t freshBit = 0x80000000u;
+  static constexpr uint32_t indexMask = ~freshBit;
+
+  // Only the middle is shared, with a flag for whether it's newer than front
+  std::atomic<uint32_t> mMiddle{1};
+  uint32_t mBack = 2;
+  uint32_t mFront = 0;
+};
+
+#endif